@@ -0,0 +1,95 @@
+//
+// FSProtocol.h
+//
+// The protocol between the file system daemon (fsd.c), which boots a
+// disk once and keeps it booted, and its clients (LibFSClient.c),
+// which call LibFS through it. A client connects to the Unix socket
+// of the daemon and sends requests, one at a time, each answered by a
+// reply before the next is sent: a request is a header followed by
+// 'len' bytes (a path, or the data written), and a reply is a header
+// followed by the data read, if any.
+//
+
+#ifndef __FSProtocol_h__
+#define __FSProtocol_h__
+
+// the socket a daemon serving a disk listens on unless told otherwise
+// is the name of the disk with this appended
+#define FSD_SOCKET_SUFFIX ".sock"
+
+// the longest path sent in a request (including the '\0')
+#define FSD_MAX_PATH 4096
+
+// the most bytes read or written by a request; a larger File_Read or
+// File_Write is split by the client
+#define FSD_MAX_DATA (1<<20)
+
+// the requests, and the arguments (args[]) and payload each takes; a
+// payload path includes its '\0'
+typedef enum {
+  FSD_BOOT,         // -> fsMaxFiles
+  FSD_SET_GEOMETRY, // sector size, total sectors, max files
+  FSD_SYNC,
+  FSD_BATCH_BEGIN,
+  FSD_BATCH_COMMIT,
+  FSD_FILE_CREATE,  // payload: path
+  FSD_FILE_OPEN,    // payload: path
+  FSD_FILE_READ,    // fd, size -> data
+  FSD_FILE_WRITE,   // fd; payload: data
+  FSD_FILE_PREAD,   // fd, size, offset -> data
+  FSD_FILE_PWRITE,  // fd, offset; payload: data
+  FSD_FILE_SEEK,    // fd, offset
+  FSD_FILE_CLOSE,   // fd
+  FSD_FILE_UNLINK,  // payload: path
+  FSD_DIR_CREATE,   // payload: path
+  FSD_DIR_UNLINK,   // payload: path
+  FSD_DIR_SIZE,     // payload: path
+  FSD_DIR_READ,     // size; payload: path -> data
+  FSD_GET_STATS,    // -> FS_Stats_t
+  FSD_RESET_STATS,
+  FSD_STATS_TIMING, // on
+  FSD_TRACE,        // on
+  FSD_TRACE_DUMP,   // payload: file (none for stderr), written by the daemon
+  FSD_TRACE_DUMP_ON_ERROR, // on; payload: file (none for stderr)
+  FSD_DIR_WALK,     // payload: path -> fsd_walk_t records, see below
+  FSD_DIR_REMOVE_TREE, // payload: path
+  FSD_DIR_USAGE,    // payload: path -> FS_Usage_t
+  FSD_DIR_OPEN,     // payload: path
+  FSD_DIR_NEXT,     // dd -> FSD_DIR_ENTRY bytes, if any
+  FSD_DIR_CLOSE,    // dd
+  FSD_SNAPSHOT,     // payload: name
+  FSD_ROLLBACK,     // payload: name
+  FSD_DELETE_SNAPSHOT, // payload: name
+  FSD_MOUNT_SNAPSHOT,  // payload: name (none to unmount)
+  FSD_CHECK,        // repair -> FS_Check_t
+} fsd_op_t;
+
+typedef struct {
+  int op;      // one of fsd_op_t
+  int args[3]; // depending on the request
+  int len;     // the length of the payload
+} fsd_request_t;
+
+// the reply carries what the call returned and the osErrno it left;
+// 'len' bytes of data follow (the data read)
+typedef struct {
+  int ret;
+  int err;
+  int len;
+} fsd_reply_t;
+
+// the size of an entry returned by Dir_Read and Dir_Next
+#define FSD_DIR_ENTRY 20
+
+// a Dir_Walk is made by the daemon, which returns a record for each
+// call to make, with the path ('len' bytes, including the '\0') right
+// after it, and each record aligned to an int; the walk stops once the
+// records fill up FSD_MAX_DATA, and the reply returns the number of
+// records, or -1
+typedef struct {
+  int type;
+  int size;
+  int len;
+} fsd_walk_t;
+
+#endif // __FSProtocol_h__
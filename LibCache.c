@@ -0,0 +1,743 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibDisk.h"
+#include "LibCache.h"
+
+// a block of the cache; its content is kept apart, in 'data'
+typedef struct cache_block {
+  int sector; // the sector held in the block, or -1 if none
+  int next;   // the next block in the same hash chain, or -1
+  int pins;   // number of users of the block; it can't be evicted until 0
+  char dirty; // changed since it was read from (or written to) the disk
+  char busy;  // BUSY_READING, BUSY_WRITING or BUSY_PREFETCH while on its way to or from the disk
+  char ref;   // used since the clock hand last went past (second chance)
+  char held;  // dirty, and kept from the disk until Cache_Release (see CACHE_HOLD)
+} cache_block_t;
+
+#define BUSY_READING 1
+#define BUSY_WRITING 2
+#define BUSY_PREFETCH 3 // being read ahead, with nobody waiting for it
+
+// the number of blocks allocated by the next Cache_Init
+static int capacity = CACHE_DEFAULT_BLOCKS;
+
+// the blocks, their content (nblocks*block_size bytes), and the heads
+// of the hash chains (nbuckets of them, a power of two) through which
+// blocks are looked up by sector
+static int nblocks;
+static int block_size;
+static cache_block_t* blocks;
+static char* data;
+static int* buckets;
+static int nbuckets;
+
+// the block at which the search for a block to evict resumes
+static int hand;
+
+// one request for each block, used to read it ahead (see
+// Cache_Prefetch), and the number of blocks being read ahead
+static Disk_Request_t* prefetch_requests;
+static int prefetching;
+
+// the number of blocks held (see CACHE_HOLD)
+static int nheld;
+
+// used for statistics: the lookups since the last Cache_Init, and
+// those of each thread (see Cache_GetThreadStats)
+static long hits, misses;
+static __thread long thread_hits, thread_misses;
+#define COUNT_HIT() (hits++, thread_hits++)
+#define COUNT_MISS() (misses++, thread_misses++)
+
+// guards everything above (but not the content of the blocks, which
+// belongs to the users who pinned them); 'cache_cond' is signalled
+// whenever a block stops being busy or pinned, for the 'waiters'
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static int waiters;
+
+#define BLOCK_DATA(b) (data + (size_t)(b)*block_size)
+#define HASH(s) (((unsigned)(s)*2654435761u) & (nbuckets-1))
+
+/*
+ * cache_wait
+ *
+ * Waits (with the cache lock held) for a block to stop being busy or
+ * pinned.
+ */
+static void cache_wait()
+{
+  waiters++;
+  pthread_cond_wait(&cache_cond, &cache_lock);
+  waiters--;
+}
+
+/*
+ * cache_wake
+ *
+ * Wakes up whoever waits in cache_wait.
+ */
+static void cache_wake()
+{
+  if(waiters > 0) pthread_cond_broadcast(&cache_cond);
+}
+
+/*
+ * cache_find
+ *
+ * Returns the block holding 'sector', or -1 if it isn't cached.
+ */
+static int cache_find(int sector)
+{
+  int b;
+  for(b = buckets[HASH(sector)]; b >= 0; b = blocks[b].next)
+    if(blocks[b].sector == sector) return b;
+  return -1;
+}
+
+/*
+ * cache_unhash
+ *
+ * Takes block 'b' out of its hash chain, if it is in one.
+ */
+static void cache_unhash(int b)
+{
+  if(blocks[b].sector < 0) return;
+  int* p = &buckets[HASH(blocks[b].sector)];
+  while(*p != b) p = &blocks[*p].next;
+  *p = blocks[b].next;
+  blocks[b].next = -1;
+  blocks[b].sector = -1;
+}
+
+/*
+ * cache_settle
+ *
+ * Makes block 'b', which was being read ahead, usable once the read is
+ * over, waiting for it (with the cache lock let go of) if need be; the
+ * block is thrown away if the read failed. Called with the cache lock
+ * held; the block may have been thrown away by another thread
+ * meanwhile, so the caller has to look it up again.
+ */
+static void cache_settle(int b)
+{
+  if(!Disk_PollBatch(&prefetch_requests[b], 1)) {
+    // pinned meanwhile, so that its request isn't reused for another
+    blocks[b].pins++;
+    pthread_mutex_unlock(&cache_lock);
+    Disk_WaitBatch(&prefetch_requests[b], 1);
+    pthread_mutex_lock(&cache_lock);
+    blocks[b].pins--;
+    cache_wake();
+  }
+  // whoever gets here first after the read is over settles the block
+  if(blocks[b].busy != BUSY_PREFETCH ||
+     !__atomic_load_n(&prefetch_requests[b].done, __ATOMIC_ACQUIRE))
+    return;
+  blocks[b].busy = 0;
+  prefetching--;
+  if(prefetch_requests[b].result < 0) cache_unhash(b);
+  cache_wake();
+}
+
+/*
+ * cache_prefetched
+ *
+ * Returns one of the blocks being read ahead, of which there has to be
+ * at least one; called with the cache lock held.
+ */
+static int cache_prefetched()
+{
+  int b;
+  for(b = 0; blocks[b].busy != BUSY_PREFETCH; b++);
+  return b;
+}
+
+/*
+ * cache_victim
+ *
+ * Picks a block to be evicted, in CLOCK order: the hand goes round the
+ * blocks, skipping those in use or held, and takes the first one that
+ * hasn't been used since it last went past; returns -1 if every block
+ * is in use or held.
+ */
+static int cache_victim()
+{
+  int i;
+  for(i = 0; i < 2*nblocks; i++) {
+    int b = hand;
+    hand = (hand+1) % nblocks;
+    if(blocks[b].busy == BUSY_PREFETCH && Disk_PollBatch(&prefetch_requests[b], 1))
+      cache_settle(b);
+    if(blocks[b].pins > 0 || blocks[b].busy || blocks[b].held) continue;
+    if(blocks[b].sector < 0 || !blocks[b].ref) return b;
+    blocks[b].ref = 0;
+  }
+  return -1;
+}
+
+/*
+ * cache_stuck
+ *
+ * Says whether waiting for a block to evict is of no use, which is
+ * the case when no block is on its way to or from the disk, and every
+ * block in use is held as well: only Cache_Release can make room then.
+ * Called with the cache lock held.
+ */
+static int cache_stuck()
+{
+  int b;
+  for(b = 0; b < nblocks; b++)
+    if(blocks[b].busy || (blocks[b].pins > 0 && !blocks[b].held)) return 0;
+  return 1;
+}
+
+/*
+ * cache_write_back
+ *
+ * Writes a dirty block back to the disk (the cache lock is let go of
+ * in the meantime); the block is busy while this is going on, and
+ * stays dirty if the write fails.
+ */
+static int cache_write_back(int b)
+{
+  blocks[b].busy = BUSY_WRITING;
+  blocks[b].dirty = 0;
+  pthread_mutex_unlock(&cache_lock);
+  int ret = Disk_Write(blocks[b].sector, BLOCK_DATA(b));
+  pthread_mutex_lock(&cache_lock);
+  if(ret < 0) blocks[b].dirty = 1;
+  blocks[b].busy = 0;
+  cache_wake();
+  return ret;
+}
+
+/*
+ * cache_get
+ *
+ * Returns the block holding 'sector' pinned, reading it from the disk
+ * (unless CACHE_NOREAD is in 'flags') if it isn't cached, in place of
+ * a block that is evicted; called with the cache lock held, which is
+ * let go of while the disk is accessed. Returns -1 on error (with
+ * E_CACHE_FULL if the blocks that can't be evicted take up the cache).
+ */
+static int cache_get(int sector, int flags)
+{
+  if(sector < 0 || sector >= TOTAL_SECTORS) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  for(;;) {
+    int b = cache_find(sector);
+    if(b >= 0) {
+      if(blocks[b].busy == BUSY_PREFETCH) { cache_settle(b); continue; }
+      if(blocks[b].busy) { cache_wait(); continue; }
+      blocks[b].pins++;
+      blocks[b].ref = 1;
+      COUNT_HIT();
+      return b;
+    }
+
+    b = cache_victim();
+    if(b < 0) {
+      // blocks being read ahead only become free once settled, which
+      // nobody waiting may come around to; held blocks are never
+      // evicted, since they'd reach the disk ahead of the journal
+      if(prefetching > 0) cache_settle(cache_prefetched());
+      else if(cache_stuck()) {
+        diskErrno = E_CACHE_FULL;
+        return -1;
+      } else cache_wait();
+      continue;
+    }
+    if(blocks[b].dirty) {
+      // the old content has to reach the disk first; the search starts
+      // over afterwards, since things may have changed in the meantime
+      if(cache_write_back(b) < 0) return -1;
+      continue;
+    }
+
+    cache_unhash(b);
+    blocks[b].sector = sector;
+    blocks[b].next = buckets[HASH(sector)];
+    buckets[HASH(sector)] = b;
+    blocks[b].pins = 1;
+    blocks[b].ref = 1;
+    COUNT_MISS();
+    if(flags & CACHE_NOREAD) return b;
+
+    blocks[b].busy = BUSY_READING;
+    pthread_mutex_unlock(&cache_lock);
+    int ret = Disk_Read(sector, BLOCK_DATA(b));
+    pthread_mutex_lock(&cache_lock);
+    blocks[b].busy = 0;
+    cache_wake();
+    if(ret < 0) {
+      cache_unhash(b);
+      blocks[b].pins = 0;
+      return -1;
+    }
+    return b;
+  }
+}
+
+/*
+ * cache_pin_cached
+ *
+ * Pins the blocks holding any of the 'count' sectors in 'sectors' that
+ * are cached, and puts them in 'pinned' (-1 for a sector that isn't
+ * cached); called with the cache lock held.
+ */
+static void cache_pin_cached(int* sectors, int count, int* pinned)
+{
+  int i;
+  for(i = 0; i < count; i++) {
+    int b;
+    while((b = cache_find(sectors[i])) >= 0 && blocks[b].busy) {
+      if(blocks[b].busy == BUSY_PREFETCH) cache_settle(b);
+      else cache_wait();
+    }
+    pinned[i] = b;
+    if(b >= 0) {
+      blocks[b].pins++;
+      blocks[b].ref = 1;
+      COUNT_HIT();
+    } else COUNT_MISS();
+  }
+}
+
+/*
+ * Cache_SetCapacity
+ *
+ * Chooses the number of blocks the cache holds from the next
+ * Cache_Init on.
+ */
+int Cache_SetCapacity(int n)
+{
+  if(n < CACHE_MIN_BLOCKS) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  pthread_mutex_lock(&cache_lock);
+  capacity = n;
+  pthread_mutex_unlock(&cache_lock);
+  return 0;
+}
+
+/*
+ * Cache_Init
+ *
+ * Sets up an empty cache of blocks of 'size' bytes, throwing away
+ * whatever was cached before (changed or not); nothing may be pinned.
+ *
+ * THIS FUNCTION MUST BE CALLED BEFORE ANY OTHER FUNCTION IN HERE CAN BE USED!
+ *
+ */
+int Cache_Init(int size)
+{
+  int i;
+  pthread_mutex_lock(&cache_lock);
+  for(i = 0; i < nblocks; i++)
+    if(blocks[i].busy == BUSY_PREFETCH) Disk_WaitBatch(&prefetch_requests[i], 1);
+  prefetching = 0;
+  nheld = 0;
+  free(blocks);
+  free(data);
+  free(buckets);
+  free(prefetch_requests);
+  nblocks = capacity;
+  block_size = size;
+  for(nbuckets = 1; nbuckets < 2*nblocks; nbuckets *= 2);
+  blocks = (cache_block_t*) calloc(nblocks, sizeof(cache_block_t));
+  // aligned so that a direct disk can transfer blocks without a copy
+  if(posix_memalign((void**)&data, DISK_DIRECT_ALIGN, (size_t)nblocks*block_size) != 0)
+    data = NULL;
+  buckets = (int*) malloc(nbuckets*sizeof(int));
+  prefetch_requests = (Disk_Request_t*) calloc(nblocks, sizeof(Disk_Request_t));
+  if(!blocks || !data || !buckets || !prefetch_requests) {
+    free(blocks); free(data); free(buckets); free(prefetch_requests);
+    blocks = NULL; data = NULL; buckets = NULL; prefetch_requests = NULL;
+    nblocks = 0;
+    pthread_mutex_unlock(&cache_lock);
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  for(i = 0; i < nblocks; i++) blocks[i].sector = blocks[i].next = -1;
+  for(i = 0; i < nbuckets; i++) buckets[i] = -1;
+  hand = 0;
+  hits = misses = 0;
+  pthread_mutex_unlock(&cache_lock);
+  return 0;
+}
+
+/*
+ * Cache_Pin
+ *
+ * Returns the content of the block holding 'sector', which stays in
+ * the cache until unpinned by Cache_Unpin; with CACHE_NOREAD, a block
+ * that isn't cached yet isn't read from the disk, and its content is
+ * left undefined for the caller to fill in. Returns NULL on error.
+ */
+char* Cache_Pin(int sector, int flags)
+{
+  pthread_mutex_lock(&cache_lock);
+  int b = cache_get(sector, flags);
+  pthread_mutex_unlock(&cache_lock);
+  return (b < 0) ? NULL : BLOCK_DATA(b);
+}
+
+/*
+ * Cache_Unpin
+ *
+ * Lets go of a block returned by Cache_Pin; 'dirty' says whether its
+ * content was changed, in which case it is written back to the disk
+ * when evicted or flushed; with CACHE_HOLD, it isn't written back
+ * (nor evicted) before Cache_Release is called.
+ */
+void Cache_Unpin(char* block, int dirty)
+{
+  int b = (block - data) / block_size;
+  pthread_mutex_lock(&cache_lock);
+  if(dirty) blocks[b].dirty = 1;
+  if(dirty == CACHE_HOLD && !blocks[b].held) {
+    blocks[b].held = 1;
+    nheld++;
+  }
+  if(--blocks[b].pins == 0) cache_wake();
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Cache_Read
+ *
+ * Reads a single sector through the cache into a buffer provided by
+ * the user.
+ */
+int Cache_Read(int sector, char* buffer)
+{
+  char* block = Cache_Pin(sector, 0);
+  if(block == NULL) return -1;
+  memcpy(buffer, block, block_size);
+  Cache_Unpin(block, 0);
+  return 0;
+}
+
+/*
+ * Cache_Write
+ *
+ * Writes a single sector from a buffer provided by the user into the
+ * cache; it reaches the disk when evicted or flushed.
+ */
+int Cache_Write(int sector, char* buffer)
+{
+  char* block = Cache_Pin(sector, CACHE_NOREAD);
+  if(block == NULL) return -1;
+  memcpy(block, buffer, block_size);
+  Cache_Unpin(block, 1);
+  return 0;
+}
+
+/*
+ * Cache_Prefetch
+ *
+ * Starts reading the 'count' sectors in 'sectors' that aren't cached
+ * into the cache, without waiting for them; a later lookup of one of
+ * them waits only for what is left of its read. No more than
+ * CACHE_MAX_PREFETCH sectors, nor a quarter of the cache, are read
+ * ahead at a time, and a sector is left out rather than have a dirty
+ * block written back to make room for it, in which case the rest are
+ * left out too. Returns the number of sectors gone through (whether
+ * already cached or now being read) before stopping.
+ */
+int Cache_Prefetch(int* sectors, int count)
+{
+  int i, started = 0;
+  pthread_mutex_lock(&cache_lock);
+  int most = (nblocks/4 < CACHE_MAX_PREFETCH) ? nblocks/4 : CACHE_MAX_PREFETCH;
+  int room = most-prefetching;
+  for(i = 0; i < count && started < room; i++) {
+    if(sectors[i] <= 0 || sectors[i] >= TOTAL_SECTORS || cache_find(sectors[i]) >= 0)
+      continue;
+    int b = cache_victim();
+    if(b < 0 || blocks[b].dirty) break;
+
+    cache_unhash(b);
+    blocks[b].sector = sectors[i];
+    blocks[b].next = buckets[HASH(sectors[i])];
+    buckets[HASH(sectors[i])] = b;
+    blocks[b].ref = 1;
+    blocks[b].busy = BUSY_PREFETCH;
+    prefetching++;
+    started++;
+
+    // submitted with the cache lock held, so that nobody can wait for
+    // the request before it is under way
+    Disk_Request_t* req = &prefetch_requests[b];
+    req->sector = sectors[i];
+    req->count = 1;
+    req->buffer = BLOCK_DATA(b);
+    req->write = 0;
+    Disk_SubmitBatch(req, 1);
+    if(Disk_PollBatch(req, 1)) cache_settle(b); // done already (memory modes)
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return i;
+}
+
+/*
+ * Cache_ReadMulti
+ *
+ * Like Disk_ReadMulti, but the sectors that are cached are copied from
+ * the cache; the others are read straight from the disk without being
+ * cached, so that a large transfer doesn't push everything else out.
+ */
+int Cache_ReadMulti(int* sectors, int count, char* buffer)
+{
+  int* pinned = (int*) malloc(count*sizeof(int));
+  Disk_Request_t* requests = (Disk_Request_t*) malloc(count*sizeof(Disk_Request_t));
+  if(pinned == NULL || requests == NULL) {
+    free(pinned);
+    free(requests);
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  pthread_mutex_lock(&cache_lock);
+  cache_pin_cached(sectors, count, pinned);
+  pthread_mutex_unlock(&cache_lock);
+
+  // the sectors that aren't cached are all read from the disk at once,
+  // while the cached ones are copied
+  int i, n, nreq = 0, ret = 0;
+  for(i = 0; i < count; i += n) {
+    n = 1;
+    if(pinned[i] >= 0) continue;
+    while(i+n < count && pinned[i+n] < 0 && sectors[i+n] == sectors[i]+n) n++;
+    requests[nreq].sector = sectors[i];
+    requests[nreq].count = n;
+    requests[nreq].buffer = buffer + (size_t)i*block_size;
+    requests[nreq].write = 0;
+    nreq++;
+  }
+  if(nreq > 0) ret = Disk_SubmitBatch(requests, nreq);
+  for(i = 0; i < count; i++)
+    if(pinned[i] >= 0)
+      memcpy(buffer + (size_t)i*block_size, BLOCK_DATA(pinned[i]), block_size);
+  if(nreq > 0 && ret == 0) ret = Disk_WaitBatch(requests, nreq);
+  free(requests);
+
+  pthread_mutex_lock(&cache_lock);
+  for(i = 0; i < count; i++)
+    if(pinned[i] >= 0) blocks[pinned[i]].pins--;
+  cache_wake();
+  pthread_mutex_unlock(&cache_lock);
+  free(pinned);
+  return ret;
+}
+
+/*
+ * Cache_WriteMulti
+ *
+ * Like Disk_WriteMulti, writing straight to the disk without caching
+ * the sectors; the blocks of the sectors that are cached are updated
+ * as well (and are clean afterwards). A held block is only updated:
+ * it stays dirty and held, to reach the disk with the next commit
+ * (see CACHE_HOLD) and not before.
+ */
+int Cache_WriteMulti(int* sectors, int count, char* buffer)
+{
+  int* pinned = (int*) malloc(count*sizeof(int));
+  if(pinned == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  pthread_mutex_lock(&cache_lock);
+  cache_pin_cached(sectors, count, pinned);
+  pthread_mutex_unlock(&cache_lock);
+
+  // the blocks pinned can't be held or let go of meanwhile, as that
+  // takes a commit, which no write runs along with
+  int i, n = 0, ret;
+  for(i = 0; i < count; i++)
+    if(pinned[i] >= 0 && blocks[pinned[i]].held) n++;
+  if(n == 0) ret = Disk_WriteMulti(sectors, count, buffer);
+  else {
+    // leave the held sectors out of the write
+    int* out = (int*) malloc((count-n)*sizeof(int) + 1);
+    char* data = (char*) malloc((size_t)(count-n)*block_size + 1);
+    ret = -1;
+    if(!out || !data) diskErrno = E_MEM_OP;
+    else {
+      for(i = 0, n = 0; i < count; i++) {
+	if(pinned[i] >= 0 && blocks[pinned[i]].held) continue;
+	out[n] = sectors[i];
+	memcpy(data + (size_t)n*block_size, buffer + (size_t)i*block_size, block_size);
+	n++;
+      }
+      ret = (n > 0) ? Disk_WriteMulti(out, n, data) : 0;
+    }
+    free(out);
+    free(data);
+  }
+  if(ret == 0) {
+    for(i = 0; i < count; i++)
+      if(pinned[i] >= 0)
+	memcpy(BLOCK_DATA(pinned[i]), buffer + (size_t)i*block_size, block_size);
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  for(i = 0; i < count; i++) {
+    if(pinned[i] < 0) continue;
+    if(ret == 0 && !blocks[pinned[i]].held) blocks[pinned[i]].dirty = 0;
+    blocks[pinned[i]].pins--;
+  }
+  cache_wake();
+  pthread_mutex_unlock(&cache_lock);
+  free(pinned);
+  return ret;
+}
+
+/*
+ * cache_compare_sectors
+ *
+ * Orders block numbers by the sector they hold (for qsort).
+ */
+static int cache_compare_sectors(const void* a, const void* b)
+{
+  return blocks[*(int*)a].sector - blocks[*(int*)b].sector;
+}
+
+/*
+ * Cache_Flush
+ *
+ * Writes every dirty block that isn't held back to the disk, starting
+ * all the writes at once in the order of their sectors, and waits for
+ * write-backs already under way to finish; the blocks stay cached. The
+ * blocks must not be changed meanwhile.
+ */
+int Cache_Flush()
+{
+  pthread_mutex_lock(&cache_lock);
+  int* order = (int*) malloc(nblocks*sizeof(int));
+  Disk_Request_t* requests = (Disk_Request_t*) malloc(nblocks*sizeof(Disk_Request_t));
+  if(order == NULL || requests == NULL) {
+    pthread_mutex_unlock(&cache_lock);
+    free(order);
+    free(requests);
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  int b, n = 0, i, ret = 0;
+  for(b = 0; b < nblocks; b++)
+    if(blocks[b].dirty && !blocks[b].busy && !blocks[b].held) order[n++] = b;
+  qsort(order, n, sizeof(int), cache_compare_sectors);
+
+  // all the dirty blocks are written back at once, and are busy until
+  // they have been
+  for(i = 0; i < n; i++) {
+    b = order[i];
+    blocks[b].busy = BUSY_WRITING;
+    blocks[b].dirty = 0;
+    requests[i].sector = blocks[b].sector;
+    requests[i].count = 1;
+    requests[i].buffer = BLOCK_DATA(b);
+    requests[i].write = 1;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  if(n > 0) {
+    Disk_SubmitBatch(requests, n);
+    Disk_WaitBatch(requests, n);
+  }
+  pthread_mutex_lock(&cache_lock);
+  for(i = 0; i < n; i++) {
+    b = order[i];
+    if(requests[i].result < 0) {
+      blocks[b].dirty = 1;
+      diskErrno = requests[i].error;
+      ret = -1;
+    }
+    blocks[b].busy = 0;
+  }
+  cache_wake();
+
+  // the write-backs of evicted blocks started elsewhere must be over
+  for(b = 0; b < nblocks; b++)
+    while(blocks[b].busy == BUSY_WRITING) cache_wait();
+  pthread_mutex_unlock(&cache_lock);
+  free(order);
+  free(requests);
+  return ret;
+}
+
+/*
+ * Cache_Held
+ *
+ * Returns the number of blocks held (see CACHE_HOLD), and puts the
+ * sectors of up to 'max' of them in 'sectors'.
+ */
+int Cache_Held(int* sectors, int max)
+{
+  int b, n = 0;
+  pthread_mutex_lock(&cache_lock);
+  for(b = 0; b < nblocks && n < max; b++)
+    if(blocks[b].held) sectors[n++] = blocks[b].sector;
+  n = nheld;
+  pthread_mutex_unlock(&cache_lock);
+  return n;
+}
+
+/*
+ * Cache_Release
+ *
+ * Lets go of the hold on every held block, which is written back to
+ * the disk from then on like any other dirty block.
+ */
+void Cache_Release()
+{
+  int b;
+  pthread_mutex_lock(&cache_lock);
+  for(b = 0; b < nblocks; b++) blocks[b].held = 0;
+  nheld = 0;
+  cache_wake();
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Cache_GetCapacity
+ *
+ * Returns the number of blocks the cache holds.
+ */
+int Cache_GetCapacity()
+{
+  pthread_mutex_lock(&cache_lock);
+  int n = nblocks;
+  pthread_mutex_unlock(&cache_lock);
+  return n;
+}
+
+/*
+ * Cache_GetStats
+ *
+ * Reports the number of sector lookups that found the sector cached
+ * (hits) and that didn't (misses) since the last Cache_Init.
+ */
+void Cache_GetStats(long* h, long* m)
+{
+  pthread_mutex_lock(&cache_lock);
+  if(h) *h = hits;
+  if(m) *m = misses;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Cache_GetThreadStats
+ *
+ * Like Cache_GetStats, but only counts the lookups of the calling
+ * thread, and since the thread started.
+ */
+void Cache_GetThreadStats(long* h, long* m)
+{
+  if(h) *h = thread_hits;
+  if(m) *m = thread_misses;
+}
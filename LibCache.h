@@ -0,0 +1,50 @@
+//
+// LibCache.h
+//
+// A write-back cache of disk blocks (sectors) sitting between the
+// file system and the disk. Blocks are looked up by sector number and
+// have to be pinned while in use; a block that isn't pinned may be
+// evicted (CLOCK order) to make room for another, and is written back
+// to the disk first if it has been changed. A changed block can also
+// be held, so that it doesn't reach the disk before the file system
+// says so (see LibFS.c for the journal this is for); a held block is
+// never evicted, so the file system has to let go of them before they
+// fill the cache.
+//
+
+#ifndef __Cache_H__
+#define __Cache_H__
+
+// the number of blocks the cache holds unless told otherwise
+#define CACHE_DEFAULT_BLOCKS 1024
+
+// the fewest blocks the cache can hold
+#define CACHE_MIN_BLOCKS 16
+
+// the most sectors being read ahead at once (see Cache_Prefetch)
+#define CACHE_MAX_PREFETCH 64
+
+// flags for Cache_Pin
+#define CACHE_NOREAD 1 // the caller overwrites the whole block, don't read it
+
+// the 'dirty' argument of Cache_Unpin for a block that is changed, and
+// held until Cache_Release
+#define CACHE_HOLD 2
+
+int Cache_SetCapacity(int nblocks);
+int Cache_Init(int block_size);
+char* Cache_Pin(int sector, int flags);
+void Cache_Unpin(char* block, int dirty);
+int Cache_Read(int sector, char* buffer);
+int Cache_Write(int sector, char* buffer);
+int Cache_Prefetch(int* sectors, int count);
+int Cache_ReadMulti(int* sectors, int count, char* buffer);
+int Cache_WriteMulti(int* sectors, int count, char* buffer);
+int Cache_Flush();
+int Cache_Held(int* sectors, int max);
+void Cache_Release();
+int Cache_GetCapacity();
+void Cache_GetStats(long* hits, long* misses);
+void Cache_GetThreadStats(long* hits, long* misses);
+
+#endif // __Cache_H__
@@ -1,35 +1,196 @@
+#define _GNU_SOURCE // O_DIRECT, SEEK_DATA
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 #include "LibDisk.h"
 
-typedef struct sector {
-  char data[SECTOR_SIZE];
-} sector_t;
+// the geometry of the disk (see Disk_SetGeometry)
+int diskSectorSize = DEFAULT_SECTOR_SIZE;
+int diskTotalSectors = DEFAULT_TOTAL_SECTORS;
 
-// used to see what happened w/ disk ops
-int diskErrno; 
+// the size of the whole disk image in bytes, and where a sector
+// starts in it
+#define DISK_BYTES ((size_t)TOTAL_SECTORS*SECTOR_SIZE)
+#define SECTOR_AT(s) (disk + (size_t)(s)*SECTOR_SIZE)
 
-// the disk in memory (static makes it private to the file)
-static sector_t* disk;
+// used to see what happened w/ disk ops (each thread has its own)
+__thread int diskErrno; 
 
-// used for statistics
-// static int lastSector = 0;
-// static int seekCount = 0;
+// the disk in memory (static makes it private to the file); only in
+// memory and mmap modes
+static char* disk;
+
+// how the disk image is backed (see Disk_SetMode)
+static int disk_mode = DISK_MODE_MMAP;
+
+// in mmap mode, the backstore file currently mapped as the disk image,
+// and in file and direct modes, the backstore file the image is read
+// from and written to; empty if the image isn't in a backstore file
+// yet (not yet saved)
+static char mapped_file[1024];
+
+// in file and direct modes, the open backstore file, or an unnamed
+// temporary file standing in for it until the image is first saved
+static int disk_fd = -1;
+
+// one bit per sector, set by Disk_Write and cleared once the sector has
+// been saved; the bits are set and cleared atomically, and a sector's
+// bit is cleared before (not after) the sector is saved, so that a
+// Disk_Write from another thread racing with Disk_Save leaves the
+// sector dirty for the next save instead of being lost
+static unsigned char* dirty; // DIRTY_BYTES long, allocated by Disk_Init
+
+// in memory mode, the backstore file that holds the same content as
+// the image apart from the dirty sectors (empty if there is no such
+// file), so that Disk_Save to it only needs to write the dirty sectors
+static char synced_file[1024];
+
+#define DIRTY_BYTES (((size_t)TOTAL_SECTORS+7)/8)
+#define IS_DIRTY(s) (__atomic_load_n(&dirty[(s)/8], __ATOMIC_RELAXED) & (1<<((s)%8)))
+#define SET_DIRTY(s) __atomic_fetch_or(&dirty[(s)/8], 1<<((s)%8), __ATOMIC_RELAXED)
+#define CLEAR_DIRTY(s) __atomic_fetch_and(&dirty[(s)/8], ~(1<<((s)%8)), __ATOMIC_RELAXED)
+
+// used for statistics: the accesses made by each thread (see
+// Disk_GetStats), and the sector the head of the disk would be over
+// after the last access, to tell how far each access has to seek
+static __thread Disk_Stats_t thread_stats;
+static int head_sector;
+
+// the timing model, if any (see Disk_SetTiming)
+static Disk_Timing_t timing;
+static int timed;
+
+// the order requests are carried out in (see Disk_SetScheduler), and
+// the direction the head is sweeping in, for DISK_SCHED_SCAN (1 if
+// towards higher sectors)
+static int disk_sched = DISK_SCHED_FIFO;
+static int head_up = 1;
 
 /*
- * Disk_Init
+ * disk_account
  *
- * Initializes the disk area (really just some memory for now).
+ * Counts an access to 'count' sectors from 'sector' for the calling
+ * thread, with the time it takes in the timing model.
+ */
+static void disk_account(int sector, int count, int write)
+{
+  if(write) thread_stats.writes += count;
+  else thread_stats.reads += count;
+  int from = __atomic_exchange_n(&head_sector, sector+count, __ATOMIC_RELAXED);
+  int distance = (sector > from) ? sector-from : from-sector;
+  thread_stats.seek_distance += distance;
+
+  if(timed) {
+    double ms = (double)count*SECTOR_SIZE/(timing.transfer_mb_per_s*1e3);
+    if(distance > 0)
+      ms += timing.seek_settle_ms + timing.seek_full_ms*distance/TOTAL_SECTORS +
+	timing.rotation_ms/2;
+    thread_stats.disk_nanoseconds += (long)(ms*1e6);
+  }
+}
+
+// each mode is implemented by a backend: a set of functions setting up
+// an empty image, giving it back, loading and saving it, and reading
+// and writing runs of consecutive sectors (already checked to be on
+// the disk) from and to buffers of the user
+typedef struct disk_backend {
+  int (*init)();
+  void (*release)();
+  int (*load)(char* file);
+  int (*save)(char* file);
+  int (*read)(int sector, int count, char* buffer);
+  int (*write)(int sector, int count, char* buffer);
+} disk_backend_t;
+
+/*
+ * disk_release
  *
- * THIS FUNCTION MUST BE CALLED BEFORE ANY OTHER FUNCTION IN HERE CAN BE USED!
+ * Gives back the memory, mapping or file of the current disk image, if
+ * any.
+ */
+static void disk_release();
+
+/*
+ * disk_next_dirty_run
  *
+ * Finds the next run of consecutive dirty sectors at or after sector
+ * 'from'; returns the first sector of the run and its length through
+ * 'len', or -1 if there are no more dirty sectors.
  */
-int Disk_Init()
+static int disk_next_dirty_run(int from, int* len)
+{
+  int s = from;
+  while(s < TOTAL_SECTORS) {
+    if(s%8 == 0 && __atomic_load_n(&dirty[s/8], __ATOMIC_RELAXED) == 0) { s += 8; continue; }
+    if(IS_DIRTY(s)) break;
+    s++;
+  }
+  if(s >= TOTAL_SECTORS) return -1;
+
+  int e = s;
+  while(e < TOTAL_SECTORS && IS_DIRTY(e)) e++;
+  *len = e-s;
+  return s;
+}
+
+/*
+ * disk_mark_run
+ *
+ * Sets (or clears) the dirty bits of 'len' sectors starting from 's'.
+ */
+static void disk_mark_run(int s, int len, int set)
 {
-  // create the disk image and fill every sector with zeroes
-  disk = (sector_t *) calloc(TOTAL_SECTORS, sizeof(sector_t));
+  int k;
+  for(k = s; k < s+len; k++) {
+    if(set) SET_DIRTY(k);
+    else CLEAR_DIRTY(k);
+  }
+}
+
+/*
+ * image_read
+ *
+ * Reads sectors of an image held (or mapped) in memory.
+ */
+static int image_read(int sector, int count, char* buffer)
+{
+  memcpy(buffer, SECTOR_AT(sector), (size_t)count*SECTOR_SIZE);
+  return 0;
+}
+
+/*
+ * image_write
+ *
+ * Writes sectors of an image held (or mapped) in memory, and marks
+ * them dirty.
+ */
+static int image_write(int sector, int count, char* buffer)
+{
+  memcpy(SECTOR_AT(sector), buffer, (size_t)count*SECTOR_SIZE);
+  disk_mark_run(sector, count, 1);
+  return 0;
+}
+
+/*
+ * memory_init
+ *
+ * DISK_MODE_MEMORY: creates the disk image and fills every sector with
+ * zeroes.
+ */
+static int memory_init()
+{
+  disk = (char*) calloc(TOTAL_SECTORS, SECTOR_SIZE);
   if(disk == NULL) {
     diskErrno = E_MEM_OP;
     return -1;
@@ -38,113 +199,1543 @@ int Disk_Init()
 }
 
 /*
- * Disk_Save
+ * memory_release
  *
- * Makes sure the current disk image gets saved to memory - this
- * will overwrite an existing file with the same name so be careful
+ * DISK_MODE_MEMORY: frees the disk image.
  */
-int Disk_Save(char* file)
+static void memory_release()
 {
-  FILE* diskFile;
-    
-  // error check
-  if (file == NULL) {
-    diskErrno = E_INVALID_PARAM;
+  free(disk);
+  disk = NULL;
+}
+
+/*
+ * disk_save_dirty
+ *
+ * Writes only the dirty sectors to 'file', which must already hold
+ * the rest of the image, merging adjacent dirty sectors into a single
+ * write; the dirty bits of each run are cleared as it is written, and
+ * set again if the write fails. The sectors have reached the disk
+ * when this returns, so that saves are done in order (which the
+ * journal of the file system counts on).
+ */
+static int disk_save_dirty(char* file)
+{
+  int fd = open(file, O_WRONLY);
+  if(fd < 0) {
+    diskErrno = E_OPENING_FILE;
     return -1;
   }
-    
+
+  int s = 0, len;
+  while((s = disk_next_dirty_run(s, &len)) >= 0) {
+    size_t bytes = (size_t)len*SECTOR_SIZE;
+    off_t offset = (off_t)s*SECTOR_SIZE;
+    disk_mark_run(s, len, 0);
+    if(pwrite(fd, SECTOR_AT(s), bytes, offset) != (ssize_t)bytes) {
+      disk_mark_run(s, len, 1);
+      close(fd);
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+    s += len;
+  }
+
+  if(fdatasync(fd) < 0) {
+    close(fd);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+/*
+ * memory_save
+ *
+ * DISK_MODE_MEMORY: writes the disk image out to 'file'.
+ */
+static int memory_save(char* file)
+{
+  FILE* diskFile;
+
+  // if the file already holds everything but the dirty sectors, only
+  // those need to be written; otherwise fall back to a full save
+  if(synced_file[0] != '\0' && !strcmp(synced_file, file) &&
+     disk_save_dirty(file) == 0)
+    return 0;
+
   // open the diskFile
   if ((diskFile = fopen(file, "w")) == NULL) {
     diskErrno = E_OPENING_FILE;
     return -1;
   }
-    
-  // actually write the disk image to a file
-  if ((fwrite(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
+
+  // actually write the disk image to a file; sectors written while
+  // this is going on stay dirty
+  memset(dirty, 0, DIRTY_BYTES);
+  if ((fwrite(disk, SECTOR_SIZE, TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
     fclose(diskFile);
+    synced_file[0] = '\0'; // the next save has to be a full one
     diskErrno = E_WRITING_FILE;
     return -1;
   }
-    
+
   // clean up and return
   fclose(diskFile);
+  strncpy(synced_file, file, sizeof(synced_file)-1);
+  synced_file[sizeof(synced_file)-1] = '\0';
   return 0;
 }
 
 /*
- * Disk_Load
+ * memory_load
  *
- * Loads a current disk image from disk into memory - requires that
- * the disk be created first.
+ * DISK_MODE_MEMORY: reads the disk image in from 'file', which must be
+ * exactly the size of the image.
  */
-int Disk_Load(char* file)
+static int memory_load(char* file)
 {
   FILE* diskFile;
-    
-  // error check
-  if (file == NULL) {
-    diskErrno = E_INVALID_PARAM;
-    return -1;
-  }
-    
+
   // open the diskFile
   if ((diskFile = fopen(file, "r")) == NULL) {
     diskErrno = E_OPENING_FILE;
     return -1;
   }
-    
+
   // actually read the disk image into memory
-  if ((fread(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
+  struct stat st;
+  if (fstat(fileno(diskFile), &st) < 0 || (size_t)st.st_size != DISK_BYTES ||
+      (fread(disk, SECTOR_SIZE, TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
     fclose(diskFile);
+    synced_file[0] = '\0'; // the image no longer matches any file
     diskErrno = E_READING_FILE;
     return -1;
   }
-    
+
   // clean up and return
   fclose(diskFile);
+  strncpy(synced_file, file, sizeof(synced_file)-1);
+  synced_file[sizeof(synced_file)-1] = '\0';
+  memset(dirty, 0, DIRTY_BYTES);
   return 0;
 }
 
 /*
- * Disk_Read
+ * mmap_init
  *
- * Reads a single sector from "disk" and puts it into a buffer provided
- * by the user.
+ * DISK_MODE_MMAP: anonymous memory stands in for the image until it
+ * is either loaded from, or saved to, a backstore file; it is
+ * zero-filled lazily by the kernel.
  */
-int Disk_Read(int sector, char* buffer)
+static int mmap_init()
 {
-  // quick error checks
-  if ((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
-    diskErrno = E_INVALID_PARAM;
+  void* image = mmap(NULL, DISK_BYTES, PROT_READ|PROT_WRITE,
+		     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(image == MAP_FAILED) {
+    diskErrno = E_MEM_OP;
     return -1;
   }
-    
-  // copy the memory for the user
-  if((memcpy((void*)buffer, (void*)(disk + sector), sizeof(sector_t))) == NULL) {
+  disk = (char*) image;
+  return 0;
+}
+
+/*
+ * mmap_release
+ *
+ * DISK_MODE_MMAP: unmaps the disk image.
+ */
+static void mmap_release()
+{
+  munmap(disk, DISK_BYTES);
+  disk = NULL;
+}
+
+/*
+ * disk_map_file
+ *
+ * Maps an open backstore file (which must be exactly the size of the
+ * disk image) in place of the current disk image.
+ */
+static int disk_map_file(int fd, char* file)
+{
+  void* image = mmap(NULL, DISK_BYTES, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(image == MAP_FAILED) {
     diskErrno = E_MEM_OP;
     return -1;
   }
-    
+  mmap_release();
+  memset(dirty, 0, DIRTY_BYTES);
+  disk = (char*) image;
+  strncpy(mapped_file, file, sizeof(mapped_file)-1);
+  mapped_file[sizeof(mapped_file)-1] = '\0';
   return 0;
 }
 
 /*
- * Disk_Write
+ * mmap_save
  *
- * Writes a single sector from memory to "disk".
+ * DISK_MODE_MMAP: flushes the mapping if the image is already backed
+ * by 'file'; otherwise writes the image out to 'file' and, if the
+ * image was still anonymous, maps the new file in its place.
  */
-int Disk_Write(int sector, char* buffer) 
+static int mmap_save(char* file)
 {
-  // quick error checks
-  if((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
+  if(mapped_file[0] != '\0' && !strcmp(mapped_file, file)) {
+    // flush only the pages spanned by dirty sectors, rather than
+    // having the kernel walk the whole mapping
+    long page = sysconf(_SC_PAGESIZE);
+    int s = 0, len;
+    while((s = disk_next_dirty_run(s, &len)) >= 0) {
+      size_t start = (size_t)s*SECTOR_SIZE & ~(size_t)(page-1);
+      size_t end = (size_t)(s+len)*SECTOR_SIZE;
+      disk_mark_run(s, len, 0);
+      if(msync(disk + start, end - start, MS_SYNC) < 0) {
+	disk_mark_run(s, len, 1);
+	diskErrno = E_WRITING_FILE;
+	return -1;
+      }
+      s += len;
+    }
+    return 0;
+  }
+
+  int fd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0666);
+  if(fd < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+
+  // write the whole image out to the new backstore file
+  size_t done = 0;
+  while(done < DISK_BYTES) {
+    ssize_t n = write(fd, disk + done, DISK_BYTES - done);
+    if(n <= 0) {
+      close(fd);
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+    done += n;
+  }
+
+  if(mapped_file[0] == '\0') {
+    if(disk_map_file(fd, file) < 0) {
+      close(fd);
+      return -1;
+    }
+    memset(dirty, 0, DIRTY_BYTES);
+  }
+  close(fd);
+  return 0;
+}
+
+/*
+ * mmap_load
+ *
+ * DISK_MODE_MMAP: maps the backstore file as the disk image instead of
+ * reading it in.
+ */
+static int mmap_load(char* file)
+{
+  int fd = open(file, O_RDWR);
+  if(fd < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+
+  // a short (or long) file can't be mapped as the image
+  struct stat st;
+  if(fstat(fd, &st) < 0 || (size_t)st.st_size != DISK_BYTES) {
+    close(fd);
+    diskErrno = E_READING_FILE;
+    return -1;
+  }
+
+  int ret = disk_map_file(fd, file);
+  close(fd);
+  return ret;
+}
+
+/*
+ * file_io
+ *
+ * Reads (or, if 'write' is set, writes) 'bytes' bytes at 'offset' of
+ * an open file, going on after a short transfer; in direct mode a
+ * buffer that isn't aligned to DISK_DIRECT_ALIGN goes through one that
+ * is, since O_DIRECT needs it.
+ */
+static int file_io(int fd, int write, char* buffer, size_t bytes, off_t offset)
+{
+  char* bounce = NULL;
+  if(disk_mode == DISK_MODE_DIRECT && (uintptr_t)buffer % DISK_DIRECT_ALIGN) {
+    if(posix_memalign((void**)&bounce, DISK_DIRECT_ALIGN, bytes) != 0) {
+      diskErrno = E_MEM_OP;
+      return -1;
+    }
+    if(write) memcpy(bounce, buffer, bytes);
+  }
+  char* p = bounce ? bounce : buffer;
+
+  size_t done = 0;
+  while(done < bytes) {
+    ssize_t n = write ? pwrite(fd, p + done, bytes - done, offset + done)
+                      : pread(fd, p + done, bytes - done, offset + done);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) {
+      free(bounce);
+      diskErrno = write ? E_WRITING_FILE : E_READING_FILE;
+      return -1;
+    }
+    done += n;
+  }
+
+  if(bounce && !write) memcpy(buffer, bounce, bytes);
+  free(bounce);
+  return 0;
+}
+
+/*
+ * file_init
+ *
+ * DISK_MODE_FILE and DISK_MODE_DIRECT: an unnamed temporary file (as
+ * big as the image, but with nothing allocated to it yet) stands in
+ * for the backstore file until the image is either loaded from, or
+ * saved to, one.
+ */
+static int file_init()
+{
+  if(disk_mode == DISK_MODE_DIRECT && SECTOR_SIZE % 512) {
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
-    
-  // copy the memory for the user
-  if((memcpy((void*)(disk + sector), (void*)buffer, sizeof(sector_t))) == NULL) {
+  FILE* tmp = tmpfile();
+  if(tmp == NULL) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  disk_fd = dup(fileno(tmp));
+  fclose(tmp);
+  if(disk_fd < 0 || ftruncate(disk_fd, DISK_BYTES) < 0) {
+    if(disk_fd >= 0) close(disk_fd);
+    disk_fd = -1;
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * file_release
+ *
+ * DISK_MODE_FILE and DISK_MODE_DIRECT: closes the backstore file.
+ */
+static void file_release()
+{
+  close(disk_fd);
+  disk_fd = -1;
+}
+
+/*
+ * file_open
+ *
+ * Opens a backstore file for file or direct mode, with O_DIRECT in the
+ * latter.
+ */
+static int file_open(char* file, int flags)
+{
+  if(disk_mode == DISK_MODE_DIRECT) flags |= O_DIRECT;
+  return open(file, flags, 0666);
+}
+
+/*
+ * file_copy_image
+ *
+ * Copies the image from the open backstore (or temporary) file to
+ * another open file 'fd', a big chunk at a time; the chunks holding
+ * nothing but a hole in the backstore file are skipped, so that they
+ * stay holes in the copy.
+ */
+static int file_copy_image(int fd)
+{
+  size_t chunk = (size_t)SECTOR_SIZE * (((1<<20) + SECTOR_SIZE - 1)/SECTOR_SIZE);
+  char* buffer;
+  if(posix_memalign((void**)&buffer, DISK_DIRECT_ALIGN, chunk) != 0) {
     diskErrno = E_MEM_OP;
     return -1;
   }
+
+  size_t offset = 0;
+  while(offset < DISK_BYTES) {
+    off_t data = lseek(disk_fd, offset, SEEK_DATA);
+    if(data < 0) break; // only a hole is left (or holes can't be told)
+    offset = (size_t)data / chunk * chunk;
+    if(offset >= DISK_BYTES) break;
+    size_t bytes = (DISK_BYTES - offset < chunk) ? DISK_BYTES - offset : chunk;
+    if(file_io(disk_fd, 0, buffer, bytes, offset) < 0 ||
+       file_io(fd, 1, buffer, bytes, offset) < 0) {
+      free(buffer);
+      return -1;
+    }
+    offset += bytes;
+  }
+  free(buffer);
+
+  // whatever wasn't written is a hole, and reads back as zeroes
+  if(ftruncate(fd, DISK_BYTES) < 0) {
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * file_save
+ *
+ * DISK_MODE_FILE and DISK_MODE_DIRECT: the image is written to the
+ * backstore file as it goes, so saving to it only needs to make sure
+ * that the writes have reached the disk; saving to another file copies
+ * the image there and, if the image was still in a temporary file,
+ * makes the new file its backstore file.
+ */
+static int file_save(char* file)
+{
+  if(mapped_file[0] != '\0' && !strcmp(mapped_file, file)) {
+    if(fdatasync(disk_fd) < 0) {
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+    return 0;
+  }
+
+  int fd = file_open(file, O_RDWR|O_CREAT|O_TRUNC);
+  if(fd < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  if(file_copy_image(fd) < 0 || fdatasync(fd) < 0) {
+    close(fd);
+    if(diskErrno != E_MEM_OP) diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+
+  if(mapped_file[0] == '\0') {
+    file_release();
+    disk_fd = fd;
+    strncpy(mapped_file, file, sizeof(mapped_file)-1);
+    mapped_file[sizeof(mapped_file)-1] = '\0';
+  } else close(fd);
+  return 0;
+}
+
+/*
+ * file_load
+ *
+ * DISK_MODE_FILE and DISK_MODE_DIRECT: opens the backstore file (a
+ * regular file exactly the size of the image, or a block device at
+ * least that big) in place of the current one, instead of reading it
+ * in.
+ */
+static int file_load(char* file)
+{
+  int fd = file_open(file, O_RDWR);
+  if(fd < 0) {
+    // only a missing file says that there's no disk there yet
+    diskErrno = (errno == ENOENT) ? E_OPENING_FILE : E_READING_FILE;
+    return -1;
+  }
+
+  struct stat st;
+  uint64_t bytes = 0;
+  if(fstat(fd, &st) == 0) {
+    if(S_ISBLK(st.st_mode)) {
+      if(ioctl(fd, BLKGETSIZE64, &bytes) < 0) bytes = 0;
+    } else if((size_t)st.st_size == DISK_BYTES) bytes = DISK_BYTES;
+  }
+  if(bytes < DISK_BYTES) {
+    close(fd);
+    diskErrno = E_READING_FILE;
+    return -1;
+  }
+
+  file_release();
+  disk_fd = fd;
+  strncpy(mapped_file, file, sizeof(mapped_file)-1);
+  mapped_file[sizeof(mapped_file)-1] = '\0';
   return 0;
 }
+
+/*
+ * file_read
+ *
+ * DISK_MODE_FILE and DISK_MODE_DIRECT: reads sectors from the
+ * backstore file.
+ */
+static int file_read(int sector, int count, char* buffer)
+{
+  return file_io(disk_fd, 0, buffer, (size_t)count*SECTOR_SIZE, (off_t)sector*SECTOR_SIZE);
+}
+
+/*
+ * file_write
+ *
+ * DISK_MODE_FILE and DISK_MODE_DIRECT: writes sectors to the
+ * backstore file.
+ */
+static int file_write(int sector, int count, char* buffer)
+{
+  return file_io(disk_fd, 1, buffer, (size_t)count*SECTOR_SIZE, (off_t)sector*SECTOR_SIZE);
+}
+
+// the backends, indexed by mode
+static disk_backend_t backends[] = {
+  [DISK_MODE_MEMORY] = { memory_init, memory_release, memory_load, memory_save, image_read, image_write },
+  [DISK_MODE_MMAP]   = { mmap_init, mmap_release, mmap_load, mmap_save, image_read, image_write },
+  [DISK_MODE_FILE]   = { file_init, file_release, file_load, file_save, file_read, file_write },
+  [DISK_MODE_DIRECT] = { file_init, file_release, file_load, file_save, file_read, file_write },
+};
+
+/*
+ * A snapshot freezes the image as it was when taken (see
+ * Disk_Snapshot): it keeps a copy of each sector written since, made
+ * just before the first write to it; a sector a snapshot has no copy
+ * of is as it was when the next snapshot was taken, or as it is now
+ * if there is none. The snapshots are kept oldest first.
+ */
+typedef struct {
+  char name[DISK_SNAPSHOT_NAME];
+  char** kept; // TOTAL_SECTORS long: the copy of each sector, or NULL
+} disk_snapshot_t;
+static disk_snapshot_t snapshots[DISK_MAX_SNAPSHOTS];
+static int nsnapshots;
+
+// the snapshot read instead of the image (see Disk_ViewSnapshot), or -1
+static int viewed = -1;
+
+/*
+ * snapshot_find
+ *
+ * Finds the snapshot called 'name'; returns its index, or -1 (with
+ * diskErrno set) if there is none.
+ */
+static int snapshot_find(char* name)
+{
+  int i;
+  for(i = 0; name && i < nsnapshots; i++)
+    if(!strcmp(snapshots[i].name, name)) return i;
+  diskErrno = E_INVALID_PARAM;
+  return -1;
+}
+
+/*
+ * snapshot_sector
+ *
+ * Finds the content of a sector in snapshot 'i': the copy kept by it
+ * or by a later snapshot, or NULL if the sector hasn't changed since.
+ */
+static char* snapshot_sector(int i, int sector)
+{
+  for(; i < nsnapshots; i++) {
+    char* copy = __atomic_load_n(&snapshots[i].kept[sector], __ATOMIC_ACQUIRE);
+    if(copy) return copy;
+  }
+  return NULL;
+}
+
+/*
+ * snapshot_keep
+ *
+ * Copies the sectors about to be written that the newest snapshot has
+ * no copy of yet into it (when two threads race to write a sector,
+ * the copy of one is dropped); refuses the writes while a snapshot is
+ * viewed. Snapshots are only taken and dropped while nothing writes.
+ */
+static int snapshot_keep(int sector, int count)
+{
+  if(viewed >= 0) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if(nsnapshots == 0) return 0;
+  char** kept = snapshots[nsnapshots-1].kept;
+  int s;
+  for(s = sector; s < sector+count; s++) {
+    if(__atomic_load_n(&kept[s], __ATOMIC_ACQUIRE)) continue;
+    char *copy = (char*) malloc(SECTOR_SIZE), *none = NULL;
+    if(copy == NULL) {
+      diskErrno = E_MEM_OP;
+      return -1;
+    }
+    if(backends[disk_mode].read(s, 1, copy) < 0) {
+      free(copy);
+      return -1;
+    }
+    if(!__atomic_compare_exchange_n(&kept[s], &none, copy, 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      free(copy);
+  }
+  return 0;
+}
+
+/*
+ * snapshot_read
+ *
+ * Reads a run of sectors of the snapshot viewed.
+ */
+static int snapshot_read(int sector, int count, char* buffer)
+{
+  int s;
+  for(s = sector; s < sector+count; s++, buffer += SECTOR_SIZE) {
+    char* copy = snapshot_sector(viewed, s);
+    if(copy) memcpy(buffer, copy, SECTOR_SIZE);
+    else if(backends[disk_mode].read(s, 1, buffer) < 0) return -1;
+  }
+  return 0;
+}
+
+/*
+ * snapshot_clear
+ *
+ * Gives back the copies kept by a snapshot, leaving it with none.
+ */
+static void snapshot_clear(disk_snapshot_t* snap)
+{
+  int s;
+  for(s = 0; s < TOTAL_SECTORS; s++) {
+    free(snap->kept[s]);
+    snap->kept[s] = NULL;
+  }
+}
+
+/*
+ * snapshot_drop
+ *
+ * Drops the snapshots from index 'from' on.
+ */
+static void snapshot_drop(int from)
+{
+  while(nsnapshots > from) {
+    disk_snapshot_t* snap = &snapshots[--nsnapshots];
+    snapshot_clear(snap);
+    free(snap->kept);
+    snap->kept = NULL;
+  }
+  if(viewed >= nsnapshots) viewed = -1;
+}
+
+// whether there's an image to give back
+static int disk_ready;
+
+static void disk_release()
+{
+  if(!disk_ready) return;
+  backends[disk_mode].release();
+  disk_ready = 0;
+  mapped_file[0] = '\0';
+  synced_file[0] = '\0';
+  if(dirty) memset(dirty, 0, DIRTY_BYTES);
+  snapshot_drop(0);
+}
+
+/*
+ * Disk_SetMode
+ *
+ * Chooses how the disk image is backed; must be called before
+ * Disk_Init. In DISK_MODE_MEMORY the whole image lives in memory and
+ * is copied in and out by Disk_Load and Disk_Save. In DISK_MODE_MMAP
+ * (the default) the backstore file is mapped directly as the image,
+ * so loading costs nothing up front and saving only flushes the pages
+ * that were written to. In DISK_MODE_FILE every sector is read from
+ * and written to the backstore file as it is accessed (through the
+ * page cache of the kernel), so the image can be larger than memory;
+ * DISK_MODE_DIRECT does the same with O_DIRECT, bypassing the page
+ * cache, and works on a block device too. Note that in all but the
+ * first mode writes may reach the file even before Disk_Save is
+ * called.
+ */
+int Disk_SetMode(int mode)
+{
+  if(mode != DISK_MODE_MEMORY && mode != DISK_MODE_MMAP &&
+     mode != DISK_MODE_FILE && mode != DISK_MODE_DIRECT) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  disk_release();
+  disk_mode = mode;
+  return 0;
+}
+
+/*
+ * Disk_SetGeometry
+ *
+ * Chooses the size of a sector (in bytes) and the number of sectors
+ * on the disk; must be called before Disk_Init, and the backstore
+ * file loaded afterwards must hold exactly that many bytes.
+ */
+int Disk_SetGeometry(int sector_size, int total_sectors)
+{
+  if(sector_size <= 0 || total_sectors <= 0 ||
+     (size_t)total_sectors > (size_t)-1/(size_t)sector_size) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  disk_release();
+  diskSectorSize = sector_size;
+  diskTotalSectors = total_sectors;
+  return 0;
+}
+
+/*
+ * Disk_Init
+ *
+ * Initializes the disk area (really just some memory for now).
+ *
+ * THIS FUNCTION MUST BE CALLED BEFORE ANY OTHER FUNCTION IN HERE CAN BE USED!
+ *
+ */
+int Disk_Init()
+{
+  disk_release();
+
+  // one dirty bit for each sector of the (possibly new) geometry
+  free(dirty);
+  dirty = (unsigned char*) calloc(DIRTY_BYTES, 1);
+  if(dirty == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+
+  // create an empty disk image
+  if(backends[disk_mode].init() < 0) return -1;
+  disk_ready = 1;
+  head_sector = 0;
+  head_up = 1;
+  return 0;
+}
+
+/*
+ * Disk_Save
+ *
+ * Makes sure the current disk image gets saved to memory - this
+ * will overwrite an existing file with the same name so be careful
+ *
+ * Disk_Read and Disk_Write are safe to call from several threads at
+ * once, and also while Disk_Save is running, except for the first
+ * save of an mmap, file or direct image to a new file (which switches
+ * the image over to the file); Disk_SetMode, Disk_Init and Disk_Load
+ * must not run concurrently with anything else.
+ */
+int Disk_Save(char* file)
+{
+  // error check
+  if (file == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  return backends[disk_mode].save(file);
+}
+
+/*
+ * Disk_Load
+ *
+ * Loads a current disk image from disk into memory - requires that
+ * the disk be created first.
+ */
+int Disk_Load(char* file)
+{
+  // error check
+  if (file == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  snapshot_drop(0);
+  return backends[disk_mode].load(file);
+}
+
+/*
+ * Disk_Read
+ *
+ * Reads a single sector from "disk" and puts it into a buffer provided
+ * by the user.
+ */
+int Disk_Read(int sector, char* buffer)
+{
+  // quick error checks
+  if ((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+    
+  // copy the sector for the user
+  disk_account(sector, 1, 0);
+  if(viewed >= 0) return snapshot_read(sector, 1, buffer);
+  return backends[disk_mode].read(sector, 1, buffer);
+}
+
+/*
+ * Disk_Write
+ *
+ * Writes a single sector from memory to "disk".
+ */
+int Disk_Write(int sector, char* buffer) 
+{
+  // quick error checks
+  if((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+    
+  // copy the sector from the user
+  if(snapshot_keep(sector, 1) < 0) return -1;
+  disk_account(sector, 1, 1);
+  return backends[disk_mode].write(sector, 1, buffer);
+}
+
+/*
+ * Disk_Snapshot
+ *
+ * Takes a snapshot of the disk image as it is, called 'name' (up to
+ * DISK_SNAPSHOT_NAME-1 characters): nothing is copied up front, but
+ * from then on each sector is copied (into memory) just before it is
+ * first written, so that Disk_Rollback can bring the image back, and
+ * Disk_ViewSnapshot read it. Up to DISK_MAX_SNAPSHOTS can be kept,
+ * until they are deleted, or the disk is set up or loaded again; this
+ * must not run concurrently with writes.
+ */
+int Disk_Snapshot(char* name)
+{
+  if(name == NULL || name[0] == '\0' || strlen(name) >= DISK_SNAPSHOT_NAME ||
+     viewed >= 0 || nsnapshots == DISK_MAX_SNAPSHOTS || !disk_ready) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  int i;
+  for(i = 0; i < nsnapshots; i++) {
+    if(!strcmp(snapshots[i].name, name)) {
+      diskErrno = E_INVALID_PARAM;
+      return -1;
+    }
+  }
+  disk_snapshot_t* snap = &snapshots[nsnapshots];
+  snap->kept = (char**) calloc(TOTAL_SECTORS, sizeof(char*));
+  if(snap->kept == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  strcpy(snap->name, name);
+  nsnapshots++;
+  return 0;
+}
+
+/*
+ * Disk_Rollback
+ *
+ * Brings the disk image back to snapshot 'name' by writing back the
+ * sectors changed since, and drops the snapshots taken after it (the
+ * snapshot itself is kept, with nothing changed since). Saving the
+ * image afterwards is up to the caller; this must not run
+ * concurrently with anything else.
+ */
+int Disk_Rollback(char* name)
+{
+  int i = snapshot_find(name), s;
+  if(i < 0) return -1;
+  if(viewed >= 0) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  for(s = 0; s < TOTAL_SECTORS; s++) {
+    char* copy = snapshot_sector(i, s);
+    if(copy && backends[disk_mode].write(s, 1, copy) < 0) return -1;
+  }
+  snapshot_drop(i+1);
+  snapshot_clear(&snapshots[i]);
+  return 0;
+}
+
+/*
+ * Disk_DeleteSnapshot
+ *
+ * Drops snapshot 'name' (which must not be viewed); the copies it kept
+ * that the snapshot before it needs are handed over to that one.
+ */
+int Disk_DeleteSnapshot(char* name)
+{
+  int i = snapshot_find(name), s;
+  if(i < 0) return -1;
+  if(viewed == i) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  disk_snapshot_t* snap = &snapshots[i];
+  for(s = 0; s < TOTAL_SECTORS; s++) {
+    if(i > 0 && snapshots[i-1].kept[s] == NULL) snapshots[i-1].kept[s] = snap->kept[s];
+    else free(snap->kept[s]);
+  }
+  free(snap->kept);
+  memmove(snap, snap+1, (nsnapshots-i-1)*sizeof(disk_snapshot_t));
+  nsnapshots--;
+  if(viewed > i) viewed--;
+  return 0;
+}
+
+/*
+ * Disk_ViewSnapshot
+ *
+ * Makes the reads return snapshot 'name' instead of the image, and
+ * refuses every write (with E_INVALID_PARAM), until called with NULL;
+ * this must not run concurrently with anything else.
+ */
+int Disk_ViewSnapshot(char* name)
+{
+  if(name == NULL) {
+    viewed = -1;
+    return 0;
+  }
+  int i = snapshot_find(name);
+  if(i < 0) return -1;
+  viewed = i;
+  return 0;
+}
+
+/*
+ * The asynchronous requests of Disk_SubmitBatch are handed to io_uring
+ * (driven through its system calls, sharing one ring between all
+ * threads) or to a pool of threads; whoever waits for a request to be
+ * done reaps the completions of the ring for everybody.
+ */
+
+// which engine carries out requests (see Disk_SetAsync)
+static int async_engine = DISK_ASYNC_AUTO;
+
+// the ring shared by all threads, set up the first time it is needed;
+// 'fd' is -1 if io_uring can't be used; 'queued' counts the requests
+// put in the submission queue and not yet handed to the kernel, and
+// 'inflight' the requests not yet reaped
+static struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  unsigned entries;
+  unsigned queued, inflight;
+} ring = { .fd = -1 };
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the requests waiting for a thread of the pool, and the pool itself,
+// started the first time it is needed; 'pool_done' is signalled when
+// a thread finishes a request
+static Disk_Request_t *pool_head, *pool_tail;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+/*
+ * ring_setup
+ *
+ * Sets up the io_uring ring, leaving 'ring.fd' at -1 if the kernel
+ * won't have it.
+ */
+static void ring_setup()
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, DISK_QUEUE_DEPTH, &p);
+  if(fd < 0) return;
+
+  size_t sq_bytes = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  size_t cq_bytes = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if(single && cq_bytes > sq_bytes) sq_bytes = cq_bytes;
+
+  char* sq = mmap(NULL, sq_bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  char* cq = single ? sq : mmap(NULL, cq_bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  void* sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  if(sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+
+  ring.sq_head = (unsigned*)(sq + p.sq_off.head);
+  ring.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  ring.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned*)(sq + p.sq_off.array);
+  ring.cq_head = (unsigned*)(cq + p.cq_off.head);
+  ring.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  ring.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  ring.sqes = (struct io_uring_sqe*) sqes;
+  ring.entries = p.sq_entries;
+  ring.fd = fd;
+}
+
+/*
+ * request_finish
+ *
+ * Marks a request as done, with 'result' (and 'error', if it failed),
+ * copying what was read from its bounce buffer (see file_io) if it
+ * has one.
+ */
+static void request_finish(Disk_Request_t* req, int result, int error)
+{
+  if(req->bounce) {
+    if(result == 0 && !req->write)
+      memcpy(req->buffer, req->bounce, (size_t)req->count*SECTOR_SIZE);
+    free(req->bounce);
+    req->bounce = NULL;
+  }
+  req->result = result;
+  req->error = error;
+  __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * request_run
+ *
+ * Carries out a request right away, in the calling thread.
+ */
+static void request_run(Disk_Request_t* req)
+{
+  int ret = req->write ? backends[disk_mode].write(req->sector, req->count, req->buffer)
+                       : backends[disk_mode].read(req->sector, req->count, req->buffer);
+  request_finish(req, ret, diskErrno);
+}
+
+/*
+ * ring_unqueue
+ *
+ * Takes back the requests put in the submission queue that the kernel
+ * hasn't taken, and carries them out right away instead. Called with
+ * 'ring_lock' held.
+ */
+static void ring_unqueue()
+{
+  unsigned first = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE), head;
+  for(head = first; head != *ring.sq_tail; head++) {
+    struct io_uring_sqe* sqe = &ring.sqes[ring.sq_array[head & *ring.sq_mask]];
+    Disk_Request_t* req = (Disk_Request_t*)(uintptr_t) sqe->user_data;
+    int r = file_io(disk_fd, req->write, (char*)(uintptr_t) sqe->addr, sqe->len, sqe->off);
+    request_finish(req, r, diskErrno);
+    ring.inflight--;
+  }
+  __atomic_store_n(ring.sq_tail, first, __ATOMIC_RELEASE);
+  ring.queued = 0;
+}
+
+/*
+ * ring_reap
+ *
+ * Marks the requests whose completions are in the ring as done.
+ * Called with 'ring_lock' held.
+ */
+static void ring_reap()
+{
+  unsigned head = *ring.cq_head;
+  while(head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+    Disk_Request_t* req = (Disk_Request_t*)(uintptr_t) cqe->user_data;
+    size_t bytes = (size_t)req->count*SECTOR_SIZE;
+    if(cqe->res >= 0 && (size_t)cqe->res == bytes)
+      request_finish(req, 0, 0);
+    else if(cqe->res >= 0 || cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP || cqe->res == -EAGAIN) {
+      // a short transfer, or one the kernel wouldn't do this way, is
+      // finished (or done again) synchronously
+      size_t done = cqe->res > 0 ? cqe->res : 0;
+      char* p = req->bounce ? req->bounce : req->buffer;
+      int r = file_io(disk_fd, req->write, p + done, bytes - done, (off_t)req->sector*SECTOR_SIZE + done);
+      request_finish(req, r, diskErrno);
+    } else
+      request_finish(req, -1, req->write ? E_WRITING_FILE : E_READING_FILE);
+    head++;
+    ring.inflight--;
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * ring_enter
+ *
+ * Hands the queued requests to the kernel and, if 'wait' is set, waits
+ * for at least one request to complete; then reaps the completions.
+ * When the kernel is short of room for them, completions are waited
+ * for and reaped until it isn't; if it won't take them otherwise (or
+ * there's nothing to wait for), the queued requests are carried out
+ * synchronously. Called with 'ring_lock' held.
+ */
+static void ring_enter(int wait)
+{
+  for(;;) {
+    int ret = syscall(__NR_io_uring_enter, ring.fd, ring.queued, wait ? 1 : 0,
+		      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if(ret >= 0) {
+      ring.queued -= ret;
+      break;
+    }
+    if(errno == EINTR) continue;
+    if((errno == EAGAIN || errno == EBUSY) && ring.inflight > ring.queued) {
+      ret = syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      if(ret >= 0 || errno == EINTR) {
+	ring_reap();
+	wait = 0; // something completed already
+	continue;
+      }
+    }
+    ring_unqueue();
+    break;
+  }
+  ring_reap();
+}
+
+/*
+ * ring_queue
+ *
+ * Puts a request in the submission queue of the ring, first making
+ * room for it if the ring is full. Called with 'ring_lock' held.
+ */
+static void ring_queue(Disk_Request_t* req)
+{
+  while(ring.inflight >= ring.entries) ring_enter(1);
+
+  size_t bytes = (size_t)req->count*SECTOR_SIZE;
+  char* p = req->buffer;
+  if(disk_mode == DISK_MODE_DIRECT && (uintptr_t)p % DISK_DIRECT_ALIGN) {
+    if(posix_memalign((void**)&req->bounce, DISK_DIRECT_ALIGN, bytes) != 0) {
+      req->bounce = NULL;
+      request_finish(req, -1, E_MEM_OP);
+      return;
+    }
+    if(req->write) memcpy(req->bounce, p, bytes);
+    p = req->bounce;
+  }
+
+  unsigned tail = *ring.sq_tail;
+  unsigned idx = tail & *ring.sq_mask;
+  struct io_uring_sqe* sqe = &ring.sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = disk_fd;
+  sqe->addr = (uintptr_t) p;
+  sqe->len = bytes;
+  sqe->off = (off_t)req->sector*SECTOR_SIZE;
+  sqe->user_data = (uintptr_t) req;
+  ring.sq_array[idx] = idx;
+  __atomic_store_n(ring.sq_tail, tail+1, __ATOMIC_RELEASE);
+  ring.queued++;
+  ring.inflight++;
+}
+
+/*
+ * pool_worker
+ *
+ * A thread of the pool: carries out requests as they come.
+ */
+static void* pool_worker(void* arg)
+{
+  for(;;) {
+    pthread_mutex_lock(&pool_lock);
+    while(pool_head == NULL) pthread_cond_wait(&pool_work, &pool_lock);
+    Disk_Request_t* req = pool_head;
+    pool_head = req->next;
+    if(pool_head == NULL) pool_tail = NULL;
+    pthread_mutex_unlock(&pool_lock);
+
+    request_run(req);
+
+    pthread_mutex_lock(&pool_lock);
+    pthread_cond_broadcast(&pool_done);
+    pthread_mutex_unlock(&pool_lock);
+  }
+  return NULL;
+}
+
+/*
+ * pool_setup
+ *
+ * Starts the threads of the pool.
+ */
+static void pool_setup()
+{
+  int i;
+  for(i = 0; i < DISK_IO_THREADS; i++) {
+    pthread_t t;
+    if(pthread_create(&t, NULL, pool_worker, NULL) == 0) pthread_detach(t);
+  }
+}
+
+/*
+ * async_ring
+ *
+ * Tells whether requests go to the ring (otherwise, to the pool).
+ */
+static int async_ring()
+{
+  if(async_engine == DISK_ASYNC_THREADS) return 0;
+  pthread_once(&ring_once, ring_setup);
+  return ring.fd >= 0;
+}
+
+/*
+ * Disk_SetAsync
+ *
+ * Chooses how Disk_SubmitBatch carries out requests in file and direct
+ * modes (see Disk_Async_t); must not be called while requests are
+ * under way.
+ */
+int Disk_SetAsync(int engine)
+{
+  if(engine != DISK_ASYNC_AUTO && engine != DISK_ASYNC_URING && engine != DISK_ASYNC_THREADS) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if(engine == DISK_ASYNC_URING) {
+    pthread_once(&ring_once, ring_setup);
+    if(ring.fd < 0) {
+      diskErrno = E_INVALID_PARAM;
+      return -1;
+    }
+  }
+  async_engine = engine;
+  return 0;
+}
+
+/*
+ * request_cmp
+ *
+ * Orders requests by their first sector, for qsort.
+ */
+static int request_cmp(const void* a, const void* b)
+{
+  int x = (*(Disk_Request_t**)a)->sector, y = (*(Disk_Request_t**)b)->sector;
+  return (x > y) - (x < y);
+}
+
+/*
+ * disk_schedule
+ *
+ * Puts the 'count' requests of a batch in 'order' in the order the
+ * scheduler carries them out, starting from where the head is: for
+ * DISK_SCHED_CLOOK, by sector from the head upwards and then from the
+ * lowest sector upwards; for DISK_SCHED_SCAN, on from the head in the
+ * direction it's sweeping in, and then back the other way.
+ */
+static void disk_schedule(Disk_Request_t* requests, int count, Disk_Request_t** order)
+{
+  Disk_Request_t *few[64], **sorted = few;
+  int i, k, n = 0;
+  for(i = 0; i < count; i++) order[i] = &requests[i];
+  qsort(order, count, sizeof(Disk_Request_t*), request_cmp);
+
+  // the requests at or above the head are sorted[k..count)
+  int head = __atomic_load_n(&head_sector, __ATOMIC_RELAXED);
+  for(k = 0; k < count && order[k]->sector < head; k++);
+  if(k == 0 || k == count) {
+    // a single sweep: upwards for C-LOOK, and for SCAN towards where
+    // the requests are, which is the way the head goes on sweeping
+    if(disk_sched == DISK_SCHED_CLOOK) return;
+    if(k == count) {
+      for(i = 0; i < count/2; i++) {
+	Disk_Request_t* r = order[i];
+	order[i] = order[count-1-i];
+	order[count-1-i] = r;
+      }
+    }
+    __atomic_store_n(&head_up, k == 0, __ATOMIC_RELAXED);
+    return;
+  }
+  if(count > 64) {
+    sorted = (Disk_Request_t**) malloc(count*sizeof(Disk_Request_t*));
+    if(sorted == NULL) return; // just in sector order, then
+  }
+  memcpy(sorted, order, count*sizeof(Disk_Request_t*));
+
+  if(disk_sched == DISK_SCHED_CLOOK) {
+    for(i = k; i < count; i++) order[n++] = sorted[i];
+    for(i = 0; i < k; i++) order[n++] = sorted[i];
+  } else if(__atomic_load_n(&head_up, __ATOMIC_RELAXED)) {
+    for(i = k; i < count; i++) order[n++] = sorted[i];
+    for(i = k-1; i >= 0; i--) order[n++] = sorted[i];
+    __atomic_store_n(&head_up, 0, __ATOMIC_RELAXED);
+  } else {
+    for(i = k-1; i >= 0; i--) order[n++] = sorted[i];
+    for(i = k; i < count; i++) order[n++] = sorted[i];
+    __atomic_store_n(&head_up, 1, __ATOMIC_RELAXED);
+  }
+  if(sorted != few) free(sorted);
+}
+
+/*
+ * Disk_SetScheduler
+ *
+ * Chooses the order the requests of each batch (see Disk_SubmitBatch)
+ * are started in (see Disk_Sched_t); DISK_SCHED_FIFO unless told
+ * otherwise.
+ */
+int Disk_SetScheduler(int sched)
+{
+  if(sched != DISK_SCHED_FIFO && sched != DISK_SCHED_SCAN && sched != DISK_SCHED_CLOOK) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  disk_sched = sched;
+  return 0;
+}
+
+/*
+ * Disk_SetTiming
+ *
+ * Sets the model of the time the accesses take (see Disk_Timing_t),
+ * or, if NULL, turns it off (the default); the time is only added up
+ * for Disk_GetStats, not waited for. Must be called before the disk is
+ * used by other threads.
+ */
+int Disk_SetTiming(Disk_Timing_t* t)
+{
+  if(t && (t->seek_settle_ms < 0 || t->seek_full_ms < 0 || t->rotation_ms < 0 ||
+	   t->transfer_mb_per_s <= 0)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  if(t) timing = *t;
+  timed = (t != NULL);
+  return 0;
+}
+
+/*
+ * Disk_SubmitBatch
+ *
+ * Starts 'count' requests to read or write runs of sectors, in the
+ * order of the scheduler (see Disk_SetScheduler), which are then
+ * carried out in any order (in parallel when the disk allows it)
+ * while the caller goes on; Disk_WaitBatch waits for them to be done.
+ * The buffers of the requests must not be touched until then. A bad
+ * request is done right away with E_INVALID_PARAM as its error.
+ */
+int Disk_SubmitBatch(Disk_Request_t* requests, int count)
+{
+  if((requests == NULL && count > 0) || count < 0) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  // the requests are taken in the order of the scheduler, if any
+  Disk_Request_t *few[64], **order = NULL;
+  if(disk_sched != DISK_SCHED_FIFO && count > 1) {
+    order = (count > 64) ? (Disk_Request_t**) malloc(count*sizeof(Disk_Request_t*)) : few;
+    if(order == NULL) {
+      diskErrno = E_MEM_OP;
+      return -1;
+    }
+    disk_schedule(requests, count, order);
+  }
+
+  int i, async = (disk_mode == DISK_MODE_FILE || disk_mode == DISK_MODE_DIRECT);
+  int use_ring = async && async_ring();
+  if(use_ring) pthread_mutex_lock(&ring_lock);
+  for(i = 0; i < count; i++) {
+    Disk_Request_t* req = order ? order[i] : &requests[i];
+    req->done = 0;
+    req->bounce = NULL;
+    req->next = NULL;
+    if(req->sector < 0 || req->count <= 0 || req->buffer == NULL ||
+       req->count > TOTAL_SECTORS - req->sector) {
+      request_finish(req, -1, E_INVALID_PARAM);
+      continue;
+    }
+    // the sectors of a snapshot are copied before being written over,
+    // and a snapshot viewed is read right away
+    if(req->write && snapshot_keep(req->sector, req->count) < 0) {
+      request_finish(req, -1, diskErrno);
+      continue;
+    }
+    disk_account(req->sector, req->count, req->write);
+    if(viewed >= 0)
+      request_finish(req, snapshot_read(req->sector, req->count, req->buffer), diskErrno);
+    else if(!async)
+      request_run(req);
+    else if(use_ring)
+      ring_queue(req);
+    else {
+      pthread_once(&pool_once, pool_setup);
+      pthread_mutex_lock(&pool_lock);
+      if(pool_tail) pool_tail->next = req;
+      else pool_head = req;
+      pool_tail = req;
+      pthread_cond_signal(&pool_work);
+      pthread_mutex_unlock(&pool_lock);
+    }
+  }
+  if(use_ring) {
+    if(ring.queued > 0) ring_enter(0);
+    pthread_mutex_unlock(&ring_lock);
+  }
+  if(order != few) free(order);
+  return 0;
+}
+
+/*
+ * Disk_WaitBatch
+ *
+ * Waits for 'count' requests started by Disk_SubmitBatch to be done;
+ * returns 0 if all of them succeeded, or -1 (with diskErrno set to the
+ * error of the first one that didn't) otherwise.
+ */
+int Disk_WaitBatch(Disk_Request_t* requests, int count)
+{
+  int i;
+  for(i = 0; i < count; i++) {
+    if(__atomic_load_n(&requests[i].done, __ATOMIC_ACQUIRE)) continue;
+    if(ring.fd >= 0 && async_engine != DISK_ASYNC_THREADS) {
+      pthread_mutex_lock(&ring_lock);
+      while(!__atomic_load_n(&requests[i].done, __ATOMIC_ACQUIRE)) ring_enter(1);
+      pthread_mutex_unlock(&ring_lock);
+    } else {
+      pthread_mutex_lock(&pool_lock);
+      while(!__atomic_load_n(&requests[i].done, __ATOMIC_ACQUIRE))
+	pthread_cond_wait(&pool_done, &pool_lock);
+      pthread_mutex_unlock(&pool_lock);
+    }
+  }
+  for(i = 0; i < count; i++) {
+    if(requests[i].result < 0) {
+      diskErrno = requests[i].error;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * disk_check_sectors
+ *
+ * Makes sure every sector in a list is on the disk.
+ */
+static int disk_check_sectors(int* sectors, int count)
+{
+  int i;
+  for(i = 0; i < count; i++) {
+    if((sectors[i] < 0) || (sectors[i] >= TOTAL_SECTORS))
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Disk_PollBatch
+ *
+ * Tells (without waiting) whether 'count' requests started by
+ * Disk_SubmitBatch are all done: returns 1 if so, and 0 if not; the
+ * requests still have to be waited for with Disk_WaitBatch to learn
+ * whether they succeeded.
+ */
+int Disk_PollBatch(Disk_Request_t* requests, int count)
+{
+  int i, polled = 0;
+  for(i = 0; i < count; i++) {
+    if(__atomic_load_n(&requests[i].done, __ATOMIC_ACQUIRE)) continue;
+    if(polled || ring.fd < 0 || async_engine == DISK_ASYNC_THREADS) return 0;
+    // reap whatever has completed, if nobody else is doing it
+    if(pthread_mutex_trylock(&ring_lock) != 0) return 0;
+    ring_enter(0);
+    pthread_mutex_unlock(&ring_lock);
+    polled = 1;
+    i--;
+  }
+  return 1;
+}
+
+/*
+ * disk_multi
+ *
+ * Reads (or, if 'write' is set, writes) the sectors listed in
+ * 'sectors', making each run of consecutive sector numbers one
+ * request, and starting all of them at once.
+ */
+static int disk_multi(int* sectors, int count, char* buffer, int write)
+{
+  Disk_Request_t few[16], *requests = few;
+  int i, n, nreq = 0;
+  for(i = 0; i < count; i++)
+    if(i == 0 || sectors[i] != sectors[i-1]+1) nreq++;
+  if(nreq > 16) {
+    requests = (Disk_Request_t*) malloc(nreq*sizeof(Disk_Request_t));
+    if(requests == NULL) {
+      diskErrno = E_MEM_OP;
+      return -1;
+    }
+  }
+
+  for(i = 0, nreq = 0; i < count; i += n) {
+    for(n = 1; i+n < count && sectors[i+n] == sectors[i]+n; n++);
+    requests[nreq].sector = sectors[i];
+    requests[nreq].count = n;
+    requests[nreq].buffer = buffer + (size_t)i*SECTOR_SIZE;
+    requests[nreq].write = write;
+    nreq++;
+  }
+
+  int ret = Disk_SubmitBatch(requests, nreq);
+  if(ret == 0) ret = Disk_WaitBatch(requests, nreq);
+  if(requests != few) free(requests);
+  return ret;
+}
+
+/*
+ * Disk_ReadMulti
+ *
+ * Reads the 'count' sectors listed in 'sectors' from "disk" into a
+ * buffer provided by the user (count*SECTOR_SIZE bytes long), one
+ * after another; runs of consecutive sector numbers are copied in one
+ * go, and all the runs are started at once (see Disk_SubmitBatch).
+ */
+int Disk_ReadMulti(int* sectors, int count, char* buffer)
+{
+  // quick error checks
+  if((sectors == NULL) || (count < 0) || (buffer == NULL) ||
+     disk_check_sectors(sectors, count) < 0) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  return disk_multi(sectors, count, buffer, 0);
+}
+
+/*
+ * Disk_WriteMulti
+ *
+ * Writes 'count' sectors from a buffer provided by the user
+ * (count*SECTOR_SIZE bytes long) to the sectors listed in 'sectors';
+ * runs of consecutive sector numbers are copied in one go, and all
+ * the runs are started at once (see Disk_SubmitBatch).
+ */
+int Disk_WriteMulti(int* sectors, int count, char* buffer)
+{
+  // quick error checks
+  if((sectors == NULL) || (count < 0) || (buffer == NULL) ||
+     disk_check_sectors(sectors, count) < 0) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  return disk_multi(sectors, count, buffer, 1);
+}
+
+/*
+ * Disk_GetStats
+ *
+ * Gets the number of sectors read and written by the calling thread
+ * (through Disk_Read, Disk_Write and the batched calls; saving and
+ * loading the image don't count), and the distance the head of the
+ * disk moved over to get to them: the number of sectors between the
+ * end of the access before each one and its start; and, if there is
+ * a timing model (see Disk_SetTiming), the time the accesses took.
+ */
+void Disk_GetStats(Disk_Stats_t* stats)
+{
+  if(stats) *stats = thread_stats;
+}
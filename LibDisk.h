@@ -1,8 +1,9 @@
 //
 // Disk.h
 //
-// Emulates a very simple disk (no timing issues). Allows user to
-// read and write to the disk just as if it was dealing with sectors
+// Emulates a very simple disk (no timing issues, unless a timing
+// model is set, see Disk_SetTiming). Allows user to read and write
+// to the disk just as if it was dealing with sectors
 //
 //
 
@@ -13,9 +14,15 @@
 #ifndef __Disk_H__
 #define __Disk_H__
 
-// a few disk parameters
-#define SECTOR_SIZE 512
-#define TOTAL_SECTORS 10000 
+// a few disk parameters; the geometry of the disk is chosen at run
+// time (see Disk_SetGeometry), and is 10000 sectors of 512 bytes each
+// unless told otherwise
+#define DEFAULT_SECTOR_SIZE 512
+#define DEFAULT_TOTAL_SECTORS 10000
+extern int diskSectorSize;   // size of a sector in bytes
+extern int diskTotalSectors; // number of sectors on the disk
+#define SECTOR_SIZE diskSectorSize
+#define TOTAL_SECTORS diskTotalSectors
 
 // disk errors
 typedef enum {
@@ -24,14 +31,108 @@ typedef enum {
   E_OPENING_FILE,
   E_WRITING_FILE,
   E_READING_FILE,
+  E_CACHE_FULL, // every block of the cache is held (see LibCache.h)
 } Disk_Error_t;
 
-extern int diskErrno; // used to see what happened w/ disk ops
+// how the disk image is backed by the backstore file
+typedef enum {
+  DISK_MODE_MEMORY, // image held in memory, loaded and saved as a whole
+  DISK_MODE_MMAP,   // backstore file mapped directly as the image (the default)
+  DISK_MODE_FILE,   // sectors read and written in the backstore file as needed
+  DISK_MODE_DIRECT, // same as DISK_MODE_FILE, with O_DIRECT (no page cache)
+} Disk_Mode_t;
+
+// in DISK_MODE_DIRECT, the buffers the kernel transfers sectors to and
+// from directly have to be aligned to this (others go through a copy)
+#define DISK_DIRECT_ALIGN 4096
+
+// how Disk_SubmitBatch carries out requests in file and direct modes
+// (in the other modes a request is done as soon as it is submitted)
+typedef enum {
+  DISK_ASYNC_AUTO,    // io_uring if the kernel has it, else DISK_ASYNC_THREADS
+  DISK_ASYNC_URING,   // io_uring
+  DISK_ASYNC_THREADS, // a pool of threads doing pread/pwrite
+} Disk_Async_t;
+
+// an asynchronous request to read or write a run of consecutive
+// sectors; the fields after 'error' are used internally
+typedef struct disk_request {
+  int sector;    // first sector of the run
+  int count;     // number of sectors in the run
+  char* buffer;  // count*SECTOR_SIZE bytes to read into or write from
+  int write;     // 1 to write the sectors, 0 to read them
+  int result;    // once done, 0 if it succeeded, -1 otherwise
+  int error;     // the diskErrno of the failure, if it failed
+  int done;
+  char* bounce;
+  struct disk_request* next;
+} Disk_Request_t;
+
+// the most requests io_uring has under way at once
+#define DISK_QUEUE_DEPTH 64
+
+// the number of threads of the DISK_ASYNC_THREADS pool
+#define DISK_IO_THREADS 4
+
+// the order the requests of a batch are carried out in (see
+// Disk_SetScheduler)
+typedef enum {
+  DISK_SCHED_FIFO,  // as submitted
+  DISK_SCHED_SCAN,  // the elevator: on in the direction the head moves,
+                    // turning back after the last request that way
+  DISK_SCHED_CLOOK, // upwards from the head only, then from the lowest
+} Disk_Sched_t;
+
+// a model of the time a spinning disk takes (see Disk_SetTiming): an
+// access that moves the head seeks for seek_settle_ms plus
+// seek_full_ms times the fraction of the disk moved across, and waits
+// for half a rotation on average; then its sectors go by at
+// transfer_mb_per_s; an access starting where the last one ended
+// takes the transfer only
+typedef struct {
+  double seek_settle_ms;
+  double seek_full_ms;
+  double rotation_ms;
+  double transfer_mb_per_s;
+} Disk_Timing_t;
+
+// a 7200 rpm disk
+#define DISK_TIMING_7200RPM { 0.5, 15.0, 60000.0/7200, 150.0 }
+
+// the accesses made by a thread (see Disk_GetStats)
+typedef struct {
+  long reads;         // sectors read
+  long writes;        // sectors written
+  long seek_distance; // sectors the head moved over to get to them
+  long disk_nanoseconds; // the time they took in the timing model
+} Disk_Stats_t;
+
+// the most snapshots kept at once (see Disk_Snapshot), and the
+// longest name of one (including the '\0')
+#define DISK_MAX_SNAPSHOTS 16
+#define DISK_SNAPSHOT_NAME 32
+
+extern __thread int diskErrno; // used to see what happened w/ disk ops (per thread)
 
+int Disk_SetMode(int mode);
+int Disk_SetGeometry(int sector_size, int total_sectors);
 int Disk_Init();
 int Disk_Save(char* file);
 int Disk_Load(char* file);
 int Disk_Write(int sector, char* buffer);
 int Disk_Read(int sector, char* buffer);
+int Disk_WriteMulti(int* sectors, int count, char* buffer);
+int Disk_ReadMulti(int* sectors, int count, char* buffer);
+int Disk_SetAsync(int engine);
+int Disk_SubmitBatch(Disk_Request_t* requests, int count);
+int Disk_WaitBatch(Disk_Request_t* requests, int count);
+int Disk_PollBatch(Disk_Request_t* requests, int count);
+int Disk_SetScheduler(int sched);
+int Disk_SetTiming(Disk_Timing_t* timing);
+void Disk_GetStats(Disk_Stats_t* stats);
+int Disk_Snapshot(char* name);
+int Disk_Rollback(char* name);
+int Disk_DeleteSnapshot(char* name);
+int Disk_ViewSnapshot(char* name);
 
 #endif // __Disk_H__
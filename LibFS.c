@@ -1,31 +1,53 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "LibDisk.h"
+#include "LibCache.h"
 #include "LibFS.h"
 #include <ctype.h>
 #include <stdbool.h>
 
-// Used for de-bug information
+// Used for de-bug information; a release build (make -f Makefile.LibFS
+// release) sets FSDEBUG to 0, and the dprintf calls compile to nothing
+// (their arguments aren't even evaluated)
+#ifndef FSDEBUG
 #define FSDEBUG 1
+#endif
 
 #if FSDEBUG
 #define dprintf printf
 #else
-#define dprintf noprintf
-void noprintf(char* str, ...) {}
+#define dprintf(...) ((void)0)
 #endif
 
 // the file system partitions the disk into five parts:
 
 // 1. the superblock (one sector), which contains a magic number at
-// its first four bytes (integer)
+// its first four bytes (integer), followed by the geometry of the
+// disk; the size of each of the other parts, and so where it starts,
+// is derived from the geometry when the disk is booted
 #define SUPERBLOCK_START_SECTOR 0
 
-// the magic number chosen for our file system
-#define OS_MAGIC 0xdeadbeef
+// the magic number chosen for our file system; it changes whenever
+// the layout on disk does, so that a disk formatted with an older one
+// isn't booted (0xdeadbeef was the layout whose inodes listed every
+// data block directly, with no geometry in the superblock)
+#define OS_MAGIC 0xdeadbef1
+
+// the head of the superblock
+typedef struct _superblock {
+  int magic;         // OS_MAGIC
+  int sector_size;   // size of a sector in bytes (SECTOR_SIZE)
+  int total_sectors; // number of sectors on the disk (TOTAL_SECTORS)
+  int max_files;     // number of inodes (MAX_FILES)
+  int journal_start;   // first sector of the journal (0 if none, see #5)
+  int journal_sectors; // number of sectors of the journal
+} superblock_t;
 
 // 2. the inode bitmap (one or more sectors), which indicates whether
 // the particular entry in the inode table (#4) is currently in use
@@ -57,7 +79,14 @@ void noprintf(char* str, ...) {}
 typedef struct _inode {
   int size; // the size of the file or number of directory entries
   int type; // 0 means regular file; 1 means directory
-  int data[MAX_SECTORS_PER_FILE]; // indices to sectors containing data blocks
+  int index; // for a directory, first sector of its hash index (0 if none);
+             // for a file, INLINE_DATA if its data is inline (0 if not)
+  union {
+    int data[DIRECT_SECTORS_PER_FILE]; // indices to sectors containing the first data blocks
+    char inline_data[DIRECT_SECTORS_PER_FILE*sizeof(int)]; // or the data of a small file
+  };
+  int indirect; // sector holding the indices of the next data blocks (0 if none)
+  int dindirect; // sector holding the indices of indirect sectors for the rest (0 if none)
 } inode_t;
 
 // the inode structures are stored consecutively and yet they don't
@@ -68,10 +97,19 @@ typedef struct _inode {
 // the system; the inode bitmap (#2) indicates whether the entries are
 // current in use or not
 #define INODES_PER_SECTOR (SECTOR_SIZE/sizeof(inode_t))                             
+
+// a file is created with its data inline, kept in the inode instead of
+// data blocks, and keeps it there until it grows past what fits in
+// place of the pointers to the data blocks; files made before files
+// had inline data don't have it, and none goes back to having it
+#define INLINE_DATA 1
+#define INLINE_DATA_SIZE ((int)sizeof(((inode_t*)0)->inline_data))
 #define INODE_TABLE_SECTORS ((MAX_FILES+INODES_PER_SECTOR-1)/INODES_PER_SECTOR)     
 
 // 5. the data blocks; all the rest sectors are reserved for data
-// blocks for the content of files and directories
+// blocks for the content of files and directories, except that the
+// first ones hold the journal of the changes to the other parts (see
+// the journal functions), unless the disk was formatted without one
 #define DATABLOCK_START_SECTOR (INODE_TABLE_START_SECTOR+INODE_TABLE_SECTORS)       
 
 // other file related definitions
@@ -82,8 +120,11 @@ typedef struct _inode {
 // max length of a filename is 16 bytes (including the ending null)
 #define MAX_NAME 16
 
-// max number of open files is 256
-#define MAX_OPEN_FILES 256
+// max number of open files is 16384
+#define MAX_OPEN_FILES 16384
+
+// max number of open directories is 256 (see Dir_Open)
+#define MAX_OPEN_DIRS 256
 
 // each directory entry represents a file/directory in the parent
 // directory, and consists of a file/directory name (less than 16
@@ -96,12 +137,63 @@ typedef struct _dirent {
 // the number of directory entries that can be contained in a sector
 #define DIRENTS_PER_SECTOR (SECTOR_SIZE/sizeof(dirent_t))               
 
-// global errno value here
-int osErrno;
+// the maximum number of entries in a directory (which only uses the
+// direct pointers of its inode)
+#define MAX_DIRENTS (DIRECT_SECTORS_PER_FILE*DIRENTS_PER_SECTOR)               
+
+// global errno value here (each thread has its own)
+__thread int osErrno;
+
+// the number of inodes of the booted disk (see MAX_FILES)
+int fsMaxFiles = DEFAULT_MAX_FILES;
+
+// the geometry FS_Boot formats a new disk with (see FS_SetGeometry)
+static superblock_t format_geometry = {
+  OS_MAGIC, DEFAULT_SECTOR_SIZE, DEFAULT_TOTAL_SECTORS, DEFAULT_MAX_FILES
+};
 
 // the name of the disk backstore file (with which the file system is booted)
 static char bs_filename[1024];
 
+// the journal of the booted disk (none if 'journal_sectors' is 0), and
+// the sequence number of the last transaction committed to it
+static int journal_start, journal_sectors;
+static unsigned int journal_seq;
+
+// held for reading while an operation changes the file system, and for
+// writing by FS_Sync, so that the saved disk never holds half of an
+// operation; FS_Sync takes no other lock while holding it, so it may
+// be taken with inodes already locked
+static pthread_rwlock_t sync_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// the number of batches the thread has begun and not yet committed
+// (see FS_BatchBegin); while there's one, the thread's FS_Sync leaves
+// the changes to be committed along with the rest of its batch, while
+// the other threads' still commit
+static __thread int batch_depth;
+
+// the statistics of the calls made (see FS_GetStats): each thread adds
+// to its own as its calls finish, and they're added up when asked for;
+// those of the threads that are gone are added to 'retired_stats', and
+// what the statistics were at the last FS_ResetStats is taken away;
+// 'stats_timing' says whether the calls are timed
+typedef struct _thread_stats {
+  FS_OpStats_t ops[FS_OPS];
+  struct _thread_stats* next;
+} thread_stats_t;
+static thread_stats_t* all_thread_stats;
+static FS_OpStats_t retired_stats[FS_OPS], reset_stats[FS_OPS];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static __thread thread_stats_t* thread_stats;
+static int stats_timing;
+
+// the counters the calling thread keeps of its own work in here (the
+// others come from LibDisk and LibCache)
+static __thread long thread_bitmap_scans, thread_bitmap_bits;
+static __thread long thread_path_components, thread_bytes_copied;
+
 
 
 
@@ -111,482 +203,1702 @@ static char bs_filename[1024];
 static int check_magic()
 {
   char buffer[SECTOR_SIZE];
-  if(Disk_Read(SUPERBLOCK_START_SECTOR, buffer) < 0)
+  if(Cache_Read(SUPERBLOCK_START_SECTOR, buffer) < 0)
     return 0;
   if(*(int*)buffer == OS_MAGIC) return 1;
   else return 0;
 }
 
-
-
-// Function to set the nth bit of the bitmap
-static char set_NthBit (unsigned char c, int n) 
+// read the head of the superblock straight from the backstore file
+// 'fname', before the disk is loaded (the geometry is needed to load
+// it); return 0 if successful, -1 if the file can't be read, and -2 if
+// it holds no disk of this layout (see OS_MAGIC), or one whose
+// formatting was cut short
+static int read_superblock(char* fname, superblock_t* sb)
 {
-    static unsigned char mask[] = {128, 64, 32, 16, 8, 4, 2, 1};
-    return (c | mask[n]);
+  FILE* f = fopen(fname, "r");
+  if(!f) return -1;
+  int n = fread(sb, sizeof(superblock_t), 1, f);
+  fclose(f);
+  if(n != 1) return -1;
+  return (sb->magic == OS_MAGIC) ? 0 : -2;
 }
 
-
-
-// Function to determine if the Nth bit is set in bitmap (1 if yes, 0 if no)
-static int isNthSet (unsigned char c, int n) 
+// the number of sectors of the journal of a disk of 'total_sectors'
+// sectors when it's formatted: a sixteenth of the disk, but no more
+// than 4096 sectors, and none at all for a disk too small for one
+static int journal_format_sectors(int total_sectors)
 {
-    static unsigned char mask[] = {128, 64, 32, 16, 8, 4, 2, 1};
-    return ((c & mask[n]) != 0);
+  int n = total_sectors/16;
+  if(n > 4096) n = 4096;
+  return (n < 8) ? 0 : n;
 }
 
-/************************** END OF HELPER FUNCTIONS *************************************************/
+// check that a geometry makes sense: the sector size is a power of
+// two no smaller than 512 bytes (so that an inode and the superblock
+// fit in a sector) and no larger than 32768 bytes (so that a position
+// in a directory fits the slots of its hash index), and the disk has
+// room for data blocks after the inode table and the journal it would
+// be formatted with; return 1 if OK, and 0 if not
+static int check_geometry(superblock_t* sb)
+{
+  if(sb->sector_size < 512 || sb->sector_size > 32768 ||
+     (sb->sector_size & (sb->sector_size-1)) != 0)
+    return 0;
+  if(sb->total_sectors <= 0 || sb->total_sectors > INT_MAX/2 ||
+     sb->max_files <= 0 || sb->max_files > INT_MAX/2)
+    return 0;
+  long long ss = sb->sector_size;
+  long long ips = ss/sizeof(inode_t);
+  long long bitmaps = (((long long)sb->max_files+7)/8+ss-1)/ss +
+    (((long long)sb->total_sectors+7)/8+ss-1)/ss;
+  long long table = (sb->max_files+ips-1)/ips;
+  return 1+bitmaps+table+journal_format_sectors(sb->total_sectors) < sb->total_sectors;
+}
 
-/************************** BITMAP FUNCTIONS *********************************************************/
+// make 'sb' the geometry of the disk (see check_geometry); return 0
+// if successful, -1 otherwise
+static int set_geometry(superblock_t* sb)
+{
+  if(!check_geometry(sb)) {
+    dprintf("... bad geometry (sector size %d, %d sectors, %d files)\n",
+	    sb->sector_size, sb->total_sectors, sb->max_files);
+    return -1;
+  }
+  if(Disk_SetGeometry(sb->sector_size, sb->total_sectors) < 0) return -1;
+  fsMaxFiles = sb->max_files;
+
+  // the journal, if any, is where the disk was formatted with it
+  if(sb->journal_sectors != 0 &&
+     (sb->journal_start != DATABLOCK_START_SECTOR || sb->journal_sectors < 2 ||
+      sb->journal_sectors >= TOTAL_SECTORS-DATABLOCK_START_SECTOR)) {
+    dprintf("... bad journal (start=%d, num=%d)\n", sb->journal_start, sb->journal_sectors);
+    return -1;
+  }
+  journal_start = sb->journal_start;
+  journal_sectors = sb->journal_sectors;
+  return 0;
+}
 
+// the 'dirty' argument of Cache_Unpin for a changed sector of metadata
+// (anything but the content of files): held in the cache until the
+// change has been committed to the journal, if the disk has one
+#define METADATA_DIRTY (journal_sectors > 0 ? CACHE_HOLD : 1)
 
-// initialize a bitmap with 'num' sectors starting from 'start'
-// sector; all bits should be set to zero except that the first
-// 'nbits' number of bits are set to one
-static void bitmap_init(int start, int num, int nbits)
+// write 'buffer' through the cache as the new content of sector
+// 'sector', which holds metadata; return 0 if successful, -1
+// otherwise
+static int metadata_write(int sector, char* buffer)
 {
-  
-	int nBytes = nbits / 8;        	// Number of bytes to set to 1  
-	int remain_bits = nbits % 8; 	// Remainder bits 
-	int last_block = 0;           	// Boolean integer indicating whether or not we are on the last block to set 1s on
-	char buffer[SECTOR_SIZE];		// Sector buffer
-  
-	int i;
-  
-	for(i = start; i < (start + num); i++)
-	{     
-		if(nBytes < SECTOR_SIZE)
-			last_block = 1;            
-		
+  char* block = Cache_Pin(sector, CACHE_NOREAD);
+  if(!block) return -1;
+  memcpy(block, buffer, SECTOR_SIZE);
+  Cache_Unpin(block, METADATA_DIRTY);
+  return 0;
+}
 
-		// Read the disk
-		if(Disk_Read(i, buffer) < 0)
-		{                                    
-			dprintf("Failed to read block %d\n" , i);
-			osErrno = E_GENERAL;
-			return;  
-		}    
-   
-		memset(buffer, 0, SECTOR_SIZE);     // Set to all zeroes
-
-		// If we have at least one byte to set 1s in
-		if(nBytes >= 0)
-		{               
-			if(last_block == 0)
-			{             
-				memset(buffer, 1, SECTOR_SIZE);    	// Set to all 1s
-				nBytes = nBytes - SECTOR_SIZE;  	// Update the remaining bytes to set 1s in
-			}
-			else
-			{
-				memset(buffer, 255, nBytes);         // Set only nByte bytes
-
-				//If there is remaining bits to set to 1 and this is the last block to set 1s in
-				if(remain_bits > 0 && last_block == 1)
-				{               
-					unsigned char mask = (255<<(8 - remain_bits));    
-					 
-					buffer[nBytes] = mask;                     
-					nBytes = -1;
-				}
-			}
-		}      
+// whether a snapshot is mounted, which can't be changed (see
+// FS_MountSnapshot)
+static int read_only;
 
-		// Write the disk
-		if(Disk_Write(i, buffer) < 0) 
-		{                                     
-			dprintf("Failed to write block %d\n" , i);
-			osErrno = E_GENERAL;
-			return;
-		}
-	}
+// check that a call may change the file system; return 0 if so, and
+// -1 (E_READ_ONLY) if a snapshot is mounted
+static int check_writable()
+{
+  if(!read_only) return 0;
+  dprintf("... a snapshot is mounted, read-only\n");
+  osErrno = E_READ_ONLY;
+  return -1;
 }
 
 
 
+/************************** END OF HELPER FUNCTIONS *************************************************/
 
-
-// set the first unused bit from a bitmap of 'nbits' bits (flip the
-// first zero appeared in the bitmap to one) and return its location;
-// return -1 if the bitmap is already full (no more zeros)
-static int bitmap_first_unused(int start, int num, int nbits)
+/************************** TRACE FUNCTIONS *********************************************************/
+
+
+// the most recent events of the file system are recorded in binary in
+// a ring in memory, so that what led to a failure can be told even
+// without dprintf; recording one is cheap (a few stores, and no
+// formatting, which is left to FS_TraceDump)
+#define TRACE_ENTRIES 4096 // a power of two
+
+typedef enum {
+  TRACE_CALL,   // an API call starts: op
+  TRACE_RETURN, // and returns: op, whether it failed, osErrno
+  TRACE_PATH,   // a path is resolved: (the path)
+  TRACE_IO,     // file data is copied: inode, offset, size, write
+  TRACE_ALLOC,  // data sectors are allocated: first, count
+  TRACE_COMMIT, // a journal transaction is committed: seq, sectors
+  TRACE_REPLAY, // and replayed at boot: seq, sectors
+} trace_event_t;
+
+typedef struct {
+  unsigned long seq;  // the number of the event, plus one (0 if none)
+  long nanoseconds;
+  int thread;
+  int event;
+  int args[4];
+  char path[24];      // the end of the path, for TRACE_PATH
+} trace_record_t;
+
+static trace_record_t trace_ring[TRACE_ENTRIES];
+static unsigned long trace_next;
+static int trace_on;
+
+// whether to dump the ring when a call fails with E_GENERAL, and
+// where to (stderr if empty; see FS_SetTraceDumpOnError), and the
+// number each thread is known by
+static int trace_dump_on_error;
+static char trace_dump_file[1024];
+static int trace_threads;
+static __thread int trace_thread;
+
+static const char* op_names[FS_OPS] = {
+  "FS_Boot", "FS_Sync", "FS_BatchCommit",
+  "File_Create", "File_Open", "File_Read", "File_Write",
+  "File_PRead", "File_PWrite", "File_Seek", "File_Close", "File_Unlink",
+  "Dir_Create", "Dir_Unlink", "Dir_Size", "Dir_Read",
+  "Dir_Walk", "Dir_RemoveTree", "Dir_Usage",
+  "Dir_Open", "Dir_Next", "Dir_Close",
+  "FS_Snapshot", "FS_Rollback", "FS_DeleteSnapshot", "FS_MountSnapshot",
+  "FS_Check",
+};
+
+// a record is copied in and out of the ring a long at a time, since a
+// thread lapping the ring may be writing the same slot meanwhile
+#define TRACE_LONGS ((int)(sizeof(trace_record_t)/sizeof(long)))
+
+// record an event with its arguments, and with the end of 'path' (if
+// not NULL); the slot is claimed by numbering the event, and marked as
+// holding it only once filled in
+static void trace_record(int event, int a0, int a1, int a2, int a3, char* path)
 {
-	int nBytes = nbits / 8;                 // Number of bytes to set to 1  
-	int remain_bits = nbits % 8;            // Remainder bits to set to 1
-	int last_block = 0;                    	// Boolean integer indicating the last block to set 1s in
-	char buffer[SECTOR_SIZE];               
-	int location = -1;                      // Return location 
-  
-	int i;
-	
-	for(i = start; i < (start + num); i++)
-	{     
-
-		// If number of bytes to set < sector size
-		if(nBytes < SECTOR_SIZE)
-			last_block = 1;      	// This is the last block to set 1s in      
-
-		// Read the sector
-		if(Disk_Read(i, buffer) < 0)
-		{                                      
-			dprintf("Failed to read block %d\n" , i);
-			osErrno = E_GENERAL;
-			return -1;  
-		}
+  if(!__atomic_load_n(&trace_on, __ATOMIC_RELAXED)) return;
+  if(!trace_thread) trace_thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+  unsigned long seq = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+
+  trace_record_t rec;
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  rec.nanoseconds = t.tv_sec*1000000000L + t.tv_nsec;
+  rec.thread = trace_thread;
+  rec.event = event;
+  rec.args[0] = a0; rec.args[1] = a1; rec.args[2] = a2; rec.args[3] = a3;
+  rec.path[0] = '\0';
+  if(path) {
+    size_t len = strlen(path);
+    if(len >= sizeof(rec.path)) {
+      path += len-(sizeof(rec.path)-1);
+      len = sizeof(rec.path)-1;
+    }
+    memcpy(rec.path, path, len+1);
+  }
 
-		int x;       
-		int bitInByte; 
-		int last; 
+  long* from = (long*) &rec, *to = (long*) &trace_ring[seq%TRACE_ENTRIES];
+  int i;
+  __atomic_store_n(&to[0], 0, __ATOMIC_RELAXED); // seq
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  for(i = 1; i < TRACE_LONGS; i++) __atomic_store_n(&to[i], from[i], __ATOMIC_RELAXED);
+  __atomic_store_n(&to[0], (long)(seq+1), __ATOMIC_RELEASE);
+}
 
-		// If this is the last sector
-		if(last_block == 1)                 
-			last = nBytes;		// Stop at nBytes
-		else                                 
-			last = SECTOR_SIZE; 	// Stop at end of sector (which means we have more sectors to set)
-   
-        
-		// Loop through all compeleted bytes 
-		for(x = 0; x < last; x++)
-		{       
-			// Loop through the bits in each byte
-			for(bitInByte = 0; bitInByte < 8; bitInByte++)
-			{  
-				location ++;
-			
-				// Check if this bit is set
-				if(!isNthSet(buffer[x], bitInByte))
-				{                 
-					buffer[x] = set_NthBit(buffer[x], bitInByte);          //Set this bit
-           
-					// Write sector back 
-					if(Disk_Write(i, buffer) < 0) 
-					{              
-						dprintf("Failed to write block %d\n" , i);
-						osErrno = E_GENERAL;
-						return -1;
-					}
-			
-					return location;        // Return the first unused spot
-				}
-        
-			}     
-		} 
+#define TRACE(event, a0, a1, a2, a3) trace_record(event, a0, a1, a2, a3, NULL)
 
-		// Need to check remaining bits in byte
-		if(last_block == 1)
-		{   
-			// Loop through the remaining bits in the byte
-			for(bitInByte = 0; bitInByte < remain_bits ; bitInByte++)
-			{  
-				location ++;
-			
-				if(!isNthSet(buffer[x], bitInByte))
-				{        //Chek if this bit is not set
-					buffer[x] = set_NthBit(buffer[x], bitInByte);          //Set this bit
-
-					// Write sector back
-					if(Disk_Write(i, buffer) < 0) 
-					{              
-						dprintf("Failed to write block %d\n" , i);
-						osErrno = E_GENERAL;
-						return -1;
-					}
-				
-					return location;        // Return the first unused spot
-				}
-			} 
-		}
-	}
+// write out one event as text, relative to the time 'start'
+static void trace_print(FILE* f, trace_record_t* rec, long start)
+{
+  int* a = rec->args;
+  fprintf(f, "%12.6f t%-3d ", (rec->nanoseconds-start)/1e9, rec->thread);
+  switch(rec->event) {
+  case TRACE_CALL:
+    fprintf(f, "call %s\n", (a[0] >= 0 && a[0] < FS_OPS) ? op_names[a[0]] : "?");
+    break;
+  case TRACE_RETURN:
+    fprintf(f, "return %s", (a[0] >= 0 && a[0] < FS_OPS) ? op_names[a[0]] : "?");
+    if(a[1]) fprintf(f, ", failed (osErrno %d)\n", a[2]);
+    else fprintf(f, "\n");
+    break;
+  case TRACE_PATH:
+    fprintf(f, "path '%s%s'\n", (strlen(rec->path) == sizeof(rec->path)-1) ? "..." : "",
+	    rec->path);
+    break;
+  case TRACE_IO:
+    fprintf(f, "%s inode %d, %d bytes at %d\n", a[3] ? "write" : "read", a[0], a[2], a[1]);
+    break;
+  case TRACE_ALLOC:
+    fprintf(f, "allocate sectors %d-%d\n", a[0], a[0]+a[1]-1);
+    break;
+  case TRACE_COMMIT:
+    fprintf(f, "commit journal transaction %u (%d sectors)\n", (unsigned)a[0], a[1]);
+    break;
+  case TRACE_REPLAY:
+    fprintf(f, "replay journal transaction %u (%d sectors)\n", (unsigned)a[0], a[1]);
+    break;
+  default:
+    fprintf(f, "event %d\n", rec->event);
+  }
+}
 
-	return -1;
+// write the events in the ring out as text, oldest first, to 'file'
+// (appended to), or to stderr if NULL; events being recorded meanwhile
+// are left out; return 0 if successful, -1 otherwise
+static int trace_dump(char* file)
+{
+  FILE* f = file ? fopen(file, "a") : stderr;
+  if(!f) return -1;
+  unsigned long end = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE), seq;
+  unsigned long begin = (end > TRACE_ENTRIES) ? end-TRACE_ENTRIES : 0;
+  long start = -1;
+  fprintf(f, "--- file system trace: events %lu to %lu ---\n", begin, end);
+  for(seq = begin; seq < end; seq++) {
+    // a record overwritten while being copied is left out
+    trace_record_t rec;
+    long* from = (long*) &trace_ring[seq%TRACE_ENTRIES], *to = (long*) &rec;
+    int i;
+    if(__atomic_load_n(&from[0], __ATOMIC_ACQUIRE) != (long)(seq+1)) continue;
+    for(i = 1; i < TRACE_LONGS; i++) to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&from[0], __ATOMIC_RELAXED) != (long)(seq+1)) continue;
+    if(start < 0) start = rec.nanoseconds;
+    rec.path[sizeof(rec.path)-1] = '\0';
+    trace_print(f, &rec, start);
+  }
+  if(file) fclose(f);
+  else fflush(f);
+  return 0;
 }
 
 
+/************************** END OF TRACE FUNCTIONS *********************************************************/
 
 
+/************************** BITMAP FUNCTIONS *********************************************************/
 
 
-// reset the i-th bit of a bitmap with 'num' sectors starting from
-// 'start' sector; return 0 if successful, -1 otherwise
-static int bitmap_reset(int start, int num, int ibit)
+// the two allocation bitmaps are kept resident in memory once the
+// file system is booted; in memory, entry i is tracked by bit i%64
+// (counting from the least significant bit) of word i/64, so a free
+// entry can be found 64 bits at a time; on disk, entry i is bit i%8 of
+// byte i/8 counting from the most significant bit; the sectors of a
+// bitmap are written back only when the file system is sync'd
+typedef struct _bitmap {
+  int start;       // first disk sector of the bitmap
+  int num;         // number of disk sectors of the bitmap
+  int nbits;       // number of entries tracked by the bitmap
+  int nwords;      // number of 64-bit words in memory
+  uint64_t* words; // the bitmap itself
+  int hint;        // word at which the next search starts (next fit)
+  char* dirty;     // one flag for each disk sector needing write-back
+  pthread_mutex_t lock; // held while the bitmap is searched or changed
+} bitmap_t;
+
+static bitmap_t inode_bitmap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static bitmap_t sector_bitmap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// reverse the order of bits in a byte (on-disk to in-memory order)
+static unsigned char reverse_bits(unsigned char c)
 {
-  
-	int nBytes = ibit / 8;                     	// Completed bytes up to the one we're going to set a bit in
-	int remain_bits = ibit % 8;                 // Position of the bit to reset
-	char buffer[SECTOR_SIZE];                  
-          
-    if(nBytes > SECTOR_SIZE * num)
-	{
-		dprintf("Error: ibit value of %d is too big for a sector\n" , ibit); 
-		return -1;                 
-    }
-
-	// Loop to the last block 
-    while(nBytes > SECTOR_SIZE)
-	{
-		nBytes = nBytes - SECTOR_SIZE;   
-    }
+  c = (c & 0xf0) >> 4 | (c & 0x0f) << 4;
+  c = (c & 0xcc) >> 2 | (c & 0x33) << 2;
+  c = (c & 0xaa) >> 1 | (c & 0x55) << 1;
+  return c;
+}
 
-    if(Disk_Read(start, buffer) < 0)
-	{                                      
-		dprintf("Failed to read block %d\n" , start);
-		osErrno = E_GENERAL;
-		return -1;  
-    }
+// mark the disk sector holding entry 'ibit' as needing write-back
+#define BITMAP_DIRTY(bm, ibit) ((bm)->dirty[((ibit)/8)/SECTOR_SIZE] = 1)
 
-    static unsigned char mask[] = {127, 191, 223, 239, 247, 251, 253, 254};
-	
-    buffer[nBytes] = (buffer[nBytes] & mask[remain_bits]);
+// allocate the in-memory bitmap for 'nbits' entries stored in 'num'
+// sectors starting from 'start'; all entries are clear, except the
+// padding bits past 'nbits' in the last word, which are set so that
+// they are never handed out; return 0 if successful, -1 otherwise
+static int bitmap_alloc(bitmap_t* bm, int start, int num, int nbits)
+{
+  free(bm->words);
+  free(bm->dirty);
+  bm->start = start;
+  bm->num = num;
+  bm->nbits = nbits;
+  bm->nwords = (nbits+63)/64;
+  bm->hint = 0;
+  bm->words = (uint64_t*) calloc(bm->nwords, sizeof(uint64_t));
+  bm->dirty = (char*) calloc(num, 1);
+  if(!bm->words || !bm->dirty) {
+    dprintf("... failed to allocate bitmap (start=%d, num=%d)\n", start, num);
+    return -1;
+  }
+  if(nbits%64) bm->words[bm->nwords-1] = ~(uint64_t)0 << (nbits%64);
+  return 0;
+}
 
-    if(Disk_Write(start, buffer) < 0) 
-	{                                        
-        dprintf("Failed to write block %d\n" , start);
-        osErrno = E_GENERAL;
-		return -1;
-	}
-    
-	return 0;
+// initialize a bitmap with 'num' sectors starting from 'start'
+// sector; all bits should be set to zero except that the first
+// 'nset' number of bits are set to one; the whole bitmap is written
+// to disk at the next flush
+static int bitmap_init(bitmap_t* bm, int start, int num, int nbits, int nset)
+{
+  if(bitmap_alloc(bm, start, num, nbits) < 0) return -1;
+  int i;
+  for(i=0; i<nset/64; i++) bm->words[i] = ~(uint64_t)0;
+  if(nset%64) bm->words[nset/64] |= ~(~(uint64_t)0 << (nset%64));
+  memset(bm->dirty, 1, num);
+  return 0;
 }
 
+// load a bitmap of 'nbits' entries from 'num' sectors starting from
+// 'start' sector into memory; return 0 if successful, -1 otherwise
+static int bitmap_load(bitmap_t* bm, int start, int num, int nbits)
+{
+  if(bitmap_alloc(bm, start, num, nbits) < 0) return -1;
 
-/************************** END OF BITMAP FUNCTIONS *********************************************************/
+  char buffer[SECTOR_SIZE];
+  int nbytes = (nbits+7)/8, i, j;
+  for(i=0; i<num; i++) {
+    if(Cache_Read(start+i, buffer) < 0) {
+      dprintf("Failed to read block %d\n", start+i);
+      return -1;
+    }
+    for(j=0; j<SECTOR_SIZE && i*SECTOR_SIZE+j < nbytes; j++) {
+      int byte = i*SECTOR_SIZE+j;
+      bm->words[byte/8] |= (uint64_t)reverse_bits(buffer[j]) << (byte%8*8);
+    }
+  }
+  return 0;
+}
 
+// write the sectors of a bitmap that changed since the last flush
+// back to the cache, to be committed (see journal_commit); return 0 if
+// successful, -1 otherwise
+static int bitmap_flush(bitmap_t* bm)
+{
+  char buffer[SECTOR_SIZE];
+  int nbytes = (bm->nbits+7)/8, i, j;
+  pthread_mutex_lock(&bm->lock);
+  for(i=0; i<bm->num; i++) {
+    if(!bm->dirty[i]) continue;
+    memset(buffer, 0, SECTOR_SIZE);
+    for(j=0; j<SECTOR_SIZE && i*SECTOR_SIZE+j < nbytes; j++) {
+      int byte = i*SECTOR_SIZE+j;
+      unsigned char c = bm->words[byte/8] >> (byte%8*8);
+      // the padding bits past 'nbits' are kept clear on disk
+      if(byte == nbytes-1 && bm->nbits%8) c &= (1<<(bm->nbits%8))-1;
+      buffer[j] = reverse_bits(c);
+    }
+    if(metadata_write(bm->start+i, buffer) < 0) {
+      dprintf("Failed to write block %d\n", bm->start+i);
+      pthread_mutex_unlock(&bm->lock);
+      return -1;
+    }
+    bm->dirty[i] = 0;
+  }
+  pthread_mutex_unlock(&bm->lock);
+  return 0;
+}
 
+// return the number of sectors of a bitmap that changed since the
+// last flush
+static int bitmap_dirty_count(bitmap_t* bm)
+{
+  int i, n = 0;
+  pthread_mutex_lock(&bm->lock);
+  for(i=0; i<bm->num; i++) n += bm->dirty[i];
+  pthread_mutex_unlock(&bm->lock);
+  return n;
+}
 
-// return 1 if the file name is illegal; otherwise, return 0; legal
-// characters for a file name include letters (case sensitive),
-// numbers, dots, dashes, and underscores; and a legal file name
-// should not be more than MAX_NAME-1 in length
-static int illegal_filename(char* name)
+// set the first unused bit from a bitmap (flip the first zero
+// appeared in the bitmap to one) and return its location; the search
+// starts from where the last one left off and wraps around; return -1
+// if the bitmap is already full (no more zeros)
+static int bitmap_first_unused(bitmap_t* bm)
 {
-	int i;	
-	bool flag = true;	
-	
-	// Loop through the string; If a character is not alphanumeric, a dot, a dash, or an underscore, 
-	// the filename is illegal
-	for(i = 0; i < strlen(name) && flag == true; i++)
-	{
-		if(isalnum(name[i]) || name[i] == '.' || name[i] == '-' || name[i] == '_')
-			flag = true;
-		else
-			flag = false;
-	}
-	
-	// Check if the string is too long
-	if(strlen(name) > (MAX_NAME-1))
-	{
-		flag = false;
-	}
-	
-	// Return 0 for legal filenames
-	if(flag)
-		return 0;
+  int n, w, ibit = -1;
+  pthread_mutex_lock(&bm->lock);
+  thread_bitmap_scans++;
+  for(n=0, w=bm->hint; n<bm->nwords; n++, w++) {
+    if(w == bm->nwords) w = 0;
+    thread_bitmap_bits += 64;
+    if(bm->words[w] != ~(uint64_t)0) {
+      ibit = w*64 + __builtin_ctzll(~bm->words[w]);
+      bm->words[w] |= (uint64_t)1 << (ibit%64);
+      BITMAP_DIRTY(bm, ibit);
+      bm->hint = w;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&bm->lock);
+  return ibit;
+}
 
-	// Return 1 for illegal filenames
-	return 1; 
+// return the first clear bit at or after 'from', or 'nbits' if there
+// is none; fully set words are skipped 64 bits at a time (the caller
+// holds the bitmap lock, as for the next two functions)
+static int bitmap_next_clear(bitmap_t* bm, int from)
+{
+  if(from >= bm->nbits) return bm->nbits;
+  int w = from/64;
+  uint64_t free_bits = ~bm->words[w] & (~(uint64_t)0 << (from%64));
+  thread_bitmap_bits += 64;
+  while(free_bits == 0) {
+    if(++w == bm->nwords) return bm->nbits;
+    free_bits = ~bm->words[w];
+    thread_bitmap_bits += 64;
+  }
+  int ibit = w*64 + __builtin_ctzll(free_bits);
+  return ibit < bm->nbits ? ibit : bm->nbits;
 }
-  
 
+// return the first set bit at or after 'from', or 'nbits' if there is
+// none; fully clear words are skipped 64 bits at a time
+static int bitmap_next_set(bitmap_t* bm, int from)
+{
+  if(from >= bm->nbits) return bm->nbits;
+  int w = from/64;
+  uint64_t used_bits = bm->words[w] & (~(uint64_t)0 << (from%64));
+  thread_bitmap_bits += 64;
+  while(used_bits == 0) {
+    if(++w == bm->nwords) return bm->nbits;
+    used_bits = bm->words[w];
+    thread_bitmap_bits += 64;
+  }
+  int ibit = w*64 + __builtin_ctzll(used_bits);
+  return ibit < bm->nbits ? ibit : bm->nbits;
+}
 
-// return the child inode of the given file name 'fname' from the
-// parent inode; the parent inode is currently stored in the segment
-// of inode table in the cache (we cache only one disk sector for
-// this); once found, both cached_inode_sector and cached_inode_buffer
-// may be updated to point to the segment of inode table containing
-// the child inode; the function returns -1 if no such file is found;
-// it returns -2 is something else is wrong (such as parent is not
-// directory, or there's read error, etc.)
-static int find_child_inode(int parent_inode, char* fname, int *cached_inode_sector, char* cached_inode_buffer){
-
-  int cached_start_entry = ((*cached_inode_sector)-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = parent_inode-cached_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* parent = (inode_t*)(cached_inode_buffer+offset*sizeof(inode_t));
-  dprintf("... load parent inode: %d (size=%d, type=%d)\n",	parent_inode, parent->size, parent->type);
-  if(parent->type != 1) {
-    dprintf("... parent not a directory\n");
-    return -2;
+// set the 'n' bits starting from bit 'first'
+static void bitmap_set_range(bitmap_t* bm, int first, int n)
+{
+  int ibit = first, end = first+n;
+  while(ibit < end) {
+    int bits = 64 - ibit%64;
+    if(bits > end-ibit) bits = end-ibit;
+    uint64_t mask = (bits == 64) ? ~(uint64_t)0 : (((uint64_t)1 << bits) - 1) << (ibit%64);
+    bm->words[ibit/64] |= mask;
+    ibit += bits;
   }
+  int sector;
+  for(sector = (first/8)/SECTOR_SIZE; sector <= ((end-1)/8)/SECTOR_SIZE; sector++)
+    bm->dirty[sector] = 1;
+}
 
-  int nentries = parent->size; // remaining number of directory entries 
-  int idx = 0;
-  while(nentries > 0) {
-    char buffer[SECTOR_SIZE]; // cached content of directory entries
-    if(Disk_Read(parent->data[idx], buffer) < 0) return -2;
-    int i;
-    for(i=0; i<DIRENTS_PER_SECTOR; i++) {
-      if(i>nentries) break;
-      if(!strcmp(((dirent_t*)buffer)[i].fname, fname)) {
-	       // found the file/directory; update inode cache
-	       int child_inode = ((dirent_t*)buffer)[i].inode;
-	       dprintf("... found child_inode=%d\n", child_inode);
-	       int sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-	       if(sector != (*cached_inode_sector)) {
-	         *cached_inode_sector = sector;
-	         if(Disk_Read(sector, cached_inode_buffer) < 0) return -2;
-	           dprintf("... load inode table for child\n");
-	       }
-	       return child_inode;
+// reserve a run of up to 'want' consecutive unused bits in one step;
+// the search starts from bit 'goal' (or from the next-fit hint if
+// 'goal' is negative) and wraps around; the first run that is long
+// enough is used, and if there is none, the longest free run is used
+// instead; return the first bit of the run and its length through
+// 'got', or -1 if the bitmap is full
+static int bitmap_alloc_run(bitmap_t* bm, int goal, int want, int* got)
+{
+  pthread_mutex_lock(&bm->lock);
+  thread_bitmap_scans++;
+  if(goal < 0 || goal >= bm->nbits) goal = (goal < 0) ? bm->hint*64 : 0;
+
+  int best = -1, best_len = 0, pass;
+  for(pass = 0; pass < 2 && best_len < want; pass++) {
+    // first pass covers [goal, nbits), second pass [0, goal)
+    int ibit = (pass == 0) ? goal : 0;
+    int end = (pass == 0) ? bm->nbits : goal;
+    while(ibit < end) {
+      int first = bitmap_next_clear(bm, ibit);
+      if(first >= end) break;
+      int last = bitmap_next_set(bm, first);
+      if(last > end) last = end;
+      if(last-first > best_len) {
+	best = first;
+	best_len = last-first;
+	if(best_len >= want) break;
       }
+      ibit = last;
     }
-    idx++; nentries -= DIRENTS_PER_SECTOR;
   }
-  dprintf("... could not find child inode\n");
-  return -1; // not found
+  if(best >= 0) {
+    *got = (best_len < want) ? best_len : want;
+    bitmap_set_range(bm, best, *got);
+    bm->hint = (best + *got)/64 < bm->nwords ? (best + *got)/64 : 0;
+  }
+  pthread_mutex_unlock(&bm->lock);
+  return best;
 }
 
-// follow the absolute path; if successful, return the inode of the
-// parent directory immediately before the last file/directory in the
-// path; for example, for '/a/b/c/d.txt', the parent is '/a/b/c' and
-// the child is 'd.txt'; the child's inode is returned through the
-// parameter 'last_inode' and its file name is returned through the
-// parameter 'last_filename' (both are references); it's possible that
-// the last file/directory is not in its parent directory, in which
-// case, 'last_inode' points to -1; if the function returns -1, it
-// means that we cannot follow the path
-static int follow_path(char* path, int* last_inode, char* last_filename)
+// reset the i-th bit of a bitmap; return 0 if successful, -1 otherwise
+static int bitmap_reset(bitmap_t* bm, int ibit)
 {
-  if(!path) {
-    dprintf("... invalid path\n");
-    return -1;
-  }
-  if(path[0] != '/') {
-    dprintf("... '%s' not absolute path\n", path);
+  if(ibit < 0 || ibit >= bm->nbits) {
+    dprintf("Error: ibit value of %d is out of range\n", ibit);
     return -1;
   }
-  
-  // make a copy of the path (skip leading '/'); this is necessary
-  // since the path is going to be modified by strsep()
-  char pathstore[MAX_PATH]; 
-  strncpy(pathstore, path+1, MAX_PATH-1);
-  pathstore[MAX_PATH-1] = '\0'; // for safety
-  char* lpath = pathstore;
-  
-  int parent_inode = -1, child_inode = 0; // start from root
-  // cache the disk sector containing the root inode
-  int cached_sector = INODE_TABLE_START_SECTOR;
-  char cached_buffer[SECTOR_SIZE];
-  if(Disk_Read(cached_sector, cached_buffer) < 0) return -1;
-  dprintf("... load inode table for root from disk sector %d\n", cached_sector);
-  
-  // for each file/directory name separated by '/'
-  char* token;
-  while((token = strsep(&lpath, "/")) != NULL) {
-    dprintf("... process token: '%s'\n", token);
-    if(*token == '\0') continue; // multiple '/' ignored
-    if(illegal_filename(token)) {
-      dprintf("... illegal file name: '%s'\n", token);
-      return -1; 
-    }
-    if(child_inode < 0) {
-      // regardless whether child_inode was not found previously, or
-      // there was issues related to the parent (say, not a
-      // directory), or there was a read error, we abort
-      dprintf("... parent inode can't be established\n");
-      return -1;
-    }
-    parent_inode = child_inode;    
-    child_inode = find_child_inode(parent_inode, token, &cached_sector, cached_buffer);    
+  pthread_mutex_lock(&bm->lock);
+  bm->words[ibit/64] &= ~((uint64_t)1 << (ibit%64));
+  BITMAP_DIRTY(bm, ibit);
+  pthread_mutex_unlock(&bm->lock);
+  return 0;
+}
 
-    if(last_filename) strcpy(last_filename, token);
-  }
-  if(child_inode < -1) return -1; // if there was error, abort
-  else {
-    // there was no error, several possibilities:
-    // 1) '/': parent = -1, child = 0
-    // 2) '/valid-dirs.../last-valid-dir/not-found': parent=last-valid-dir, child=-1
-    // 3) '/valid-dirs.../last-valid-dir/found: parent=last-valid-dir, child=found
-    // in the first case, we set parent=child=0 as special case
-    if(parent_inode==-1 && child_inode==0) parent_inode = 0;
-    dprintf("... found parent_inode=%d, child_inode=%d\n", parent_inode, child_inode);
-    *last_inode = child_inode;
-    return parent_inode;
+// the bits to reset in a bitmap, collected to be reset in one go
+typedef struct {
+  int* bits;
+  int n, max;
+} bit_list_t;
+
+// add a bit to a list; return 0 if successful, -1 if out of memory
+static int bit_list_add(bit_list_t* list, int ibit)
+{
+  if(list->n == list->max) {
+    int max = list->max ? 2*list->max : 256;
+    int* bits = (int*) realloc(list->bits, max*sizeof(int));
+    if(!bits) return -1;
+    list->bits = bits;
+    list->max = max;
   }
+  list->bits[list->n++] = ibit;
+  return 0;
 }
 
-// add a new file or directory (determined by 'type') of given name
-// 'file' under parent directory represented by 'parent_inode'
-int add_inode(int type, int parent_inode, char* file)
+// reset the bits of a list, taking the lock of the bitmap once, and
+// empty the list; return 0 if successful, -1 if any was out of range
+// (the others are reset all the same)
+static int bitmap_reset_list(bitmap_t* bm, bit_list_t* list)
 {
-  // get a new inode for child
-  int child_inode = bitmap_first_unused(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, INODE_BITMAP_SIZE);
-  
-  if(child_inode < 0) {
-    dprintf("... error: inode table is full\n");
-    return -1; 
+  int i, ret = 0;
+  pthread_mutex_lock(&bm->lock);
+  for(i=0; i<list->n; i++) {
+    int ibit = list->bits[i];
+    if(ibit < 0 || ibit >= bm->nbits) {
+      dprintf("Error: ibit value of %d is out of range\n", ibit);
+      ret = -1;
+      continue;
+    }
+    bm->words[ibit/64] &= ~((uint64_t)1 << (ibit%64));
+    BITMAP_DIRTY(bm, ibit);
   }
-  dprintf("... new child inode %d\n", child_inode);
+  pthread_mutex_unlock(&bm->lock);
+  list->n = 0;
+  return ret;
+}
 
-  // load the disk sector containing the child inode
-  int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
- // printf("Inode sector = %d\n", inode_sector);
+// the sectors given back since the last commit: the metadata last
+// committed may still point to them, so they're only marked free in
+// the sector bitmap by the commit that records them as free (see
+// journal_commit), and can't be taken again (and written in place by
+// File_Write, over what a crash would bring back) before then
+static bit_list_t freed_sectors;
+static pthread_mutex_t freed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// give back the sectors of a list at the next commit, and empty the
+// list; the sectors of the bitmap that change then are marked dirty
+// right away, so that they're counted in the transaction (see
+// journal_make_room); if they can't all be kept until then, those
+// left over stay taken (lost, until FS_Check repairs the bitmap)
+static void sectors_free_list(bit_list_t* list)
+{
+  int i, n;
+  pthread_mutex_lock(&freed_lock);
+  for(n=0; n<list->n && bit_list_add(&freed_sectors, list->bits[n]) == 0; n++);
+  pthread_mutex_unlock(&freed_lock);
+  if(n < list->n) dprintf("... out of memory, %d sectors lost\n", list->n-n);
+
+  pthread_mutex_lock(&sector_bitmap.lock);
+  for(i=0; i<n; i++)
+    if(list->bits[i] >= 0 && list->bits[i] < sector_bitmap.nbits)
+      BITMAP_DIRTY(&sector_bitmap, list->bits[i]);
+  pthread_mutex_unlock(&sector_bitmap.lock);
+  list->n = 0;
+}
 
-  char inode_buffer[SECTOR_SIZE];
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
+// return whether there are sectors to be given back at the next
+// commit; an operation short of space commits (see fs_sync) and tries
+// again if there are
+static int freed_sectors_pending()
+{
+  pthread_mutex_lock(&freed_lock);
+  int n = freed_sectors.n;
+  pthread_mutex_unlock(&freed_lock);
+  return n > 0;
+}
 
-  // get the child inode
-  int inode_start_index = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
- 
-  int offset = child_inode-inode_start_index;
-  
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
+// give back a sector at the next commit (see sectors_free_list)
+static void sector_free(int sector)
+{
+  bit_list_t one = { &sector, 1, 1 };
+  sectors_free_list(&one);
+}
 
-  // update the new child inode and write to disk
-  memset(child, 0, sizeof(inode_t));
-  child->type = type;
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n", child_inode, child->size, child->type, inode_sector);
+// mark the sectors given back since the last commit free in the sector
+// bitmap, for the commit about to record them, or taken again if
+// 'taken' is set (the commit having failed); no operation may be
+// changing the file system meanwhile (see sync_lock)
+static void freed_sectors_mark(int taken)
+{
+  int i;
+  pthread_mutex_lock(&sector_bitmap.lock);
+  for(i=0; i<freed_sectors.n; i++) {
+    int ibit = freed_sectors.bits[i];
+    if(ibit < 0 || ibit >= sector_bitmap.nbits) continue;
+    if(taken) sector_bitmap.words[ibit/64] |= (uint64_t)1 << (ibit%64);
+    else sector_bitmap.words[ibit/64] &= ~((uint64_t)1 << (ibit%64));
+    BITMAP_DIRTY(&sector_bitmap, ibit);
+  }
+  pthread_mutex_unlock(&sector_bitmap.lock);
+}
 
-  // get the disk sector containing the parent inode
-  inode_sector = INODE_TABLE_START_SECTOR+parent_inode/INODES_PER_SECTOR;
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for parent inode %d from disk sector %d\n", parent_inode, inode_sector);
 
-  // get the parent inode
-  inode_start_index = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  offset = parent_inode-inode_start_index;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* parent = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-  dprintf("... get parent inode %d (size=%d, type=%d)\n", parent_inode, parent->size, parent->type);
+/************************** END OF BITMAP FUNCTIONS *********************************************************/
 
-  // get the dirent sector
-  if(parent->type != 1) {
-    dprintf("... error: parent inode is not directory\n");
-    return -2; // parent not directory
+
+/************************** INODE TABLE FUNCTIONS *********************************************************/
+
+
+// the inode table is kept resident in memory once the file system is
+// booted, as an array of decoded inodes indexed by inode number; a
+// sector of the table is read from disk the first time one of its
+// inodes is needed, and the sectors holding inodes that changed are
+// written back only when the file system is sync'd
+static inode_t* inode_table;      // INODE_TABLE_SECTORS*INODES_PER_SECTOR entries
+static char* inode_sector_loaded; // one flag for each inode table sector
+static char* inode_sector_dirty;  // one flag for each inode table sector
+
+// serializes loading sectors of the inode table
+static pthread_mutex_t inode_load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// each inode also has a reader/writer lock: a file is locked for
+// reading by File_Read and for writing by File_Write, and a directory
+// is locked for reading while names are looked up in it and for
+// writing while entries are added to or removed from it; when two
+// inodes are held at once, the parent directory is always locked
+// before its child, so there's no deadlock
+#define LOCK_READ 0
+#define LOCK_WRITE 1
+static pthread_rwlock_t* inode_locks; // MAX_FILES entries
+static int inode_locks_count;         // MAX_FILES of the disk they were made for
+
+// set up an empty inode table cache; if 'format' is set, every inode
+// is considered loaded (and zero) and the whole table is written to
+// disk at the next flush; return 0 if successful, -1 otherwise
+static int inode_table_init(int format)
+{
+  free(inode_table);
+  free(inode_sector_loaded);
+  free(inode_sector_dirty);
+  inode_table = (inode_t*) calloc(INODE_TABLE_SECTORS*INODES_PER_SECTOR, sizeof(inode_t));
+  inode_sector_loaded = (char*) calloc(INODE_TABLE_SECTORS, 1);
+  inode_sector_dirty = (char*) calloc(INODE_TABLE_SECTORS, 1);
+  if(!inode_table || !inode_sector_loaded || !inode_sector_dirty) {
+    dprintf("... failed to allocate inode table cache\n");
+    return -1;
+  }
+  if(inode_locks_count != MAX_FILES) {
+    int i;
+    for(i=0; i<inode_locks_count; i++) pthread_rwlock_destroy(&inode_locks[i]);
+    free(inode_locks);
+    inode_locks_count = 0;
+    inode_locks = (pthread_rwlock_t*) calloc(MAX_FILES, sizeof(pthread_rwlock_t));
+    if(!inode_locks) {
+      dprintf("... failed to allocate inode locks\n");
+      return -1;
+    }
+    for(i=0; i<MAX_FILES; i++) pthread_rwlock_init(&inode_locks[i], NULL);
+    inode_locks_count = MAX_FILES;
+  }
+  if(format) {
+    memset(inode_sector_loaded, 1, INODE_TABLE_SECTORS);
+    memset(inode_sector_dirty, 1, INODE_TABLE_SECTORS);
+  }
+  return 0;
+}
+
+// return the cached inode 'ino', loading its sector of the inode table
+// from disk if needed; return NULL if the sector can't be read; the
+// caller should hold the inode's lock to look at or change its fields
+static inode_t* get_inode(int ino)
+{
+  assert(0 <= ino && ino < MAX_FILES);
+  int sector = ino/INODES_PER_SECTOR;
+  if(!__atomic_load_n(&inode_sector_loaded[sector], __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&inode_load_lock);
+    if(!inode_sector_loaded[sector]) {
+      char buffer[SECTOR_SIZE];
+      if(Cache_Read(INODE_TABLE_START_SECTOR+sector, buffer) < 0) {
+        dprintf("... failed to load inode table sector %d\n", (int)(INODE_TABLE_START_SECTOR+sector));
+        pthread_mutex_unlock(&inode_load_lock);
+        return NULL;
+      }
+      memcpy(&inode_table[sector*INODES_PER_SECTOR], buffer, INODES_PER_SECTOR*sizeof(inode_t));
+      __atomic_store_n(&inode_sector_loaded[sector], 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&inode_load_lock);
+  }
+  return &inode_table[ino];
+}
+
+// lock inode 'ino' for reading or writing ('mode' is LOCK_READ or
+// LOCK_WRITE)
+static void inode_lock(int ino, int mode)
+{
+  if(mode == LOCK_WRITE) pthread_rwlock_wrlock(&inode_locks[ino]);
+  else pthread_rwlock_rdlock(&inode_locks[ino]);
+}
+
+// release the lock on inode 'ino'
+static void inode_unlock(int ino)
+{
+  pthread_rwlock_unlock(&inode_locks[ino]);
+}
+
+// mark the cached inode 'ino' as changed, so that its sector of the
+// inode table is written back at the next flush
+static void inode_dirty(int ino)
+{
+  __atomic_store_n(&inode_sector_dirty[ino/INODES_PER_SECTOR], 1, __ATOMIC_RELAXED);
+}
+
+// write the sectors of the inode table holding changed inodes back to
+// the cache, to be committed (no inode may be changing meanwhile, see
+// sync_lock); return 0 if successful, -1 otherwise
+static int inode_table_flush()
+{
+  char buffer[SECTOR_SIZE];
+  int i;
+  for(i=0; i<INODE_TABLE_SECTORS; i++) {
+    if(!inode_sector_dirty[i]) continue;
+    memset(buffer, 0, SECTOR_SIZE);
+    memcpy(buffer, &inode_table[i*INODES_PER_SECTOR], INODES_PER_SECTOR*sizeof(inode_t));
+    if(metadata_write(INODE_TABLE_START_SECTOR+i, buffer) < 0) {
+      dprintf("Failed to write block %d\n", (int)(INODE_TABLE_START_SECTOR+i));
+      return -1;
+    }
+    __atomic_store_n(&inode_sector_dirty[i], 0, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+
+/************************** END OF INODE TABLE FUNCTIONS *********************************************************/
+
+
+/************************** JOURNAL FUNCTIONS *********************************************************/
+
+
+// the metadata (the bitmaps, the inode table, and the directory
+// entries, hash indices and pointer sectors in the data blocks) is
+// changed in the cache only, where the changed sectors are held (see
+// METADATA_DIRTY) until they are committed together as a transaction:
+// their content is logged to the journal first, along with a header
+// saying where each sector goes, and only once the header is on disk
+// (which is the commit) are they written in place; a transaction that
+// was committed but not written in place completely is replayed when
+// the disk is booted, and one that wasn't committed completely is
+// ignored, so the metadata on disk is always that of the last commit;
+// the content of files isn't logged, but it's on disk before the
+// metadata that points to it is committed
+
+// the journal starts with a header sector, followed by the sectors
+// listing where each logged sector goes (as many as needed), followed
+// by the content of the logged sectors
+typedef struct _journal_header {
+  int magic;        // JOURNAL_MAGIC
+  unsigned int seq; // sequence number of the transaction
+  int count;        // number of sectors logged (0 if nothing to replay)
+  unsigned int sum; // checksum of the rest of the transaction
+} journal_header_t;
+
+#define JOURNAL_MAGIC 0x6a726e6c
+
+// the number of sectors listing where 'n' logged sectors go
+#define JOURNAL_LIST_SECTORS(n) (((n)+POINTERS_PER_SECTOR-1)/POINTERS_PER_SECTOR)
+
+// return the most sectors that can be logged in one transaction
+static int journal_capacity()
+{
+  int n = (long long)(journal_sectors-1)*POINTERS_PER_SECTOR/(POINTERS_PER_SECTOR+1);
+  while(n > 0 && 1+JOURNAL_LIST_SECTORS(n)+n > journal_sectors) n--;
+  return n;
+}
+
+// checksum (FNV-1a) of a transaction whose logged part, 'len' bytes in
+// 'log', follows the header
+static unsigned int journal_checksum(journal_header_t* h, char* log, size_t len)
+{
+  unsigned int sum = 2166136261u;
+  size_t i;
+  sum = (sum ^ h->seq) * 16777619u;
+  sum = (sum ^ (unsigned int)h->count) * 16777619u;
+  for(i=0; i<len; i++) sum = (sum ^ (unsigned char)log[i]) * 16777619u;
+  return sum;
+}
+
+// write the header of the journal through to the disk (not the
+// cache, which never holds the journal); return 0 if successful, -1
+// otherwise
+static int journal_write_header(journal_header_t* h)
+{
+  char buffer[SECTOR_SIZE];
+  memset(buffer, 0, SECTOR_SIZE);
+  memcpy(buffer, h, sizeof(journal_header_t));
+  return Disk_Write(journal_start, buffer);
+}
+
+// read the 'n' sectors logged by a transaction (the list of where they
+// go followed by their content) from the journal into 'log' if 'read'
+// is set, or write them from 'log' to the journal otherwise; return 0
+// if successful, -1 otherwise
+static int journal_log_access(char* log, int n, int read)
+{
+  int nlog = JOURNAL_LIST_SECTORS(n)+n, i, ret;
+  int* sectors = (int*) malloc(nlog*sizeof(int));
+  if(!sectors) return -1;
+  for(i=0; i<nlog; i++) sectors[i] = journal_start+1+i;
+  ret = read ? Disk_ReadMulti(sectors, nlog, log) : Disk_WriteMulti(sectors, nlog, log);
+  free(sectors);
+  return ret;
+}
+
+// log the 'n' held sectors and the header that commits them, saving
+// the disk in between; return 0 if successful, -1 otherwise
+static int journal_log(int n)
+{
+  int nlist = JOURNAL_LIST_SECTORS(n);
+  size_t len = (size_t)(nlist+n)*SECTOR_SIZE;
+  char* log = (char*) calloc(len, 1);
+  if(!log) return -1;
+  int* home = (int*) log, i;
+  Cache_Held(home, n);
+  for(i=0; i<n; i++) {
+    if(Cache_Read(home[i], log+(size_t)(nlist+i)*SECTOR_SIZE) < 0) {
+      free(log);
+      return -1;
+    }
+  }
+
+  // the logged sectors, along with the content of files (so that the
+  // metadata committed never points to content that isn't there),
+  // reach the disk before the header that commits them
+  journal_header_t h = { JOURNAL_MAGIC, journal_seq+1, n, 0 };
+  h.sum = journal_checksum(&h, log, len);
+  if(journal_log_access(log, n, 0) < 0 || Cache_Flush() < 0 || Disk_Save(bs_filename) < 0 ||
+     journal_write_header(&h) < 0 || Disk_Save(bs_filename) < 0) {
+    dprintf("... failed to commit journal transaction %u\n", h.seq);
+    free(log);
+    return -1;
+  }
+  free(log);
+  journal_seq = h.seq;
+  TRACE(TRACE_COMMIT, (int)h.seq, n, 0, 0);
+  dprintf("... committed journal transaction %u (%d sectors)\n", h.seq, n);
+  return 0;
+}
+
+// commit the changes made since the last commit (see journal_commit)
+static int journal_write()
+{
+  if(bitmap_flush(&inode_bitmap) < 0 || bitmap_flush(&sector_bitmap) < 0 ||
+     inode_table_flush() < 0)
+    return -1;
+
+  // a transaction is kept small enough to be logged (see
+  // journal_make_room); one that isn't can't be written in place
+  // without breaking what was committed before, so it stays held
+  int n = (journal_sectors > 0) ? Cache_Held(NULL, 0) : 0;
+  if(n > journal_capacity()) {
+    dprintf("... %d sectors changed don't fit in the journal\n", n);
+    return -1;
+  }
+  if(n > 0 && journal_log(n) < 0) return -1;
+  if(n == 0)
+    return (Cache_Flush() < 0 || Disk_Save(bs_filename) < 0) ? -1 : 0;
+
+  // now the held sectors can be written in place; the header says
+  // there's nothing to replay once they are (that goes to the disk
+  // with the next save, but replaying them before then is harmless)
+  journal_header_t h = { JOURNAL_MAGIC, journal_seq, 0, 0 };
+  Cache_Release();
+  if(Cache_Flush() < 0 || Disk_Save(bs_filename) < 0) return -1;
+  return journal_write_header(&h);
+}
+
+// commit every change made since the last commit, and save the disk;
+// the sectors given back meanwhile are free from then on (see
+// freed_sectors); no operation may be changing the file system
+// meanwhile (see sync_lock); return 0 if successful, -1 otherwise
+static int journal_commit()
+{
+  freed_sectors_mark(0);
+  if(journal_write() < 0) {
+    freed_sectors_mark(1);
+    return -1;
+  }
+  freed_sectors.n = 0;
+  return 0;
+}
+
+// write the sectors logged by the last transaction in place if it was
+// committed, right after the disk is loaded (before the bitmaps and
+// the inode table are); return 0 if successful, -1 otherwise
+static int journal_replay()
+{
+  char buffer[SECTOR_SIZE];
+  journal_header_t h;
+  journal_seq = 0;
+  if(journal_sectors == 0) return 0;
+  if(Disk_Read(journal_start, buffer) < 0) return -1;
+  memcpy(&h, buffer, sizeof(journal_header_t));
+  if(h.magic != JOURNAL_MAGIC) return 0; // nothing ever committed
+  journal_seq = h.seq;
+  if(h.count <= 0 || h.count > journal_capacity()) return 0;
+
+  int n = h.count, nlist = JOURNAL_LIST_SECTORS(n), i;
+  size_t len = (size_t)(nlist+n)*SECTOR_SIZE;
+  char* log = (char*) malloc(len);
+  if(!log || journal_log_access(log, n, 1) < 0) {
+    free(log);
+    return -1;
+  }
+  int* home = (int*) log;
+  for(i=0; i<n && home[i] > SUPERBLOCK_START_SECTOR && home[i] < TOTAL_SECTORS; i++);
+  if(i < n || journal_checksum(&h, log, len) != h.sum) {
+    // the header got to the disk, but not all that it commits
+    dprintf("... journal transaction %u incomplete, ignored\n", h.seq);
+    free(log);
+    return 0;
+  }
+
+  int ret = Disk_WriteMulti(home, n, log+(size_t)nlist*SECTOR_SIZE);
+  free(log);
+  if(ret < 0 || Disk_Save(bs_filename) < 0) return -1;
+  TRACE(TRACE_REPLAY, (int)h.seq, n, 0, 0);
+  dprintf("... replayed journal transaction %u (%d sectors)\n", h.seq, n);
+  h.count = 0;
+  return (journal_write_header(&h) < 0 || Disk_Save(bs_filename) < 0) ? -1 : 0;
+}
+
+static int fs_sync(); // see FS_Sync
+
+// return the number of sectors the next transaction logs so far: the
+// held ones, and those of the bitmaps and of the inode table still to
+// be flushed (which are held once they are)
+static int journal_pending()
+{
+  int n = Cache_Held(NULL, 0) + bitmap_dirty_count(&inode_bitmap) +
+    bitmap_dirty_count(&sector_bitmap), i;
+  for(i=0; i<INODE_TABLE_SECTORS; i++)
+    n += __atomic_load_n(&inode_sector_dirty[i], __ATOMIC_RELAXED);
+  return n;
+}
+
+// commit early if the next transaction takes up much of the journal
+// or of the cache; called before an operation changes the file
+// system, so that a transaction stays small enough to be logged, and
+// the held sectors (which can't be evicted) leave room in the cache
+// for the others; a batch open then is committed as far as it's gone,
+// and the rest of it later
+static void journal_make_room()
+{
+  if(journal_sectors == 0) return;
+  int n = journal_pending();
+  if(n > journal_capacity()/2 || n > Cache_GetCapacity()/4) fs_sync();
+}
+
+
+/************************** END OF JOURNAL FUNCTIONS *********************************************************/
+
+
+/************************** BLOCK MAP FUNCTIONS *********************************************************/
+
+
+// data block b of a file is in sector data[b] of its inode if b is
+// less than DIRECT_SECTORS_PER_FILE; the next POINTERS_PER_SECTOR
+// blocks are listed in the indirect sector, and the rest are listed
+// in the indirect sectors listed in the double-indirect sector; a
+// pointer sector that doesn't exist (zero) stands for a sector full of
+// zero pointers; a range of blocks is always looked up in one go,
+// reading each pointer sector once, so that the cost per block stays
+// constant whatever the size of the file
+
+// number of blocks looked up at a time by File_Read and File_Write
+#define BLOCK_MAP_CHUNK POINTERS_PER_SECTOR
+
+// read (or, if 'set', write) the 'n' pointers starting from 'first' in
+// the pointer sector whose index is at 'psector', from (or to) 'ptrs';
+// when written to, a missing pointer sector is created (and 'psector'
+// updated), unless all the pointers written are zero; return 0 if
+// successful, -1 otherwise
+static int pointer_sector_access(int* psector, int first, int n, int* ptrs, int set)
+{
+  int* buffer;
+  int i;
+  if(*psector == 0) {
+    if(!set) {
+      memset(ptrs, 0, n*sizeof(int));
+      return 0;
+    }
+    for(i=0; i<n && ptrs[i] == 0; i++);
+    if(i == n) return 0; // nothing to record
+    int newsec = bitmap_first_unused(&sector_bitmap);
+    if(newsec < 0) {
+      dprintf("... error: disk is full, no pointer sector\n");
+      return -1;
+    }
+    if(!(buffer = (int*) Cache_Pin(newsec, CACHE_NOREAD))) {
+      bitmap_reset(&sector_bitmap, newsec);
+      return -1;
+    }
+    memset(buffer, 0, SECTOR_SIZE);
+    *psector = newsec;
+    dprintf("... new pointer sector %d\n", newsec);
+  } else if(!(buffer = (int*) Cache_Pin(*psector, 0))) return -1;
+
+  if(!set) memcpy(ptrs, buffer+first, n*sizeof(int));
+  else memcpy(buffer+first, ptrs, n*sizeof(int));
+  Cache_Unpin((char*)buffer, set ? METADATA_DIRTY : 0);
+  return 0;
+}
+
+// read (or, if 'set', write) the indices of the sectors holding data
+// blocks 'first' to 'first+n-1' of a file from (or to) 'sectors' (zero
+// means the block has no sector); pointer sectors are created as
+// needed when written to, in which case the caller has to mark the
+// inode as changed; return 0 if successful, -1 otherwise
+static int file_map_blocks(inode_t* inode, int first, int n, int* sectors, int set)
+{
+  int b = first, end = first+n;
+
+  // the direct pointers in the inode
+  for(; b < end && b < DIRECT_SECTORS_PER_FILE; b++) {
+    if(set) inode->data[b] = sectors[b-first];
+    else sectors[b-first] = inode->data[b];
+  }
+
+  // the pointers in the indirect sector
+  int limit = DIRECT_SECTORS_PER_FILE + POINTERS_PER_SECTOR;
+  if(b < end && b < limit) {
+    int cnt = (end < limit ? end : limit) - b;
+    if(pointer_sector_access(&inode->indirect, b-DIRECT_SECTORS_PER_FILE, cnt, sectors+(b-first), set) < 0)
+      return -1;
+    b += cnt;
+  }
+
+  // the pointers in the indirect sectors listed in the double-indirect
+  // sector; 'r' counts blocks from the start of this part
+  if(b < end) {
+    int r = b-limit, rend = end-limit;
+    int lo = r/POINTERS_PER_SECTOR, hi = (rend-1)/POINTERS_PER_SECTOR;
+    int level1[POINTERS_PER_SECTOR];
+    int changed = 0, j;
+    if(pointer_sector_access(&inode->dindirect, lo, hi-lo+1, level1, 0) < 0) return -1;
+    for(j = lo; j <= hi; j++) {
+      int from = (r > j*POINTERS_PER_SECTOR) ? r : j*POINTERS_PER_SECTOR;
+      int to = (rend < (j+1)*POINTERS_PER_SECTOR) ? rend : (j+1)*POINTERS_PER_SECTOR;
+      int old = level1[j-lo];
+      if(pointer_sector_access(&level1[j-lo], from-j*POINTERS_PER_SECTOR, to-from,
+			       sectors+(from+limit-first), set) < 0)
+	return -1;
+      if(level1[j-lo] != old) changed = 1;
+    }
+    if(changed && pointer_sector_access(&inode->dindirect, lo, hi-lo+1, level1, 1) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// add a sector of a file to the list of those to give back, or give
+// it back on its own if the list can't grow
+static void file_free_later(bit_list_t* freed, int sector)
+{
+  if(bit_list_add(freed, sector) < 0) sector_free(sector);
+}
+
+// give back every data block of a file, and its pointer sectors, in
+// one go, at the next commit (see freed_sectors); or, if 'freed' isn't
+// NULL, add them to it, to be given back along with others
+static void file_free_blocks(inode_t* inode, bit_list_t* freed)
+{
+  int level1[POINTERS_PER_SECTOR], level2[POINTERS_PER_SECTOR];
+  int i, j;
+  bit_list_t own = { NULL, 0, 0 }, *list = freed ? freed : &own;
+  if(inode->index == INLINE_DATA) return;
+  for(i=0; i<DIRECT_SECTORS_PER_FILE; i++)
+    if(inode->data[i] > 0) file_free_later(list, inode->data[i]);
+
+  if(inode->indirect > 0) {
+    if(Cache_Read(inode->indirect, (char*)level2) == 0) {
+      for(j=0; j<POINTERS_PER_SECTOR; j++)
+	if(level2[j] > 0) file_free_later(list, level2[j]);
+    }
+    file_free_later(list, inode->indirect);
+  }
+
+  if(inode->dindirect > 0) {
+    if(Cache_Read(inode->dindirect, (char*)level1) == 0) {
+      for(i=0; i<POINTERS_PER_SECTOR; i++) {
+	if(level1[i] <= 0) continue;
+	if(Cache_Read(level1[i], (char*)level2) == 0) {
+	  for(j=0; j<POINTERS_PER_SECTOR; j++)
+	    if(level2[j] > 0) file_free_later(list, level2[j]);
+	}
+	file_free_later(list, level1[i]);
+      }
+    }
+    file_free_later(list, inode->dindirect);
   }
-  int group = parent->size/DIRENTS_PER_SECTOR;
-  char dirent_buffer[SECTOR_SIZE];
+  memset(inode->data, 0, sizeof(inode->data));
+  inode->indirect = inode->dindirect = 0;
+
+  if(!freed) {
+    sectors_free_list(&own);
+    free(own.bits);
+  }
+}
+
+
+/************************** END OF BLOCK MAP FUNCTIONS *********************************************************/
+
+
+/************************** DIRECTORY ENTRY CACHE FUNCTIONS *********************************************************/
+
+
+// the directory entry cache (dcache) remembers the result of looking
+// up a file name in a directory, so that resolving a path that has
+// been seen before needs no scan of directory entries; it also
+// remembers names known not to exist in a directory (negative
+// entries); the cache is direct-mapped on a hash of (parent inode,
+// file name), and a colliding entry simply replaces the older one
+#define DCACHE_SIZE 4096 // must be a power of two
+
+typedef struct _dcache_entry {
+  int parent; // inode of the parent directory (-1 means entry not used)
+  int child;  // inode of the child, or -1 if there is no such child
+  char fname[MAX_NAME]; // name of the child
+} dcache_entry_t;
+
+static dcache_entry_t dcache[DCACHE_SIZE];
+
+// the dcache is shared by all threads; slot i is protected by lock
+// i%DCACHE_STRIPES, so that lookups in different slots seldom contend
+#define DCACHE_STRIPES 64
+static pthread_mutex_t dcache_locks[DCACHE_STRIPES] = {
+  [0 ... DCACHE_STRIPES-1] = PTHREAD_MUTEX_INITIALIZER
+};
+#define DCACHE_LOCK(e) (&dcache_locks[((e)-dcache)%DCACHE_STRIPES])
+
+// hash a file name (FNV-1a), mixing in 'seed' first
+static unsigned int fname_hash(unsigned int seed, char* fname)
+{
+  unsigned int h = (2166136261u ^ seed) * 16777619u;
+  for(; *fname; fname++) {
+    h ^= (unsigned char)*fname;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// return the dcache slot for the given parent inode and file name
+static dcache_entry_t* dcache_slot(int parent_inode, char* fname)
+{
+  return &dcache[fname_hash(parent_inode, fname) & (DCACHE_SIZE-1)];
+}
+
+// forget everything in the dcache
+static void dcache_clear()
+{
+  int i;
+  for(i=0; i<DCACHE_SIZE; i++) dcache[i].parent = -1;
+}
+
+// look up 'fname' in the parent directory; return 1 and set 'child'
+// (to -1 for a negative entry) if the dcache knows the answer, and 0
+// otherwise
+static int dcache_lookup(int parent_inode, char* fname, int* child)
+{
+  dcache_entry_t* e = dcache_slot(parent_inode, fname);
+  int hit = 0;
+  pthread_mutex_lock(DCACHE_LOCK(e));
+  if(e->parent == parent_inode && !strcmp(e->fname, fname)) {
+    *child = e->child;
+    hit = 1;
+  }
+  pthread_mutex_unlock(DCACHE_LOCK(e));
+  return hit;
+}
+
+// remember that 'fname' in the parent directory is 'child' (or
+// doesn't exist, if 'child' is -1)
+static void dcache_insert(int parent_inode, char* fname, int child)
+{
+  dcache_entry_t* e = dcache_slot(parent_inode, fname);
+  pthread_mutex_lock(DCACHE_LOCK(e));
+  e->parent = parent_inode;
+  e->child = child;
+  strncpy(e->fname, fname, MAX_NAME-1);
+  e->fname[MAX_NAME-1] = '\0';
+  pthread_mutex_unlock(DCACHE_LOCK(e));
+}
+
+
+/************************** END OF DIRECTORY ENTRY CACHE FUNCTIONS *********************************************************/
+
+
+/************************** DIRECTORY FUNCTIONS *********************************************************/
+
+
+// a directory whose entries outgrow one sector gets a hash index: a
+// run of DIR_INDEX_SECTORS contiguous sectors holding an open
+// addressing (linear probing) table of DIR_INDEX_SLOTS slots; a slot
+// holds the position of a directory entry plus one (zero means the
+// slot is empty), and an entry lives in the slot given by the hash of
+// its file name, or in the first empty slot after it; with the index,
+// looking up or removing a name reads a couple of sectors instead of
+// scanning all the entries of the directory; the directory entries
+// themselves are still stored as a flat array, so that they can be
+// listed in order
+#define DIR_INDEX_THRESHOLD DIRENTS_PER_SECTOR
+#define DIR_INDEX_SLOTS (MAX_DIRENTS*4/3+1)
+#define DIR_INDEX_SECTORS ((DIR_INDEX_SLOTS*sizeof(unsigned short)+SECTOR_SIZE-1)/SECTOR_SIZE)
+#define DIR_INDEX_SLOTS_PER_SECTOR (SECTOR_SIZE/sizeof(unsigned short))
+
+// read the directory entry at position 'pos' of directory 'dir';
+// return 0 if successful, -1 otherwise
+static int read_dirent(inode_t* dir, int pos, dirent_t* dirent)
+{
+  char* buffer = Cache_Pin(dir->data[pos/DIRENTS_PER_SECTOR], 0);
+  if(!buffer) return -1;
+  memcpy(dirent, buffer+(pos%DIRENTS_PER_SECTOR)*sizeof(dirent_t), sizeof(dirent_t));
+  Cache_Unpin(buffer, 0);
+  return 0;
+}
+
+// write the directory entry at position 'pos' of directory 'dir',
+// whose sector must already be allocated; return 0 if successful, -1
+// otherwise
+static int write_dirent(inode_t* dir, int pos, dirent_t* dirent)
+{
+  char* buffer = Cache_Pin(dir->data[pos/DIRENTS_PER_SECTOR], 0);
+  if(!buffer) return -1;
+  memcpy(buffer+(pos%DIRENTS_PER_SECTOR)*sizeof(dirent_t), dirent, sizeof(dirent_t));
+  Cache_Unpin(buffer, METADATA_DIRTY);
+  return 0;
+}
+
+// read slot 'slot' of the hash index of directory 'dir'; return its
+// value, or -1 if there's a read error
+static int dir_index_get(inode_t* dir, int slot)
+{
+  unsigned short* buffer = (unsigned short*) Cache_Pin(dir->index + slot/DIR_INDEX_SLOTS_PER_SECTOR, 0);
+  if(!buffer) return -1;
+  int value = buffer[slot%DIR_INDEX_SLOTS_PER_SECTOR];
+  Cache_Unpin((char*)buffer, 0);
+  return value;
+}
+
+// set slot 'slot' of the hash index of directory 'dir' to 'value';
+// return 0 if successful, -1 otherwise
+static int dir_index_set(inode_t* dir, int slot, int value)
+{
+  unsigned short* buffer = (unsigned short*) Cache_Pin(dir->index + slot/DIR_INDEX_SLOTS_PER_SECTOR, 0);
+  if(!buffer) return -1;
+  buffer[slot%DIR_INDEX_SLOTS_PER_SECTOR] = value;
+  Cache_Unpin((char*)buffer, METADATA_DIRTY);
+  return 0;
+}
+
+// look up 'fname' in the hash index of directory 'dir'; return the
+// position of its directory entry (and its slot through 'slot'), -1
+// if there's no such entry (and the empty slot where it would go
+// through 'slot'), or -2 if there's a read error
+static int dir_index_lookup(inode_t* dir, char* fname, int* slot)
+{
+  int s = fname_hash(0, fname) % DIR_INDEX_SLOTS, n;
+  for(n=0; n<DIR_INDEX_SLOTS; n++, s=(s+1)%DIR_INDEX_SLOTS) {
+    int value = dir_index_get(dir, s);
+    if(value < 0) return -2;
+    if(value == 0) break;
+    dirent_t dirent;
+    if(read_dirent(dir, value-1, &dirent) < 0) return -2;
+    if(!strcmp(dirent.fname, fname)) {
+      *slot = s;
+      return value-1;
+    }
+  }
+  *slot = s;
+  return -1;
+}
+
+// add 'fname', whose directory entry is at position 'pos', to the
+// hash index of directory 'dir'; return 0 if successful, -1 otherwise
+static int dir_index_insert(inode_t* dir, char* fname, int pos)
+{
+  int slot;
+  if(dir_index_lookup(dir, fname, &slot) != -1) return -1;
+  return dir_index_set(dir, slot, pos+1);
+}
+
+// remove 'fname' from the hash index of directory 'dir'; the entries
+// following it in the same cluster are shifted back as needed, so
+// that no tombstones are left behind; return 0 if successful, -1
+// otherwise
+static int dir_index_remove(inode_t* dir, char* fname)
+{
+  int hole;
+  if(dir_index_lookup(dir, fname, &hole) < 0) return -1;
+
+  int s = hole;
+  for(;;) {
+    s = (s+1)%DIR_INDEX_SLOTS;
+    int value = dir_index_get(dir, s);
+    if(value < 0) return -1;
+    if(value == 0) break;
+    dirent_t dirent;
+    if(read_dirent(dir, value-1, &dirent) < 0) return -1;
+
+    // the entry can fill the hole unless its home slot lies
+    // (cyclically) after the hole and at or before where it is now
+    int home = fname_hash(0, dirent.fname) % DIR_INDEX_SLOTS;
+    int stays = (hole <= s) ? (hole < home && home <= s) : (hole < home || home <= s);
+    if(stays) continue;
+    if(dir_index_set(dir, hole, value) < 0) return -1;
+    hole = s;
+  }
+  return dir_index_set(dir, hole, 0);
+}
+
+// record in the hash index of directory 'dir' that the directory entry
+// for 'fname' has moved to position 'pos'; return 0 if successful, -1
+// otherwise
+static int dir_index_move(inode_t* dir, char* fname, int pos)
+{
+  int slot;
+  if(dir_index_lookup(dir, fname, &slot) < 0) return -1;
+  return dir_index_set(dir, slot, pos+1);
+}
+
+// give back the sectors of the hash index of directory 'dir', if any,
+// at the next commit
+static void dir_index_free(inode_t* dir)
+{
+  int i;
+  if(dir->index <= 0) return;
+  for(i=0; i<DIR_INDEX_SECTORS; i++) sector_free(dir->index+i);
+  dir->index = 0;
+}
+
+// build the hash index of directory 'dir' from its existing entries;
+// the index is optional, so if there isn't enough contiguous space
+// for it, or it can't be written, the directory simply stays
+// unindexed (and the sectors taken for it are given back); return 1
+// if the index is built, 0 otherwise
+static int dir_index_build(inode_t* dir)
+{
+  int got, i;
+  int first = bitmap_alloc_run(&sector_bitmap, dir->data[0], DIR_INDEX_SECTORS, &got);
+  if(first < 0) return 0;
+  TRACE(TRACE_ALLOC, first, got, 0, 0);
+  if(got < DIR_INDEX_SECTORS) {
+    for(i=0; i<got; i++) bitmap_reset(&sector_bitmap, first+i);
+    return 0;
+  }
+
+  char buffer[SECTOR_SIZE];
+  memset(buffer, 0, SECTOR_SIZE);
+  dir->index = first;
+  for(i=0; i<DIR_INDEX_SECTORS; i++) {
+    if(metadata_write(first+i, buffer) < 0) {
+      dir_index_free(dir);
+      return 0;
+    }
+  }
+  dprintf("... build hash index for directory (sectors %d-%d)\n", first, first+(int)DIR_INDEX_SECTORS-1);
+
+  for(i=0; i<dir->size; i++) {
+    dirent_t dirent;
+    if(read_dirent(dir, i, &dirent) < 0 || dir_index_insert(dir, dirent.fname, i) < 0) {
+      dir_index_free(dir);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+/************************** END OF DIRECTORY FUNCTIONS *********************************************************/
+
+
+
+// return 1 if the file name is illegal; otherwise, return 0; legal
+// characters for a file name include letters (case sensitive),
+// numbers, dots, dashes, and underscores; and a legal file name
+// should not be more than MAX_NAME-1 in length
+static int illegal_filename(char* name)
+{
+	int i;	
+	bool flag = true;	
+	
+	// Loop through the string; If a character is not alphanumeric, a dot, a dash, or an underscore, 
+	// the filename is illegal
+	for(i = 0; i < strlen(name) && flag == true; i++)
+	{
+		if(isalnum(name[i]) || name[i] == '.' || name[i] == '-' || name[i] == '_')
+			flag = true;
+		else
+			flag = false;
+	}
+	
+	// Check if the string is too long
+	if(strlen(name) > (MAX_NAME-1))
+	{
+		flag = false;
+	}
+	
+	// Return 0 for legal filenames
+	if(flag)
+		return 0;
+
+	// Return 1 for illegal filenames
+	return 1; 
+}
+  
+
+
+// return the child inode of the given file name 'fname' from the
+// parent inode; the answer is taken from the dcache if possible, and
+// otherwise found by scanning the parent's directory entries and then
+// added to the dcache; the function returns -1 if no such file is
+// found; it returns -2 is something else is wrong (such as parent is
+// not directory, or there's read error, etc.)
+static int find_child_inode(int parent_inode, char* fname){
+
+  inode_t* parent = get_inode(parent_inode);
+  if(!parent) return -2;
+  dprintf("... load parent inode: %d (size=%d, type=%d)\n",	parent_inode, parent->size, parent->type);
+  if(parent->type != 1) {
+    dprintf("... parent not a directory\n");
+    return -2;
+  }
+
+  int child_inode;
+  if(dcache_lookup(parent_inode, fname, &child_inode)) {
+    dprintf("... dcache hit, child_inode=%d\n", child_inode);
+    return child_inode;
+  }
+
+  if(parent->index > 0) {
+    // large directory: go through its hash index
+    int slot;
+    int pos = dir_index_lookup(parent, fname, &slot);
+    if(pos < -1) return -2;
+    if(pos < 0) {
+      dprintf("... could not find child inode in hash index\n");
+      dcache_insert(parent_inode, fname, -1);
+      return -1;
+    }
+    dirent_t dirent;
+    if(read_dirent(parent, pos, &dirent) < 0) return -2;
+    dprintf("... found child_inode=%d in hash index\n", dirent.inode);
+    dcache_insert(parent_inode, fname, dirent.inode);
+    return dirent.inode;
+  }
+
+  int nentries = parent->size; // remaining number of directory entries 
+  int idx = 0;
+  while(nentries > 0) {
+    char* buffer = Cache_Pin(parent->data[idx], 0); // cached content of directory entries
+    if(!buffer) return -2;
+    int i;
+    for(i=0; i<DIRENTS_PER_SECTOR; i++) {
+      if(i>=nentries) break;
+      if(!strcmp(((dirent_t*)buffer)[i].fname, fname)) {
+	       // found the file/directory
+	       child_inode = ((dirent_t*)buffer)[i].inode;
+	       Cache_Unpin(buffer, 0);
+	       dprintf("... found child_inode=%d\n", child_inode);
+	       dcache_insert(parent_inode, fname, child_inode);
+	       return child_inode;
+      }
+    }
+    Cache_Unpin(buffer, 0);
+    idx++; nentries -= DIRENTS_PER_SECTOR;
+  }
+  dprintf("... could not find child inode\n");
+  dcache_insert(parent_inode, fname, -1);
+  return -1; // not found
+}
+
+// follow the absolute path; if successful, return the inode of the
+// parent directory immediately before the last file/directory in the
+// path; for example, for '/a/b/c/d.txt', the parent is '/a/b/c' and
+// the child is 'd.txt'; the child's inode is returned through the
+// parameter 'last_inode' and its file name is returned through the
+// parameter 'last_filename' (both are references); it's possible that
+// the last file/directory is not in its parent directory, in which
+// case, 'last_inode' points to -1; if the function returns -1, it
+// means that we cannot follow the path; otherwise the parent directory
+// is returned locked in 'mode' (LOCK_READ or LOCK_WRITE), and the
+// caller must unlock it
+static int follow_path(char* path, int* last_inode, char* last_filename, int mode)
+{
+  if(!path) {
+    dprintf("... invalid path\n");
+    return -1;
+  }
+  if(path[0] != '/') {
+    dprintf("... '%s' not absolute path\n", path);
+    return -1;
+  }
+  trace_record(TRACE_PATH, 0, 0, 0, 0, path);
+  
+  // make a copy of the path (skip leading '/'); this is necessary
+  // since the path is going to be modified by strsep()
+  char pathstore[MAX_PATH]; 
+  strncpy(pathstore, path+1, MAX_PATH-1);
+  pathstore[MAX_PATH-1] = '\0'; // for safety
+  char* lpath = pathstore;
+  
+  // split the path into file/directory names separated by '/'
+  char* tokens[MAX_PATH/2];
+  int ntokens = 0;
+  char* token;
+  while((token = strsep(&lpath, "/")) != NULL) {
+    dprintf("... process token: '%s'\n", token);
+    if(*token == '\0') continue; // multiple '/' ignored
+    if(illegal_filename(token)) {
+      dprintf("... illegal file name: '%s'\n", token);
+      return -1; 
+    }
+    tokens[ntokens++] = token;
+  }
+
+  // walk down from the root; each directory is locked before a name
+  // is looked up in it, and its parent is unlocked only after that;
+  // the directory holding the last name is locked in 'mode', the
+  // others only for reading
+  int parent_inode = 0, child_inode = 0; // start from root
+  int i;
+  inode_lock(0, (ntokens <= 1) ? mode : LOCK_READ);
+  for(i=0; i<ntokens; i++) {
+    thread_path_components++;
+    child_inode = find_child_inode(parent_inode, tokens[i]);    
+    if(i == ntokens-1) break;
+    if(child_inode < 0) {
+      // regardless whether child_inode was not found, or there was
+      // issues related to the parent (say, not a directory), or there
+      // was a read error, we abort
+      dprintf("... parent inode can't be established\n");
+      inode_unlock(parent_inode);
+      return -1;
+    }
+    inode_lock(child_inode, (i+1 == ntokens-1) ? mode : LOCK_READ);
+    inode_unlock(parent_inode);
+    parent_inode = child_inode;    
+  }
+  if(child_inode < -1) { // if there was error, abort
+    inode_unlock(parent_inode);
+    return -1;
+  }
+
+  // there was no error, several possibilities:
+  // 1) '/': parent = child = 0 (special case)
+  // 2) '/valid-dirs.../last-valid-dir/not-found': parent=last-valid-dir, child=-1
+  // 3) '/valid-dirs.../last-valid-dir/found: parent=last-valid-dir, child=found
+  if(last_filename && ntokens > 0) strcpy(last_filename, tokens[ntokens-1]);
+  dprintf("... found parent_inode=%d, child_inode=%d\n", parent_inode, child_inode);
+  *last_inode = child_inode;
+  return parent_inode;
+}
+
+// add a new file or directory (determined by 'type') of given name
+// 'file' under parent directory represented by 'parent_inode', which
+// the caller has locked for writing
+int add_inode(int type, int parent_inode, char* file)
+{
+  // get the parent inode
+  inode_t* parent = get_inode(parent_inode);
+  if(!parent) return -1;
+  dprintf("... get parent inode %d (size=%d, type=%d)\n", parent_inode, parent->size, parent->type);
+
+  if(parent->type != 1) {
+    dprintf("... error: parent inode is not directory\n");
+    return -2; // parent not directory
+  }
+  if(parent->size >= MAX_DIRENTS) {
+    dprintf("... error: parent directory is full\n");
+    return -1;
+  }
+
+  // get a new inode for child
+  int child_inode = bitmap_first_unused(&inode_bitmap);
+  
+  if(child_inode < 0) {
+    dprintf("... error: inode table is full\n");
+    return -1; 
+  }
+  dprintf("... new child inode %d\n", child_inode);
+
+  // get the child inode
+  inode_t* child = get_inode(child_inode);
+  if(!child) {
+    bitmap_reset(&inode_bitmap, child_inode);
+    return -1;
+  }
+
+  // get the dirent sector
+  int group = parent->size/DIRENTS_PER_SECTOR, newsec = 0;
   if(group*DIRENTS_PER_SECTOR == parent->size) {
     // new disk sector is needed
-    int newsec = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
+    newsec = bitmap_first_unused(&sector_bitmap);
     if(newsec < 0) {
       dprintf("... error: disk is full\n");
+      bitmap_reset(&inode_bitmap, child_inode);
       return -1;
     }
-    parent->data[group] = newsec;
+    char dirent_buffer[SECTOR_SIZE];
     memset(dirent_buffer, 0, SECTOR_SIZE);
-    dprintf("... new disk sector %d for dirent group %d\n", newsec, group);
-  } else {
-    if(Disk_Read(parent->data[group], dirent_buffer) < 0)
+    if(metadata_write(newsec, dirent_buffer) < 0) {
+      bitmap_reset(&sector_bitmap, newsec);
+      bitmap_reset(&inode_bitmap, child_inode);
       return -1;
-    dprintf("... load disk sector %d for dirent group %d\n", parent->data[group], group);
+    }
+    parent->data[group] = newsec;
+    dprintf("... new disk sector %d for dirent group %d\n", newsec, group);
+  }
+
+  // update the new child inode
+  memset(child, 0, sizeof(inode_t));
+  child->type = type;
+  if(type == 0) child->index = INLINE_DATA;
+  inode_dirty(child_inode);
+  dprintf("... update child inode %d (size=%d, type=%d)\n", child_inode, child->size, child->type);
+
+  // add the dirent and write to disk
+  dirent_t dirent;
+  memset(&dirent, 0, sizeof(dirent_t));
+  strncpy(dirent.fname, file, MAX_NAME-1);
+  dirent.inode = child_inode;
+
+  // the entry goes in the hash index of a large directory, if it has
+  // one, before it's counted, so that a failure leaves the directory
+  // as it was, and everything taken for the entry is given back
+  if(write_dirent(parent, parent->size, &dirent) < 0 ||
+     (parent->index > 0 && dir_index_insert(parent, dirent.fname, parent->size) < 0)) {
+    dprintf("... error: failed to add dirent\n");
+    if(newsec > 0) {
+      parent->data[group] = 0;
+      bitmap_reset(&sector_bitmap, newsec);
+    }
+    bitmap_reset(&inode_bitmap, child_inode);
+    return -1;
   }
+  dprintf("... append dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n", parent->size, dirent.fname, dirent.inode, group, parent->data[group]);
 
-  // add the dirent and write to disk
-  int start_entry = group*DIRENTS_PER_SECTOR;
-  offset = parent->size-start_entry;
-  dirent_t* dirent = (dirent_t*)(dirent_buffer+offset*sizeof(dirent_t));
-  strncpy(dirent->fname, file, MAX_NAME);
-  dirent->inode = child_inode;
-  if(Disk_Write(parent->data[group], dirent_buffer) < 0) return -1;
-  dprintf("... append dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n", parent->size, dirent->fname, dirent->inode, group, parent->data[group]);
-
-  // update parent inode and write to disk
+  // update parent inode
   parent->size++;
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... update parent inode on disk sector %d\n", inode_sector);
+  inode_dirty(parent_inode);
+  dprintf("... update parent inode %d\n", parent_inode);
+
+  // the hash index is built once the directory outgrows a single
+  // sector of entries (a directory it can't be built for stays
+  // without, see dir_index_build)
+  if(parent->index == 0 && parent->size > DIR_INDEX_THRESHOLD) dir_index_build(parent);
+    
+  // replaces any negative dcache entry for the name
+  dcache_insert(parent_inode, file, child_inode);
     
   return 0;
 }
@@ -595,24 +1907,35 @@ int add_inode(int type, int parent_inode, char* file)
 // is directory
 int create_file_or_directory(int type, char* pathname)
 {
-  int child_inode;
+  int child_inode, ret;
   char last_filename[MAX_NAME];
-  int parent_inode = follow_path(pathname, &child_inode, last_filename);
+  int parent_inode = follow_path(pathname, &child_inode, last_filename, LOCK_WRITE);
   if(parent_inode >= 0) {
     if(child_inode >= 0) {
       dprintf("... file/directory '%s' already exists, failed to create\n", pathname);
       osErrno = E_CREATE;
-      return -1;
+      ret = -1;
     } else {
-        if(add_inode(type, parent_inode, last_filename) >= 0) {
+        journal_make_room();
+        pthread_rwlock_rdlock(&sync_lock);
+        int added = add_inode(type, parent_inode, last_filename);
+        pthread_rwlock_unlock(&sync_lock);
+        if(added < 0 && freed_sectors_pending() && fs_sync() == 0) {
+          pthread_rwlock_rdlock(&sync_lock);
+          added = add_inode(type, parent_inode, last_filename);
+          pthread_rwlock_unlock(&sync_lock);
+        }
+        if(added >= 0) {
   	      dprintf("... successfully created file/directory: '%s'\n", pathname);
-  	      return 0;
+  	      ret = 0;
         } else {
   	      dprintf("... error: something wrong with adding child inode\n");
   	      osErrno = E_CREATE;
-  	      return -1;
+  	      ret = -1;
         }
       }
+    inode_unlock(parent_inode);
+    return ret;
   } else {
     dprintf("... error: something wrong with the file/path: '%s'\n", pathname);
     osErrno = E_CREATE;
@@ -620,222 +1943,1156 @@ int create_file_or_directory(int type, char* pathname)
   }
 }
 
-
-
-
-
-// remove the child from parent; the function is called by both
-// File_Unlink() and Dir_Unlink(); the function returns 0 if success,
-// -1 if general error, -2 if directory not empty, -3 if wrong type
-int remove_inode(int type, int parent_inode, int child_inode)
+
+
+
+
+// remove the child named 'file' from parent; the function is called
+// by both File_Unlink() and Dir_Unlink(), which have locked both the
+// parent and the child for writing; the function returns 0 if success,
+// -1 if general error, -2 if directory not empty, -3 if wrong type
+int remove_inode(int type, int parent_inode, int child_inode, char* file)
+{
+	// Get child inode
+	inode_t* child = get_inode(child_inode);
+ 
+	if(!child) 
+		return -1;
+
+	// If we have the wrong type
+	if(child->type != type)
+		return -3;               
+
+	// If node is a nonempty directory
+	if(child->type == 1 && child->size > 0)
+		return -2;                               
+
+	// If node is a file, reclaim data sectors of child inode (and the sectors pointing to them)
+	if(child->type == 0)
+	{
+		dprintf("Resetting data sectors of inode %d\n", child_inode);
+		file_free_blocks(child, NULL);
+	}
+  
+	// If node is a directory, reclaim its hash index
+	if(child->type == 1)
+		dir_index_free(child);
+
+	// Clear the child
+	memset(child, 0, sizeof(inode_t));
+	inode_dirty(child_inode);
+  
+	dprintf("Clear inode %d\n", child_inode);
+
+	// Update inode bitmap
+	bitmap_reset(&inode_bitmap, child_inode);
+
+	// Get the parent
+	inode_t* parent = get_inode(parent_inode);
+	
+	if(!parent) 
+		return -1;
+	
+	dprintf("Get parent: %d, size: %d, type: %d\n", parent_inode, parent->size, parent->type);
+
+	
+	// If a parent is somehow not a parent
+	if(parent->type != 1) 
+	{
+		dprintf("ERROR: parent inode is not a directory\n");
+		return -2; 
+	}
+  
+	// Now we find (in parent inode) the dirent structure containing child inode, swap with last dirent entry in parent
+	dirent_t current_dirent;
+	int pos = -1;
+	
+	if(parent->index > 0)
+	{
+		// Large directory: find the entry through the hash index, then drop it from the index
+		int slot;
+		pos = dir_index_lookup(parent, file, &slot);
+	
+		if(pos < 0 || dir_index_remove(parent, file) < 0)
+			return -1;
+	}
+	else
+	{
+		// Loop through all dirents
+		for(pos = 0; pos < parent->size; pos++)
+		{
+			if(read_dirent(parent, pos, &current_dirent) < 0)
+				return -1;
+
+			if(current_dirent.inode == child_inode)
+				break;
+		}
+		
+		if(pos == parent->size)
+			return -1;
+	}
+	
+	int last = parent->size - 1;
+	
+	// Move the last dirent into the hole left by the one we're deleting
+	if(pos != last)
+	{  
+		dirent_t last_dirent;
+		
+		if(read_dirent(parent, last, &last_dirent) < 0 || write_dirent(parent, pos, &last_dirent) < 0)
+			return -1;
+		
+		if(parent->index > 0 && dir_index_move(parent, last_dirent.fname, pos) < 0)
+			return -1;
+
+		dprintf("Update dirent %d, name: %s, inode: %d\n", pos, last_dirent.fname, last_dirent.inode);
+	}
+		
+	// Clear the last dirent, and give back its sector once it holds no more dirents
+	memset(&current_dirent, 0, sizeof(dirent_t));
+    
+	if(write_dirent(parent, last, &current_dirent) < 0)
+		return -1;
+			
+	if(last % DIRENTS_PER_SECTOR == 0)
+	{
+		sector_free(parent->data[last / DIRENTS_PER_SECTOR]);
+		parent->data[last / DIRENTS_PER_SECTOR] = 0;
+	}
+
+	parent->size--;
+	inode_dirty(parent_inode);
+	
+	dprintf("Update parent inode %d\n", parent_inode);
+ 
+	// The name no longer exists in the parent
+	dcache_insert(parent_inode, file, -1);
+ 
+	return 0;  
+}
+
+
+
+
+
+
+
+
+
+// make sure the first 'nsectors' data blocks of a file are allocated
+// (a file has a sector for each block up to its size); the missing
+// ones are reserved in as few contiguous runs as possible, starting
+// right after the last sector the file already has, so that the file
+// stays sequential on disk; return 0 if successful, -1 if the disk is
+// full, in which case no data block is reserved
+static int reserve_file_sectors(inode_t* inode, int nsectors)
+{
+  int have = (inode->size+SECTOR_SIZE-1)/SECTOR_SIZE;
+  if(have >= nsectors) return 0;
+
+  int n = nsectors-have, i = 0, goal = -1;
+  int* sectors = (int*) malloc(n*sizeof(int));
+  if(!sectors) return -1;
+  if(have > 0 && file_map_blocks(inode, have-1, 1, &goal, 0) == 0) goal++;
+
+  while(i < n) {
+    int got, k;
+    int first = bitmap_alloc_run(&sector_bitmap, goal, n-i, &got);
+    if(first < 0) break;
+    TRACE(TRACE_ALLOC, first, got, 0, 0);
+    dprintf("... reserve sectors %d-%d for data blocks %d-%d\n", first, first+got-1, have+i, have+i+got-1);
+    for(k=0; k<got; k++) sectors[i++] = first+k;
+    goal = first+got;
+  }
+
+  if(i < n || file_map_blocks(inode, have, n, sectors, 1) < 0) {
+    dprintf("... disk is full, release %d reserved sectors\n", i);
+    while(i > 0) bitmap_reset(&sector_bitmap, sectors[--i]);
+    memset(sectors, 0, n*sizeof(int));
+    file_map_blocks(inode, have, n, sectors, 1);
+    free(sectors);
+    return -1;
+  }
+  free(sectors);
+  return 0;
+}
+
+// move the inline data of a file to a data block of its own; return 0
+// if successful, -1 (with the data still inline) if the disk is full
+// or the block can't be written
+static int file_uninline(inode_t* inode)
+{
+  char saved[INLINE_DATA_SIZE];
+  memcpy(saved, inode->inline_data, INLINE_DATA_SIZE);
+  memset(inode->inline_data, 0, INLINE_DATA_SIZE);
+  inode->index = 0;
+  if(inode->size == 0) return 0;
+
+  // the file has no data block yet, whatever its size
+  int size = inode->size, reserved;
+  inode->size = 0;
+  reserved = reserve_file_sectors(inode, 1);
+  inode->size = size;
+
+  char* block = NULL;
+  if(reserved == 0 && (block = Cache_Pin(inode->data[0], CACHE_NOREAD)) == NULL)
+    file_free_blocks(inode, NULL);
+  if(block == NULL) {
+    memcpy(inode->inline_data, saved, INLINE_DATA_SIZE);
+    inode->index = INLINE_DATA;
+    return -1;
+  }
+  memset(block, 0, SECTOR_SIZE);
+  memcpy(block, saved, inode->size);
+  Cache_Unpin(block, 1);
+  dprintf("... move %d bytes of inline data to sector %d\n", inode->size, inode->data[0]);
+  return 0;
+}
+
+
+
+
+
+// representing an open file; an entry is claimed by taking it off the
+// free list, so opening and closing files takes no lock on the whole
+// table; the entry's own lock is held by the calls using the file
+// descriptor, which share the read/write position
+typedef struct _open_file {
+  int inode; // pointing to the inode of the file (0 means entry not used)
+  int pos;   // read/write position
+  int ra_next;   // the offset right after the last read (see file_read_ahead)
+  int ra_end;    // the data block up to which the file has been read ahead
+  int ra_window; // the number of blocks read ahead of the reader
+  int next_free; // the next entry on the free list, -1 if the last
+  pthread_mutex_t lock; // serializes the calls on this file descriptor
+} open_file_t;
+static open_file_t open_files[MAX_OPEN_FILES];
+
+// the entries not used, as a stack: the low 32 bits of the head are
+// the first entry plus one (0 if none), and the high 32 bits count the
+// changes of the head, so that a head popped and pushed back meanwhile
+// isn't mistaken for unchanged
+static uint64_t free_fds;
+#define FREE_FD(head) ((int)((head) & 0xffffffff) - 1)
+#define FREE_HEAD(fd, head) ((((head) >> 32) + 1) << 32 | (uint64_t)((fd) + 1))
+
+// the number of file descriptors each inode is open as, MAX_FILES long
+static int* open_counts;
+
+// representing a directory open for listing (see Dir_Open): the
+// sector of entries being gone through is kept, so that each sector
+// is read once; the entry's own lock is held by the calls using it
+typedef struct _open_dir {
+  int inode;     // pointing to the inode of the directory (-1 means entry not used)
+  int pos;       // the next entry returned
+  int sector;    // which sector of entries 'entries' holds, -1 if none
+  char* entries; // SECTOR_SIZE bytes
+  pthread_mutex_t lock; // serializes the calls on this directory
+} open_dir_t;
+static open_dir_t open_dirs[MAX_OPEN_DIRS];
+static pthread_mutex_t open_dirs_lock = PTHREAD_MUTEX_INITIALIZER; // claiming an entry
+
+// mark every entry of the open file and directory tables as not used;
+// return 0 if successful, -1 otherwise
+static int open_files_init()
+{
+  int i;
+  for(i=0; i<MAX_OPEN_FILES; i++) {
+    open_files[i].inode = 0;
+    open_files[i].pos = 0;
+    open_files[i].ra_next = open_files[i].ra_end = open_files[i].ra_window = 0;
+    open_files[i].next_free = (i+1 < MAX_OPEN_FILES) ? i+1 : -1;
+    pthread_mutex_init(&open_files[i].lock, NULL);
+  }
+  free_fds = FREE_HEAD(0, (uint64_t)0);
+  for(i=0; i<MAX_OPEN_DIRS; i++) {
+    open_dirs[i].inode = -1;
+    free(open_dirs[i].entries);
+    open_dirs[i].entries = NULL;
+    pthread_mutex_init(&open_dirs[i].lock, NULL);
+  }
+  free(open_counts);
+  open_counts = (int*) calloc(MAX_FILES, sizeof(int));
+  return open_counts ? 0 : -1;
+}
+
+// return true if the file (or directory) pointed to by inode has
+// already been open
+int is_file_open(int inode)
+{
+  return __atomic_load_n(&open_counts[inode], __ATOMIC_ACQUIRE) > 0;
+}
+
+// claim a file descriptor not used for the file pointed to by inode
+// and return it (its position is already 0, see File_Close); -1 if
+// full
+int new_file_fd(int inode)
+{
+  uint64_t head = __atomic_load_n(&free_fds, __ATOMIC_ACQUIRE), next;
+  int fd;
+  do {
+    fd = FREE_FD(head);
+    if(fd < 0) return -1;
+    next = FREE_HEAD(__atomic_load_n(&open_files[fd].next_free, __ATOMIC_RELAXED), head);
+  } while(!__atomic_compare_exchange_n(&free_fds, &head, next, 1,
+				       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  __atomic_add_fetch(&open_counts[inode], 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&open_files[fd].inode, inode, __ATOMIC_RELEASE);
+  return fd;
+}
+
+// give back a file descriptor no longer used for the file pointed to
+// by inode
+static void free_file_fd(int fd, int inode)
+{
+  __atomic_sub_fetch(&open_counts[inode], 1, __ATOMIC_RELEASE);
+  uint64_t head = __atomic_load_n(&free_fds, __ATOMIC_ACQUIRE);
+  do {
+    __atomic_store_n(&open_files[fd].next_free, FREE_FD(head), __ATOMIC_RELAXED);
+  } while(!__atomic_compare_exchange_n(&free_fds, &head, FREE_HEAD(fd, head), 1,
+				       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+// return the inode of the file open as 'fd', or -1 if 'fd' is not an
+// open file; the entry isn't locked, so this is for the calls that
+// don't use the read/write position
+static int open_file_inode(int fd)
+{
+  if(fd < 0 || fd >= MAX_OPEN_FILES) {
+    dprintf("... fd=%d out of bound\n", fd);
+    return -1;
+  }
+  int inode = __atomic_load_n(&open_files[fd].inode, __ATOMIC_ACQUIRE);
+  if(inode <= 0) {
+    dprintf("... fd=%d not an open file\n", fd);
+    return -1;
+  }
+  return inode;
+}
+
+// return the entry of an open file descriptor, locked, and the inode
+// of the file through 'inode'; NULL if 'fd' is not an open file
+static open_file_t* lock_open_file(int fd, int* inode)
+{
+  if(fd < 0 || fd >= MAX_OPEN_FILES) {
+    dprintf("... fd=%d out of bound\n", fd);
+    return NULL;
+  }
+  open_file_t* of = &open_files[fd];
+  pthread_mutex_lock(&of->lock);
+  *inode = __atomic_load_n(&of->inode, __ATOMIC_ACQUIRE);
+  if(*inode <= 0) {
+    dprintf("... fd=%d not an open file\n", fd);
+    pthread_mutex_unlock(&of->lock);
+    return NULL;
+  }
+  return of;
+}
+
+// return the entry of an open directory, locked; NULL if 'dd' is not
+// an open directory
+static open_dir_t* lock_open_dir(int dd)
+{
+  if(dd < 0 || dd >= MAX_OPEN_DIRS) {
+    dprintf("... dd=%d out of bound\n", dd);
+    return NULL;
+  }
+  open_dir_t* od = &open_dirs[dd];
+  pthread_mutex_lock(&od->lock);
+  if(__atomic_load_n(&od->inode, __ATOMIC_ACQUIRE) < 0) {
+    dprintf("... dd=%d not an open directory\n", dd);
+    pthread_mutex_unlock(&od->lock);
+    return NULL;
+  }
+  return od;
+}
+
+// the number of data blocks read ahead of a sequential reader to
+// begin with, and the most it grows to
+#define READ_AHEAD_MIN 4
+#define READ_AHEAD_MAX 64
+
+// after 'bytes' bytes of the file pointed to by 'inode' have been read
+// from 'offset' through 'of', start reading the next data blocks into
+// the cache if the reads are sequential (each starting where the last
+// one ended); the window of blocks read ahead doubles each time the
+// reader has gone through half of it (as far as the cache has room),
+// and starts over when the reader jumps elsewhere; the caller has
+// locked the inode (at least for reading)
+static void file_read_ahead(open_file_t* of, int inode, int offset, int bytes)
+{
+  int sequential = (offset == of->ra_next);
+  of->ra_next = offset+bytes;
+  if(!sequential || bytes <= 0) {
+    of->ra_end = of->ra_window = 0;
+    return;
+  }
+
+  inode_t* child = get_inode(inode);
+  if(!child || child->index == INLINE_DATA) return;
+  int next = (offset+bytes+SECTOR_SIZE-1)/SECTOR_SIZE; // first block not read yet
+  int last = (child->size+SECTOR_SIZE-1)/SECTOR_SIZE; // one past the last block
+  if(of->ra_end < next) of->ra_end = next;
+  if(of->ra_window > 0 && of->ra_end-next > of->ra_window/2)
+    return; // still well ahead of the reader
+
+  if(of->ra_window == 0) of->ra_window = READ_AHEAD_MIN;
+  else if(2*of->ra_window < READ_AHEAD_MAX) of->ra_window *= 2;
+  else of->ra_window = READ_AHEAD_MAX;
+  int first = of->ra_end;
+  int n = next+of->ra_window-first;
+  if(n > last-first) n = last-first;
+  if(n <= 0) return;
+
+  int sectors[READ_AHEAD_MAX];
+  if(file_map_blocks(child, first, n, sectors, 0) < 0) return;
+  int done = Cache_Prefetch(sectors, n); // holes (zero sectors) are skipped
+  of->ra_end = first+done;
+
+  // the cache took fewer blocks than asked for, so the window isn't
+  // to grow past what it can keep
+  if(done < n)
+    of->ra_window = (of->ra_end-next > READ_AHEAD_MIN) ? of->ra_end-next : READ_AHEAD_MIN;
+}
+
+
+/************************** TREE FUNCTIONS *********************************************************/
+
+
+// Dir_Walk, Dir_RemoveTree and Dir_Usage go through a tree by the
+// inode numbers of its directories, so that only the path of its top
+// is resolved; each directory is locked while its entries are read,
+// along with a copy of the inodes they point to, and is only read
+// again (with its parent locked, to check that it's still there) when
+// gone down into
+typedef struct {
+  dirent_t dirent;
+  inode_t inode;
+} tree_entry_t;
+
+// Dir_RemoveTree and Dir_Usage hand the subdirectories to threads of
+// their own, as long as fewer than TREE_THREADS (of all the calls) are
+// running, and go through them themselves otherwise
+#define TREE_THREADS 8
+static int tree_threads;
+
+// Dir_RemoveTree removes the entries of a directory this many at a
+// time, each lot in a transaction of its own
+#define TREE_BATCH 64
+
+// a directory of a tree gone through by a thread of its own (or not):
+// its entry in its parent, what it adds up to, and how it went
+typedef struct {
+  int parent;
+  tree_entry_t* entry;
+  FS_Usage_t usage;
+  int ret;
+  int forked;
+  pthread_t thread;
+} tree_job_t;
+
+// copy inode 'ino', locked by the caller, into 'inode', and read its
+// entries (see tree_entry_t) into 'entries' (allocated, NULL if none)
+// if it's a directory, each child locked while copied (of a file being
+// written, say); return the number of entries, or -1 on error
+static int tree_read(int ino, inode_t* inode, tree_entry_t** entries)
+{
+  char buffer[SECTOR_SIZE];
+  inode_t* node = get_inode(ino);
+  int i;
+  *entries = NULL;
+  if(!node) return -1;
+  *inode = *node;
+  if(node->type != 1 || node->size <= 0) return 0;
+  *entries = (tree_entry_t*) malloc(node->size*sizeof(tree_entry_t));
+  if(!*entries) return -1;
+  for(i=0; i<node->size; i++) {
+    tree_entry_t* e = &(*entries)[i];
+    inode_t* child = NULL;
+    if(i%DIRENTS_PER_SECTOR != 0 || Cache_Read(node->data[i/DIRENTS_PER_SECTOR], buffer) == 0) {
+      memcpy(&e->dirent, buffer + (i%DIRENTS_PER_SECTOR)*sizeof(dirent_t), sizeof(dirent_t));
+      child = get_inode(e->dirent.inode);
+    }
+    if(!child) {
+      free(*entries);
+      *entries = NULL;
+      return -1;
+    }
+    e->dirent.fname[MAX_NAME-1] = '\0';
+    inode_lock(e->dirent.inode, LOCK_READ);
+    e->inode = *child;
+    inode_unlock(e->dirent.inode);
+  }
+  return node->size;
+}
+
+// read the directory of entry 'e' of directory 'parent' again (see
+// tree_read), with the parent locked meanwhile; return the number of
+// entries, -2 if the directory is no longer there, or -1 on error
+static int tree_descend(int parent, tree_entry_t* e, tree_entry_t** entries)
+{
+  int ino = e->dirent.inode, n = -2;
+  *entries = NULL;
+  inode_lock(parent, LOCK_READ);
+  if(find_child_inode(parent, e->dirent.fname) == ino) {
+    inode_lock(ino, LOCK_READ);
+    n = tree_read(ino, &e->inode, entries);
+    if(n >= 0 && e->inode.type != 1) n = -2;
+    inode_unlock(ino);
+  }
+  inode_unlock(parent);
+  return n;
+}
+
+// start 'fn' on a job in a thread of its own if there is room for one
+static void tree_fork(tree_job_t* job, void* (*fn)(void*))
+{
+  job->forked = 0;
+  if(__atomic_add_fetch(&tree_threads, 1, __ATOMIC_RELAXED) <= TREE_THREADS &&
+     pthread_create(&job->thread, NULL, fn, job) == 0) {
+    job->forked = 1;
+    return;
+  }
+  __atomic_sub_fetch(&tree_threads, 1, __ATOMIC_RELAXED);
+}
+
+// wait for a job started in a thread of its own
+static void tree_join(tree_job_t* job)
+{
+  if(!job->forked) return;
+  pthread_join(job->thread, NULL);
+  __atomic_sub_fetch(&tree_threads, 1, __ATOMIC_RELAXED);
+}
+
+// add what a file or directory takes to 'usage'
+static void tree_count(inode_t* inode, FS_Usage_t* usage)
+{
+  if(inode->type == 1) {
+    usage->dirs++;
+    usage->sectors += (inode->size+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR;
+    if(inode->index > 0) usage->sectors += DIR_INDEX_SECTORS;
+    return;
+  }
+  usage->files++;
+  usage->bytes += inode->size;
+  if(inode->index == INLINE_DATA) return;
+  long blocks = (inode->size+SECTOR_SIZE-1)/SECTOR_SIZE;
+  usage->sectors += blocks;
+  if(blocks > DIRECT_SECTORS_PER_FILE) usage->sectors++; // indirect
+  blocks -= DIRECT_SECTORS_PER_FILE+POINTERS_PER_SECTOR;
+  if(blocks > 0) usage->sectors += 1 + (blocks+POINTERS_PER_SECTOR-1)/POINTERS_PER_SECTOR;
+}
+
+static void* tree_usage_thread(void* arg);
+
+// add up what the 'n' entries of directory 'dir' take in 'job->usage';
+// 'job->ret' is 0 if successful, -1 otherwise
+static void tree_usage(tree_job_t* job, int dir, tree_entry_t* entries, int n)
+{
+  tree_job_t* jobs = (n > 0) ? (tree_job_t*) calloc(n, sizeof(tree_job_t)) : NULL;
+  int i;
+  job->ret = 0;
+  if(n > 0 && !jobs) {
+    job->ret = -1;
+    return;
+  }
+  for(i=0; i<n; i++) {
+    jobs[i].parent = dir;
+    jobs[i].entry = &entries[i];
+    if(entries[i].inode.type == 1) tree_fork(&jobs[i], tree_usage_thread);
+    else tree_count(&entries[i].inode, &jobs[i].usage);
+  }
+  for(i=0; i<n; i++)
+    if(!jobs[i].forked && entries[i].inode.type == 1) tree_usage_thread(&jobs[i]);
+  for(i=0; i<n; i++) {
+    tree_join(&jobs[i]);
+    if(jobs[i].ret < 0) job->ret = -1;
+    job->usage.files += jobs[i].usage.files;
+    job->usage.dirs += jobs[i].usage.dirs;
+    job->usage.bytes += jobs[i].usage.bytes;
+    job->usage.sectors += jobs[i].usage.sectors;
+  }
+  free(jobs);
+}
+
+// add up what a subdirectory takes, itself included (nothing if it's
+// gone meanwhile)
+static void* tree_usage_thread(void* arg)
+{
+  tree_job_t* job = (tree_job_t*) arg;
+  tree_entry_t* entries;
+  int n = tree_descend(job->parent, job->entry, &entries);
+  job->ret = (n == -1) ? -1 : 0;
+  if(n < 0) return NULL;
+  tree_count(&job->entry->inode, &job->usage);
+  tree_usage(job, job->entry->dirent.inode, entries, n);
+  free(entries);
+  return NULL;
+}
+
+// call 'fn' on the 'n' entries of directory 'dir', whose path is
+// 'path', and on what their directories hold in turn; return the
+// number of calls, or -1 on error; '*stop' is set once 'fn' asks to
+// stop
+static int tree_walk(char* path, int dir, tree_entry_t* entries, int n,
+		     Dir_WalkFn fn, void* arg, int* stop)
+{
+  char child_path[MAX_PATH+MAX_NAME];
+  int i, calls = 0;
+  for(i=0; i<n && !*stop; i++) {
+    tree_entry_t* e = &entries[i];
+    tree_entry_t* sub = NULL;
+    int m = 0;
+    if(e->inode.type == 1) {
+      m = tree_descend(dir, e, &sub);
+      if(m == -1) return -1;
+      if(m == -2) continue; // gone meanwhile
+    }
+    snprintf(child_path, sizeof(child_path), "%s%s%s", path,
+	     path[strlen(path)-1] == '/' ? "" : "/", e->dirent.fname);
+    calls++;
+    if(fn(child_path, e->inode.type, e->inode.size, arg) != 0) *stop = 1;
+    else if(m > 0) {
+      int c = tree_walk(child_path, e->dirent.inode, sub, m, fn, arg, stop);
+      if(c < 0) {
+	free(sub);
+	return -1;
+      }
+      calls += c;
+    }
+    free(sub);
+  }
+  return calls;
+}
+
+static void* tree_clear_thread(void* arg);
+
+// remove everything directory 'dir' holds, but for the files and
+// directories open and the directories holding them; the directory
+// is locked for writing by the caller, and so is its parent, so that
+// nothing can be opened in it meanwhile; 'job->ret' is 0 if the
+// directory has been emptied, 1 if there were files in use, -1 on
+// error
+static void tree_clear(tree_job_t* job, int dir)
+{
+  inode_t* node = get_inode(dir);
+  inode_t copy;
+  tree_entry_t* entries;
+  int n = node ? tree_read(dir, &copy, &entries) : -1, i;
+  job->ret = 0;
+  if(n <= 0) {
+    job->ret = n;
+    return;
+  }
+  tree_job_t* jobs = (tree_job_t*) calloc(n, sizeof(tree_job_t));
+  if(!jobs) {
+    free(entries);
+    job->ret = -1;
+    return;
+  }
+
+  // empty the subdirectories first, as many at once as there are
+  // threads for
+  int kept = 0;
+  for(i=0; i<n; i++) {
+    jobs[i].parent = dir;
+    jobs[i].entry = &entries[i];
+    if(entries[i].inode.type == 1) tree_fork(&jobs[i], tree_clear_thread);
+  }
+  for(i=0; i<n; i++)
+    if(!jobs[i].forked && entries[i].inode.type == 1) tree_clear_thread(&jobs[i]);
+  for(i=0; i<n; i++) {
+    tree_join(&jobs[i]);
+    if(is_file_open(entries[i].dirent.inode)) jobs[i].ret = 1;
+    if(jobs[i].ret) kept++;
+    if(jobs[i].ret < 0) job->ret = -1;
+    else if(jobs[i].ret > 0 && job->ret == 0) job->ret = 1;
+  }
+
+  if(kept > 0) {
+    // some entries stay, so the others are removed one by one
+    for(i=0; i<n; i++) {
+      int ino = entries[i].dirent.inode;
+      if(jobs[i].ret) continue;
+      inode_lock(ino, LOCK_WRITE);
+      journal_make_room();
+      pthread_rwlock_rdlock(&sync_lock);
+      if(remove_inode(entries[i].inode.type, dir, ino, entries[i].dirent.fname) < 0)
+	job->ret = -1;
+      pthread_rwlock_unlock(&sync_lock);
+      inode_unlock(ino);
+    }
+  } else {
+    // the whole directory goes: its entries are dropped from the end, a
+    // lot at a time, with the inodes and sectors they free given back
+    // together; the hash index goes first, as it no longer matches
+    bit_list_t inodes = { NULL, 0, 0 }, sectors = { NULL, 0, 0 };
+    int end = n;
+    while(end > 0) {
+      int begin = (end > TREE_BATCH) ? end-TREE_BATCH : 0, k;
+      // wait for anyone still looking inside the children
+      for(i=begin; i<end; i++) inode_lock(entries[i].dirent.inode, LOCK_WRITE);
+      journal_make_room();
+      pthread_rwlock_rdlock(&sync_lock);
+      dir_index_free(node);
+      for(i=begin; i<end; i++) {
+	int ino = entries[i].dirent.inode;
+	inode_t* child = get_inode(ino);
+	if(!child) {
+	  job->ret = -1;
+	  continue;
+	}
+	if(child->type == 0) file_free_blocks(child, &sectors);
+	else dir_index_free(child);
+	memset(child, 0, sizeof(inode_t));
+	inode_dirty(ino);
+	if(bit_list_add(&inodes, ino) < 0) bitmap_reset(&inode_bitmap, ino);
+	dcache_insert(dir, entries[i].dirent.fname, -1);
+      }
+      for(k=(begin+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR; k<(end+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR; k++) {
+	file_free_later(&sectors, node->data[k]);
+	node->data[k] = 0;
+      }
+      node->size = begin;
+      inode_dirty(dir);
+      if(bitmap_reset_list(&inode_bitmap, &inodes) < 0) job->ret = -1;
+      sectors_free_list(&sectors);
+      pthread_rwlock_unlock(&sync_lock);
+      for(i=begin; i<end; i++) inode_unlock(entries[i].dirent.inode);
+      dprintf("... removed entries %d-%d of directory inode %d\n", begin, end-1, dir);
+      end = begin;
+    }
+    free(inodes.bits);
+    free(sectors.bits);
+  }
+  free(jobs);
+  free(entries);
+}
+
+// empty a subdirectory, locked meanwhile
+static void* tree_clear_thread(void* arg)
+{
+  tree_job_t* job = (tree_job_t*) arg;
+  int ino = job->entry->dirent.inode;
+  inode_lock(ino, LOCK_WRITE);
+  tree_clear(job, ino);
+  inode_unlock(ino);
+  return NULL;
+}
+
+
+/************************** END OF TREE FUNCTIONS *********************************************************/
+
+
+/************************** CHECK FUNCTIONS *********************************************************/
+
+
+// FS_Check goes through the tree level by level from the root: the
+// inodes of a level are shared out between up to CHECK_THREADS
+// threads (one for every CHECK_SHARE inodes), which claim them one at
+// a time, mark the inode and the sectors each one takes in bitmaps of
+// their own (as atomic words, just like the resident bitmaps), and
+// add the inodes the entries of a directory point to to the next
+// level; nothing changes the file system meanwhile (see sync_lock), so
+// no inode is locked
+#define CHECK_THREADS 8
+#define CHECK_SHARE 64
+
+// what the threads going through a level share
+typedef struct {
+  int* level;   // the inodes of the level
+  int nlevel;
+  int claimed;  // how many of them are claimed
+  int* next;    // the inodes of the next level (each inode is in one
+  int nnext;    // level at most, so MAX_FILES are enough)
+  uint64_t* inodes;  // the inodes reached, as in inode_bitmap
+  uint64_t* sectors; // the sectors reached, as in sector_bitmap
+  int failed;   // set if something couldn't be read
+} check_t;
+
+// a thread going through a level, and what it has found so far
+typedef struct {
+  check_t* check;
+  FS_Check_t found;
+  pthread_t thread;
+} check_job_t;
+
+// mark sector 's' as reached; return 1 if it's reached for the first
+// time, and 0 if it was already, or is no sector of data blocks (and
+// so isn't to be gone into)
+static int check_sector(check_job_t* job, int s)
+{
+  if(s < DATABLOCK_START_SECTOR+journal_sectors || s >= TOTAL_SECTORS) {
+    job->found.bad_pointers++;
+    return 0;
+  }
+  uint64_t bit = (uint64_t)1 << (s%64);
+  if(__atomic_fetch_or(&job->check->sectors[s/64], bit, __ATOMIC_RELAXED) & bit) {
+    job->found.shared_sectors++;
+    return 0;
+  }
+  job->found.sectors++;
+  return 1;
+}
+
+// mark the sectors listed in a pointer sector just reached, and, if
+// 'pointers' is set, the sectors listed in those as well (for the
+// double-indirect sector)
+static void check_pointers(check_job_t* job, int psector, int pointers)
+{
+  int ptrs[POINTERS_PER_SECTOR], i;
+  if(Cache_Read(psector, (char*)ptrs) < 0) {
+    __atomic_store_n(&job->check->failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  for(i=0; i<POINTERS_PER_SECTOR; i++) {
+    if(ptrs[i] != 0 && check_sector(job, ptrs[i]) && pointers)
+      check_pointers(job, ptrs[i], 0);
+  }
+}
+
+// mark the sectors of a file
+static void check_file(check_job_t* job, inode_t* inode)
+{
+  int i;
+  if(inode->size < 0 || inode->size > MAX_FILE_SIZE) job->found.bad_inodes++;
+  if(inode->index == INLINE_DATA) {
+    if(inode->size > INLINE_DATA_SIZE) job->found.bad_inodes++;
+    return;
+  }
+  if(inode->index != 0) job->found.bad_inodes++;
+  for(i=0; i<DIRECT_SECTORS_PER_FILE; i++)
+    if(inode->data[i] != 0) check_sector(job, inode->data[i]);
+  if(inode->indirect != 0 && check_sector(job, inode->indirect))
+    check_pointers(job, inode->indirect, 0);
+  if(inode->dindirect != 0 && check_sector(job, inode->dindirect))
+    check_pointers(job, inode->dindirect, 1);
+}
+
+// mark the sectors of a directory, and add the inodes its entries
+// point to to the next level; an entry pointing to no inode, or to an
+// inode already reached (linked twice, or up the tree), is bad
+static void check_dir(check_job_t* job, inode_t* dir)
+{
+  check_t* c = job->check;
+  char buffer[SECTOR_SIZE];
+  int i, j;
+  if(dir->size < 0 || dir->size > MAX_DIRENTS) {
+    job->found.bad_inodes++;
+    return;
+  }
+  for(i=0; i<DIRECT_SECTORS_PER_FILE; i++) {
+    int n = dir->size - i*DIRENTS_PER_SECTOR;
+    if(n > (int)DIRENTS_PER_SECTOR) n = DIRENTS_PER_SECTOR;
+    if(dir->data[i] == 0) {
+      if(n > 0) job->found.bad_inodes++;
+      continue;
+    }
+    if(!check_sector(job, dir->data[i]) || n <= 0) continue;
+    if(Cache_Read(dir->data[i], buffer) < 0) {
+      __atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    for(j=0; j<n; j++) {
+      int child = ((dirent_t*)buffer)[j].inode;
+      uint64_t bit = (uint64_t)1 << (child%64);
+      if(child <= 0 || child >= MAX_FILES ||
+	 (__atomic_fetch_or(&c->inodes[child/64], bit, __ATOMIC_RELAXED) & bit)) {
+	job->found.bad_entries++;
+	continue;
+      }
+      c->next[__atomic_fetch_add(&c->nnext, 1, __ATOMIC_RELAXED)] = child;
+    }
+  }
+  if(dir->index < 0) job->found.bad_inodes++;
+  else if(dir->index > 0) {
+    for(i=0; i<DIR_INDEX_SECTORS; i++) check_sector(job, dir->index+i);
+  }
+}
+
+// go through the inodes of a level, claiming them one at a time
+static void* check_level(void* arg)
 {
-	// First, load child inode sector
-	int inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
- 
-	char inode_buffer[SECTOR_SIZE];
-  
-	if(Disk_Read(inode_sector, inode_buffer) < 0) 
-		return -1;
-  
-	dprintf("Load inode table for child inode from disk sector %d\n", inode_sector);
-
-	// Get child inode
-	int inode_start_index = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
- 
-	int offset = child_inode - inode_start_index;
-  
-	assert(0 <= offset && offset < INODES_PER_SECTOR);
-	inode_t* child = (inode_t*)(inode_buffer + offset * sizeof(inode_t));
+  check_job_t* job = (check_job_t*) arg;
+  check_t* c = job->check;
+  int i;
+  while((i = __atomic_fetch_add(&c->claimed, 1, __ATOMIC_RELAXED)) < c->nlevel) {
+    inode_t* inode = get_inode(c->level[i]);
+    if(!inode) {
+      __atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    job->found.inodes++;
+    if(inode->type == 0) check_file(job, inode);
+    else if(inode->type == 1) check_dir(job, inode);
+    else job->found.bad_inodes++;
+  }
+  return NULL;
+}
 
-	// If we have the wrong type
-	if(child->type != type)
-		return -3;               
+// compare what's reached with a bitmap, counting the entries marked
+// in use but not reached ('lost') and those reached but marked free
+// ('missing'); the padding bits past the end are set in 'reached', as
+// they are in the bitmap
+static void check_compare(bitmap_t* bm, uint64_t* reached, long* lost, long* missing)
+{
+  int w;
+  if(bm->nbits%64) reached[bm->nwords-1] |= ~(uint64_t)0 << (bm->nbits%64);
+  for(w=0; w<bm->nwords; w++) {
+    *lost += __builtin_popcountll(bm->words[w] & ~reached[w]);
+    *missing += __builtin_popcountll(reached[w] & ~bm->words[w]);
+  }
+}
 
-	// If node is a nonempty directory
-	if(child->type == 1 && child->size > 0)
-		return -2;                               
+// make a bitmap what's reached, to be written back at the next commit
+// (only the sectors that change, so that the commit stays small)
+static void check_repair(bitmap_t* bm, uint64_t* reached)
+{
+  int w;
+  pthread_mutex_lock(&bm->lock);
+  for(w=0; w<bm->nwords; w++) {
+    if(bm->words[w] == reached[w]) continue;
+    bm->words[w] = reached[w];
+    bm->dirty[w*8/SECTOR_SIZE] = 1;
+  }
+  bm->hint = 0;
+  pthread_mutex_unlock(&bm->lock);
+}
 
-	// If node is a file, reclaim data sectors of child inode
-	if(child->type == 0)
-	{
-		int i;
-		
-		// Loop through all sectors
-		for(i = 0; i < MAX_SECTORS_PER_FILE; i++)
-		{   
-			// If we have valid data we need to clear
-			if(child->data[i] > 0)
-			{           
-				bitmap_reset(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, child->data[i]);    // Reset the entry in the sector bitmap
-				dprintf("Resetting bit sector %d from index [%d]\n", child->data[i], i );
-			}
-		}
-	}
-  
-	// Clear the child
-	memset(child, 0, sizeof(inode_t));
-  
-	// Write to disk
-	if(Disk_Write(inode_sector, inode_buffer) < 0) 
-		return -1;
-	
-	dprintf("Update disk sector %d\n", inode_sector);
+// go through the whole tree (see check_t), and add what's found to
+// 'report'; the caller holds sync_lock for writing; return 0 if
+// successful, -1 if something couldn't be read (or out of memory)
+static int check_tree(check_t* c, FS_Check_t* report)
+{
+  check_job_t jobs[CHECK_THREADS];
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = (cpus < 1) ? 1 : (cpus < CHECK_THREADS) ? (int)cpus : CHECK_THREADS;
+  int i, s;
+  memset(jobs, 0, sizeof(jobs));
+  for(i=0; i<CHECK_THREADS; i++) jobs[i].check = c;
+
+  // the sectors before the data blocks are always in use
+  for(s=0; s<DATABLOCK_START_SECTOR+journal_sectors; s++)
+    c->sectors[s/64] |= (uint64_t)1 << (s%64);
+  report->sectors = DATABLOCK_START_SECTOR+journal_sectors;
+
+  c->inodes[0] |= 1;
+  c->level[0] = 0;
+  c->nlevel = 1;
+  while(c->nlevel > 0) {
+    int nthreads = (c->nlevel+CHECK_SHARE-1)/CHECK_SHARE;
+    if(nthreads > max_threads) nthreads = max_threads;
+    c->claimed = 0;
+    c->nnext = 0;
+    for(i=1; i<nthreads; i++) {
+      if(pthread_create(&jobs[i].thread, NULL, check_level, &jobs[i]) != 0) break;
+    }
+    nthreads = i;
+    check_level(&jobs[0]);
+    for(i=1; i<nthreads; i++) pthread_join(jobs[i].thread, NULL);
+    int* level = c->level;
+    c->level = c->next;
+    c->nlevel = c->nnext;
+    c->next = level;
+  }
 
-	// Update inode bitmap
-	bitmap_reset(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, child_inode);
+  for(i=0; i<CHECK_THREADS; i++) {
+    long* from = (long*) &jobs[i].found, *to = (long*) report;
+    for(s=0; s<(int)(sizeof(FS_Check_t)/sizeof(long)); s++) to[s] += from[s];
+  }
+  return c->failed ? -1 : 0;
+}
 
-	// Get sector containing parent 
-	inode_sector = INODE_TABLE_START_SECTOR + parent_inode / INODES_PER_SECTOR;
-	
-	// Read the disk
-	if(Disk_Read(inode_sector, inode_buffer) < 0) 
-		return -1;
-	
-	dprintf("Load inode table for parent inode %d from disk sector %d\n", parent_inode, inode_sector);
 
-	// Get the parent
-	inode_start_index = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-	offset = parent_inode - inode_start_index;
-	
-	assert(0 <= offset && offset < INODES_PER_SECTOR);
-	
-	inode_t* parent = (inode_t*)(inode_buffer + offset * sizeof(inode_t));
-	dprintf("Get parent: %d, size: %d, type: %d\n", parent_inode, parent->size, parent->type);
+/************************** END OF CHECK FUNCTIONS *********************************************************/
 
-	
-	// If a parent is somehow not a parent
-	if(parent->type != 1) 
-	{
-		dprintf("ERROR: parent inode is not a directory\n");
-		return -2; 
-	}
-  
-	// Now we find (in parent inode) the dirent structure containing child inode, swap with last dirent entry in parent
-	char dirent_buffer[SECTOR_SIZE];
-	
-	int group = 0;
-    int entry = 0;  
-	
-    dirent_t* current_dirent;
 
-	if(parent->size > 1)
-	{  
-		int last_group = parent->size / DIRENTS_PER_SECTOR;
-		char last_dirent_buffer[SECTOR_SIZE];
-		int last_sector = parent->data[last_group];
-		
-		if(Disk_Read(last_sector, last_dirent_buffer) < 0)  
-			return -1;
-		
-		dprintf("Load sector %d corresponding to last dirent in group %d\n", parent->data[last_group], group);
+/************************** STATISTICS FUNCTIONS *********************************************************/
 
-		// Get the last dirent entry
-		int start_entry = last_group * DIRENTS_PER_SECTOR;
-		offset = parent->size - start_entry - 1;
-		
-		// Last dirent to swap with the one we're deleting
-		dirent_t* last_dirent = (dirent_t*)(last_dirent_buffer + offset * sizeof(dirent_t));  
-    
-		// Loop through all groups    
-		for(group = 0; group < MAX_SECTORS_PER_FILE; group++)
-		{       
-			// Read sector in this group
-			if(Disk_Read(parent->data[group], dirent_buffer) < 0)    
-				return -1;
-			
-			dprintf("Load disk sector %d for dirent group %d\n", parent->data[last_group], group);
-			
-			// Loop through all dirents in this group
-			for(entry = 0; entry < DIRENTS_PER_SECTOR; entry++)
-			{      
-				current_dirent = (dirent_t*)(dirent_buffer + entry * sizeof(dirent_t));
-				
-				if(current_dirent->inode == child_inode)
-				{
-					strncpy(current_dirent->fname, last_dirent->fname, MAX_NAME);
-					current_dirent->inode = last_dirent->inode; 
-	
-					char * empty = "";
-				
-					strncpy(last_dirent->fname, empty, MAX_NAME);
-					last_dirent->inode = -1;
-                     
-					memset(last_dirent, 0 , sizeof(dirent_t));
-				
-					if(Disk_Write(parent->data[group], dirent_buffer) < 0) 
-						return -1;     
-				
-					dprintf("Update dirent %d, name: %s, inode: %d to group %d; update disk sector %d\n", (group * 30) + entry, current_dirent->fname, 
-						current_dirent->inode, group, parent->data[group]);
-						
-					if(Disk_Write(inode_sector, inode_buffer) < 0) 
-						return -1;     
-				
-					group = MAX_SECTORS_PER_FILE; 
-				
-					break;
-				}
-			}
-		}
-	}
 
-	parent->size--;
-	
-	if(Disk_Write(inode_sector, inode_buffer) < 0) 
-		return -1;
-  
-	dprintf("Update parent inode on disk sector %d\n", inode_sector);
- 
-	return 0;  
+// the counters of the calling thread, from its start; 'nanoseconds'
+// is the time now if the calls are timed
+static void stats_thread(FS_OpStats_t* st)
+{
+  Disk_Stats_t disk;
+  Disk_GetStats(&disk);
+  memset(st, 0, sizeof(FS_OpStats_t));
+  st->sector_reads = disk.reads;
+  st->sector_writes = disk.writes;
+  st->seek_distance = disk.seek_distance;
+  st->disk_nanoseconds = disk.disk_nanoseconds;
+  Cache_GetThreadStats(&st->cache_hits, &st->cache_misses);
+  st->bitmap_scans = thread_bitmap_scans;
+  st->bitmap_bits = thread_bitmap_bits;
+  st->path_components = thread_path_components;
+  st->bytes_copied = thread_bytes_copied;
+  if(__atomic_load_n(&stats_timing, __ATOMIC_RELAXED)) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    st->nanoseconds = t.tv_sec*1000000000L + t.tv_nsec;
+  }
 }
 
+// the counters of FS_OpStats_t are all longs, and are added one by one
+#define STATS_LONGS ((int)(sizeof(FS_OpStats_t)/sizeof(long)))
 
+// a call being counted: what it is, the counters of its thread when
+// it started, and the osErrno it was made with; osErrno is set to
+// STATS_NO_ERROR meanwhile, so that the call is known to have failed
+// if it's set to anything else
+typedef struct {
+  int op;
+  FS_OpStats_t start;
+  int errno_before;
+} stats_call_t;
 
+#define STATS_NO_ERROR (-1)
 
+static stats_call_t stats_begin(int op)
+{
+  stats_call_t call = { op };
+  stats_thread(&call.start);
+  call.errno_before = osErrno;
+  osErrno = STATS_NO_ERROR;
+  TRACE(TRACE_CALL, op, 0, 0, 0);
+  return call;
+}
 
+// add the statistics of a thread that's gone to those of the others
+// that were, and drop them (see stats_key)
+static void stats_retire(void* arg)
+{
+  thread_stats_t* ts = (thread_stats_t*) arg, **p;
+  long* from = (long*) ts->ops, *to = (long*) retired_stats;
+  int i;
+  pthread_mutex_lock(&stats_lock);
+  for(p = &all_thread_stats; *p != ts; p = &(*p)->next);
+  *p = ts->next;
+  for(i = 0; i < FS_OPS*STATS_LONGS; i++) to[i] += from[i];
+  pthread_mutex_unlock(&stats_lock);
+  free(ts);
+}
 
+static void stats_setup()
+{
+  pthread_key_create(&stats_key, stats_retire);
+}
 
+// return the statistics of the calling thread, set up the first time
+// (NULL if out of memory)
+static thread_stats_t* stats_of_thread()
+{
+  if(thread_stats) return thread_stats;
+  pthread_once(&stats_once, stats_setup);
+  thread_stats_t* ts = (thread_stats_t*) calloc(1, sizeof(thread_stats_t));
+  if(!ts) return NULL;
+  pthread_mutex_lock(&stats_lock);
+  ts->next = all_thread_stats;
+  all_thread_stats = ts;
+  pthread_mutex_unlock(&stats_lock);
+  pthread_setspecific(stats_key, ts);
+  return thread_stats = ts;
+}
 
-
-// representing an open file
-typedef struct _open_file {
-  int inode; // pointing to the inode of the file (0 means entry not used)
-  int size;  // file size cached here for convenience
-  int pos;   // read/write position
-} open_file_t;
-static open_file_t open_files[MAX_OPEN_FILES];
-
-// return true if the file pointed to by inode has already been open
-int is_file_open(int inode)
+// add up the statistics of every thread, past and present, into 'sum'
+static void stats_sum(FS_OpStats_t* sum)
 {
+  thread_stats_t* ts;
+  long* to = (long*) sum;
   int i;
-  for(i=0; i<MAX_OPEN_FILES; i++) {
-    if(open_files[i].inode == inode)
-      return 1;
+  pthread_mutex_lock(&stats_lock);
+  memcpy(sum, retired_stats, sizeof(retired_stats));
+  for(ts = all_thread_stats; ts; ts = ts->next) {
+    long* from = (long*) ts->ops;
+    for(i = 0; i < FS_OPS*STATS_LONGS; i++) to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
   }
-  return 0;
+  pthread_mutex_unlock(&stats_lock);
 }
 
-// return a new file descriptor not used; -1 if full
-int new_file_fd()
+// add what the thread did since the call started to the statistics of
+// the call; only the thread itself changes them, so no atomic
+// addition is needed (the stores are atomic only so that they can be
+// added up meanwhile)
+static void stats_end(stats_call_t* call)
 {
+  FS_OpStats_t now;
+  stats_thread(&now);
+  if(!call->start.nanoseconds) now.nanoseconds = 0;
+  long* from = (long*) &call->start, *to = (long*) &now;
+  thread_stats_t* ts = stats_of_thread();
   int i;
-  for(i=0; i<MAX_OPEN_FILES; i++) {
-    if(open_files[i].inode <= 0)
-      return i;
+  if(ts) {
+    long* total = (long*) &ts->ops[call->op];
+    for(i = 0; i < STATS_LONGS; i++) {
+      long add = i ? to[i]-from[i] : 1; // the first counter is the calls
+      if(add) __atomic_store_n(&total[i], __atomic_load_n(&total[i], __ATOMIC_RELAXED)+add, __ATOMIC_RELAXED);
+    }
+  }
+
+  int failed = (osErrno != STATS_NO_ERROR);
+  TRACE(TRACE_RETURN, call->op, failed, failed ? osErrno : 0, 0);
+  if(!failed) osErrno = call->errno_before;
+  else if(osErrno == E_GENERAL && trace_dump_on_error) {
+    dprintf("... %s failed, dump trace\n", op_names[call->op]);
+    trace_dump(trace_dump_file[0] ? trace_dump_file : NULL);
   }
-  return -1;
 }
 
+// count the call of the API function this is put at the start of, up
+// to whichever way it returns
+#define STATS_OP(op) \
+  stats_call_t stats_call __attribute__((cleanup(stats_end))) = stats_begin(op)
+
+
+/************************** END OF STATISTICS FUNCTIONS *********************************************************/
+
+
 /* end of internal helper functions, start of API functions */
 
 
 
 
 
+int FS_SetGeometry(int sector_size, int total_sectors, int max_files)
+{
+  dprintf("FS_SetGeometry(%d, %d, %d):\n", sector_size, total_sectors, max_files);
+  superblock_t sb = { OS_MAGIC, sector_size, total_sectors, max_files };
+  if(!check_geometry(&sb)) {
+    dprintf("... bad geometry\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  format_geometry = sb;
+  return 0;
+}
+
 int FS_Boot(char* backstore_fname)
 {
+  STATS_OP(FS_OP_BOOT);
   dprintf("FS_Boot('%s'):\n", backstore_fname);
+  // nothing cached from a previously booted disk is valid any more,
+  // and neither is a batch the thread began on it
+  dcache_clear();
+  freed_sectors.n = 0;
+  batch_depth = 0;
+  read_only = 0;
+
+  // a disk that exists is booted with the geometry in its superblock,
+  // and a new one is formatted with the geometry chosen for it
+  superblock_t sb;
+  int found = read_superblock(backstore_fname, &sb);
+  if(found == -2) {
+    dprintf("... '%s' holds no disk of this file system (or of an older layout), boot failed\n",
+	    backstore_fname);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(found < 0) sb = format_geometry;
+  if(set_geometry(&sb) < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
   // initialize a new disk (this is a simulated disk)
   if(Disk_Init() < 0) {
     dprintf("... disk init failed\n");
@@ -844,6 +3101,14 @@ int FS_Boot(char* backstore_fname)
   }
   dprintf("... disk initialized\n");
   
+  // every sector is read and written through the block cache, which
+  // starts out empty
+  if(Cache_Init(SECTOR_SIZE) < 0) {
+    dprintf("... block cache init failed\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  
   // we should copy the filename down; if not, the user may change the
   // content pointed to by 'backstore_fname' after calling this function
   strncpy(bs_filename, backstore_fname, 1024);
@@ -858,47 +3123,66 @@ int FS_Boot(char* backstore_fname)
     if(diskErrno == E_OPENING_FILE) {
       dprintf("... couldn't open file, create new file system\n");
 
-      // format superblock
+      // the journal takes the first sectors after the inode table
+      sb.journal_sectors = journal_format_sectors(TOTAL_SECTORS);
+      sb.journal_start = sb.journal_sectors ? DATABLOCK_START_SECTOR : 0;
+      journal_start = sb.journal_start;
+      journal_sectors = sb.journal_sectors;
+      journal_seq = 0;
+
+      // format superblock, without the magic number for now (see below)
       char buffer[SECTOR_SIZE];
       memset(buffer, 0, SECTOR_SIZE);
-      *(int*)buffer = OS_MAGIC;
-      if(Disk_Write(SUPERBLOCK_START_SECTOR, buffer) < 0) {
+      memcpy(buffer, &sb, sizeof(superblock_t));
+      ((superblock_t*)buffer)->magic = 0;
+      if(Cache_Write(SUPERBLOCK_START_SECTOR, buffer) < 0) {
 	    dprintf("... failed to format superblock\n");
 	    osErrno = E_GENERAL;
 	    return -1;
       }
 
-      dprintf("... formatted superblock (sector %d)\n", SUPERBLOCK_START_SECTOR);
+      dprintf("... formatted superblock (sector %d, sector size %d, %d sectors, %d files)\n",
+	      SUPERBLOCK_START_SECTOR, SECTOR_SIZE, TOTAL_SECTORS, MAX_FILES);
+      dprintf("... formatted journal (start=%d, num=%d)\n", journal_start, journal_sectors);
 
       // format inode bitmap (reserve the first inode to root)
-      bitmap_init(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, 1);
+      if(bitmap_init(&inode_bitmap, INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, MAX_FILES, 1) < 0) {
+        osErrno = E_GENERAL;
+        return -1;
+      }
       dprintf("... formatted inode bitmap (start=%d, num=%d)\n", (int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
       
       // format sector bitmap (reserve the first few sectors to
-      // superblock, inode bitmap, sector bitmap, and inode table)
-      bitmap_init(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,DATABLOCK_START_SECTOR);
+      // superblock, inode bitmap, sector bitmap, inode table, and
+      // journal)
+      if(bitmap_init(&sector_bitmap, SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, TOTAL_SECTORS, DATABLOCK_START_SECTOR+journal_sectors) < 0) {
+        osErrno = E_GENERAL;
+        return -1;
+      }
       dprintf("... formatted sector bitmap (start=%d, num=%d)\n",(int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
       
       // format inode tables
-      int i;
-      for(i=0; i<INODE_TABLE_SECTORS; i++) {
-	       memset(buffer, 0, SECTOR_SIZE);
-	       if(i==0) {
-	       // the first inode table entry is the root directory
-	         ((inode_t*)buffer)->size = 0;
-	         ((inode_t*)buffer)->type = 1;
-	       }
-	       if(Disk_Write(INODE_TABLE_START_SECTOR+i, buffer) < 0) {
-  	        dprintf("... failed to format inode table\n");
-  	        osErrno = E_GENERAL;
-  	        return -1;	
-          } 
-        }
+      if(inode_table_init(1) < 0) {
+        osErrno = E_GENERAL;
+        return -1;
+      }
+      // the first inode table entry is the root directory
+      inode_table[0].size = 0;
+      inode_table[0].type = 1;
 
       dprintf("... formatted inode table (start=%d, num=%d)\n",(int)INODE_TABLE_START_SECTOR, (int)INODE_TABLE_SECTORS);
       
-      // we need to synchronize the disk to the backstore file (so that we don't lose the formatted disk)
-      if(Disk_Save(bs_filename) < 0) {
+      // we need to synchronize the disk to the backstore file (so that
+      // we don't lose the formatted disk); the magic number is saved
+      // last, so that a disk whose formatting was cut short won't boot,
+      // and so the formatted metadata (which may not fit in the
+      // journal) is written in place rather than logged
+      ((superblock_t*)buffer)->magic = OS_MAGIC;
+      journal_sectors = 0;
+      int formatted = journal_commit();
+      journal_sectors = sb.journal_sectors;
+      if(formatted < 0 || Cache_Write(SUPERBLOCK_START_SECTOR, buffer) < 0 ||
+         Cache_Flush() < 0 || Disk_Save(bs_filename) < 0) {
 	     // if can't write to file, something's wrong with the backstore
       	dprintf("... failed to save disk to file '%s'\n", bs_filename);
       	osErrno = E_GENERAL;
@@ -906,7 +3190,10 @@ int FS_Boot(char* backstore_fname)
       } else {
       	// everything's good now, boot is successful
       	dprintf("... successfully formatted disk, boot successful\n");
-      	memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
+      	if(open_files_init() < 0) {
+      	  osErrno = E_GENERAL;
+      	  return -1;
+      	}
       	return 0;
       }
     } else {
@@ -918,28 +3205,35 @@ int FS_Boot(char* backstore_fname)
   }else {
       dprintf("... load disk from file '%s' successful\n", bs_filename);
     
-      // we successfully loaded the disk, we need to do two more checks,
-      // first the file size must be exactly the size as expected (this
-      // supposedly should be folded in Disk_Load(); and it's not)
-      int sz = 0;
-      FILE* f = fopen(bs_filename, "r");
-      if(f) {
-        fseek(f, 0, SEEK_END);
-        sz = ftell(f);
-        fclose(f);
-      }
-      if(sz != SECTOR_SIZE*TOTAL_SECTORS) {
-        dprintf("... check size of file '%s' failed\n", bs_filename);
-        osErrno = E_GENERAL;
-        return -1;
-      }
-      dprintf("... check size of file '%s' successful\n", bs_filename);
-    
-      // check magic
+      // we successfully loaded the disk (Disk_Load has made sure that
+      // the file is as big as the disk, which for a block device may
+      // be bigger than the file system), then check magic
       if(check_magic()) {
-        // everything's good by now, boot is successful
         dprintf("... check magic successful\n");
-        memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
+
+        // finish writing in place what the last commit before a crash
+        // didn't
+        if(journal_replay() < 0) {
+          dprintf("... failed to replay journal, boot failed\n");
+          osErrno = E_GENERAL;
+          return -1;
+        }
+
+        // keep both bitmaps and the inode table in memory from now on
+        if(bitmap_load(&inode_bitmap, INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, MAX_FILES) < 0 ||
+           bitmap_load(&sector_bitmap, SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, TOTAL_SECTORS) < 0 ||
+           inode_table_init(0) < 0) {
+          dprintf("... failed to load bitmaps, boot failed\n");
+          osErrno = E_GENERAL;
+          return -1;
+        }
+
+        // everything's good by now, boot is successful
+        if(open_files_init() < 0) {
+          dprintf("... out of memory, boot failed\n");
+          osErrno = E_GENERAL;
+          return -1;
+        }
         return 0;
       } else {      
         // mismatched magic number
@@ -948,25 +3242,314 @@ int FS_Boot(char* backstore_fname)
         return -1;
       }
   }
-}
+}
+
+
+
+
+
+
+// commit the changes made to the file system and save the disk, even
+// in the middle of a batch: the changes of every thread are committed
+// together, those of the batches still open as far as they've gone
+// (FS_Sync does it only outside of the thread's own batch)
+static int fs_sync()
+{
+  // a snapshot mounted has nothing to commit
+  if(read_only) return 0;
+
+  // wait for the operations changing the file system to finish, and
+  // hold off new ones until the disk is saved
+  pthread_rwlock_wrlock(&sync_lock);
+
+  // commit the bitmap and inode table sectors, and the rest of the
+  // metadata, changed since the last sync, along with every dirty
+  // block of the block cache
+  int ret = journal_commit();
+  pthread_rwlock_unlock(&sync_lock);
+  if(ret < 0) {
+    // if can't write to file, something's wrong with the backstore
+    dprintf("FS_Sync():\n... failed to save disk to file '%s'\n", bs_filename);
+    osErrno = E_GENERAL;
+    return -1;
+  } else {
+    // everything's good now, sync is successful
+    dprintf("FS_Sync():\n... successfully saved disk to file '%s'\n", bs_filename);
+    return 0;
+  }  
+}
+
+int FS_Sync()
+{
+  STATS_OP(FS_OP_SYNC);
+  // the thread's batch is committed in one go when it ends; nothing
+  // is committed now, which is told apart from a sync
+  if(batch_depth > 0) {
+    dprintf("FS_Sync():\n... in a batch, left for FS_BatchCommit()\n");
+    return 1;
+  }
+  return fs_sync();
+}
+
+int FS_BatchBegin()
+{
+  batch_depth++;
+  dprintf("FS_BatchBegin():\n... batch depth %d\n", batch_depth);
+  return 0;
+}
+
+int FS_BatchCommit()
+{
+  STATS_OP(FS_OP_BATCH_COMMIT);
+  // only the batch begun first commits, so batches may be nested
+  if(batch_depth <= 0) {
+    dprintf("FS_BatchCommit():\n... no batch begun\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(--batch_depth > 0) return 0;
+  return fs_sync();
+}
+
+// the snapshot mounted, if any (see FS_MountSnapshot)
+static char mounted[DISK_SNAPSHOT_NAME];
+
+// check that no file or directory is open, as the file system can't
+// be swapped for another under them; return 0 if so, and -1
+// (E_FILE_IN_USE) otherwise
+static int check_nothing_open()
+{
+  int i;
+  for(i=0; i<MAX_FILES; i++) {
+    if(is_file_open(i)) {
+      dprintf("... inode %d open\n", i);
+      osErrno = E_FILE_IN_USE;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// hold off the operations changing the file system (see sync_lock)
+// and commit what they changed, so that no dirty block is left to be
+// written behind the back of the snapshots; sync_lock is held for
+// writing whether it succeeds (0) or not (-1)
+static int fs_quiesce()
+{
+  pthread_rwlock_wrlock(&sync_lock);
+  return read_only ? 0 : journal_commit();
+}
+
+// load the bitmaps and the inode table again, as FS_Boot does, once
+// the disk under them has changed (see FS_Rollback); return 0 if
+// successful, -1 otherwise
+static int fs_reload()
+{
+  dcache_clear();
+  freed_sectors.n = 0;
+  if(Cache_Init(SECTOR_SIZE) < 0 || journal_replay() < 0 ||
+     bitmap_load(&inode_bitmap, INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, MAX_FILES) < 0 ||
+     bitmap_load(&sector_bitmap, SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, TOTAL_SECTORS) < 0 ||
+     inode_table_init(0) < 0 || open_files_init() < 0) {
+    dprintf("... failed to reload the file system\n");
+    return -1;
+  }
+  return 0;
+}
+
+int FS_Snapshot(char* name)
+{
+  STATS_OP(FS_OP_SNAPSHOT);
+  dprintf("FS_Snapshot(%s):\n", name ? name : "NULL");
+  if(check_writable() < 0) return -1;
+
+  // the snapshot is the disk as just committed: from then on each
+  // sector is copied before it's written over
+  int ret = fs_quiesce();
+  if(ret == 0) ret = Disk_Snapshot(name);
+  pthread_rwlock_unlock(&sync_lock);
+  if(ret < 0) {
+    dprintf("... failed to take snapshot\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+
+int FS_Rollback(char* name)
+{
+  STATS_OP(FS_OP_ROLLBACK);
+  dprintf("FS_Rollback(%s):\n", name ? name : "NULL");
+  if(check_writable() < 0 || check_nothing_open() < 0) return -1;
+
+  int ret = fs_quiesce();
+  if(ret == 0 && Disk_Rollback(name) < 0) {
+    pthread_rwlock_unlock(&sync_lock);
+    dprintf("... no snapshot '%s'\n", name ? name : "NULL");
+    osErrno = (diskErrno == E_INVALID_PARAM) ? E_NO_SUCH_SNAPSHOT : E_GENERAL;
+    return -1;
+  }
+  if(ret == 0) ret = (Disk_Save(bs_filename) < 0 || fs_reload() < 0) ? -1 : 0;
+  pthread_rwlock_unlock(&sync_lock);
+  if(ret < 0) {
+    dprintf("... failed to roll back to snapshot '%s'\n", name);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+
+int FS_DeleteSnapshot(char* name)
+{
+  STATS_OP(FS_OP_DELETE_SNAPSHOT);
+  dprintf("FS_DeleteSnapshot(%s):\n", name ? name : "NULL");
+  if(read_only && name && !strcmp(name, mounted)) {
+    dprintf("... snapshot mounted\n");
+    osErrno = E_FILE_IN_USE;
+    return -1;
+  }
+
+  int ret = fs_quiesce();
+  if(ret == 0 && Disk_DeleteSnapshot(name) < 0) {
+    pthread_rwlock_unlock(&sync_lock);
+    dprintf("... no snapshot '%s'\n", name ? name : "NULL");
+    osErrno = E_NO_SUCH_SNAPSHOT;
+    return -1;
+  }
+  pthread_rwlock_unlock(&sync_lock);
+  if(ret < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+
+int FS_MountSnapshot(char* name)
+{
+  STATS_OP(FS_OP_MOUNT_SNAPSHOT);
+  dprintf("FS_MountSnapshot(%s):\n", name ? name : "NULL");
+  if(check_nothing_open() < 0) return -1;
+
+  int ret = fs_quiesce();
+  if(ret == 0 && Disk_ViewSnapshot(name) < 0) {
+    pthread_rwlock_unlock(&sync_lock);
+    dprintf("... no snapshot '%s'\n", name);
+    osErrno = E_NO_SUCH_SNAPSHOT;
+    return -1;
+  }
+  if(ret == 0) {
+    read_only = (name != NULL);
+    snprintf(mounted, sizeof(mounted), "%s", name ? name : "");
+    ret = fs_reload();
+  }
+  pthread_rwlock_unlock(&sync_lock);
+  if(ret < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return 0;
+}
+
+int FS_Check(int repair, FS_Check_t* report)
+{
+  STATS_OP(FS_OP_CHECK);
+  dprintf("FS_Check(%d):\n", repair);
+  if(!report) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  memset(report, 0, sizeof(FS_Check_t));
+  if(repair && check_writable() < 0) return -1;
+
+  check_t c;
+  memset(&c, 0, sizeof(c));
+  c.level = (int*) malloc(MAX_FILES*sizeof(int));
+  c.next = (int*) malloc(MAX_FILES*sizeof(int));
+  c.inodes = (uint64_t*) calloc(inode_bitmap.nwords, sizeof(uint64_t));
+  c.sectors = (uint64_t*) calloc(sector_bitmap.nwords, sizeof(uint64_t));
+
+  // what's reached is compared with the bitmaps as just committed
+  int ret = -1;
+  if(c.level && c.next && c.inodes && c.sectors) {
+    ret = fs_quiesce();
+    if(ret == 0) ret = check_tree(&c, report);
+    if(ret == 0) {
+      check_compare(&inode_bitmap, c.inodes, &report->lost_inodes, &report->missing_inodes);
+      check_compare(&sector_bitmap, c.sectors, &report->lost_sectors, &report->missing_sectors);
+      if(repair && report->lost_inodes+report->missing_inodes+
+	 report->lost_sectors+report->missing_sectors > 0) {
+	check_repair(&inode_bitmap, c.inodes);
+	check_repair(&sector_bitmap, c.sectors);
+	ret = journal_commit();
+	dprintf("... bitmaps repaired\n");
+      }
+    }
+    pthread_rwlock_unlock(&sync_lock);
+  }
+  free(c.level); free(c.next); free(c.inodes); free(c.sectors);
+  if(ret < 0) {
+    dprintf("... failed to check the file system\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
 
+  long left = report->shared_sectors + report->bad_entries + report->bad_pointers + report->bad_inodes;
+  if(!repair) left += report->lost_inodes + report->missing_inodes +
+		report->lost_sectors + report->missing_sectors;
+  dprintf("... %ld inodes, %ld sectors reached, %ld problems left\n",
+	  report->inodes, report->sectors, left);
+  return (left > INT_MAX) ? INT_MAX : (int)left;
+}
 
+int FS_GetStats(FS_Stats_t* stats)
+{
+  if(!stats) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  long* sum = (long*) stats->ops, *reset = (long*) reset_stats;
+  int i;
+  stats_sum(stats->ops);
+  pthread_mutex_lock(&stats_lock);
+  for(i = 0; i < FS_OPS*STATS_LONGS; i++) sum[i] -= reset[i];
+  pthread_mutex_unlock(&stats_lock);
+  return 0;
+}
 
+void FS_ResetStats()
+{
+  FS_OpStats_t sum[FS_OPS];
+  stats_sum(sum);
+  pthread_mutex_lock(&stats_lock);
+  memcpy(reset_stats, sum, sizeof(reset_stats));
+  pthread_mutex_unlock(&stats_lock);
+}
 
+void FS_SetStatsTiming(int on)
+{
+  __atomic_store_n(&stats_timing, on ? 1 : 0, __ATOMIC_RELAXED);
+}
 
+void FS_SetTrace(int on)
+{
+  __atomic_store_n(&trace_on, on ? 1 : 0, __ATOMIC_RELAXED);
+}
 
-int FS_Sync()
+int FS_TraceDump(char* file)
 {
-  if(Disk_Save(bs_filename) < 0) {
-    // if can't write to file, something's wrong with the backstore
-    dprintf("FS_Sync():\n... failed to save disk to file '%s'\n", bs_filename);
+  if(trace_dump(file) < 0) {
     osErrno = E_GENERAL;
     return -1;
-  } else {
-    // everything's good now, sync is successful
-    dprintf("FS_Sync():\n... successfully saved disk to file '%s'\n", bs_filename);
-    return 0;
-  }  
+  }
+  return 0;
+}
+
+void FS_SetTraceDumpOnError(int on, char* file)
+{
+  trace_dump_on_error = 0;
+  snprintf(trace_dump_file, sizeof(trace_dump_file), "%s", file ? file : "");
+  trace_dump_on_error = on;
+  if(on) FS_SetTrace(1); // there'd be nothing to dump otherwise
 }
 
 
@@ -976,7 +3559,9 @@ int FS_Sync()
 
 int File_Create(char* file)
 {
+  STATS_OP(FS_OP_FILE_CREATE);
   dprintf("File_Create('%s'):\n", file);
+  if(check_writable() < 0) return -1;
   return create_file_or_directory(0, file);
 }
 
@@ -987,13 +3572,15 @@ int File_Create(char* file)
 
 int File_Unlink(char* file)
 {
+	STATS_OP(FS_OP_FILE_UNLINK);
 	dprintf("File_Unlink(%s):\n", file);
+	if(check_writable() < 0) return -1;
 	
 	int child_inode;
 	char last_filename[MAX_NAME];
 	
-	// Get father inode
-	int parent_inode = follow_path(file, &child_inode, last_filename);   
+	// Get father inode, locked so that the file can't be opened meanwhile
+	int parent_inode = follow_path(file, &child_inode, last_filename, LOCK_WRITE);   
   
 	// If father found
 	if(parent_inode >= 0) 
@@ -1004,12 +3591,20 @@ int File_Unlink(char* file)
 			// If file is already open
 			if(is_file_open(child_inode) == 1)
 			{     
+				inode_unlock(parent_inode);
 				osErrno = E_FILE_IN_USE;    
 				return -1;    
 			}
       
 			int result;
-			result = remove_inode(0, parent_inode, child_inode); 
+			// Wait for anyone still looking inside the child
+			inode_lock(child_inode, LOCK_WRITE);
+			journal_make_room();
+			pthread_rwlock_rdlock(&sync_lock);
+			result = remove_inode(0, parent_inode, child_inode, last_filename); 
+			pthread_rwlock_unlock(&sync_lock);
+			inode_unlock(child_inode);
+			inode_unlock(parent_inode);
       
 			switch(result)
 			{
@@ -1032,6 +3627,7 @@ int File_Unlink(char* file)
 		}
 		else
 		{
+			inode_unlock(parent_inode);
 			dprintf("File %s does not exist\n", file);
 			osErrno = E_NO_SUCH_FILE;
 			return -1;
@@ -1057,47 +3653,39 @@ int File_Unlink(char* file)
 
 int File_Open(char* file)
 {
+  STATS_OP(FS_OP_FILE_OPEN);
   dprintf("File_Open('%s'):\n", file);
-  int fd = new_file_fd();
-  if(fd < 0) {
-    dprintf("... max open files reached\n");
-    osErrno = E_TOO_MANY_OPEN_FILES;
-    return -1;
-  }
 
+  // the parent stays locked until the file is in the open file
+  // table, so that it can't be unlinked meanwhile
   int child_inode;
-  follow_path(file, &child_inode, NULL);
-  if(child_inode >= 0) { // child is the one
-    // load the disk sector containing the inode
-    int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-    if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
-    dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
-
-    // get the inode
-    int inode_start_index = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-    int offset = child_inode-inode_start_index;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-    dprintf("... inode %d (size=%d, type=%d)\n",
-	    child_inode, child->size, child->type);
-
-    if(child->type != 0) {
-      dprintf("... error: '%s' is not a file\n", file);
-      osErrno = E_GENERAL;
-      return -1;
-    }
-
-    // initialize open file entry and return its index
-    open_files[fd].inode = child_inode;
-    open_files[fd].size = child->size;
-    open_files[fd].pos = 0;
-    return fd;
-  } else {
+  int parent_inode = follow_path(file, &child_inode, NULL, LOCK_READ);
+  if(parent_inode < 0 || child_inode < 0) {
+    if(parent_inode >= 0) inode_unlock(parent_inode);
     dprintf("... file '%s' is not found\n", file);
     osErrno = E_NO_SUCH_FILE;
     return -1;
   }  
+
+  // get the inode (the root directory is locked already)
+  if(child_inode != parent_inode) inode_lock(child_inode, LOCK_READ);
+  inode_t* child = get_inode(child_inode);
+  int type = child ? child->type : -1;
+  if(child) dprintf("... inode %d (size=%d, type=%d)\n",
+		    child_inode, child->size, child->type);
+  if(child_inode != parent_inode) inode_unlock(child_inode);
+
+  int fd = -1;
+  if(!child) osErrno = E_GENERAL;
+  else if(type != 0) {
+    dprintf("... error: '%s' is not a file\n", file);
+    osErrno = E_GENERAL;
+  } else if((fd = new_file_fd(child_inode)) < 0) {
+    dprintf("... max open files reached\n");
+    osErrno = E_TOO_MANY_OPEN_FILES;
+  }
+  inode_unlock(parent_inode);
+  return fd;
 }
 
 
@@ -1107,48 +3695,25 @@ int File_Open(char* file)
 
 
 
-int File_Read(int fd, void* buffer, int size)
+// read up to 'size' bytes of the file pointed to by 'child_inode',
+// starting from byte 'offset', into 'buffer'; the caller has locked
+// the inode (at least for reading); return the number of bytes read,
+// or -1 on error
+static int file_read_at(int child_inode, void* buffer, int size, int offset)
 {
-  
-	dprintf("Reading file... \n");
-	
 	int i;
  
-	// Check if file open
-	if(is_file_open(open_files[fd].inode) != 1)
-	{		
-        osErrno = E_BAD_FD;
-        return -1; 
-    }
-
-	dprintf("open_files.nodes = %d and size %d  and initial position %d \n", open_files[fd].inode, open_files[fd].size, open_files[fd].pos );
-	
-	// Position at which read ends
-	int end_of_read = (open_files[fd].pos + size);
+	dprintf("open_files.nodes = %d and initial position %d \n", child_inode, offset);
+	TRACE(TRACE_IO, child_inode, offset, size, 0);
 	
-	// If reading past the file size, read until EOF
-	if(end_of_read > open_files[fd].size)
-	{ 
-		end_of_read = (open_files[fd].size);
-	}
-
   	// Get child inode
-	int child_inode = open_files[fd].inode;		
-	int inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR; 
-	char inode_buffer[SECTOR_SIZE];
+	inode_t* child = get_inode(child_inode);
 	
-	if(Disk_Read(inode_sector, inode_buffer) < 0) 
+	if(!child) 
+	{
+		osErrno = E_GENERAL;
 		return -1;
-		
-	dprintf("Load inode table for child inode from disk sector %d\n", inode_sector);
-
-	// Get the position we start reading data from 
-	int inode_start_index = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-	int offset = child_inode - inode_start_index;
-	
-	assert(0 <= offset && offset < INODES_PER_SECTOR);
-	
-	inode_t* child = (inode_t*)(inode_buffer + offset * sizeof(inode_t));
+	}
 
 	// If child is not a file
 	if(child->type != 0) 
@@ -1160,71 +3725,133 @@ int File_Read(int fd, void* buffer, int size)
 
 	dprintf("Reading inode: %d, size: %d, type: %d\n", child_inode, child->size, child->type);	
  
-	int bytes_to_read = end_of_read - open_files[fd].pos;       // Number of bytes we have to read
-	int bytes_read = bytes_to_read;   							// Number of bytes that have been read                                 
-
-	int offset_sector_toLoad = open_files[fd].pos / SECTOR_SIZE;  // Starting index of data sectors to be loaded for the read 
-	int sector_index = open_files[fd].pos % SECTOR_SIZE;       	// Number of bytes to read in first sector
+	// Position at which read ends
+	int end_of_read = (offset + size);
 
-	
-	// Number of bytes to read inside a sector
-	int sector_bytes = bytes_to_read < SECTOR_SIZE? bytes_to_read: SECTOR_SIZE - sector_index; 
-	
-	int buffer_index = 0; 
-  
-	// Number of sectors to read
-	int sectors_to_read = (end_of_read - (SECTOR_SIZE - sector_index)) / SECTOR_SIZE;    
+	// If reading past the file size, read until EOF
+	if(end_of_read > child->size)
+	{ 
+		end_of_read = child->size;
+	}
 
-	char buffer[SECTOR_SIZE];
-  
-	if(open_files[fd].size <= open_files[fd].pos)
+	if(end_of_read <= offset)
 	{
          dprintf("Pointer is at EOF\n");
           return 0;
     }
 
-	// Loop through all file data
-	for(i = offset_sector_toLoad; i < offset_sector_toLoad + sectors_to_read + 1; i++)
+	int bytes_read = end_of_read - offset;				// Number of bytes that will be read
+
+	// Inline data is right there in the inode
+	if(child->index == INLINE_DATA)
+	{
+		memcpy(buffer, child->inline_data + offset, bytes_read);
+		thread_bytes_copied += bytes_read;
+		return bytes_read;
+	}
+
+	int first_sector = offset / SECTOR_SIZE;			// Index of the first data sector read
+	int end_sector = (end_of_read + SECTOR_SIZE - 1) / SECTOR_SIZE;	// One past the last data sector read
+	
+	int buffer_index = 0; 
+	int sectors[BLOCK_MAP_CHUNK];				// Sectors of the data blocks looked up last
+	int mapped_first = 0, mapped_count = 0;
+  
+	// Loop through all sectors touched by the read
+	for(i = first_sector; i < end_sector; i++)
 	{       
+		// Look up the sectors of the next chunk of blocks once past the current one
+		if(i >= mapped_first + mapped_count)
+		{
+			mapped_first = i;
+			mapped_count = (end_sector - i < BLOCK_MAP_CHUNK)? end_sector - i : BLOCK_MAP_CHUNK;
+			
+			if(file_map_blocks(child, mapped_first, mapped_count, sectors, 0) < 0)
+			{
+				dprintf("Failed to look up data blocks %d-%d\n", mapped_first, mapped_first + mapped_count - 1);
+				osErrno = E_GENERAL;
+				return -1;
+			}
+		}
+		int sector = sectors[i - mapped_first];
 
-		 // Check if file too large
-		if(i > MAX_SECTORS_PER_FILE)
-		{ 
-			osErrno = E_FILE_TOO_BIG;
-			return -1;              
-		}   
-
-		if(Disk_Read(child->data[i], buffer) == 0)
-		{       
-
-			//Read from memory to buffer
-			if(memcpy(buffer + buffer_index, buffer + sector_index , sector_bytes) == NULL) 
-				return -1; 			
-       
-			// Update file position
-			open_files[fd].pos +=  sector_bytes;        
+		int sector_index = (i == first_sector)? offset % SECTOR_SIZE : 0;	// Where the read starts in this sector
+		int sector_bytes = SECTOR_SIZE - sector_index;									// Number of bytes to read in this sector
+
+		if(sector_bytes > bytes_read - buffer_index)
+			sector_bytes = bytes_read - buffer_index;
+
+		// Whole sectors are copied straight into the user buffer, as many in one call as possible
+		if(sector_bytes == SECTOR_SIZE)
+		{
+			int n = (bytes_read - buffer_index) / SECTOR_SIZE;
 			
-			// Update buffer index
-			buffer_index += sector_bytes; 
+			if(n > mapped_first + mapped_count - i)
+				n = mapped_first + mapped_count - i;
 			
-			bytes_to_read -= sector_bytes;
-			sector_bytes = bytes_to_read < SECTOR_SIZE? bytes_to_read: SECTOR_SIZE; 
-
+			if(Cache_ReadMulti(&sectors[i - mapped_first], n, (char*)buffer + buffer_index) < 0)
+			{
+				dprintf("Failed to read sectors %d-%d of the file\n", i, i + n - 1);
+				osErrno = E_GENERAL; 
+				return -1; 
+			}
+			
+			buffer_index += n * SECTOR_SIZE;
+			i += n - 1;
+			continue;
 		}
-		else
+
+		char* block = Cache_Pin(sector, 0);
+		if(block == NULL)
 		{
-			dprintf("Failed to read sector %d\n", child->data[i]);
+			dprintf("Failed to read sector %d\n", sector);
 			osErrno = E_GENERAL; 
 			return -1; 
 		}    
+
+		// Copy from the cached sector to user buffer
+		memcpy((char*)buffer + buffer_index, block + sector_index, sector_bytes);
+		buffer_index += sector_bytes; 
+		Cache_Unpin(block, 0);
 	}
   
 	dprintf("Total bytes read: %d\n", bytes_read );
+	thread_bytes_copied += bytes_read;
 	
 	return bytes_read; 
 }
 
+int File_Read(int fd, void* buffer, int size)
+{
+	STATS_OP(FS_OP_FILE_READ);
+  
+	dprintf("Reading file... \n");
+ 
+	// Check if file open
+	int child_inode;
+	open_file_t* of = lock_open_file(fd, &child_inode);
+	
+	if(!of)
+	{		
+        osErrno = E_BAD_FD;
+        return -1; 
+    }
 
+	// Other readers of the same file may go on at the same time
+	inode_lock(child_inode, LOCK_READ);
+	int bytes_read = file_read_at(child_inode, buffer, size, of->pos);
+	if(bytes_read >= 0)
+		file_read_ahead(of, child_inode, of->pos, bytes_read);
+	inode_unlock(child_inode);
+  
+	// Update file position
+	if(bytes_read > 0)
+		of->pos += bytes_read;
+  
+	pthread_mutex_unlock(&of->lock);
+	
+	return bytes_read; 
+}
 
 
 
@@ -1232,43 +3859,35 @@ int File_Read(int fd, void* buffer, int size)
 
 
 
-int File_Write(int fd, void* buffer, int size)
-{
-	dprintf("Writing file...\n");
 
-	// Check if file is open
-	if(is_file_open(open_files[fd].inode) != 1)
-	{ 
-        osErrno = E_BAD_FD;
-        return -1;              
-	}
 
-	dprintf("open_files.nodes: %d\n", open_files[fd].inode);
+// write 'size' bytes from 'buffer' to the file pointed to by
+// 'child_inode', starting from byte 'offset'; the caller has locked
+// the inode for writing; return the number of bytes written, or -1 on
+// error
+static int file_write_at(int child_inode, void* buffer, int size, int offset)
+{
+	dprintf("open_files.nodes: %d\n", child_inode);
+	TRACE(TRACE_IO, child_inode, offset, size, 1);
+
+	if(size <= 0)
+		return 0;
 
 	// If file is too big
-	if(open_files[fd].size + size > MAX_FILE_SIZE)
+	if(size > MAX_FILE_SIZE - offset)
 	{
 		osErrno=E_FILE_TOO_BIG;
 		return -1;              
 	}
   
 	// Get child inode
-	int child_inode = open_files[fd].inode;
-	int inode_sector = INODE_TABLE_START_SECTOR + child_inode / INODES_PER_SECTOR;
-	char inode_buffer[SECTOR_SIZE];
+	inode_t* child = get_inode(child_inode);
 	
-	if(Disk_Read(inode_sector, inode_buffer) < 0)
+	if(!child)
+	{
+		osErrno = E_GENERAL;
 		return -1;
-    
-	dprintf("Load inode table for child inode from disk sector: %d\n", inode_sector);
-
-	// Get position to start writing to 
-	int inode_start_index = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-	int offset = child_inode - inode_start_index;
-	
-	assert(0 <= offset && offset < INODES_PER_SECTOR);
-	
-	inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
+	}
 
 	// If inode not a file
 	if(child->type != 0) 
@@ -1278,96 +3897,286 @@ int File_Write(int fd, void* buffer, int size)
 		return -1;
 	}	
 
-	dprintf("Attempting to write inode: %d, size: %d, type: %d\n", child_inode, child->size, child->type);
-	
-	int offset_sector_toLoad = open_files[fd].pos / SECTOR_SIZE;          
-	int sector_index = open_files[fd].pos % SECTOR_SIZE;         	// Number of bytes to write in first sector
+	dprintf("Attempting to write inode: %d, size: %d, type: %d\n", child_inode, child->size, child->type);
+	
+	// Files have no holes, so a write can't start past the end of the file
+	if(offset > child->size)
+	{
+		osErrno = E_SEEK_OUT_OF_BOUNDS;
+		return -1;
+	}
+	
+	int end_of_write = offset + size;					// Position at which the write ends
+
+	// Inline data stays inline as long as it fits, and otherwise moves to a data block first
+	if(child->index == INLINE_DATA)
+	{
+		if(end_of_write <= INLINE_DATA_SIZE)
+		{
+			memcpy(child->inline_data + offset, buffer, size);
+			if(end_of_write > child->size)
+				child->size = end_of_write;
+			inode_dirty(child_inode);
+			thread_bytes_copied += size;
+			return size;
+		}
+		if(file_uninline(child) < 0)
+		{
+			dprintf("ERROR: Disk is full\n");
+			osErrno = E_NO_SPACE;
+			return -1;
+		}
+		inode_dirty(child_inode);
+	}
+
+	int first_sector = offset / SECTOR_SIZE;			// Index of the first data sector written
+	int end_sector = (end_of_write + SECTOR_SIZE - 1) / SECTOR_SIZE;	// One past the last data sector written
+	int old_sectors = (child->size + SECTOR_SIZE - 1) / SECTOR_SIZE;	// Number of data sectors the file had
+
+	// Reserve all the sectors this write adds to the file up front, in as few contiguous runs as possible
+	if(reserve_file_sectors(child, end_sector) < 0)
+	{
+		inode_dirty(child_inode);	// Pointer sectors may have been added all the same
+		dprintf("ERROR: Disk is full\n");
+		osErrno = E_NO_SPACE;
+		return -1;
+	}
+
+	int buffer_index = 0;
+	int sectors[BLOCK_MAP_CHUNK];				// Sectors of the data blocks looked up last
+	int mapped_first = 0, mapped_count = 0;
+	
+	int i;
+  
+	// Loop through all sectors touched by the write
+	for(i = first_sector; i < end_sector; i++)
+	{       
+		// Look up the sectors of the next chunk of blocks once past the current one
+		if(i >= mapped_first + mapped_count)
+		{
+			mapped_first = i;
+			mapped_count = (end_sector - i < BLOCK_MAP_CHUNK)? end_sector - i : BLOCK_MAP_CHUNK;
+			
+			if(file_map_blocks(child, mapped_first, mapped_count, sectors, 0) < 0)
+			{
+				dprintf("Failed to look up data blocks %d-%d\n", mapped_first, mapped_first + mapped_count - 1);
+				osErrno = E_GENERAL;
+				return -1;
+			}
+		}
+		int sector = sectors[i - mapped_first];
+
+		int sector_index = (i == first_sector)? offset % SECTOR_SIZE : 0;	// Where the write starts in this sector
+		int sector_bytes = SECTOR_SIZE - sector_index;									// Number of bytes to write in this sector
+    
+		if(sector_bytes > size - buffer_index)
+			sector_bytes = size - buffer_index;
+		
+		// Whole sectors are copied straight from the user buffer, as many in one call as possible; there
+		// is nothing in them to preserve, so they are not read first
+		if(sector_bytes == SECTOR_SIZE)
+		{
+			int n = (size - buffer_index) / SECTOR_SIZE;
+			
+			if(n > mapped_first + mapped_count - i)
+				n = mapped_first + mapped_count - i;
+			
+			dprintf("Writing whole disk sectors for index: %d-%d\n", i, i + n - 1);
+			
+			if(Cache_WriteMulti(&sectors[i - mapped_first], n, (char*)buffer + buffer_index) < 0)
+			{
+				dprintf("Failed to write sectors %d-%d of the file\n", i, i + n - 1); 
+				osErrno = E_GENERAL;
+				return -1;  
+			}
+			
+			buffer_index += n * SECTOR_SIZE;
+			i += n - 1;
+			continue;
+		}
+		
+		dprintf("Writing bytes into disk sector: %d, index: %d\n" , sector, i);
+     
+		// Pin the sector in the block cache, reading it from disk unless it was just added to the file
+		char* block = Cache_Pin(sector, (i >= old_sectors)? CACHE_NOREAD : 0);
+		if(block == NULL)
+		{
+			dprintf("Failed to read sector: %d\n", sector);
+			osErrno = E_GENERAL; 
+			return -1; 
+		}    
+		if(i >= old_sectors)
+		{
+			memset(block, 0, SECTOR_SIZE);
+		}
+
+		// Copy from user buffer into the cached sector, which is written back later
+		memcpy(block + sector_index, (char*)buffer + buffer_index, sector_bytes);
+		buffer_index += sector_bytes;
+		Cache_Unpin(block, 1);
+	}
+
+	// Write success
+	if(end_of_write > child->size)
+		child->size = end_of_write;
+	inode_dirty(child_inode);
+
+    dprintf("Final index of pointer inside file: %d\n", end_of_write);
+	thread_bytes_copied += size;
+	
+	return size;
+}
+
+// Write 'size' bytes from 'buffer' to the file pointed to by
+// 'child_inode' at byte 'offset', in chunks each making room in the
+// journal first (see journal_make_room); a chunk adds no more pointer
+// sectors than an eighth of the cache, so that no write changes more
+// metadata than the cache can hold (the sectors held for the journal
+// can't be evicted), and with a cache of the default size no file is
+// larger than a chunk; a chunk short of space is tried again once
+// after a commit if sectors given back are waiting for one; the
+// caller has locked the inode for writing; return the number of bytes
+// written, or -1 if none could be written
+static int file_write_chunks(int child_inode, void* buffer, int size, int offset)
+{
+	int done = 0, retried = 0;
+	int pointers = Cache_GetCapacity() / 8;
+	long long chunk_size = (long long)(pointers > 0? pointers : 1) * POINTERS_PER_SECTOR * SECTOR_SIZE;
+	
+	// A write that can't be made whole isn't started
+	if(size > MAX_FILE_SIZE - offset)
+	{
+		osErrno = E_FILE_TOO_BIG;
+		return -1;
+	}
+	
+	do
+	{
+		long long chunk = chunk_size - (offset + done) % chunk_size;
+		if(chunk > size - done)
+			chunk = size - done;
+		
+		journal_make_room();
+		pthread_rwlock_rdlock(&sync_lock);
+		int n = file_write_at(child_inode, (char*)buffer + done, (int)chunk, offset + done);
+		pthread_rwlock_unlock(&sync_lock);
+		
+		// The sectors given back since the last commit are free once it's made
+		if(n < 0 && osErrno == E_NO_SPACE && !retried && freed_sectors_pending() && fs_sync() == 0)
+		{
+			retried = 1;
+			continue;
+		}
+		if(n < 0)
+			return (done > 0)? done : -1;
+		done += n;
+		retried = 0;
+	} while(done < size);
+	
+	return done;
+}
+
+int File_Write(int fd, void* buffer, int size)
+{
+	STATS_OP(FS_OP_FILE_WRITE);
+	dprintf("Writing file...\n");
+	if(check_writable() < 0) return -1;
+
+	// Check if file is open
+	int child_inode;
+	open_file_t* of = lock_open_file(fd, &child_inode);
+	
+	if(!of)
+	{ 
+        osErrno = E_BAD_FD;
+        return -1;              
+	}
+
+	// Nobody else may read or write the file meanwhile
+	inode_lock(child_inode, LOCK_WRITE);
+	int bytes_written = file_write_chunks(child_inode, buffer, size, of->pos);
+	inode_unlock(child_inode);
+	
+	// Update file position
+	if(bytes_written > 0)
+		of->pos += bytes_written;
+	
+	pthread_mutex_unlock(&of->lock);
+	
+	return bytes_written;
+}
+
+
+
+
+
+
+
+
+
+int File_PRead(int fd, void* buffer, int size, int offset)
+{
+	STATS_OP(FS_OP_FILE_PREAD);
+	dprintf("Reading file at offset %d...\n", offset);
+
+	// Check if file open
+	int child_inode = open_file_inode(fd);
+	
+	if(child_inode < 0)
+	{
+		osErrno = E_BAD_FD;
+		return -1;
+	}
+
+	if(offset < 0)
+	{
+		osErrno = E_SEEK_OUT_OF_BOUNDS;
+		return -1;
+	}
+
+	// The file position isn't used, so the fd isn't locked; any number of threads can read at once
+	inode_lock(child_inode, LOCK_READ);
+	int bytes_read = file_read_at(child_inode, buffer, size, offset);
+	inode_unlock(child_inode);
+
+	return bytes_read;
+}
+
 
 
-	int remainder_bytes = (MAX_FILE_SIZE < open_files[fd].pos + size)? MAX_FILE_SIZE - open_files[fd].pos : size;
-	int sector_bytes = SECTOR_SIZE - sector_index;
-	int buffer_index = 0;
-  
-	// Number of sectors we need to write (after initial sector)
-	int sectors_to_write = (size - (SECTOR_SIZE - sector_index)) / SECTOR_SIZE;             
 
-	char buffer[SECTOR_SIZE];	// Holds all file data
-	
-	int i;
-  
-	// Loop through all file data
-	for(i = offset_sector_toLoad; i < sectors_to_write + 1; i++)
-	{       
-    
-		// If file too large
-		if(i > MAX_SECTORS_PER_FILE)
-		{ 
-			osErrno = E_FILE_TOO_BIG;
-			return -1;             
-		}
-    
-		// Sector not being used; initialize it
-		if(child->data[i] == 0)
-		{    
-			// Request a new sector
-			child->data[i] = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);    
-			
-			if(child->data[i] < 0) 
-			{
-				dprintf("ERROR: Disk is full\n");
-				osErrno = E_NO_SPACE;
-				return -1;
-			}
-		}
-		
-		dprintf("Writing bytes into disk sector: %d, index: %d\n" , child->data[i], i);
-     
-		// Read data from disk
-		if(Disk_Read(child->data[i], buffer) == 0)
-		{          
-			// Copy from buffer to memory sector
-			if(memcpy(buffer + sector_index , buffer + buffer_index, sector_bytes) == NULL) 
-				return -1;
-			
-			open_files[fd].pos += sector_bytes;
-			buffer_index += sector_bytes;
-			remainder_bytes -= sector_bytes;
-			sector_bytes = remainder_bytes < SECTOR_SIZE? remainder_bytes: SECTOR_SIZE;
 
-			// Write back to memory sector
-			if(Disk_Write(child->data[i], buffer) < 0) 
-			{
-				dprintf("Failed to write sector: %d\n", child->data[i]); 
-				osErrno = E_GENERAL;
-				return -1;  
-			}
 
-		}
-		else
-		{
-			dprintf("Failed to read sector: %d\n", child->data[i]);
-			osErrno = E_GENERAL; 
-			return -1; 
-		}    
-	}
 
-	// Write success
-	open_files[fd].size = open_files[fd].pos;
-	child->size =  open_files[fd].pos;
 
-	// Write inode sector back to disk
-	if(Disk_Write(inode_sector, inode_buffer) < 0) 
+
+int File_PWrite(int fd, void* buffer, int size, int offset)
+{
+	STATS_OP(FS_OP_FILE_PWRITE);
+	dprintf("Writing file at offset %d...\n", offset);
+	if(check_writable() < 0) return -1;
+
+	// Check if file open
+	int child_inode = open_file_inode(fd);
+	
+	if(child_inode < 0)
+	{
+		osErrno = E_BAD_FD;
+		return -1;
+	}
+
+	if(offset < 0)
 	{
-        dprintf("Failed to write sector: %d\n", inode_sector);     
-		osErrno = E_GENERAL;
-        return -1;  
+		osErrno = E_SEEK_OUT_OF_BOUNDS;
+		return -1;
 	}
-  
-	dprintf("Successfully wrote inode sector: %d\n", inode_sector );
 
-    dprintf("Final index of pointer inside file: %d\n", open_files[fd].pos);
+	// The file position isn't used, so only the file itself is locked
+	inode_lock(child_inode, LOCK_WRITE);
+	int bytes_written = file_write_chunks(child_inode, buffer, size, offset);
+	inode_unlock(child_inode);
 	
-	return size;
+	return bytes_written;
 }
 
 
@@ -1380,24 +4189,42 @@ int File_Write(int fd, void* buffer, int size)
 
 int File_Seek(int fd, int offset)
 {
+	STATS_OP(FS_OP_FILE_SEEK);
 	// Check if file open
-	if(is_file_open(open_files[fd].inode) != 1)
+	int child_inode;
+	open_file_t* of = lock_open_file(fd, &child_inode);
+	
+	if(!of)
 	{ 
         osErrno = E_BAD_FD;
         return -1; 
 	}
 
-	dprintf("File Seek: open_files[%d].size = %d\n",fd, open_files[fd].size);
+	inode_lock(child_inode, LOCK_READ);
+	inode_t* child = get_inode(child_inode);
+	int file_size = child ? child->size : -1;
+	inode_unlock(child_inode);
+	
+	if(!child)
+	{
+		pthread_mutex_unlock(&of->lock);
+		osErrno = E_GENERAL;
+		return -1;
+	}
+
+	dprintf("File Seek: open_files[%d].size = %d\n",fd, file_size);
 	
-	if(open_files[fd].size < offset || open_files[fd].size < 0)
+	if(file_size < offset || offset < 0)
 	{	
+		pthread_mutex_unlock(&of->lock);
 		osErrno = E_SEEK_OUT_OF_BOUNDS;
 		return -1;
 	}
   
-	open_files[fd].pos = offset;	
+	of->pos = offset;	
+	pthread_mutex_unlock(&of->lock);
 	
-	return open_files[fd].pos;  
+	return offset;  
 }
 
 
@@ -1408,20 +4235,21 @@ int File_Seek(int fd, int offset)
 
 int File_Close(int fd)
 {
+  STATS_OP(FS_OP_FILE_CLOSE);
   dprintf("File_Close(%d):\n", fd);
-  if(0 > fd || fd > MAX_OPEN_FILES) {
-    dprintf("... fd=%d out of bound\n", fd);
-    osErrno = E_BAD_FD;
-    return -1;
-  }
-  if(open_files[fd].inode <= 0) {
-    dprintf("... fd=%d not an open file\n", fd);
+  int inode;
+  open_file_t* of = lock_open_file(fd, &inode);
+  if(!of) {
     osErrno = E_BAD_FD;
     return -1;
   }
 
   dprintf("... file closed successfully\n");
-  open_files[fd].inode = 0;
+  of->pos = 0;
+  of->ra_next = of->ra_end = of->ra_window = 0;
+  __atomic_store_n(&of->inode, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&of->lock);
+  free_file_fd(fd, inode);
   return 0;
 }
 
@@ -1432,7 +4260,9 @@ int File_Close(int fd)
 
 int Dir_Create(char* path)
 {
+  STATS_OP(FS_OP_DIR_CREATE);
   dprintf("Dir_Create('%s'):\n", path);
+  if(check_writable() < 0) return -1;
   return create_file_or_directory(1, path);
 }
 
@@ -1444,24 +4274,49 @@ int Dir_Create(char* path)
 
 int Dir_Unlink(char* path)
 {   
+	STATS_OP(FS_OP_DIR_UNLINK);
 	dprintf("Dir_Unlink(%s):\n", path);
+	if(check_writable() < 0) return -1;
   
 	int child_inode;
 	char last_filename[MAX_NAME];	// last filename
 	
 	// Get father inode
-	int parent_inode = follow_path(path, &child_inode, last_filename);  
+	int parent_inode = follow_path(path, &child_inode, last_filename, LOCK_WRITE);  
   
 	// Father found
 	if(parent_inode >= 0) 
 	{          
+		// The root directory can't be removed
+		if(child_inode == parent_inode)
+		{
+			inode_unlock(parent_inode);
+			osErrno = E_ROOT_DIR;
+			return -1;
+		}
+
 		// Child found
 		if(child_inode >= 0) 
 		{          
+			// If directory is open for listing
+			if(is_file_open(child_inode) == 1)
+			{
+				inode_unlock(parent_inode);
+				osErrno = E_FILE_IN_USE;
+				return -1;
+			}
+
 			int result;
 			
 			// Remove the inode
-			result = remove_inode(1, parent_inode, child_inode); 
+			// Wait for anyone still looking inside the child
+			inode_lock(child_inode, LOCK_WRITE);
+			journal_make_room();
+			pthread_rwlock_rdlock(&sync_lock);
+			result = remove_inode(1, parent_inode, child_inode, last_filename); 
+			pthread_rwlock_unlock(&sync_lock);
+			inode_unlock(child_inode);
+			inode_unlock(parent_inode);
       
 			switch(result)
 			{
@@ -1484,6 +4339,7 @@ int Dir_Unlink(char* path)
 		}
 		else
 		{
+			inode_unlock(parent_inode);
 			dprintf("Directory %s doesn't exist, delete failed\n", path);
 			osErrno = E_NO_SUCH_DIR;
 			return -1;
@@ -1509,52 +4365,52 @@ int Dir_Unlink(char* path)
 
 int Dir_Size(char* path)
 {
+	STATS_OP(FS_OP_DIR_SIZE);
 	int child_inode;
 	
 	char last_filename[MAX_NAME];
 	
-	follow_path(path, &child_inode, last_filename);  
+	int parent_inode = follow_path(path, &child_inode, last_filename, LOCK_READ);  
   
 	// If child exists
-	if(child_inode >= 0) 
+	if(parent_inode >= 0 && child_inode >= 0) 
 	{        
 		dprintf("Found file: %s at inode: %d\n", path, child_inode); 
      
-		// Load sector that has inode
-		int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-		char inode_buffer[SECTOR_SIZE];
+		// Get inode (the root directory is locked already)
+		if(child_inode != parent_inode)
+		{
+			inode_lock(child_inode, LOCK_READ);
+			inode_unlock(parent_inode);
+		}
+		
+		inode_t* child = get_inode(child_inode);
+		int result = -1;
 		
-		if(Disk_Read(inode_sector, inode_buffer) < 0) 
+		if(!child) 
 		{ 
 			osErrno = E_GENERAL; 
-			return -1; 
 		}
-		
-		dprintf("Load inode table for inode from disk sector: %d\n", inode_sector);
-	
-		int inode_start_index = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-		int offset = child_inode - inode_start_index;
-		
-		assert(0 <= offset && offset < INODES_PER_SECTOR);
-		
-		inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-		
-		dprintf("Inode: %d, size: %d, type: %d\n", child_inode, child->size, child->type);
-
-		// If inode is a file
-		if(child->type == 0) 
+		else if(child->type == 0) 
 		{     
+			// If inode is a file
 			dprintf("ERROR: inode found is a file, not a directory: %s\n", path);
 			osErrno = E_GENERAL;
-			return -1;
 		}
-
-		// We know inode is a directory, so return it's size
-		return child->size * (sizeof(dirent_t));
-
+		else
+		{
+			// We know inode is a directory, so return it's size
+			dprintf("Inode: %d, size: %d, type: %d\n", child_inode, child->size, child->type);
+			result = child->size * (sizeof(dirent_t));
+		}
+		
+		inode_unlock(child_inode);
+		return result;
 	}
 	else 
 	{
+		if(parent_inode >= 0)
+			inode_unlock(parent_inode);
 		dprintf("Couldn't find file: %s\n", path);
 		osErrno = E_GENERAL;
 		return -1;
@@ -1569,94 +4425,370 @@ int Dir_Size(char* path)
 
 
 
-int Dir_Read(char* path, void* buffer, int size)
+// copy the directory entries of the directory pointed to by
+// 'child_inode' into 'buffer'; the caller has locked the inode (at
+// least for reading); return the number of entries, or -1 on error
+static int read_dir_entries(int child_inode, void* buffer, int size)
 {
- 
-	//First we need to get the child inode referenced by path
-	int child_inode;
-	char last_filename[MAX_NAME];
-	
-	follow_path(path, &child_inode, last_filename);  
-	
 	int counter = 0;              //This counter will keep track of how many dirent we have visited
   
 	dirent_t* current_dirent;
 
-	// If child exists
-	if(child_inode >= 0) 
-	{        
-		// Check if size big enough for dirent objects
-		if(size < Dir_Size(path))
-		{      
-			dprintf("Buffer size: %d is too small for dierectory\n", size);
-			osErrno = E_BUFFER_TOO_SMALL;
-			return -1;
-		}
+	// Get inode
+	inode_t* child = get_inode(child_inode);
+	
+	if(!child) 
+	{ 
+		osErrno = E_GENERAL; 
+		return -1; 
+	}
+	
+	dprintf("Inode: %d, size: %d, type: %d\n", child_inode, child->size, child->type);
 
-		// Load disk sector that has inode
-		int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-		char inode_buffer[SECTOR_SIZE];
-		
-		if(Disk_Read(inode_sector, inode_buffer) < 0) 
+	// If inode is a file
+	if(child->type == 0)
+	{
+		dprintf("ERROR: inode found is a file, not a directory\n");
+		osErrno = E_GENERAL;
+		return -1;
+	}
+
+	// Check if size big enough for dirent objects
+	if(size < child->size * (int)sizeof(dirent_t))
+	{      
+		dprintf("Buffer size: %d is too small for dierectory\n", size);
+		osErrno = E_BUFFER_TOO_SMALL;
+		return -1;
+	}
+     
+	int i;
+    
+	for(i = 0; i < DIRECT_SECTORS_PER_FILE; i++)
+	{     
+		char data_buffer[SECTOR_SIZE];
+        
+		// Read data from disk to sector
+		if(Cache_Read(child->data[i], data_buffer) < 0) 
 		{ 
 			osErrno = E_GENERAL; 
 			return -1; 
-		}
-      
-		dprintf("Load inode table for inode from disk sector: %d\n", inode_sector);
-
-		// Get inode
-		int inode_start_index = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-		int offset = child_inode - inode_start_index;
-		
-		assert(0 <= offset && offset < INODES_PER_SECTOR);
+		}  
 		
-		inode_t* child = (inode_t*)(inode_buffer + offset * sizeof(inode_t));
+		dprintf("Load data from disk sector: %d\n", child->data[i]);
 		
-		dprintf("Inode: %d, size: %d, type: %d\n", child_inode, child->size, child->type);
-
-     
+		int j;
 		
-		int i;
-    
-		for(i = 0; i < MAX_SECTORS_PER_FILE; i++)
-		{     
-			char data_buffer[SECTOR_SIZE];
-        
-			// Read data from disk to sector
-			if(Disk_Read(child->data[i], data_buffer) < 0) 
-			{ 
-				osErrno = E_GENERAL; 
-				return -1; 
-			}  
-			
-			dprintf("Load data from disk sector: %d\n", child->data[i]);
-			
-			int j;
-			
-			// Loop through all dirents in the directory
-			for(j = 0; ((j < DIRENTS_PER_SECTOR) && (counter < child->size)); j++)
-			{   
-				current_dirent = (dirent_t*)(data_buffer + j * sizeof(dirent_t));              
+		// Loop through all dirents in the directory
+		for(j = 0; ((j < DIRENTS_PER_SECTOR) && (counter < child->size)); j++)
+		{   
+			current_dirent = (dirent_t*)(data_buffer + j * sizeof(dirent_t));              
               
-				if(memcpy(buffer + j *(sizeof(dirent_t)), current_dirent, sizeof(dirent_t)) == NULL) 
-					return -1;                                                                      
+			if(memcpy(buffer + counter *(sizeof(dirent_t)), current_dirent, sizeof(dirent_t)) == NULL) 
+				return -1;                                                                      
               
-				counter++;        
-			}
+			counter++;        
+		}
         
-			if(counter == child->size)
-			{          
-				return child->size;
-			} 
+		if(counter == child->size)
+		{          
+			return child->size;
+		} 
+	}
+
+	return -1;
+}
+
+int Dir_Read(char* path, void* buffer, int size)
+{
+	STATS_OP(FS_OP_DIR_READ);
+ 
+	//First we need to get the child inode referenced by path
+	int child_inode;
+	char last_filename[MAX_NAME];
+	
+	int parent_inode = follow_path(path, &child_inode, last_filename, LOCK_READ);  
+
+	// If child exists
+	if(parent_inode >= 0 && child_inode >= 0) 
+	{        
+		// Lock the directory (the root directory is locked already)
+		if(child_inode != parent_inode)
+		{      
+			inode_lock(child_inode, LOCK_READ);
+			inode_unlock(parent_inode);
 		}
+
+		int result = read_dir_entries(child_inode, buffer, size);
+		
+		inode_unlock(child_inode);
+		return result;
 	}
 	else 
 	{
+		if(parent_inode >= 0)
+			inode_unlock(parent_inode);
 		dprintf("Couldn't find file: %s\n", path);
 		osErrno = E_GENERAL;
 		return -1;
 	}     
+}
 
-	return -1;
-}
\ No newline at end of file
+
+int Dir_Open(char* path)
+{
+  STATS_OP(FS_OP_DIR_OPEN);
+  dprintf("Dir_Open(%s):\n", path);
+
+  int child_inode;
+  char last_filename[MAX_NAME];
+  int parent_inode = follow_path(path, &child_inode, last_filename, LOCK_READ);
+  if(parent_inode < 0 || child_inode < 0) {
+    if(parent_inode >= 0) inode_unlock(parent_inode);
+    dprintf("... directory '%s' is not found\n", path);
+    osErrno = E_NO_SUCH_DIR;
+    return -1;
+  }
+
+  // the parent stays locked until the directory is counted as open, so
+  // that it can't be removed in between (the root directory is locked
+  // already)
+  if(child_inode != parent_inode) inode_lock(child_inode, LOCK_READ);
+  inode_t* child = get_inode(child_inode);
+  int type = child ? child->type : -1;
+  if(child_inode != parent_inode) inode_unlock(child_inode);
+
+  int dd = -1;
+  if(type != 1) {
+    dprintf("... error: '%s' is not a directory\n", path);
+    osErrno = E_GENERAL;
+  } else {
+    char* entries = (char*) malloc(SECTOR_SIZE);
+    pthread_mutex_lock(&open_dirs_lock);
+    if(entries)
+      for(dd=0; dd<MAX_OPEN_DIRS && __atomic_load_n(&open_dirs[dd].inode, __ATOMIC_RELAXED) >= 0; dd++);
+    if(entries && dd < MAX_OPEN_DIRS) {
+      // the entry is taken once its inode is set, and not used before
+      open_dir_t* od = &open_dirs[dd];
+      od->pos = 0;
+      od->sector = -1;
+      od->entries = entries;
+      __atomic_add_fetch(&open_counts[child_inode], 1, __ATOMIC_RELEASE);
+      __atomic_store_n(&od->inode, child_inode, __ATOMIC_RELEASE);
+    } else {
+      dprintf("... max open directories reached\n");
+      free(entries);
+      dd = -1;
+      osErrno = E_TOO_MANY_OPEN_FILES;
+    }
+    pthread_mutex_unlock(&open_dirs_lock);
+  }
+  inode_unlock(parent_inode);
+  return dd;
+}
+
+int Dir_Next(int dd, void* entry)
+{
+  STATS_OP(FS_OP_DIR_NEXT);
+  dprintf("Dir_Next(%d):\n", dd);
+  open_dir_t* od = lock_open_dir(dd);
+  if(!od) {
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+
+  inode_lock(od->inode, LOCK_READ);
+  inode_t* dir = get_inode(od->inode);
+  int ret = 0;
+  if(!dir || dir->type != 1) {
+    ret = -1;
+  } else if(od->pos < dir->size) {
+    // the next sector is read once its first entry is wanted
+    int sector = od->pos/DIRENTS_PER_SECTOR;
+    if(sector != od->sector) {
+      od->sector = -1;
+      if(Cache_Read(dir->data[sector], od->entries) == 0) od->sector = sector;
+    }
+    if(od->sector < 0) ret = -1;
+    else {
+      memcpy(entry, od->entries + (od->pos%DIRENTS_PER_SECTOR)*sizeof(dirent_t), sizeof(dirent_t));
+      od->pos++;
+      ret = 1;
+    }
+  }
+  inode_unlock(od->inode);
+  pthread_mutex_unlock(&od->lock);
+
+  if(ret < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... %s\n", ret ? "next entry returned" : "no more entries");
+  return ret;
+}
+
+int Dir_Close(int dd)
+{
+  STATS_OP(FS_OP_DIR_CLOSE);
+  dprintf("Dir_Close(%d):\n", dd);
+  open_dir_t* od = lock_open_dir(dd);
+  if(!od) {
+    osErrno = E_BAD_FD;
+    return -1;
+  }
+
+  __atomic_sub_fetch(&open_counts[od->inode], 1, __ATOMIC_RELEASE);
+  free(od->entries);
+  od->entries = NULL;
+  pthread_mutex_lock(&open_dirs_lock);
+  __atomic_store_n(&od->inode, -1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&open_dirs_lock);
+  pthread_mutex_unlock(&od->lock);
+  dprintf("... directory closed successfully\n");
+  return 0;
+}
+
+int Dir_Walk(char* path, Dir_WalkFn fn, void* arg)
+{
+  STATS_OP(FS_OP_DIR_WALK);
+  dprintf("Dir_Walk(%s):\n", path);
+  if(!fn) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  // the top is read while its parent is still locked (the root
+  // directory is its own parent), so that it can't go in between
+  int child_inode;
+  char last_filename[MAX_NAME];
+  int parent_inode = follow_path(path, &child_inode, last_filename, LOCK_READ);
+  if(parent_inode < 0 || child_inode < 0) {
+    if(parent_inode >= 0) inode_unlock(parent_inode);
+    dprintf("... '%s' not found\n", path);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  inode_t inode;
+  tree_entry_t* entries;
+  if(child_inode != parent_inode) inode_lock(child_inode, LOCK_READ);
+  int n = tree_read(child_inode, &inode, &entries);
+  if(child_inode != parent_inode) inode_unlock(child_inode);
+  inode_unlock(parent_inode);
+  if(n < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  int stop = 0, calls = 1;
+  if(fn(path, inode.type, inode.size, arg) != 0) stop = 1;
+  else if(n > 0) {
+    int c = tree_walk(path, child_inode, entries, n, fn, arg, &stop);
+    if(c < 0) {
+      free(entries);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    calls += c;
+  }
+  free(entries);
+  dprintf("... %d calls\n", calls);
+  return calls;
+}
+
+int Dir_RemoveTree(char* path)
+{
+  STATS_OP(FS_OP_DIR_REMOVE_TREE);
+  dprintf("Dir_RemoveTree(%s):\n", path);
+  if(check_writable() < 0) return -1;
+
+  int child_inode;
+  char last_filename[MAX_NAME];
+  int parent_inode = follow_path(path, &child_inode, last_filename, LOCK_WRITE);
+  if(parent_inode < 0 || child_inode < 0) {
+    if(parent_inode >= 0) inode_unlock(parent_inode);
+    dprintf("... '%s' not found\n", path);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  if(child_inode == parent_inode) {
+    inode_unlock(parent_inode);
+    osErrno = E_ROOT_DIR;
+    return -1;
+  }
+
+  // the parent stays locked for writing throughout, so that nothing in
+  // the tree can be opened (or the tree moved) meanwhile
+  inode_lock(child_inode, LOCK_WRITE);
+  inode_t* child = get_inode(child_inode);
+  tree_job_t job;
+  memset(&job, 0, sizeof(job));
+  if(!child) job.ret = -1;
+  else if(child->type == 0) job.ret = is_file_open(child_inode);
+  else {
+    tree_clear(&job, child_inode);
+    if(job.ret == 0) job.ret = is_file_open(child_inode);
+  }
+  if(job.ret == 0) {
+    journal_make_room();
+    pthread_rwlock_rdlock(&sync_lock);
+    if(remove_inode(child->type, parent_inode, child_inode, last_filename) < 0) job.ret = -1;
+    pthread_rwlock_unlock(&sync_lock);
+  }
+  inode_unlock(child_inode);
+  inode_unlock(parent_inode);
+
+  if(job.ret > 0) {
+    dprintf("... files in use left in '%s'\n", path);
+    osErrno = E_FILE_IN_USE;
+    return -1;
+  }
+  if(job.ret < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... '%s' removed\n", path);
+  return 0;
+}
+
+int Dir_Usage(char* path, FS_Usage_t* usage)
+{
+  STATS_OP(FS_OP_DIR_USAGE);
+  dprintf("Dir_Usage(%s):\n", path);
+  if(!usage) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  int child_inode;
+  char last_filename[MAX_NAME];
+  int parent_inode = follow_path(path, &child_inode, last_filename, LOCK_READ);
+  if(parent_inode < 0 || child_inode < 0) {
+    if(parent_inode >= 0) inode_unlock(parent_inode);
+    dprintf("... '%s' not found\n", path);
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
+  tree_job_t job;
+  memset(&job, 0, sizeof(job));
+  inode_t inode;
+  tree_entry_t* entries;
+  if(child_inode != parent_inode) inode_lock(child_inode, LOCK_READ);
+  int n = tree_read(child_inode, &inode, &entries);
+  if(child_inode != parent_inode) inode_unlock(child_inode);
+  inode_unlock(parent_inode);
+  if(n < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  tree_count(&inode, &job.usage);
+  tree_usage(&job, child_inode, entries, n);
+  free(entries);
+  if(job.ret < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  *usage = job.usage;
+  dprintf("... %ld files, %ld directories, %ld bytes, %ld sectors\n", usage->files,
+	  usage->dirs, usage->bytes, usage->sectors);
+  return 0;
+}
@@ -5,6 +5,8 @@
 #ifndef __LibFS_h__
 #define __LibFS_h__
 
+#include <limits.h>
+
 // error types
 typedef enum {
     E_GENERAL,      // general
@@ -20,33 +22,172 @@ typedef enum {
     E_DIR_NOT_EMPTY,
     E_ROOT_DIR,
     E_BUFFER_TOO_SMALL, 
+    E_READ_ONLY,
+    E_NO_SUCH_SNAPSHOT,
 } FS_Error_t;
     
-// used for errors
-extern int osErrno;
+// used for errors (each thread has its own)
+extern __thread int osErrno;
 
 // a few file system parameters
 
 // the total number of files and directories in the file system has a
-// maximum limit of 1000
-#define MAX_FILES 1000
+// maximum limit, chosen when the disk is formatted (see
+// FS_SetGeometry); it is 1000 unless told otherwise
+#define DEFAULT_MAX_FILES 1000
+extern int fsMaxFiles;
+#define MAX_FILES fsMaxFiles
 
-// each file can have a maximum of 30 sectors; we treat the data
-// blocks of the file/director the same as sectors
-#define MAX_SECTORS_PER_FILE 30
+// we treat the data blocks of the file/director the same as sectors;
+// the inode of a file points to its first 28 sectors directly, to the
+// next SECTOR_SIZE/4 sectors through an indirect sector (holding
+// their indices), and to the rest through a double-indirect sector
+// (holding the indices of more indirect sectors); a directory only
+// uses the direct pointers
+#define DIRECT_SECTORS_PER_FILE 28
+#define POINTERS_PER_SECTOR ((int)(SECTOR_SIZE/sizeof(int)))
+#define MAX_SECTORS_PER_FILE (DIRECT_SECTORS_PER_FILE + POINTERS_PER_SECTOR + \
+			      POINTERS_PER_SECTOR*POINTERS_PER_SECTOR)
 
-// the size of a file or directory is limited
-#define MAX_FILE_SIZE (MAX_SECTORS_PER_FILE*SECTOR_SIZE)
+// the size of a file or directory is limited, and since sizes and
+// offsets are ints, never beyond the last whole sector below INT_MAX
+#define MAX_INT_FILE_SIZE (INT_MAX/SECTOR_SIZE*SECTOR_SIZE)
+#define MAX_FILE_SIZE ((long long)MAX_SECTORS_PER_FILE*SECTOR_SIZE < MAX_INT_FILE_SIZE ? \
+		       MAX_SECTORS_PER_FILE*SECTOR_SIZE : MAX_INT_FILE_SIZE)
 
 // file system generic calls
 int FS_Boot(char *path);
+// chooses the sector size (a power of two from 512 to 32768 bytes),
+// the number of sectors and the number of files FS_Boot uses when it
+// formats a new disk; a disk that already exists is always booted with
+// the geometry stored in its superblock
+int FS_SetGeometry(int sector_size, int total_sectors, int max_files);
+// commits every change made so far, by every thread, and returns 0,
+// or -1 if it can't; in a batch the thread began, it commits nothing
+// and returns 1
 int FS_Sync();
+// between FS_BatchBegin() and FS_BatchCommit(), the changes made by
+// the thread are committed together by FS_BatchCommit(), each sector
+// changed written once; batches are the thread's own, may be nested,
+// and only the outermost one commits; a batch isn't kept apart from
+// the rest, though: FS_Sync() in another thread commits it as far as
+// it's gone, and so does a batch too large for the journal or the
+// block cache, which is committed in several goes, so a crash may
+// leave part of a batch (each call in it whole or not at all)
+int FS_BatchBegin();
+int FS_BatchCommit();
+// snapshots of the file system, kept in memory (sectors are copied as
+// they are written over, see Disk_Snapshot) until the disk is booted
+// again: FS_Snapshot() syncs and takes one under a name (up to 31
+// characters); FS_Rollback() brings the file system back to one,
+// dropping those taken after it, and saves the disk; and
+// FS_MountSnapshot() makes every call see one, and fail to change
+// anything (E_READ_ONLY), until FS_MountSnapshot(NULL) brings back the
+// file system as it is; FS_Rollback() and FS_MountSnapshot() need no
+// file or directory open (E_FILE_IN_USE), and like FS_Boot() must not
+// run at the same time as other calls
+int FS_Snapshot(char* name);
+int FS_Rollback(char* name);
+int FS_DeleteSnapshot(char* name);
+int FS_MountSnapshot(char* name);
+// FS_Check() goes through the whole tree from the root (in several
+// threads), with every change held off, and compares the inodes and
+// sectors it reaches with the inode and sector bitmaps; with 'repair'
+// set (refused while a snapshot is mounted, E_READ_ONLY) it makes the
+// bitmaps match, giving back what was lost and taking what's reached;
+// it returns the number of problems left (0 if the file system is
+// consistent), or -1 if the disk can't be read
+typedef struct {
+  long inodes;          // inodes reached, the root included
+  long sectors;         // sectors reached, those before the data blocks included
+  long lost_inodes;     // marked in use but not reached (repaired)
+  long missing_inodes;  // reached but marked free (repaired)
+  long lost_sectors;    // marked in use but not reached, leaked (repaired)
+  long missing_sectors; // reached but marked free (repaired)
+  long shared_sectors;  // reached more than once
+  long bad_entries;     // directory entries to no inode, or to one reached already
+  long bad_pointers;    // pointers to sectors outside the data blocks
+  long bad_inodes;      // inodes whose type, size or pointers make no sense
+} FS_Check_t;
+int FS_Check(int repair, FS_Check_t* report);
+
+// statistics of the calls made since the program started (or since
+// FS_ResetStats), kept for each kind of call; the time the calls took
+// is only measured once FS_SetStatsTiming(1) is called
+typedef enum {
+  FS_OP_BOOT,
+  FS_OP_SYNC,
+  FS_OP_BATCH_COMMIT,
+  FS_OP_FILE_CREATE,
+  FS_OP_FILE_OPEN,
+  FS_OP_FILE_READ,
+  FS_OP_FILE_WRITE,
+  FS_OP_FILE_PREAD,
+  FS_OP_FILE_PWRITE,
+  FS_OP_FILE_SEEK,
+  FS_OP_FILE_CLOSE,
+  FS_OP_FILE_UNLINK,
+  FS_OP_DIR_CREATE,
+  FS_OP_DIR_UNLINK,
+  FS_OP_DIR_SIZE,
+  FS_OP_DIR_READ,
+  FS_OP_DIR_WALK,
+  FS_OP_DIR_REMOVE_TREE,
+  FS_OP_DIR_USAGE,
+  FS_OP_DIR_OPEN,
+  FS_OP_DIR_NEXT,
+  FS_OP_DIR_CLOSE,
+  FS_OP_SNAPSHOT,
+  FS_OP_ROLLBACK,
+  FS_OP_DELETE_SNAPSHOT,
+  FS_OP_MOUNT_SNAPSHOT,
+  FS_OP_CHECK,
+  FS_OPS
+} FS_Op_t;
+
+typedef struct {
+  long calls;
+  long sector_reads;    // sectors read from the disk
+  long sector_writes;   // sectors written to the disk
+  long cache_hits;      // sector lookups in the block cache that hit
+  long cache_misses;    // and that missed
+  long bitmap_scans;    // searches of the inode and sector bitmaps
+  long bitmap_bits;     // bits probed by the searches
+  long path_components; // names looked up resolving paths
+  long bytes_copied;    // file data read or written
+  long seek_distance;   // sectors the head of the disk moved over
+  long disk_nanoseconds; // time the disk took, if it has a timing model
+  long nanoseconds;     // time taken, if measured
+} FS_OpStats_t;
+
+typedef struct {
+  FS_OpStats_t ops[FS_OPS];
+} FS_Stats_t;
+
+int FS_GetStats(FS_Stats_t* stats);
+void FS_ResetStats();
+void FS_SetStatsTiming(int on);
+
+// once FS_SetTrace(1) is called (and until FS_SetTrace(0) is), the
+// most recent calls, and what they did (the paths resolved, the file
+// data copied, the sectors allocated, the journal transactions
+// committed), are recorded in a ring in memory; FS_TraceDump() writes
+// them out, appending to the file given, or to stderr if NULL; after
+// FS_SetTraceDumpOnError(1, file), which turns the recording on, they're
+// also written out whenever a call fails with E_GENERAL
+void FS_SetTrace(int on);
+int FS_TraceDump(char* file);
+void FS_SetTraceDumpOnError(int on, char* file);
 
 // file ops
 int File_Create(char *file);
 int File_Open(char *file);
 int File_Read(int fd, void *buffer, int size);
 int File_Write(int fd, void *buffer, int size);
+// like File_Read() and File_Write(), but at the given offset, and
+// without using or moving the read/write position of the file
+int File_PRead(int fd, void *buffer, int size, int offset);
+int File_PWrite(int fd, void *buffer, int size, int offset);
 int File_Seek(int fd, int offset);
 int File_Close(int fd);
 int File_Unlink(char *file);
@@ -56,5 +197,40 @@ int Dir_Create(char *path);
 int Dir_Unlink(char *path);
 int Dir_Size(char *path);
 int Dir_Read(char *path, void *buffer, int size);
+// like Dir_Read(), but an entry at a time, reading one sector of
+// entries at a time whatever the size of the directory: Dir_Open()
+// returns a handle to list the directory with, Dir_Next() copies the
+// next entry (the layout of those of Dir_Read(), 20 bytes) to 'entry'
+// and returns 1, or 0 once there are no more; entries added or
+// removed meanwhile may or may not be listed, and entries moved to
+// fill the place of those removed may be missed; an open directory
+// can't be removed (E_FILE_IN_USE)
+int Dir_Open(char *path);
+int Dir_Next(int dd, void *entry);
+int Dir_Close(int dd);
+
+// tree ops, on a directory and everything under it (or just a file):
+// Dir_Walk() calls 'fn' on every file and directory of the tree, the
+// top first and each directory before what it holds, with the type (0
+// for a file, 1 for a directory) and size (in bytes, or in entries for
+// a directory) of each; no lock is held while 'fn' runs, so it may call
+// the file system; the walk stops early if 'fn' returns anything but
+// 0; it returns the number of calls to 'fn', or -1 if there's no such
+// file or directory
+typedef int (*Dir_WalkFn)(char* path, int type, int size, void* arg);
+int Dir_Walk(char* path, Dir_WalkFn fn, void* arg);
+// Dir_RemoveTree() removes the whole tree, but for the files and
+// directories open (and the directories holding them), and fails with
+// E_FILE_IN_USE if there are any
+int Dir_RemoveTree(char* path);
+// Dir_Usage() adds up what the tree holds, and the sectors it takes
+typedef struct {
+  long files;   // files in the tree
+  long dirs;    // directories in the tree, the top one included
+  long bytes;   // data in the files
+  long sectors; // sectors taken by data blocks, pointer sectors,
+                // directory entries and directory indexes
+} FS_Usage_t;
+int Dir_Usage(char* path, FS_Usage_t* usage);
 
 #endif /* __LibFS_h__ */
@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "LibFS.h"
+#include "FSProtocol.h"
+
+// the LibFS calls of LibFS.h, made by the file system daemon (fsd.c)
+// on behalf of the program they're linked with: FS_Boot connects to
+// the daemon serving the disk, which is already booted, and every
+// other call is a request to it (see FSProtocol.h); the socket of the
+// daemon is the name of the disk with FSD_SOCKET_SUFFIX appended,
+// unless the FSD_SOCKET environment variable says otherwise
+
+// global errno value here
+__thread int osErrno;
+
+// the number of files of the disk served (see FS_Boot)
+int fsMaxFiles = DEFAULT_MAX_FILES;
+
+// the connection to the daemon (-1 if none), and the lock making the
+// requests of different threads take turns
+static int server = -1;
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * transfer
+ *
+ * Sends (if 'out' is set) or receives exactly 'n' bytes on the
+ * connection; returns 0 if successful, -1 if the connection broke.
+ */
+static int transfer(void* buf, size_t n, int out)
+{
+  while(n > 0) {
+    ssize_t r = out ? write(server, buf, n) : read(server, buf, n);
+    if(r < 0 && errno == EINTR) continue;
+    if(r <= 0) return -1;
+    buf = (char*)buf + r; n -= r;
+  }
+  return 0;
+}
+
+/*
+ * request
+ *
+ * Sends a request with its arguments and 'len' bytes of payload, and
+ * receives the reply, with up to 'max' bytes of data going to 'data';
+ * returns what the call returned, with osErrno set if it failed, or -1
+ * (E_GENERAL) if the daemon can't be reached.
+ */
+static int request(int op, int a0, int a1, int a2, const void* payload, int len,
+		   void* data, int max)
+{
+  fsd_request_t req = { op, { a0, a1, a2 }, len };
+  fsd_reply_t rep;
+  pthread_mutex_lock(&server_lock);
+  if(server < 0 || transfer(&req, sizeof(req), 1) < 0 ||
+     transfer((void*)payload, len, 1) < 0 || transfer(&rep, sizeof(rep), 0) < 0 ||
+     rep.len < 0 || rep.len > max || transfer(data, rep.len, 0) < 0) {
+    // a broken (or garbled) connection isn't used again
+    if(server >= 0) close(server);
+    server = -1;
+    pthread_mutex_unlock(&server_lock);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  pthread_mutex_unlock(&server_lock);
+  if(rep.ret < 0) osErrno = rep.err;
+  return rep.ret;
+}
+
+/*
+ * path_request
+ *
+ * Sends a request taking a path as its payload.
+ */
+static int path_request(int op, char* path, int a0, void* data, int max)
+{
+  int len = strlen(path)+1;
+  if(len > FSD_MAX_PATH) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return request(op, a0, 0, 0, path, len, data, max);
+}
+
+int FS_Boot(char* path)
+{
+  char* sockname = getenv("FSD_SOCKET"), buf[FSD_MAX_PATH];
+  if(!sockname) {
+    snprintf(buf, sizeof(buf), "%s%s", path, FSD_SOCKET_SUFFIX);
+    sockname = buf;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, sockname, sizeof(addr.sun_path)-1);
+
+  pthread_mutex_lock(&server_lock);
+  if(server >= 0) close(server);
+  server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(server >= 0 && connect(server, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(server);
+    server = -1;
+  }
+  pthread_mutex_unlock(&server_lock);
+
+  int n = request(FSD_BOOT, 0, 0, 0, NULL, 0, NULL, 0);
+  if(n < 0) {
+    fprintf(stderr, "no file system daemon serving '%s' on socket '%s'\n", path, sockname);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  fsMaxFiles = n;
+  return 0;
+}
+
+int FS_SetGeometry(int sector_size, int total_sectors, int max_files)
+{
+  return request(FSD_SET_GEOMETRY, sector_size, total_sectors, max_files, NULL, 0, NULL, 0);
+}
+
+int FS_Sync()
+{
+  return request(FSD_SYNC, 0, 0, 0, NULL, 0, NULL, 0);
+}
+
+int FS_BatchBegin()
+{
+  return request(FSD_BATCH_BEGIN, 0, 0, 0, NULL, 0, NULL, 0);
+}
+
+int FS_BatchCommit()
+{
+  return request(FSD_BATCH_COMMIT, 0, 0, 0, NULL, 0, NULL, 0);
+}
+
+int File_Create(char* file)
+{
+  return path_request(FSD_FILE_CREATE, file, 0, NULL, 0);
+}
+
+int File_Open(char* file)
+{
+  return path_request(FSD_FILE_OPEN, file, 0, NULL, 0);
+}
+
+/*
+ * file_io
+ *
+ * Reads or writes (if 'write') 'size' bytes of a file, at 'offset'
+ * (or the read/write position if 'offset' is negative), in requests of
+ * up to FSD_MAX_DATA bytes; returns the number of bytes transferred,
+ * or -1 if not even the first request succeeded.
+ */
+static int file_io(int fd, void* buffer, int size, int offset, int write)
+{
+  int done = 0;
+  if(size < 0) size = 0;
+  do {
+    int n = size-done, r;
+    if(n > FSD_MAX_DATA) n = FSD_MAX_DATA;
+    char* p = (char*)buffer+done;
+    if(write)
+      r = (offset < 0) ? request(FSD_FILE_WRITE, fd, 0, 0, p, n, NULL, 0) :
+	request(FSD_FILE_PWRITE, fd, offset+done, 0, p, n, NULL, 0);
+    else
+      r = (offset < 0) ? request(FSD_FILE_READ, fd, n, 0, NULL, 0, p, n) :
+	request(FSD_FILE_PREAD, fd, n, offset+done, NULL, 0, p, n);
+    if(r < 0) return done ? done : -1;
+    done += r;
+    if(r < n) break;
+  } while(done < size);
+  return done;
+}
+
+int File_Read(int fd, void* buffer, int size)
+{
+  return file_io(fd, buffer, size, -1, 0);
+}
+
+int File_Write(int fd, void* buffer, int size)
+{
+  return file_io(fd, buffer, size, -1, 1);
+}
+
+int File_PRead(int fd, void* buffer, int size, int offset)
+{
+  if(offset < 0) {
+    osErrno = E_SEEK_OUT_OF_BOUNDS;
+    return -1;
+  }
+  return file_io(fd, buffer, size, offset, 0);
+}
+
+int File_PWrite(int fd, void* buffer, int size, int offset)
+{
+  if(offset < 0) {
+    osErrno = E_SEEK_OUT_OF_BOUNDS;
+    return -1;
+  }
+  return file_io(fd, buffer, size, offset, 1);
+}
+
+int File_Seek(int fd, int offset)
+{
+  return request(FSD_FILE_SEEK, fd, offset, 0, NULL, 0, NULL, 0);
+}
+
+int File_Close(int fd)
+{
+  return request(FSD_FILE_CLOSE, fd, 0, 0, NULL, 0, NULL, 0);
+}
+
+int File_Unlink(char* file)
+{
+  return path_request(FSD_FILE_UNLINK, file, 0, NULL, 0);
+}
+
+int Dir_Create(char* path)
+{
+  return path_request(FSD_DIR_CREATE, path, 0, NULL, 0);
+}
+
+int Dir_Unlink(char* path)
+{
+  return path_request(FSD_DIR_UNLINK, path, 0, NULL, 0);
+}
+
+int Dir_Size(char* path)
+{
+  return path_request(FSD_DIR_SIZE, path, 0, NULL, 0);
+}
+
+int Dir_Read(char* path, void* buffer, int size)
+{
+  if(size > FSD_MAX_DATA) size = FSD_MAX_DATA;
+  return path_request(FSD_DIR_READ, path, size, buffer, size);
+}
+
+int Dir_Open(char* path)
+{
+  return path_request(FSD_DIR_OPEN, path, 0, NULL, 0);
+}
+
+int Dir_Next(int dd, void* entry)
+{
+  return request(FSD_DIR_NEXT, dd, 0, 0, NULL, 0, entry, FSD_DIR_ENTRY);
+}
+
+int Dir_Close(int dd)
+{
+  return request(FSD_DIR_CLOSE, dd, 0, 0, NULL, 0, NULL, 0);
+}
+
+// the daemon walks the tree and returns the calls to make (see
+// fsd_walk_t), which are made here, so that 'fn' runs in the client;
+// a tree with more than fits in a reply is cut short
+
+int Dir_Walk(char* path, Dir_WalkFn fn, void* arg)
+{
+  char* buffer = malloc(FSD_MAX_DATA);
+  if(!fn || !buffer) {
+    free(buffer);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  int n = path_request(FSD_DIR_WALK, path, 0, buffer, FSD_MAX_DATA), i, pos = 0;
+  for(i=0; i<n; i++) {
+    fsd_walk_t rec;
+    memcpy(&rec, buffer+pos, sizeof(rec));
+    char* name = buffer+pos+sizeof(rec);
+    pos += (sizeof(rec)+rec.len+sizeof(int)-1)/sizeof(int)*sizeof(int);
+    if(fn(name, rec.type, rec.size, arg) != 0) {
+      i++;
+      break;
+    }
+  }
+  free(buffer);
+  return (n < 0) ? -1 : i;
+}
+
+int Dir_RemoveTree(char* path)
+{
+  return path_request(FSD_DIR_REMOVE_TREE, path, 0, NULL, 0);
+}
+
+int Dir_Usage(char* path, FS_Usage_t* usage)
+{
+  if(!usage) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return path_request(FSD_DIR_USAGE, path, 0, usage, sizeof(FS_Usage_t));
+}
+
+int FS_Snapshot(char* name)
+{
+  return path_request(FSD_SNAPSHOT, name, 0, NULL, 0);
+}
+
+int FS_Rollback(char* name)
+{
+  return path_request(FSD_ROLLBACK, name, 0, NULL, 0);
+}
+
+int FS_DeleteSnapshot(char* name)
+{
+  return path_request(FSD_DELETE_SNAPSHOT, name, 0, NULL, 0);
+}
+
+int FS_MountSnapshot(char* name)
+{
+  if(!name) return request(FSD_MOUNT_SNAPSHOT, 0, 0, 0, NULL, 0, NULL, 0);
+  return path_request(FSD_MOUNT_SNAPSHOT, name, 0, NULL, 0);
+}
+
+int FS_Check(int repair, FS_Check_t* report)
+{
+  if(!report) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return request(FSD_CHECK, repair, 0, 0, NULL, 0, report, sizeof(FS_Check_t));
+}
+
+int FS_GetStats(FS_Stats_t* stats)
+{
+  if(!stats) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  return request(FSD_GET_STATS, 0, 0, 0, NULL, 0, stats, sizeof(FS_Stats_t));
+}
+
+void FS_ResetStats()
+{
+  request(FSD_RESET_STATS, 0, 0, 0, NULL, 0, NULL, 0);
+}
+
+void FS_SetStatsTiming(int on)
+{
+  request(FSD_STATS_TIMING, on, 0, 0, NULL, 0, NULL, 0);
+}
+
+// the trace is the daemon's, and is written out by the daemon, to its
+// own stderr if no file is given
+
+void FS_SetTrace(int on)
+{
+  request(FSD_TRACE, on, 0, 0, NULL, 0, NULL, 0);
+}
+
+int FS_TraceDump(char* file)
+{
+  if(!file) return request(FSD_TRACE_DUMP, 0, 0, 0, NULL, 0, NULL, 0);
+  return path_request(FSD_TRACE_DUMP, file, 0, NULL, 0);
+}
+
+void FS_SetTraceDumpOnError(int on, char* file)
+{
+  if(!file) request(FSD_TRACE_DUMP_ON_ERROR, on, 0, 0, NULL, 0, NULL, 0);
+  else path_request(FSD_TRACE_DUMP_ON_ERROR, file, on, NULL, 0);
+}
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "LibFS.h"
+#include "LibDisk.h"
+
+// benchmarks of the hot paths of LibFS: each one times every call it
+// makes, and reports the throughput and the 50th, 99th and 99.9th
+// percentiles of the latency, along with the time a 7200 rpm disk
+// would have taken for the calls (see Disk_SetTiming), with the
+// request scheduler given, and the disk image backed the way given
+// (see Disk_SetMode), so that the page cache can be compared with
+// O_DIRECT; the disk is formatted afresh, bigger than the default so
+// that files of several megabytes fit
+
+#define BENCH_SECTOR_SIZE 512
+#define BENCH_TOTAL_SECTORS 131072 // 64 MB
+#define BENCH_MAX_FILES 4000
+
+// the size of the file read and written, and the sizes of the calls
+#define IO_FILE_SIZE (4<<20)
+static int io_sizes[] = { 512, 4096, 65536, 1<<20 };
+
+// the results go here, while whatever LibFS prints goes nowhere
+static FILE* out;
+
+// the latencies of a set of calls, in seconds, and the time the disk
+// model took for them
+typedef struct {
+  double* lat;
+  int n, max;
+  long disk_ns;
+} samples_t;
+
+// the calls of the benchmark being run
+static samples_t calls;
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [--mode memory|mmap|file|direct] [disk] [fifo|scan|clook]\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec/1e9;
+}
+
+// the time the disk model has taken for the calls so far
+static long disk_time()
+{
+  Disk_Stats_t st;
+  Disk_GetStats(&st);
+  return st.disk_nanoseconds;
+}
+
+static void fail(char* what)
+{
+  fprintf(out, "ERROR: %s failed (osErrno %d)\n", what, osErrno);
+  exit(2);
+}
+
+static void record(samples_t* s, double t, long disk_ns)
+{
+  s->disk_ns += disk_ns;
+  if(s->n == s->max) {
+    s->max = s->max ? 2*s->max : 1024;
+    s->lat = realloc(s->lat, s->max*sizeof(double));
+    if(!s->lat) fail("malloc");
+  }
+  s->lat[s->n++] = t;
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+  double x = *(double*)a, y = *(double*)b;
+  return (x > y) - (x < y);
+}
+
+// the latency below which a fraction 'p' of the (sorted) calls came in
+static double percentile(samples_t* s, double p)
+{
+  int i = (int)(p*s->n + 0.999999) - 1;
+  if(i < 0) i = 0;
+  if(i >= s->n) i = s->n-1;
+  return s->lat[i];
+}
+
+// report the calls recorded since the last report, and forget them;
+// 'bytes' is the amount of data they moved (0 for calls moving none)
+static void report(char* name, samples_t* s, long long bytes)
+{
+  double total = 0;
+  int i;
+  for(i=0; i<s->n; i++) total += s->lat[i];
+  qsort(s->lat, s->n, sizeof(double), cmp_double);
+  fprintf(out, "%-28s %7d %10.0f", name, s->n, s->n/total);
+  if(bytes) fprintf(out, " %9.1f", bytes/total/(1<<20));
+  else fprintf(out, " %9s", "-");
+  fprintf(out, " %9.1f %9.1f %9.1f %10.1f\n", percentile(s, 0.5)*1e6,
+	  percentile(s, 0.99)*1e6, percentile(s, 0.999)*1e6, s->disk_ns/1e6);
+  s->n = 0;
+  s->disk_ns = 0;
+}
+
+// time one call, which has to succeed
+#define TIMED(s, what, call) do {		\
+    long d0 = disk_time();			\
+    double t0 = now();				\
+    if((call) < 0) fail(what);			\
+    record(s, now()-t0, disk_time()-d0);	\
+  } while(0)
+
+// create 'n' files in a directory (no more than a directory holds)
+// and unlink them all, 'rounds' times over
+static void bench_churn(int n, int rounds)
+{
+  static samples_t unlinks;
+  char path[64];
+  int i, r;
+  if(Dir_Create("/churn") < 0) fail("Dir_Create");
+  for(r=0; r<rounds; r++) {
+    for(i=0; i<n; i++) {
+      sprintf(path, "/churn/f%d", i);
+      TIMED(&calls, "File_Create", File_Create(path));
+    }
+    for(i=0; i<n; i++) {
+      sprintf(path, "/churn/f%d", i);
+      TIMED(&unlinks, "File_Unlink", File_Unlink(path));
+    }
+  }
+  report("File_Create", &calls, 0);
+  report("File_Unlink", &unlinks, 0);
+  if(Dir_Unlink("/churn") < 0) fail("Dir_Unlink");
+}
+
+// resolve the path of a file 'depth' directories down, each holding
+// 'width' entries, by opening it
+static void bench_path(int depth, int width, int n)
+{
+  char path[1024], name[1100];
+  int d, i;
+  sprintf(path, "/p%d_%d", depth, width);
+  for(d=0; d<depth; d++) {
+    if(d > 0) strcat(path, "/d");
+    if(Dir_Create(path) < 0) fail("Dir_Create");
+    for(i=1; i<width; i++) {
+      sprintf(name, "%s/x%d", path, i);
+      if(File_Create(name) < 0) fail("File_Create");
+    }
+  }
+  strcat(path, "/target");
+  if(File_Create(path) < 0) fail("File_Create");
+  for(i=0; i<n; i++) {
+    long d0 = disk_time();
+    double t0 = now();
+    int fd = File_Open(path);
+    if(fd < 0) fail("File_Open");
+    record(&calls, now()-t0, disk_time()-d0);
+    File_Close(fd);
+  }
+  sprintf(name, "path depth %d width %d", depth, width);
+  report(name, &calls, 0);
+}
+
+// read and write a file of IO_FILE_SIZE bytes 'size' bytes at a time,
+// in order (in as many passes as it takes to make a few hundred
+// calls) and at random offsets aligned to the size
+static void bench_io(int size, char* buf)
+{
+  char name[64];
+  int n = IO_FILE_SIZE/size, m = (n < 256) ? 256 : n, i;
+  if(File_Create("/io") < 0) fail("File_Create");
+  int fd = File_Open("/io");
+  if(fd < 0) fail("File_Open");
+
+  for(i=0; i<m; i++) {
+    if(i > 0 && i%n == 0 && File_Seek(fd, 0) < 0) fail("File_Seek");
+    TIMED(&calls, "File_Write", File_Write(fd, buf, size));
+  }
+  sprintf(name, "write seq %d", size);
+  report(name, &calls, (long long)m*size);
+
+  for(i=0; i<m; i++) {
+    if(i%n == 0 && File_Seek(fd, 0) < 0) fail("File_Seek");
+    TIMED(&calls, "File_Read", File_Read(fd, buf, size));
+  }
+  sprintf(name, "read seq %d", size);
+  report(name, &calls, (long long)m*size);
+
+  for(i=0; i<m; i++)
+    TIMED(&calls, "File_PWrite", File_PWrite(fd, buf, size, (rand()%n)*size));
+  sprintf(name, "write random %d", size);
+  report(name, &calls, (long long)m*size);
+  for(i=0; i<m; i++)
+    TIMED(&calls, "File_PRead", File_PRead(fd, buf, size, (rand()%n)*size));
+  sprintf(name, "read random %d", size);
+  report(name, &calls, (long long)m*size);
+
+  File_Close(fd);
+  if(File_Unlink("/io") < 0) fail("File_Unlink");
+}
+
+// a sync after changing a single file, and a boot of the synced disk
+static void bench_sync_boot(char* diskfile, int n)
+{
+  char path[64];
+  int i;
+  for(i=0; i<n; i++) {
+    sprintf(path, "/s%d", i);
+    if(File_Create(path) < 0) fail("File_Create");
+    TIMED(&calls, "FS_Sync", FS_Sync());
+  }
+  report("FS_Sync", &calls, 0);
+  for(i=0; i<n; i++) TIMED(&calls, "FS_Boot", FS_Boot(diskfile));
+  report("FS_Boot", &calls, 0);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "bench-disk", *modename = "mmap", *schedname = "fifo";
+  int sched = DISK_SCHED_FIFO, mode = DISK_MODE_MMAP;
+  if(argc >= 3 && !strcmp(argv[1], "--mode")) {
+    modename = argv[2];
+    if(!strcmp(modename, "memory")) mode = DISK_MODE_MEMORY;
+    else if(!strcmp(modename, "file")) mode = DISK_MODE_FILE;
+    else if(!strcmp(modename, "direct")) mode = DISK_MODE_DIRECT;
+    else if(strcmp(modename, "mmap")) usage(argv[0]);
+    argc -= 2;
+    argv += 2;
+  }
+  if(argc > 3) usage(argv[0]);
+  if(argc >= 2) diskfile = argv[1];
+  if(argc == 3) {
+    schedname = argv[2];
+    if(!strcmp(argv[2], "scan")) sched = DISK_SCHED_SCAN;
+    else if(!strcmp(argv[2], "clook")) sched = DISK_SCHED_CLOOK;
+    else if(strcmp(argv[2], "fifo")) usage(argv[0]);
+  }
+  Disk_Timing_t model = DISK_TIMING_7200RPM;
+  if(Disk_SetMode(mode) < 0 || Disk_SetTiming(&model) < 0 || Disk_SetScheduler(sched) < 0) {
+    printf("ERROR: can't set up the disk model\n");
+    return -1;
+  }
+
+  // keep the results apart from the debug output of LibFS
+  fflush(stdout);
+  out = fdopen(dup(1), "w");
+  int devnull = open("/dev/null", O_WRONLY);
+  if(!out || devnull < 0) fail("redirecting output");
+  dup2(devnull, 1);
+  close(devnull);
+  setvbuf(out, NULL, _IOLBF, 0);
+
+  unlink(diskfile);
+  if(FS_SetGeometry(BENCH_SECTOR_SIZE, BENCH_TOTAL_SECTORS, BENCH_MAX_FILES) < 0 ||
+     FS_Boot(diskfile) < 0)
+    fail("FS_Boot");
+
+  fprintf(out, "disk mode %s, scheduler %s\n", modename, schedname);
+  fprintf(out, "%-28s %7s %10s %9s %9s %9s %9s %10s\n", "benchmark", "calls", "calls/s",
+	  "MB/s", "p50 us", "p99 us", "p999 us", "disk ms");
+  bench_churn(500, 4);
+  bench_path(1, 1, 2000);
+  bench_path(4, 1, 2000);
+  bench_path(16, 1, 2000);
+  bench_path(1, 100, 2000);
+  bench_path(1, 600, 2000);
+  bench_path(4, 100, 2000);
+
+  char* buf = calloc(1, io_sizes[sizeof(io_sizes)/sizeof(int)-1]);
+  if(!buf) fail("malloc");
+  int i;
+  for(i=0; i<(int)(sizeof(io_sizes)/sizeof(int)); i++) bench_io(io_sizes[i], buf);
+  free(buf);
+
+  bench_sync_boot(diskfile, 50);
+  unlink(diskfile);
+  return 0;
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "LibFS.h"
+
+// the longest path, on either side
+#define PATHSZ 4096
+
+// the most read from a file at a time
+#define BFSZ (4<<20)
+
+// an entry returned by Dir_Read: the name, then the inode
+#define ENTRYSZ 20
+
+static char buf[BFSZ];
+
+void usage(char *prog)
+{
+  printf("USAGE: %s disk path to_unix_dir\n", prog);
+  exit(1);
+}
+
+// copy the file 'path' to the unix file 'fname'
+static int export_file(char* path, char* fname)
+{
+  int fd = File_Open(path);
+  if(fd < 0) {
+    printf("ERROR: can't open file '%s'\n", path);
+    return -2;
+  }
+  int ufd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if(ufd < 0) {
+    printf("ERROR: can't open file '%s' to export\n", fname);
+    return -3;
+  }
+  int sz;
+  do {
+    sz = File_Read(fd, buf, BFSZ);
+    if(sz < 0) {
+      printf("ERROR: can't read file '%s'\n", path);
+      return -4;
+    } else if(sz > 0 && write(ufd, buf, sz) != sz) {
+      printf("ERROR: can't write file '%s'\n", fname);
+      return -5;
+    }
+  } while(sz == BFSZ);
+  close(ufd);
+  File_Close(fd);
+  return 0;
+}
+
+// copy the file or directory tree 'path' into the unix directory
+// 'udir' (the root directory's entries go into 'udir' itself)
+static int export(char* path, char* udir)
+{
+  char* name = strrchr(path, '/');
+  name = name ? name+1 : path;
+  char fname[PATHSZ];
+  snprintf(fname, PATHSZ, "%s%s%s", udir, *name ? "/" : "", name);
+
+  int sz = Dir_Size(path);
+  if(sz < 0) return export_file(path, fname);
+
+  if(*name && mkdir(fname, 0755) < 0 && errno != EEXIST) {
+    printf("ERROR: can't create directory '%s' to export\n", fname);
+    return -3;
+  }
+  if(sz == 0) return 0;
+  char* entries = malloc(sz);
+  int n = entries ? Dir_Read(path, entries, sz) : -1;
+  if(n < 0) {
+    printf("ERROR: can't list '%s'\n", path);
+    free(entries);
+    return -2;
+  }
+  int i, ret = 0;
+  for(i=0; !ret && i<n; i++) {
+    char child[PATHSZ];
+    snprintf(child, PATHSZ, "%s%s%s", path, *name ? "/" : "", &entries[i*ENTRYSZ]);
+    ret = export(child, fname);
+  }
+  free(entries);
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc != 4) usage(argv[0]);
+  char *diskfile = argv[1], *path = argv[2], *udir = argv[3];
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  // trailing slashes would leave no name to export under
+  size_t len = strlen(path);
+  while(len > 1 && path[len-1] == '/') path[--len] = '\0';
+  int ret = export(path, udir);
+  if(ret < 0) return ret;
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "LibFS.h"
+
+// the longest path, on either side
+#define PATHSZ 4096
+
+void usage(char *prog)
+{
+  printf("USAGE: %s disk dir from_unix_path...\n", prog);
+  exit(1);
+}
+
+// the path of 'name' in directory 'dir' of the file system
+static void join(char* path, char* dir, char* name)
+{
+  snprintf(path, PATHSZ, "%s%s%s", dir, strcmp(dir, "/") ? "/" : "", name);
+}
+
+// copy the unix file 'fname' to the file 'path' with one write
+static int import_file(char* path, char* fname, off_t size)
+{
+  if(File_Create(path) < 0) {
+    printf("ERROR: can't create file '%s'\n", path);
+    return -2;
+  }
+  int fd = File_Open(path);
+  if(fd < 0) {
+    printf("ERROR: can't open file '%s'\n", path);
+    return -2;
+  }
+  if(size > 0) {
+    if(size > INT_MAX) {
+      printf("ERROR: file '%s' is too big to import\n", fname);
+      return -3;
+    }
+    int ufd = open(fname, O_RDONLY);
+    char* data = (ufd < 0) ? MAP_FAILED :
+      mmap(NULL, size, PROT_READ, MAP_PRIVATE, ufd, 0);
+    if(data == MAP_FAILED) {
+      printf("ERROR: can't open file '%s' to import\n", fname);
+      return -3;
+    }
+    close(ufd);
+    madvise(data, size, MADV_SEQUENTIAL);
+    int wsz = File_Write(fd, data, (int)size);
+    munmap(data, size);
+    if(wsz != (int)size) {
+      printf("ERROR: can't write file '%s'\n", path);
+      return -5;
+    }
+  }
+  File_Close(fd);
+  return 0;
+}
+
+// copy the unix file or directory tree 'fname' into directory 'dir'
+static int import(char* dir, char* fname)
+{
+  struct stat st;
+  if(stat(fname, &st) < 0) {
+    printf("ERROR: can't find file '%s' to import\n", fname);
+    return -3;
+  }
+  char* name = strrchr(fname, '/');
+  name = name ? name+1 : fname;
+  char path[PATHSZ];
+  join(path, dir, name);
+
+  if(S_ISREG(st.st_mode)) return import_file(path, fname, st.st_size);
+  if(!S_ISDIR(st.st_mode)) {
+    printf("skipping '%s': not a file or directory\n", fname);
+    return 0;
+  }
+
+  if(Dir_Create(path) < 0) {
+    printf("ERROR: can't create directory '%s'\n", path);
+    return -2;
+  }
+  DIR* d = opendir(fname);
+  if(!d) {
+    printf("ERROR: can't read directory '%s' to import\n", fname);
+    return -4;
+  }
+  struct dirent* e; int ret = 0;
+  while(!ret && (e = readdir(d))) {
+    if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+    char child[PATHSZ];
+    snprintf(child, PATHSZ, "%s/%s", fname, e->d_name);
+    ret = import(path, child);
+  }
+  closedir(d);
+  return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 4) usage(argv[0]);
+  char *diskfile = argv[1], *dir = argv[2];
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  // everything is imported and synced in one batch
+  FS_BatchBegin();
+  int i;
+  for(i=3; i<argc; i++) {
+    // trailing slashes would leave no name to import under
+    size_t len = strlen(argv[i]);
+    while(len > 1 && argv[i][len-1] == '/') argv[i][--len] = '\0';
+    int ret = import(dir, argv[i]);
+    if(ret < 0) return ret;
+  }
+
+  if(FS_BatchCommit() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
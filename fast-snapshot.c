@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+// takes a snapshot of the file system under a name, rolls it back to
+// one, deletes one, or mounts one read-only (or the file system as it
+// is again, with unmount) for every call made after (see FS_Snapshot);
+// snapshots are kept in the memory of whoever booted the disk, so they
+// outlive the call only in the daemon: unlike the other tools, this
+// one is built as a client of it (fsd) alone
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] take|rollback|delete|mount name\n", prog);
+  printf("       %s [disk] unmount\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk", *cmd, *name = NULL;
+  if(argc == 4) { diskfile = argv[1]; cmd = argv[2]; name = argv[3]; }
+  else if(argc == 3 && !strcmp(argv[2], "unmount")) { diskfile = argv[1]; cmd = argv[2]; }
+  else if(argc == 3) { cmd = argv[1]; name = argv[2]; }
+  else if(argc == 2) cmd = argv[1];
+  else usage(argv[0]);
+  if(!strcmp(cmd, "unmount") != !name) usage(argv[0]);
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  int ret;
+  if(!strcmp(cmd, "take")) ret = FS_Snapshot(name);
+  else if(!strcmp(cmd, "rollback")) ret = FS_Rollback(name);
+  else if(!strcmp(cmd, "delete")) ret = FS_DeleteSnapshot(name);
+  else if(!strcmp(cmd, "mount") || !strcmp(cmd, "unmount")) ret = FS_MountSnapshot(name);
+  else usage(argv[0]);
+  if(ret < 0) {
+    if(osErrno == E_NO_SUCH_SNAPSHOT) printf("ERROR: no snapshot '%s'\n", name);
+    else if(osErrno == E_FILE_IN_USE) printf("ERROR: files in use\n");
+    else if(osErrno == E_READ_ONLY) printf("ERROR: a snapshot is mounted\n");
+    else printf("ERROR: can't %s snapshot '%s'\n", cmd, name ? name : "");
+    return -2;
+  }
+  printf("%s%s%s done\n", cmd, name ? " " : "", name ? name : "");
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "LibFS.h"
+#include "FSProtocol.h"
+
+// the file system daemon: boots a disk once, and serves the LibFS
+// calls of its clients (see FSProtocol.h) until it's stopped by
+// SIGINT or SIGTERM, when it syncs the disk; each client is served by
+// a thread of its own, and can only use the files and directories it
+// opened, which are closed (and the batches it began, committed) when
+// it goes away
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] [socket]\n", prog);
+  exit(1);
+}
+
+// the file descriptors (or directory handles) a client has open
+typedef struct {
+  int* ids;
+  int n, max;
+} handles_t;
+
+// a connected client
+typedef struct {
+  int sock;
+  handles_t fds; // the files it has open
+  handles_t dds; // and the directories (see Dir_Open)
+  int batches;   // the batches it has begun and not committed, to
+                 // commit when it goes away
+  char* in;      // the payload of the request being served
+  int in_cap;
+  char* out;     // the data of the reply
+  int out_cap;
+} client_t;
+
+static volatile sig_atomic_t stopping;
+
+// a rollback or the mount of a snapshot swaps the file system for
+// another, so it waits for every other request to be served, and
+// holds them off meanwhile (see FS_Rollback)
+static pthread_rwlock_t swap_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void stop(int sig)
+{
+  stopping = 1;
+}
+
+// transfer exactly 'n' bytes on the socket; return 0 if successful,
+// -1 if the connection broke
+static int read_full(int sock, void* buf, size_t n)
+{
+  while(n > 0) {
+    ssize_t r = read(sock, buf, n);
+    if(r < 0 && errno == EINTR) continue;
+    if(r <= 0) return -1;
+    buf = (char*)buf + r; n -= r;
+  }
+  return 0;
+}
+
+static int write_full(int sock, void* buf, size_t n)
+{
+  while(n > 0) {
+    ssize_t r = write(sock, buf, n);
+    if(r < 0 && errno == EINTR) continue;
+    if(r <= 0) return -1;
+    buf = (char*)buf + r; n -= r;
+  }
+  return 0;
+}
+
+// make room for 'n' bytes in '*buf'; return NULL if out of memory
+static char* grow(char** buf, int* cap, int n)
+{
+  if(n > *cap) {
+    char* b = realloc(*buf, n);
+    if(!b) return NULL;
+    *buf = b; *cap = n;
+  }
+  return *buf;
+}
+
+// the position of 'id' among the handles the client has open, -1 if not
+static int find_handle(handles_t* h, int id)
+{
+  int i;
+  for(i=0; i<h->n; i++)
+    if(h->ids[i] == id) return i;
+  return -1;
+}
+
+static int add_handle(handles_t* h, int id)
+{
+  if(h->n == h->max) {
+    int n = h->max ? 2*h->max : 16;
+    int* ids = realloc(h->ids, n*sizeof(int));
+    if(!ids) return -1;
+    h->ids = ids; h->max = n;
+  }
+  h->ids[h->n++] = id;
+  return 0;
+}
+
+static void drop_handle(handles_t* h, int id)
+{
+  h->ids[find_handle(h, id)] = h->ids[--h->n];
+}
+
+// what a Dir_Walk served has put in the reply so far
+typedef struct {
+  client_t* c;
+  int len;
+  int records;
+} walk_reply_t;
+
+// add a record of the walk to the reply, and stop once it's full
+static int walk_record(char* path, int type, int size, void* arg)
+{
+  walk_reply_t* w = (walk_reply_t*) arg;
+  int len = strlen(path)+1;
+  int n = (sizeof(fsd_walk_t)+len+sizeof(int)-1)/sizeof(int)*sizeof(int);
+  if(w->len+n > FSD_MAX_DATA || !grow(&w->c->out, &w->c->out_cap, w->len+n)) return 1;
+  fsd_walk_t rec = { type, size, len };
+  memcpy(w->c->out+w->len, &rec, sizeof(rec));
+  memcpy(w->c->out+w->len+sizeof(rec), path, len);
+  w->len += n;
+  w->records++;
+  return 0;
+}
+
+// serve one request; the payload is in c->in, and the data read goes
+// to c->out; return what the call returns, and set '*outlen'
+static int serve_request(client_t* c, fsd_request_t* req, int* outlen)
+{
+  int* a = req->args, ret;
+  char* path = c->in;
+  *outlen = 0;
+
+  // a file (or directory) can only be used by the client that opened it
+  switch(req->op) {
+  case FSD_FILE_READ: case FSD_FILE_WRITE: case FSD_FILE_PREAD:
+  case FSD_FILE_PWRITE: case FSD_FILE_SEEK: case FSD_FILE_CLOSE:
+    if(find_handle(&c->fds, a[0]) < 0) {
+      osErrno = E_BAD_FD;
+      return -1;
+    }
+    break;
+  case FSD_DIR_NEXT: case FSD_DIR_CLOSE:
+    if(find_handle(&c->dds, a[0]) < 0) {
+      osErrno = E_BAD_FD;
+      return -1;
+    }
+  }
+  // and no more can be read than a reply holds
+  int size = (req->op == FSD_DIR_READ) ? a[0] : a[1];
+  switch(req->op) {
+  case FSD_FILE_READ: case FSD_FILE_PREAD: case FSD_DIR_READ:
+    if(size < 0 || size > FSD_MAX_DATA || !grow(&c->out, &c->out_cap, size)) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+  }
+
+  switch(req->op) {
+  case FSD_BOOT:
+    return fsMaxFiles;
+  case FSD_SET_GEOMETRY:
+    return FS_SetGeometry(a[0], a[1], a[2]);
+  // the batches of a client are its own, as LibFS keeps those of
+  // each thread apart, and a client is served by a thread of its own
+  case FSD_SYNC:
+    return FS_Sync();
+  case FSD_BATCH_BEGIN:
+    c->batches++;
+    return FS_BatchBegin();
+  case FSD_BATCH_COMMIT:
+    if(c->batches > 0) c->batches--;
+    return FS_BatchCommit();
+  case FSD_FILE_CREATE:
+    return File_Create(path);
+  case FSD_FILE_OPEN:
+    ret = File_Open(path);
+    if(ret >= 0 && add_handle(&c->fds, ret) < 0) {
+      File_Close(ret);
+      osErrno = E_TOO_MANY_OPEN_FILES;
+      return -1;
+    }
+    return ret;
+  case FSD_FILE_READ:
+    ret = File_Read(a[0], c->out, a[1]);
+    if(ret > 0) *outlen = ret;
+    return ret;
+  case FSD_FILE_WRITE:
+    return File_Write(a[0], c->in, req->len);
+  case FSD_FILE_PREAD:
+    ret = File_PRead(a[0], c->out, a[1], a[2]);
+    if(ret > 0) *outlen = ret;
+    return ret;
+  case FSD_FILE_PWRITE:
+    return File_PWrite(a[0], c->in, req->len, a[1]);
+  case FSD_FILE_SEEK:
+    return File_Seek(a[0], a[1]);
+  case FSD_FILE_CLOSE:
+    ret = File_Close(a[0]);
+    if(ret == 0) drop_handle(&c->fds, a[0]);
+    return ret;
+  case FSD_FILE_UNLINK:
+    return File_Unlink(path);
+  case FSD_DIR_CREATE:
+    return Dir_Create(path);
+  case FSD_DIR_UNLINK:
+    return Dir_Unlink(path);
+  case FSD_DIR_SIZE:
+    return Dir_Size(path);
+  case FSD_DIR_READ:
+    ret = Dir_Read(path, c->out, size);
+    if(ret >= 0) *outlen = ret*FSD_DIR_ENTRY;
+    return ret;
+  case FSD_DIR_OPEN:
+    ret = Dir_Open(path);
+    if(ret >= 0 && add_handle(&c->dds, ret) < 0) {
+      Dir_Close(ret);
+      osErrno = E_TOO_MANY_OPEN_FILES;
+      return -1;
+    }
+    return ret;
+  case FSD_DIR_NEXT:
+    if(!grow(&c->out, &c->out_cap, FSD_DIR_ENTRY)) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    ret = Dir_Next(a[0], c->out);
+    if(ret > 0) *outlen = FSD_DIR_ENTRY;
+    return ret;
+  case FSD_DIR_CLOSE:
+    ret = Dir_Close(a[0]);
+    if(ret == 0) drop_handle(&c->dds, a[0]);
+    return ret;
+  case FSD_DIR_WALK: {
+    walk_reply_t w = { c, 0, 0 };
+    if(Dir_Walk(path, walk_record, &w) < 0) return -1;
+    *outlen = w.len;
+    return w.records;
+  }
+  case FSD_DIR_REMOVE_TREE:
+    return Dir_RemoveTree(path);
+  case FSD_SNAPSHOT:
+    return FS_Snapshot(path);
+  case FSD_ROLLBACK:
+    return FS_Rollback(path);
+  case FSD_DELETE_SNAPSHOT:
+    return FS_DeleteSnapshot(path);
+  case FSD_MOUNT_SNAPSHOT:
+    return FS_MountSnapshot(req->len ? path : NULL);
+  case FSD_DIR_USAGE:
+    if(!grow(&c->out, &c->out_cap, sizeof(FS_Usage_t))) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    ret = Dir_Usage(path, (FS_Usage_t*) c->out);
+    if(ret == 0) *outlen = sizeof(FS_Usage_t);
+    return ret;
+  case FSD_CHECK:
+    if(!grow(&c->out, &c->out_cap, sizeof(FS_Check_t))) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    ret = FS_Check(a[0], (FS_Check_t*) c->out);
+    if(ret >= 0) *outlen = sizeof(FS_Check_t);
+    return ret;
+  case FSD_GET_STATS:
+    if(!grow(&c->out, &c->out_cap, sizeof(FS_Stats_t))) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    ret = FS_GetStats((FS_Stats_t*) c->out);
+    if(ret == 0) *outlen = sizeof(FS_Stats_t);
+    return ret;
+  case FSD_RESET_STATS:
+    FS_ResetStats();
+    return 0;
+  case FSD_STATS_TIMING:
+    FS_SetStatsTiming(a[0]);
+    return 0;
+  case FSD_TRACE:
+    FS_SetTrace(a[0]);
+    return 0;
+  case FSD_TRACE_DUMP:
+    return FS_TraceDump(req->len ? path : NULL);
+  case FSD_TRACE_DUMP_ON_ERROR:
+    FS_SetTraceDumpOnError(a[0], req->len ? path : NULL);
+    return 0;
+  default:
+    osErrno = E_GENERAL;
+    return -1;
+  }
+}
+
+// serve a client until it goes away
+static void* serve(void* arg)
+{
+  client_t* c = (client_t*) arg;
+  fsd_request_t req;
+  while(read_full(c->sock, &req, sizeof(req)) == 0) {
+    // a payload (path or data) always gets a '\0' after it
+    if(req.len < 0 || req.len > FSD_MAX_DATA ||
+       !grow(&c->in, &c->in_cap, req.len+1) ||
+       read_full(c->sock, c->in, req.len) < 0)
+      break;
+    c->in[req.len] = '\0';
+
+    fsd_reply_t rep;
+    int swap = (req.op == FSD_ROLLBACK || req.op == FSD_MOUNT_SNAPSHOT);
+    if(swap) pthread_rwlock_wrlock(&swap_lock);
+    else pthread_rwlock_rdlock(&swap_lock);
+    osErrno = E_GENERAL;
+    rep.ret = serve_request(c, &req, &rep.len);
+    rep.err = osErrno;
+    pthread_rwlock_unlock(&swap_lock);
+    if(write_full(c->sock, &rep, sizeof(rep)) < 0 ||
+       write_full(c->sock, c->out, rep.len) < 0)
+      break;
+  }
+
+  int i;
+  for(i=0; i<c->fds.n; i++) File_Close(c->fds.ids[i]);
+  for(i=0; i<c->dds.n; i++) Dir_Close(c->dds.ids[i]);
+  while(c->batches-- > 0) FS_BatchCommit();
+  close(c->sock);
+  free(c->fds.ids); free(c->dds.ids); free(c->in); free(c->out); free(c);
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk", sockname[FSD_MAX_PATH];
+  if(argc > 3) usage(argv[0]);
+  if(argc >= 2) diskfile = argv[1];
+  if(argc == 3) snprintf(sockname, sizeof(sockname), "%s", argv[2]);
+  else snprintf(sockname, sizeof(sockname), "%s%s", diskfile, FSD_SOCKET_SUFFIX);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(sockname) >= sizeof(addr.sun_path)) {
+    printf("ERROR: socket name '%s' is too long\n", sockname);
+    return -1;
+  }
+  strcpy(addr.sun_path, sockname);
+
+  // a socket left behind by a daemon that's gone is taken over, but
+  // not the socket of one still running
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock >= 0 && connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    printf("ERROR: a daemon is already serving on '%s'\n", sockname);
+    return -1;
+  }
+  close(sock);
+  unlink(sockname);
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+     listen(sock, SOMAXCONN) < 0) {
+    printf("ERROR: can't listen on socket '%s'\n", sockname);
+    return -2;
+  }
+
+  // accept() is interrupted (no SA_RESTART) when it's time to stop,
+  // and a client going away mid-reply is no reason to
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  printf("serving disk '%s' on socket '%s'\n", diskfile, sockname);
+  fflush(stdout);
+
+  // only the thread accepting clients is interrupted by the signals
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+
+  while(!stopping) {
+    int s = accept(sock, NULL, NULL);
+    if(s < 0) {
+      if(errno != EINTR) perror("accept");
+      continue;
+    }
+    client_t* c = calloc(1, sizeof(client_t));
+    pthread_t t;
+    if(!c) { close(s); continue; }
+    c->sock = s;
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    int err = pthread_create(&t, NULL, serve, c);
+    pthread_sigmask(SIG_UNBLOCK, &stop_signals, NULL);
+    if(err != 0) {
+      close(s); free(c);
+      continue;
+    }
+    pthread_detach(t);
+  }
+
+  // whatever batches clients still have open are committed as well
+  close(sock);
+  unlink(sockname);
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  printf("disk '%s' synced, stopped\n", diskfile);
+  return 0;
+}
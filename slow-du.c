@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+// prints what a directory and everything under it (or a file) holds,
+// and the sectors it takes up (see Dir_Usage)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] path\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *path;
+  if(argc != 2 && argc != 3) usage(argv[0]);
+  if(argc == 3) { diskfile = argv[1]; path = argv[2]; }
+  else { diskfile = "default-disk"; path = argv[1]; }
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  FS_Usage_t u;
+  if(Dir_Usage(path, &u) < 0) {
+    printf("ERROR: can't add up '%s'\n", path);
+    return -2;
+  }
+  printf("%ld files, %ld directories, %ld bytes, %ld sectors: %s\n",
+	 u.files, u.dirs, u.bytes, u.sectors, path);
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+// checks that the bitmaps of the file system agree with what the tree
+// reached from the root takes (see FS_Check), and lists the problems
+// found; 'repair' makes the bitmaps match
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] [check|repair]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk", *cmd = "check";
+  if(argc > 3) usage(argv[0]);
+  if(argc >= 2) diskfile = argv[1];
+  if(argc == 3) cmd = argv[2];
+  if(strcmp(cmd, "check") && strcmp(cmd, "repair")) usage(argv[0]);
+  int repair = !strcmp(cmd, "repair");
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  FS_Check_t r;
+  int left = FS_Check(repair, &r);
+  if(left < 0) {
+    printf("ERROR: can't check disk '%s'\n", diskfile);
+    return -2;
+  }
+  printf("%-16s %10ld\n", "inodes", r.inodes);
+  printf("%-16s %10ld\n", "sectors", r.sectors);
+  printf("%-16s %10ld\n", "lost inodes", r.lost_inodes);
+  printf("%-16s %10ld\n", "missing inodes", r.missing_inodes);
+  printf("%-16s %10ld\n", "lost sectors", r.lost_sectors);
+  printf("%-16s %10ld\n", "missing sectors", r.missing_sectors);
+  printf("%-16s %10ld\n", "shared sectors", r.shared_sectors);
+  printf("%-16s %10ld\n", "bad entries", r.bad_entries);
+  printf("%-16s %10ld\n", "bad pointers", r.bad_pointers);
+  printf("%-16s %10ld\n", "bad inodes", r.bad_inodes);
+  if(left > 0) {
+    printf("ERROR: %d problems left on disk '%s'\n", left, diskfile);
+    return -2;
+  }
+  printf("disk '%s' is consistent\n", diskfile);
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
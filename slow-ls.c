@@ -20,29 +20,25 @@ int main(int argc, char *argv[])
     printf("ERROR: can't boot file system from file '%s'\n", diskfile);
     return -1;
   }
-  int sz = Dir_Size(path);
-  if(sz < 0) {
+  // the entries are listed as they're read, however many there are
+  int dd = Dir_Open(path);
+  if(dd < 0) {
     printf("ERROR: can't list '%s'\n", path);
     return -2;
-  } else if (sz == 0) {
-    printf("directory '%s': empty\n", path);
-    return 0;
   }
-  
-  char* buf = malloc(sz);
-  int entries = Dir_Read(path, buf, sz);
-  if(entries < 0) {
+
+  int entry[5]; // the name (16 bytes), then the inode
+  int i, r;
+  for(i=0; (r = Dir_Next(dd, entry)) > 0; i++) {
+    if(i == 0) printf("directory '%s':\n     %-15s\t%-s\n", path, "NAME", "INODE");
+    printf("%-4d %-15s\t%-d\n", i, (char*)entry, entry[4]);
+  }
+  Dir_Close(dd);
+  if(r < 0) {
     printf("ERROR: can't list '%s'\n", path);
     return -3;
   }
-  
-  printf("directory '%s':\n     %-15s\t%-s\n", path, "NAME", "INODE");
-  int idx = 0;
-  for(int i=0; i<entries; i++) {
-    printf("%-4d %-15s\t%-d\n", i, &buf[idx], *(int*)&buf[idx+16]);
-    idx += 20;
-  }
-  free(buf);
+  if(i == 0) printf("directory '%s': empty\n", path);
 
   if(FS_Sync() < 0) {
     printf("ERROR: can't sync disk '%s'\n", diskfile);
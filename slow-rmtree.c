@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+// removes a directory and everything under it, or a file (see
+// Dir_RemoveTree); files in use are left, with the directories
+// holding them
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] path\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *path;
+  if(argc != 2 && argc != 3) usage(argv[0]);
+  if(argc == 3) { diskfile = argv[1]; path = argv[2]; }
+  else { diskfile = "default-disk"; path = argv[1]; }
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  if(Dir_RemoveTree(path) < 0) {
+    if(osErrno == E_FILE_IN_USE)
+      printf("ERROR: files in use are left in '%s'\n", path);
+    else printf("ERROR: can't remove '%s'\n", path);
+    return -2;
+  }
+  printf("'%s' removed successfully\n", path);
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+// prints the statistics of the calls made to the file system (see
+// FS_GetStats): those made by the daemon serving the disk for all its
+// clients, when run as a client (fast-stats), or just those of its own
+// boot otherwise; it can also reset them, turn the timing of the
+// calls on or off, turn the trace of the calls on or off, and dump it
+// (see FS_TraceDump) to stderr, or to a file (of the daemon, for
+// fast-stats)
+
+static char* op_names[FS_OPS] = {
+  "FS_Boot", "FS_Sync", "FS_BatchCommit",
+  "File_Create", "File_Open", "File_Read", "File_Write",
+  "File_PRead", "File_PWrite", "File_Seek", "File_Close", "File_Unlink",
+  "Dir_Create", "Dir_Unlink", "Dir_Size", "Dir_Read",
+  "Dir_Walk", "Dir_RemoveTree", "Dir_Usage",
+  "Dir_Open", "Dir_Next", "Dir_Close",
+  "FS_Snapshot", "FS_Rollback", "FS_DeleteSnapshot", "FS_MountSnapshot",
+  "FS_Check",
+};
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk] [show|reset|timing-on|timing-off|trace-on|trace-off|trace [file]]\n", prog);
+  exit(1);
+}
+
+static void print_row(char* name, FS_OpStats_t* st)
+{
+  printf("%-15s %8ld %9ld %9ld %9ld %9ld %7ld %10ld %8ld %11ld %10ld %9.1f",
+	 name, st->calls, st->sector_reads, st->sector_writes, st->cache_hits,
+	 st->cache_misses, st->bitmap_scans, st->bitmap_bits, st->path_components,
+	 st->bytes_copied, st->seek_distance, st->disk_nanoseconds/1e6);
+  if(st->nanoseconds && st->calls) printf(" %9.1f\n", st->nanoseconds/1e3/st->calls);
+  else printf(" %9s\n", "-");
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile = "default-disk", *cmd = "show", *file = NULL;
+  if(argc > 4) usage(argv[0]);
+  if(argc >= 2) diskfile = argv[1];
+  if(argc >= 3) cmd = argv[2];
+  if(argc == 4) {
+    if(strcmp(cmd, "trace")) usage(argv[0]);
+    file = argv[3];
+  }
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  if(!strcmp(cmd, "reset")) FS_ResetStats();
+  else if(!strcmp(cmd, "timing-on")) FS_SetStatsTiming(1);
+  else if(!strcmp(cmd, "timing-off")) FS_SetStatsTiming(0);
+  else if(!strcmp(cmd, "trace-on")) FS_SetTrace(1);
+  else if(!strcmp(cmd, "trace-off")) FS_SetTrace(0);
+  else if(!strcmp(cmd, "trace")) {
+    if(FS_TraceDump(file) < 0) {
+      printf("ERROR: can't dump the trace to '%s'\n", file ? file : "stderr");
+      return -2;
+    }
+  }
+  else if(strcmp(cmd, "show")) usage(argv[0]);
+  else {
+    FS_Stats_t stats;
+    if(FS_GetStats(&stats) < 0) {
+      printf("ERROR: can't get the statistics of disk '%s'\n", diskfile);
+      return -2;
+    }
+    printf("%-15s %8s %9s %9s %9s %9s %7s %10s %8s %11s %10s %9s %9s\n", "CALL", "CALLS",
+	   "SECT-RD", "SECT-WR", "CACHE-HIT", "CACHE-MIS", "BM-SCAN", "BM-BITS",
+	   "PATH", "BYTES", "SEEK", "DISK-MS", "AVG-US");
+    FS_OpStats_t total;
+    memset(&total, 0, sizeof(total));
+    int i, j;
+    for(i=0; i<FS_OPS; i++) {
+      if(stats.ops[i].calls == 0) continue;
+      print_row(op_names[i], &stats.ops[i]);
+      long* from = (long*) &stats.ops[i], *to = (long*) &total;
+      for(j=0; j<(int)(sizeof(FS_OpStats_t)/sizeof(long)); j++) to[j] += from[j];
+    }
+    print_row("total", &total);
+  }
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  return 0;
+}
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "LibFS.h"
+
+// checks that the batches of a thread are its own: FS_Sync() in the
+// batch commits nothing (and says so), while FS_Sync() in another
+// thread commits what the batch has changed so far; and that a batch
+// too large for the journal is committed in several goes, so that a
+// crash in the middle of it leaves a consistent disk with part of the
+// batch, each call in it whole or not at all
+
+// with 4000 sectors of 512 bytes, the journal holds 250 sectors; the
+// large batch changes more metadata than that (file data isn't logged)
+#define SECTORS 4000
+#define FILES 600 // files written by the large batch
+#define BIG 1000  // bytes of each
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file>\n", prog);
+  exit(1);
+}
+
+static int failures;
+
+static void check(int ok, char* what, int n)
+{
+  if(ok) return;
+  printf("ERROR: %s (%d), osErrno=%d\n", what, n, osErrno);
+  failures++;
+}
+
+static int file_data(int i, char* buf)
+{
+  int j, size = (i < FILES) ? BIG : 100;
+  for(j=0; j<size; j++) buf[j] = (char)(i*13 + j);
+  return size;
+}
+
+// write the i-th file (under 'dir'), whole; return 0 if successful,
+// -1 otherwise
+static int write_file(char* dir, int i)
+{
+  char fn[32], buf[BIG];
+  sprintf(fn, "%s/f%d", dir, i);
+  int fd = (File_Create(fn) < 0) ? -1 : File_Open(fn), size = file_data(i, buf);
+  return (fd < 0 || File_Write(fd, buf, size) != size || File_Close(fd) < 0) ? -1 : 0;
+}
+
+// return 1 if the i-th file (under 'dir') is there whole, 0 if it
+// isn't there, and -1 if it's there but not as written; one made by a
+// call committed before the next one wrote it may be there empty, if
+// 'empty' is set
+static int file_there(char* dir, int i, int empty)
+{
+  char fn[32], buf[BIG+1], want[BIG];
+  sprintf(fn, "%s/f%d", dir, i);
+  int fd = File_Open(fn);
+  if(fd < 0) return 0;
+  int size = file_data(i, want), got = File_Read(fd, buf, sizeof(buf));
+  File_Close(fd);
+  if(got == size && !memcmp(buf, want, size)) return 1;
+  return (empty && got == 0) ? 0 : -1;
+}
+
+static void* sync_thread(void* arg)
+{
+  *(int*)arg = FS_Sync();
+  return NULL;
+}
+
+// the process crashed: in a batch, writes files another thread then
+// syncs, and one more its own FS_Sync() leaves for the end of a batch
+// that never comes
+static void sync_child(char* disk)
+{
+  int i, ret = -1;
+  pthread_t t;
+  if(FS_Boot(disk) < 0 || Dir_Create("/s") < 0 || FS_Sync() != 0 || FS_BatchBegin() < 0) _exit(1);
+  for(i=0; i<10; i++)
+    if(write_file("/s", FILES+i) < 0) _exit(1);
+  if(pthread_create(&t, NULL, sync_thread, &ret) != 0) _exit(1);
+  pthread_join(t, NULL);
+  if(ret != 0 || write_file("/s", FILES+10) < 0) _exit(1);
+  _exit(FS_Sync() == 1 ? 0 : 1);
+}
+
+// the process crashed: writes more files in a batch than the journal
+// holds, and never commits it
+static void large_child(char* disk)
+{
+  int i;
+  if(FS_Boot(disk) < 0 || Dir_Create("/l") < 0 || FS_Sync() != 0 || FS_BatchBegin() < 0) _exit(1);
+  for(i=0; i<FILES; i++)
+    if(write_file("/l", i) < 0) _exit(1);
+  _exit(0);
+}
+
+// run 'child' in a process of its own, and check it got to its end
+static void in_child(char* disk, void (*child)(char*), char* what)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if(pid == 0) child(disk);
+  int status;
+  check(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+	WEXITSTATUS(status) == 0, what, 0);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) usage(argv[0]);
+  char* disk = argv[1];
+  int i, n, bad;
+  FS_Check_t r;
+
+  unlink(disk);
+  FS_SetGeometry(512, SECTORS, 1000);
+  if(FS_Boot(disk) < 0 || FS_Sync() != 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", disk);
+    return -1;
+  }
+
+  // nested batches commit with the outermost one, and one can't be
+  // committed twice
+  check(FS_BatchBegin() == 0 && FS_BatchBegin() == 0, "can't begin batches", 0);
+  check(FS_Sync() == 1, "synced in a batch", 0);
+  check(FS_BatchCommit() == 0 && FS_Sync() == 1, "inner batch ended the outer one", 0);
+  check(FS_BatchCommit() == 0 && FS_Sync() == 0, "can't commit batch", 0);
+  check(FS_BatchCommit() == -1 && osErrno == E_GENERAL, "committed a batch not begun", 0);
+
+  // what another thread synced is there, what the batch's own
+  // FS_Sync() left isn't
+  in_child(disk, sync_child, "can't write and sync in a batch");
+  check(FS_Boot(disk) == 0, "can't boot the disk after a crash", 0);
+  for(i=0, bad=0; i<10; i++) bad += (file_there("/s", FILES+i, 0) != 1);
+  check(bad == 0, "files synced by another thread lost", bad);
+  check(file_there("/s", FILES+10, 1) == 0, "file of a batch not committed kept", 0);
+  check(FS_Check(0, &r) == 0, "problems on the disk after a crash", 0);
+  printf("what another thread synced kept after a crash, and nothing else\n");
+
+  // part of a large batch is there, each file whole or not at all
+  in_child(disk, large_child, "can't write a large batch");
+  check(FS_Boot(disk) == 0, "can't boot the disk after a crash", 1);
+  for(i=0, n=0, bad=0; i<FILES; i++) {
+    int there = file_there("/l", i, 1);
+    bad += (there < 0);
+    n += (there > 0);
+  }
+  check(bad == 0, "files of a batch cut short by a crash", bad);
+  check(n > 0 && n < FILES, "large batch not committed in several goes", n);
+  check(FS_Check(0, &r) == 0, "problems on the disk after a crash", 1);
+  printf("%d files of %d kept of a large batch after a crash\n", n, FILES);
+
+  // and one committed is there whole
+  check(Dir_RemoveTree("/l") == 0 && Dir_Create("/l") == 0 && FS_Sync() == 0, "can't start over", 0);
+  check(FS_BatchBegin() == 0, "can't begin batch", 1);
+  for(i=0; i<FILES; i++) check(write_file("/l", i) == 0, "can't write file", i);
+  check(FS_BatchCommit() == 0, "can't commit batch", 1);
+  check(FS_Boot(disk) == 0, "can't boot again", 0);
+  for(i=0, bad=0; i<FILES; i++) bad += (file_there("/l", i, 0) != 1);
+  check(bad == 0, "files of a large batch lost", bad);
+  check(FS_Check(0, &r) == 0, "problems on the disk", 2);
+  check(FS_Sync() == 0, "can't sync", 0);
+
+  if(failures > 0) {
+    printf("ERROR: %d checks failed\n", failures);
+    return -2;
+  }
+  printf("every batch committed as its thread wanted\n");
+  return 0;
+}
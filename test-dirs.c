@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "LibFS.h"
+
+// fills a directory well past the number of entries from which it's
+// hashed, up to the most it can hold, and checks that every name is
+// found, and only those, as entries are removed (and others moved in
+// their place) and added again, before and after the disk is booted
+// again
+
+// the most entries a directory holds, and the number from which it's
+// hashed, with sectors of 512 bytes and entries of 20
+#define SECTOR 512
+#define DIRENT 20
+#define MAX_ENTRIES (28*(SECTOR/DIRENT))
+#define HASHED (SECTOR/DIRENT)
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file>\n", prog);
+  exit(1);
+}
+
+static int failures;
+
+static void check(int ok, char* what, int n)
+{
+  if(ok) return;
+  printf("ERROR: %s (%d), osErrno=%d\n", what, n, osErrno);
+  failures++;
+}
+
+// whether entry i of the directory should be there: the first
+// 'created' (but those removed, the odd ones, if 'removed' is set),
+// and the first 'added' of the others
+static int wanted(int i, int created, int removed, int added)
+{
+  if(i < MAX_ENTRIES) return i < created && (!removed || i%2 == 0);
+  return i-MAX_ENTRIES < added;
+}
+
+static void entry_name(char* fn, int i)
+{
+  if(i < MAX_ENTRIES) sprintf(fn, "/d/n%d", i);
+  else sprintf(fn, "/d/m%d", i-MAX_ENTRIES);
+}
+
+// whether there's such a file, or directory (the even entries made
+// first are directories)
+static int exists(char* fn)
+{
+  int fd = File_Open(fn);
+  if(fd < 0) return Dir_Size(fn) >= 0;
+  File_Close(fd);
+  return 1;
+}
+
+// check that the directory holds the entries wanted and no others, by
+// looking each of them up, and by listing the directory both ways
+static void check_dir(int created, int removed, int added, char* when)
+{
+  static char buf[MAX_ENTRIES*DIRENT];
+  char fn[32], seen[2*MAX_ENTRIES];
+  int i, n = 0, bad = 0;
+
+  for(i=0; i<2*MAX_ENTRIES; i++) {
+    entry_name(fn, i);
+    if(exists(fn) != wanted(i, created, removed, added)) bad++;
+    n += wanted(i, created, removed, added);
+  }
+  check(bad == 0, "wrong entries found", bad);
+  check(Dir_Size("/d") == n*DIRENT, "wrong directory size", Dir_Size("/d"));
+
+  // each entry listed once, those wanted only
+  memset(seen, 0, sizeof(seen));
+  check(Dir_Read("/d", buf, sizeof(buf)) == n, "wrong number of entries read", n);
+  for(i=0, bad=0; i<n; i++) {
+    char* name = buf + i*DIRENT;
+    int j = atoi(name+1) + (name[0] == 'm' ? MAX_ENTRIES : 0);
+    if(j < 0 || j >= 2*MAX_ENTRIES || seen[j]++ || !wanted(j, created, removed, added)) bad++;
+  }
+  check(bad == 0, "wrong entries read", bad);
+
+  int dd = Dir_Open("/d"), listed = 0;
+  check(dd >= 0, "can't open directory", 0);
+  while(dd >= 0 && Dir_Next(dd, buf) == 1) listed++;
+  if(dd >= 0) Dir_Close(dd);
+  check(listed == n, "wrong number of entries listed", listed);
+  printf("%d entries found %s\n", n, when);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) usage(argv[0]);
+  char* disk = argv[1];
+
+  unlink(disk);
+  FS_SetGeometry(SECTOR, 10000, 2000);
+  if(FS_Boot(disk) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", disk);
+    return -1;
+  }
+
+  char fn[32];
+  int i;
+  check(Dir_Create("/d") == 0, "can't create directory", 0);
+
+  // fill the directory, going past the point where it's hashed
+  for(i=0; i<MAX_ENTRIES; i++) {
+    entry_name(fn, i);
+    if(i%2) check(File_Create(fn) == 0, "can't create file", i);
+    else check(Dir_Create(fn) == 0, "can't create directory", i);
+    if(i == HASHED) check_dir(i+1, 0, 0, "once hashed");
+  }
+  check_dir(MAX_ENTRIES, 0, 0, "in the full directory");
+  check(File_Create("/d/toomany") == -1 && osErrno == E_CREATE, "created past the most entries", 0);
+  for(i=0; i<MAX_ENTRIES; i += 97) {
+    entry_name(fn, i);
+    check(File_Create(fn) == -1 && osErrno == E_CREATE, "created a file twice", i);
+    check(Dir_Create(fn) == -1 && osErrno == E_CREATE, "created a directory twice", i);
+  }
+  check(Dir_Unlink("/d") == -1 && osErrno == E_DIR_NOT_EMPTY, "removed a full directory", 0);
+
+  // remove every other entry, the last ones moving to fill their places
+  for(i=1; i<MAX_ENTRIES; i += 2) {
+    entry_name(fn, i);
+    check(File_Unlink(fn) == 0, "can't unlink file", i);
+  }
+  check_dir(MAX_ENTRIES, 1, 0, "once half of them removed");
+  for(i=0; i<MAX_ENTRIES/2; i++) {
+    entry_name(fn, MAX_ENTRIES+i);
+    check(File_Create(fn) == 0, "can't create file", MAX_ENTRIES+i);
+  }
+  check_dir(MAX_ENTRIES, 1, MAX_ENTRIES/2, "once as many added");
+
+  check(FS_Sync() == 0, "can't sync", 0);
+  check(FS_Boot(disk) == 0, "can't boot again", 0);
+  check_dir(MAX_ENTRIES, 1, MAX_ENTRIES/2, "after booting again");
+
+  // the directories left behind in it go with it
+  check(Dir_RemoveTree("/d") == 0, "can't remove directory tree", 0);
+  check(File_Open("/d/n0") == -1, "found an entry of a directory removed", 0);
+  check(Dir_Create("/d") == 0, "can't create directory again", 0);
+  for(i=0; i<MAX_ENTRIES/2; i++) {
+    entry_name(fn, i);
+    check(File_Create(fn) == 0, "can't create file", i);
+  }
+  check(Dir_Size("/d") == MAX_ENTRIES/2*DIRENT, "wrong directory size", Dir_Size("/d"));
+
+  FS_Check_t r;
+  check(FS_Check(0, &r) == 0, "problems on the disk", 0);
+  check(r.inodes == 2+MAX_ENTRIES/2, "wrong number of inodes", (int)r.inodes);
+  check(FS_Sync() == 0, "can't sync", 0);
+
+  if(failures > 0) {
+    printf("ERROR: %d checks failed\n", failures);
+    return -2;
+  }
+  printf("every directory entry found as wanted\n");
+  return 0;
+}
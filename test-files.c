@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "LibFS.h"
+#include "LibDisk.h"
+
+// writes files past their direct sectors, through the indirect and the
+// double-indirect sector up to the largest size a file can have, and
+// checks what's read back, before and after the disk is booted again,
+// and that their sectors are all given back once they're removed
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file>\n", prog);
+  exit(1);
+}
+
+static int failures;
+
+static void check(int ok, char* what, int n)
+{
+  if(ok) return;
+  printf("ERROR: %s (%d), osErrno=%d\n", what, n, osErrno);
+  failures++;
+}
+
+static void fill(char* buf, int size, int seed)
+{
+  int i;
+  for(i=0; i<size; i++) buf[i] = (char)(seed + i*13 + i/SECTOR_SIZE);
+}
+
+// write a file of 'size' bytes in odd-sized pieces, so that the pieces
+// straddle sectors and the ends of the direct and indirect pointers
+static void write_file(char* fn, char* data, int size)
+{
+  check(File_Create(fn) == 0, "can't create file", size);
+  int fd = File_Open(fn), done = 0;
+  check(fd >= 0, "can't open file", size);
+  while(done < size) {
+    int n = 1000 + (done/7)%60000;
+    if(n > size-done) n = size-done;
+    if(File_Write(fd, data+done, n) != n) {
+      check(0, "can't write file", done);
+      break;
+    }
+    done += n;
+  }
+  File_Close(fd);
+}
+
+static void read_file(char* fn, char* data, int size, char* buf)
+{
+  int fd = File_Open(fn);
+  check(fd >= 0, "can't open file", size);
+  memset(buf, 0, size);
+  check(File_Read(fd, buf, size+1) == size, "wrong size read", size);
+  check(!memcmp(buf, data, size), "wrong content read", size);
+  File_Close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) usage(argv[0]);
+  char* disk = argv[1];
+
+  // a disk large enough for a file of the largest size
+  unlink(disk);
+  FS_SetGeometry(512, 20000, 100);
+  if(FS_Boot(disk) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", disk);
+    return -1;
+  }
+
+  FS_Check_t empty;
+  check(FS_Check(0, &empty) == 0, "problems on the new disk", 0);
+
+  // sizes just past the direct sectors, in the indirect range, just
+  // past it, and the largest
+  int direct = DIRECT_SECTORS_PER_FILE*SECTOR_SIZE, indirect = direct + POINTERS_PER_SECTOR*SECTOR_SIZE;
+  int sizes[] = { direct+1, indirect-100, indirect+SECTOR_SIZE*3+7, MAX_FILE_SIZE };
+  int nsizes = sizeof(sizes)/sizeof(sizes[0]), i;
+  char* data = malloc(MAX_FILE_SIZE), *buf = malloc(MAX_FILE_SIZE+1);
+  char fn[32];
+
+  for(i=0; i<nsizes; i++) {
+    sprintf(fn, "/big%d", i);
+    fill(data, sizes[i], i);
+    write_file(fn, data, sizes[i]);
+    read_file(fn, data, sizes[i], buf);
+    printf("file '%s' of %d bytes written and read back\n", fn, sizes[i]);
+
+    // overwritten across the end of the indirect pointers, and read
+    // back piece by piece at offsets
+    if(sizes[i] > indirect+4096) {
+      int fd = File_Open(fn), off = indirect-2000;
+      fill(data+off, 4000, 99);
+      check(File_PWrite(fd, data+off, 4000, off) == 4000, "can't overwrite file", off);
+      for(off=0; off<sizes[i]; off += 100003)
+	check(File_PRead(fd, buf, 777, off) == (sizes[i]-off < 777 ? sizes[i]-off : 777) &&
+	      !memcmp(buf, data+off, sizes[i]-off < 777 ? sizes[i]-off : 777), "wrong content at offset", off);
+      check(File_PWrite(fd, data, 1, MAX_FILE_SIZE) == -1 && osErrno == E_FILE_TOO_BIG,
+	    "wrote past the largest size", i);
+      File_Close(fd);
+    }
+
+    check(FS_Sync() == 0, "can't sync", i);
+    check(FS_Boot(disk) == 0, "can't boot again", i);
+    read_file(fn, data, sizes[i], buf);
+    printf("file '%s' read back after booting again\n", fn);
+
+    // the largest file is kept for the check of the disk at the end
+    if(i < nsizes-1) check(File_Unlink(fn) == 0, "can't unlink file", i);
+  }
+
+  FS_Check_t r;
+  check(FS_Check(0, &r) == 0, "problems on the disk", 0);
+  check(r.inodes == empty.inodes+1, "wrong number of inodes", (int)r.inodes);
+  // the largest file takes its data sectors, the indirect sector, the
+  // double-indirect one and all the indirect sectors it points to, and
+  // the root directory a sector for its entry
+  int taken = MAX_SECTORS_PER_FILE + 2 + POINTERS_PER_SECTOR + 1;
+  check(r.sectors == empty.sectors+taken, "wrong number of sectors taken", (int)r.sectors);
+  check(File_Unlink("/big3") == 0, "can't unlink file", 3);
+  check(FS_Check(0, &r) == 0 && r.sectors == empty.sectors, "sectors not given back", (int)r.sectors);
+  write_file("/big3", data, MAX_FILE_SIZE);
+  check(FS_Sync() == 0, "can't sync", 0);
+
+  free(data);
+  free(buf);
+  if(failures > 0) {
+    printf("ERROR: %d checks failed\n", failures);
+    return -2;
+  }
+  printf("every file read back as written\n");
+  return 0;
+}
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "LibFS.h"
+
+// corrupts the inode and sector bitmaps of a disk image, marking in
+// use some inodes and sectors that are free and marking free some that
+// are in use, and checks that FS_Check() finds exactly those, that it
+// repairs them, and that nothing is lost or handed out twice after
+
+// with sectors of 512 bytes, 4000 sectors and 1000 files, the inode
+// bitmap takes sector 1 and the sector bitmap sector 2
+#define SECTOR 512
+#define SECTORS 4000
+#define INODES 1000
+#define INODE_BITMAP (1*SECTOR)
+#define SECTOR_BITMAP (2*SECTOR)
+
+#define FILES 40
+#define LOST 5    // entries marked in use but free, in each bitmap
+#define MISSING 3 // entries marked free but in use, in each bitmap
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file>\n", prog);
+  exit(1);
+}
+
+static int failures;
+
+static void check(int ok, char* what, int n)
+{
+  if(ok) return;
+  printf("ERROR: %s (%d), osErrno=%d\n", what, n, osErrno);
+  failures++;
+}
+
+static int file_data(int i, char* buf)
+{
+  int j, size = 700*(i%5) + i*3 + 1;
+  for(j=0; j<size; j++) buf[j] = (char)(i*11 + j);
+  return size;
+}
+
+static void write_files(int first, int n)
+{
+  char fn[32], buf[4000];
+  int i;
+  for(i=first; i<first+n; i++) {
+    sprintf(fn, "/d%d/f%d", i%4, i);
+    check(File_Create(fn) == 0, "can't create file", i);
+    int fd = File_Open(fn), size = file_data(i, buf);
+    check(fd >= 0 && File_Write(fd, buf, size) == size, "can't write file", i);
+    if(fd >= 0) File_Close(fd);
+  }
+}
+
+static void check_files(int n, char* when)
+{
+  char fn[32], buf[4001], want[4000];
+  int i, bad = 0;
+  for(i=0; i<n; i++) {
+    sprintf(fn, "/d%d/f%d", i%4, i);
+    int fd = File_Open(fn), size = file_data(i, want);
+    if(fd < 0 || File_Read(fd, buf, sizeof(buf)) != size || memcmp(buf, want, size)) bad++;
+    if(fd >= 0) File_Close(fd);
+  }
+  check(bad == 0, "wrong files", bad);
+  printf("%d files read back %s\n", n, when);
+}
+
+// flip bits of a bitmap of 'nbits' entries, stored from 'offset' of the
+// image, the most significant bit of each byte first: the 'lost'
+// highest free entries are marked in use, and the 'missing' highest
+// entries in use marked free
+static void corrupt(FILE* f, long offset, int nbits, int lost, int missing)
+{
+  unsigned char map[SECTOR];
+  int i;
+  fseek(f, offset, SEEK_SET);
+  check(fread(map, 1, (nbits+7)/8, f) == (nbits+7)/8, "can't read bitmap", 0);
+  for(i=nbits-1; i>=0 && (lost > 0 || missing > 0); i--) {
+    int set = map[i/8] & (0x80 >> (i%8));
+    if(!set && lost > 0) lost--;
+    else if(set && missing > 0) missing--;
+    else continue;
+    map[i/8] ^= 0x80 >> (i%8);
+  }
+  check(lost == 0 && missing == 0, "not enough bits to flip", nbits);
+  fseek(f, offset, SEEK_SET);
+  check(fwrite(map, 1, (nbits+7)/8, f) == (nbits+7)/8, "can't write bitmap", 0);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) usage(argv[0]);
+  char* disk = argv[1];
+
+  unlink(disk);
+  FS_SetGeometry(SECTOR, SECTORS, INODES);
+  if(FS_Boot(disk) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", disk);
+    return -1;
+  }
+
+  char fn[32];
+  int i;
+  for(i=0; i<4; i++) {
+    sprintf(fn, "/d%d", i);
+    check(Dir_Create(fn) == 0, "can't create directory", i);
+  }
+  write_files(0, FILES);
+  FS_Check_t good, r;
+  check(FS_Check(0, &good) == 0, "problems on the disk", 0);
+  check(FS_Sync() == 0, "can't sync", 0);
+
+  // the free entries flipped are the highest ones, far from those in
+  // use, and those in use the last ones taken: the last files written
+  FILE* f = fopen(disk, "r+b");
+  if(!f) {
+    printf("ERROR: can't open disk image '%s'\n", disk);
+    return -2;
+  }
+  corrupt(f, INODE_BITMAP, INODES, LOST, MISSING);
+  corrupt(f, SECTOR_BITMAP, SECTORS, LOST, MISSING);
+  fclose(f);
+  printf("%d inodes and sectors marked in use, and %d marked free, wrongly\n", LOST, MISSING);
+
+  // found without repairing anything
+  check(FS_Boot(disk) == 0, "can't boot the corrupted disk", 0);
+  check(FS_Check(0, &r) == 2*(LOST+MISSING), "wrong number of problems", 0);
+  check(r.lost_inodes == LOST && r.missing_inodes == MISSING, "wrong inodes found", (int)r.lost_inodes);
+  check(r.lost_sectors == LOST && r.missing_sectors == MISSING, "wrong sectors found", (int)r.lost_sectors);
+  check(r.inodes == good.inodes && r.sectors == good.sectors, "wrong inodes or sectors reached", (int)r.sectors);
+  check(r.shared_sectors+r.bad_entries+r.bad_pointers+r.bad_inodes == 0, "other problems found", 0);
+  check(FS_Check(0, &r) == 2*(LOST+MISSING), "problems repaired by a check only", 0);
+
+  // then repaired, for good
+  check(FS_Check(1, &r) == 0, "problems left after repairing", 0);
+  check(r.lost_inodes == LOST && r.missing_inodes == MISSING &&
+	r.lost_sectors == LOST && r.missing_sectors == MISSING, "wrong problems repaired", 0);
+  check(FS_Check(0, &r) == 0, "problems found after repairing", 0);
+  check_files(FILES, "once repaired");
+
+  // what was marked free is not handed out again, what was marked in
+  // use is given back
+  write_files(FILES, FILES);
+  check_files(2*FILES, "once more are added");
+  check(FS_Sync() == 0, "can't sync", 0);
+  check(FS_Boot(disk) == 0, "can't boot again", 0);
+  check_files(2*FILES, "after booting again");
+  check(FS_Check(0, &r) == 0, "problems on the disk", 0);
+  check(r.inodes == good.inodes+FILES, "wrong number of inodes", (int)r.inodes);
+
+  if(failures > 0) {
+    printf("ERROR: %d checks failed\n", failures);
+    return -2;
+  }
+  printf("every problem of the bitmaps found and repaired\n");
+  return 0;
+}
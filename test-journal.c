@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "LibFS.h"
+#include "LibDisk.h"
+
+// crashes a process changing the file system (and syncing after every
+// change) at random points, most of them in the middle of a commit,
+// and checks after each crash that the disk boots with every change
+// that was synced, whole, and with nothing else broken: a commit cut
+// short is either replayed in full when the disk boots, or ignored;
+// and first crashes one that writes a file over the sectors of one it
+// has just removed, before it syncs, and checks that the file removed
+// is back whole
+
+#define ROUNDS 16
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file>\n", prog);
+  exit(1);
+}
+
+static int failures;
+
+static void check(int ok, char* what, int n)
+{
+  if(ok) return;
+  printf("ERROR: %s (%d), osErrno=%d\n", what, n, osErrno);
+  failures++;
+}
+
+// the content of the i-th file
+static int file_data(int i, char* buf)
+{
+  int j, size = (i*97)%3000+1;
+  for(j=0; j<size; j++) buf[j] = (char)(i*7+j);
+  return size;
+}
+
+// whether the i-th file is there once the first 'n' steps are synced:
+// step i creates it, and step i+2 removes it again (before creating
+// its own) if i%3 is 0
+static int file_kept(int i, int n)
+{
+  return i < n && !(i%3 == 0 && i+2 < n);
+}
+
+// the process crashed: changes the file system step by step until
+// killed, telling the other end of 'pipe' of each step synced
+static void crash_child(char* disk, int pipe)
+{
+  char fn[32], buf[3000];
+  int i;
+  if(FS_Boot(disk) < 0) _exit(1);
+  for(i=0; ; i++) {
+    if(i%3 == 2) {
+      sprintf(fn, "/f%d", i-2);
+      if(File_Unlink(fn) < 0) _exit(1);
+    }
+    sprintf(fn, "/f%d", i);
+    int fd = (File_Create(fn) < 0) ? -1 : File_Open(fn);
+    if(fd < 0 || File_Write(fd, buf, file_data(i, buf)) < 0 || File_Close(fd) < 0) _exit(1);
+    if(FS_Sync() < 0) _exit(1);
+    if(write(pipe, &i, sizeof(i)) != sizeof(i)) _exit(1);
+  }
+}
+
+// check the disk left by a crash once the first 'n' steps were synced
+// (the step under way may or may not have made it), and count the
+// commits replayed in 'replayed'
+static void check_crash(char* disk, int n, int* replayed)
+{
+  char fn[32], trace[1100], line[200], buf[3000], want[3000];
+  int i;
+
+  // the replay of a commit shows in the trace of the boot
+  snprintf(trace, sizeof(trace), "%s.trace", disk);
+  unlink(trace);
+  FS_SetTrace(1);
+  check(FS_Boot(disk) == 0, "can't boot the disk after a crash", n);
+  FS_TraceDump(trace);
+  FS_SetTrace(0);
+  FILE* f = fopen(trace, "r");
+  while(f && fgets(line, sizeof(line), f))
+    if(strstr(line, "replay journal")) (*replayed)++;
+  if(f) fclose(f);
+  unlink(trace);
+
+  for(i=0; i<=n; i++) {
+    if(i == n) continue; // made by the step under way
+    sprintf(fn, "/f%d", i);
+    int fd = File_Open(fn);
+    // the file removed by the step under way may be there or not, but
+    // whole if it is
+    if(!(i%3 == 0 && i+2 == n))
+      check((fd >= 0) == file_kept(i, n), "wrong file left after a crash", i);
+    if(fd < 0) continue;
+    int size = file_data(i, want);
+    check(File_Read(fd, buf, sizeof(buf)) == size && !memcmp(buf, want, size),
+	  "wrong content after a crash", i);
+    File_Close(fd);
+  }
+
+  FS_Check_t r;
+  check(FS_Check(0, &r) == 0, "problems on the disk after a crash", n);
+}
+
+// write 'c' all over a new file 'fn' of 'size' bytes; return 0 if
+// successful, -1 otherwise
+static int write_all(char* fn, char c, int size)
+{
+  char buf[3000];
+  memset(buf, c, size);
+  int fd = (File_Create(fn) < 0) ? -1 : File_Open(fn);
+  return (fd < 0 || File_Write(fd, buf, size) != size || File_Close(fd) < 0) ? -1 : 0;
+}
+
+// the process crashed: removes a file synced, and writes another one
+// (which may take the sectors given back) without syncing
+static void reuse_child(char* disk)
+{
+  if(FS_Boot(disk) < 0 || write_all("/a", 'A', 3000) < 0 || FS_Sync() < 0 ||
+     File_Unlink("/a") < 0 || write_all("/b", 'B', 3000) < 0)
+    _exit(1);
+  _exit(0);
+}
+
+// check that the file removed is back whole, and the other one gone
+static void check_reuse(char* disk)
+{
+  char buf[3001], want[3000];
+  memset(want, 'A', sizeof(want));
+  check(FS_Boot(disk) == 0, "can't boot the disk after a crash", 0);
+  int fd = File_Open("/a");
+  check(fd >= 0, "file removed but not synced is gone", 0);
+  check(fd < 0 || (File_Read(fd, buf, sizeof(buf)) == 3000 && !memcmp(buf, want, 3000)),
+	"file removed but not synced written over", 0);
+  if(fd >= 0) File_Close(fd);
+  check(File_Open("/b") < 0, "file written but not synced is there", 0);
+  FS_Check_t r;
+  check(FS_Check(0, &r) == 0, "problems on the disk after a crash", 0);
+}
+
+// run 'fn' on the disk in a process of its own, and return the number
+// of checks that failed
+static int in_child(void (*fn)(char*), char* disk)
+{
+  int status;
+  fflush(stdout);
+  pid_t child = fork();
+  if(child == 0) {
+    fn(disk);
+    fflush(stdout);
+    _exit(failures > 255 ? 255 : failures);
+  }
+  waitpid(child, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) usage(argv[0]);
+  char* disk = argv[1];
+
+  // each write goes straight to the file, so a crash leaves what was
+  // written so far, as it would on a disk; this process never boots
+  // the disk itself, the disk (and its threads) being started afresh by
+  // the processes crashed and those checking after them
+  Disk_SetMode(DISK_MODE_FILE);
+  srand(getpid());
+
+  unlink(disk);
+  int bad = in_child(reuse_child, disk);
+  bad += in_child(check_reuse, disk);
+  if(bad == 0) printf("file removed and not synced kept whole after a crash\n");
+  failures += bad;
+
+  int round, replayed = 0;
+  for(round=0; round<ROUNDS; round++) {
+    unlink(disk);
+    int p[2];
+    if(pipe(p) < 0) return -1;
+    fflush(stdout);
+    pid_t child = fork();
+    if(child == 0) {
+      close(p[0]);
+      crash_child(disk, p[1]);
+    }
+    close(p[1]);
+    usleep(20000 + rand()%80000);
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+
+    int i, n = 0, status;
+    while(read(p[0], &i, sizeof(i)) == sizeof(i)) n = i+1;
+    close(p[0]);
+
+    // the checking process tells the number of commits replayed, and
+    // exits with the number of checks failed
+    if(pipe(p) < 0) return -1;
+    fflush(stdout);
+    child = fork();
+    if(child == 0) {
+      int r = 0;
+      close(p[0]);
+      check_crash(disk, n, &r);
+      if(write(p[1], &r, sizeof(r)) != sizeof(r)) failures++;
+      fflush(stdout);
+      _exit(failures > 255 ? 255 : failures);
+    }
+    close(p[1]);
+    if(read(p[0], &i, sizeof(i)) == sizeof(i)) replayed += i;
+    close(p[0]);
+    waitpid(child, &status, 0);
+    if(!WIFEXITED(status)) failures++;
+    else failures += WEXITSTATUS(status);
+    printf("crash %d: %d steps synced\n", round, n);
+  }
+  printf("%d crashes, %d commits replayed when booting after them\n", ROUNDS, replayed);
+
+  if(failures > 0) {
+    printf("ERROR: %d checks failed\n", failures);
+    return -2;
+  }
+  printf("the disk was consistent after every crash\n");
+  return 0;
+}
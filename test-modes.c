@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "LibFS.h"
+#include "LibDisk.h"
+
+// boots a new disk in each of the ways the disk image can be backed
+// (see Disk_SetMode), writes and syncs files on it, and checks that
+// they're read back as written when the disk is booted again, both in
+// the same mode and in memory mode (which loads the saved image whole)
+
+static struct { int mode; char* name; } modes[] = {
+  { DISK_MODE_MMAP, "mmap" },
+  { DISK_MODE_MEMORY, "memory" },
+  { DISK_MODE_FILE, "file" },
+  { DISK_MODE_DIRECT, "direct" },
+};
+#define NMODES (int)(sizeof(modes)/sizeof(modes[0]))
+
+#define FILES 30
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file>\n", prog);
+  exit(1);
+}
+
+static int failures;
+
+static void check(int ok, char* what, int n)
+{
+  if(ok) return;
+  printf("ERROR: %s (%d), osErrno=%d\n", what, n, osErrno);
+  failures++;
+}
+
+static int file_data(int i, char* buf)
+{
+  int j, size = 900*(i%12) + i + 1;
+  for(j=0; j<size; j++) buf[j] = (char)(i*5 + j + j/512);
+  return size;
+}
+
+static void write_files()
+{
+  char fn[32], buf[12000];
+  int i;
+  check(Dir_Create("/d") == 0, "can't create directory", 0);
+  for(i=0; i<FILES; i++) {
+    sprintf(fn, (i%2) ? "/d/f%d" : "/f%d", i);
+    check(File_Create(fn) == 0, "can't create file", i);
+    int fd = File_Open(fn), size = file_data(i, buf);
+    check(fd >= 0 && File_Write(fd, buf, size) == size, "can't write file", i);
+    if(fd >= 0) File_Close(fd);
+  }
+}
+
+static void check_files(char* mode, char* when)
+{
+  char fn[32], buf[12001], want[12000];
+  int i, bad = 0;
+  for(i=0; i<FILES; i++) {
+    sprintf(fn, (i%2) ? "/d/f%d" : "/f%d", i);
+    int fd = File_Open(fn), size = file_data(i, want);
+    if(fd < 0 || File_Read(fd, buf, sizeof(buf)) != size || memcmp(buf, want, size)) bad++;
+    if(fd >= 0) File_Close(fd);
+  }
+  check(bad == 0, "wrong files", bad);
+  FS_Check_t r;
+  check(FS_Check(0, &r) == 0, "problems on the disk", 0);
+  printf("%s mode: files read back %s\n", mode, when);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) usage(argv[0]);
+  char* disk = argv[1];
+  int m;
+
+  FS_SetGeometry(512, 8000, 200);
+  for(m=0; m<NMODES; m++) {
+    unlink(disk);
+    check(Disk_SetMode(modes[m].mode) == 0, "can't choose disk mode", m);
+    if(FS_Boot(disk) < 0) {
+      printf("ERROR: can't boot file system from file '%s' in %s mode\n", disk, modes[m].name);
+      return -1;
+    }
+    write_files();
+    check(FS_Sync() == 0, "can't sync", m);
+    check_files(modes[m].name, "once synced");
+
+    // what was synced is in the file, whichever way it's read
+    check(FS_Boot(disk) == 0, "can't boot again", m);
+    check_files(modes[m].name, "after booting again");
+    check(Disk_SetMode(DISK_MODE_MEMORY) == 0 && FS_Boot(disk) == 0, "can't boot in memory mode", m);
+    check_files(modes[m].name, "after booting in memory mode");
+  }
+
+  // the disk is left as the tools find it
+  check(Disk_SetMode(DISK_MODE_MMAP) == 0, "can't choose disk mode", 0);
+  check(FS_Boot(disk) == 0 && FS_Sync() == 0, "can't boot and sync", 0);
+
+  if(failures > 0) {
+    printf("ERROR: %d checks failed\n", failures);
+    return -2;
+  }
+  printf("every file read back as written in every mode\n");
+  return 0;
+}
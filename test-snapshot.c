@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "LibFS.h"
+
+// takes snapshots of the file system between changes, and checks that
+// each of them, mounted, shows the files and directories as they were
+// when it was taken, without letting them change, and that rolling
+// back to it brings them back for good, after booting again too
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file>\n", prog);
+  exit(1);
+}
+
+static int failures;
+
+static void check(int ok, char* what, int n)
+{
+  if(ok) return;
+  printf("ERROR: %s (%d), osErrno=%d\n", what, n, osErrno);
+  failures++;
+}
+
+// what each path should be at each step (before the first snapshot,
+// between it and the second one, and after): a directory, a file of
+// that size filled from that seed, or nothing
+#define ABSENT -1
+#define DIRECTORY -2
+#define NPATHS 6
+static char* paths[NPATHS] = { "/a", "/big", "/c", "/dir", "/dir/b", "/dir/new" };
+
+static int sizes[3][NPATHS] = {
+  { 100, 9000, 10, DIRECTORY, 600, ABSENT },
+  { 200, 12000, ABSENT, DIRECTORY, 1500, 30 },
+  { 200, 3000, 40, ABSENT, ABSENT, ABSENT },
+};
+static int seeds[3][NPATHS] = {
+  { 1, 2, 3, 0, 4, 0 },
+  { 5, 6, 0, 0, 7, 8 },
+  { 5, 9, 10, 0, 0, 0 },
+};
+
+static void fill(char* buf, int size, int seed)
+{
+  int i;
+  for(i=0; i<size; i++) buf[i] = (char)(seed*31 + i*7 + i/512);
+}
+
+// whether there's such a file
+static int exists(char* fn)
+{
+  int fd = File_Open(fn);
+  if(fd < 0) return 0;
+  File_Close(fd);
+  return 1;
+}
+
+// (re)write a file whole, as files can't be cut shorter
+static void write_file(char* fn, int size, int seed)
+{
+  static char buf[12000];
+  fill(buf, size, seed);
+  if(exists(fn)) check(File_Unlink(fn) == 0, "can't unlink file", seed);
+  check(File_Create(fn) == 0, "can't create file", seed);
+  int fd = File_Open(fn);
+  check(fd >= 0, "can't open file", seed);
+  check(File_Write(fd, buf, size) == size, "can't write file", seed);
+  File_Close(fd);
+}
+
+// make the file system as it should be at 'step', from what it was
+// at the step before
+static void change_to(int step)
+{
+  int i;
+  for(i=0; i<NPATHS; i++) {
+    int size = sizes[step][i], was = step ? sizes[step-1][i] : ABSENT;
+    if(size == ABSENT && was == DIRECTORY) check(Dir_RemoveTree(paths[i]) == 0, "can't remove tree", i);
+    else if(size == ABSENT && exists(paths[i])) // unless gone with its directory
+      check(File_Unlink(paths[i]) == 0, "can't unlink file", i);
+    else if(size == DIRECTORY && was != DIRECTORY) check(Dir_Create(paths[i]) == 0, "can't create directory", i);
+    else if(size >= 0 && (was != size || seeds[step][i] != (step ? seeds[step-1][i] : 0)))
+      write_file(paths[i], size, seeds[step][i]);
+  }
+}
+
+// check that the file system is as it should be at 'step'
+static void check_step(int step, char* when)
+{
+  static char buf[12001], want[12000];
+  int i, bad = 0;
+  for(i=0; i<NPATHS; i++) {
+    int size = sizes[step][i];
+    if(size == DIRECTORY) {
+      if(Dir_Size(paths[i]) < 0) bad++;
+      continue;
+    }
+    int fd = File_Open(paths[i]);
+    if((fd >= 0) != (size >= 0)) bad++;
+    if(fd < 0) continue;
+    fill(want, size, seeds[step][i]);
+    if(File_Read(fd, buf, sizeof(buf)) != size || memcmp(buf, want, size)) bad++;
+    File_Close(fd);
+  }
+  check(bad == 0, "wrong files", step);
+  printf("files as they were at step %d %s\n", step, when);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) usage(argv[0]);
+  char* disk = argv[1];
+
+  unlink(disk);
+  FS_SetGeometry(512, 2000, 100);
+  if(FS_Boot(disk) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", disk);
+    return -1;
+  }
+
+  change_to(0);
+  check(FS_Snapshot("s0") == 0, "can't take snapshot", 0);
+  change_to(1);
+  check(FS_Snapshot("s1") == 0, "can't take snapshot", 1);
+  change_to(2);
+  check_step(2, "before any snapshot is mounted");
+
+  // each snapshot mounted shows the files as they were, and nothing
+  // can be changed until the file system is back
+  int step;
+  for(step=0; step<2; step++) {
+    check(FS_MountSnapshot(step ? "s1" : "s0") == 0, "can't mount snapshot", step);
+    check_step(step, "in the snapshot mounted");
+    check(File_Create("/new") == -1 && osErrno == E_READ_ONLY, "created file in a snapshot", step);
+    check(File_Unlink("/a") == -1 && osErrno == E_READ_ONLY, "unlinked file in a snapshot", step);
+    int fd = File_Open("/a");
+    check(File_Write(fd, "x", 1) == -1 && osErrno == E_READ_ONLY, "wrote file in a snapshot", step);
+    File_Close(fd);
+    FS_Check_t r;
+    check(FS_Check(1, &r) == -1 && osErrno == E_READ_ONLY, "repaired a snapshot", step);
+    check(FS_Check(0, &r) == 0, "problems in the snapshot", step);
+    check(FS_MountSnapshot(NULL) == 0, "can't mount the file system back", step);
+    check_step(2, "once the file system is back");
+  }
+  check(FS_MountSnapshot("none") == -1 && osErrno == E_NO_SUCH_SNAPSHOT, "mounted no snapshot", 0);
+
+  // nothing may be open to roll back
+  int fd = File_Open("/a");
+  check(FS_Rollback("s1") == -1 && osErrno == E_FILE_IN_USE, "rolled back with a file open", 0);
+  File_Close(fd);
+
+  // rolling back to the second snapshot keeps the first one, rolling
+  // back to the first one drops the second one
+  check(FS_Rollback("s1") == 0, "can't roll back", 1);
+  check_step(1, "once rolled back");
+  change_to(2);
+  check(FS_Rollback("s1") == 0, "can't roll back again", 1);
+  check_step(1, "once rolled back again");
+  check(FS_Rollback("s0") == 0, "can't roll back", 0);
+  check_step(0, "once rolled back");
+  check(FS_MountSnapshot("s1") == -1 && osErrno == E_NO_SUCH_SNAPSHOT, "mounted snapshot dropped", 1);
+  check(FS_DeleteSnapshot("s0") == 0, "can't delete snapshot", 0);
+  check(FS_Rollback("s0") == -1 && osErrno == E_NO_SUCH_SNAPSHOT, "rolled back to snapshot deleted", 0);
+
+  // what was rolled back to is on the disk
+  check(FS_Boot(disk) == 0, "can't boot again", 0);
+  check_step(0, "after booting again");
+  FS_Check_t r;
+  check(FS_Check(0, &r) == 0, "problems on the disk", 0);
+  check(FS_Sync() == 0, "can't sync", 0);
+
+  if(failures > 0) {
+    printf("ERROR: %d checks failed\n", failures);
+    return -2;
+  }
+  printf("every snapshot showed the files as they were\n");
+  return 0;
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "LibFS.h"
+
+// threads creating, writing and unlinking files at the same time, each
+// in a directory of its own and all in a shared one, and racing to
+// create and unlink the same names there; checks that each name was
+// created and unlinked once, and that the files left are those wanted,
+// with their content, before and after the disk is booted again
+
+#define THREADS 8
+#define FILES 150   // files of each thread, a third of them kept
+#define COMMON 100  // names all the threads race for
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file>\n", prog);
+  exit(1);
+}
+
+static int failures;
+static pthread_mutex_t failures_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void check(int ok, char* what, int n)
+{
+  if(ok) return;
+  pthread_mutex_lock(&failures_lock);
+  printf("ERROR: %s (%d), osErrno=%d\n", what, n, osErrno);
+  failures++;
+  pthread_mutex_unlock(&failures_lock);
+}
+
+// the names won and the files they were won by
+static int created[COMMON], unlinked[COMMON];
+static pthread_mutex_t common_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void file_name(char* fn, int t, int i, int shared)
+{
+  if(shared) sprintf(fn, "/s/t%d_%d", t, i);
+  else sprintf(fn, "/t%d/f%d", t, i);
+}
+
+static int file_data(int t, int i, char* buf)
+{
+  return sprintf(buf, "file %d of thread %d, %*d", i, t, (i*t)%300, i);
+}
+
+static void* worker(void* arg)
+{
+  int t = (int)(long)arg, i, shared;
+  char fn[32], buf[400];
+
+  for(i=0; i<FILES; i++) {
+    for(shared=0; shared<2; shared++) {
+      file_name(fn, t, i, shared);
+      check(File_Create(fn) == 0, "can't create file", i);
+      int fd = File_Open(fn), size = file_data(t, i, buf);
+      check(fd >= 0 && File_Write(fd, buf, size) == size, "can't write file", i);
+      if(fd >= 0) File_Close(fd);
+      // those made two steps before go, but for a third of them
+      if(i >= 2 && (i-2)%3 != 0) {
+	file_name(fn, t, i-2, shared);
+	check(File_Unlink(fn) == 0, "can't unlink file", i-2);
+      }
+    }
+
+    // every thread tries each name, in an order of its own
+    if(i < COMMON) {
+      int c = (i*(t+1)*7) % COMMON;
+      sprintf(fn, "/s/c%d", c);
+      if(File_Create(fn) == 0) {
+	pthread_mutex_lock(&common_lock);
+	created[c]++;
+	pthread_mutex_unlock(&common_lock);
+      } else check(osErrno == E_CREATE, "wrong error creating file twice", c);
+      c = ((i+COMMON/2)*(t+1)*7) % COMMON;
+      sprintf(fn, "/s/c%d", c);
+      if(File_Unlink(fn) == 0) {
+	pthread_mutex_lock(&common_lock);
+	unlinked[c]++;
+	pthread_mutex_unlock(&common_lock);
+      } else check(osErrno == E_NO_SUCH_FILE, "wrong error unlinking file", c);
+    }
+  }
+  // the last one or two made are kept too
+  for(i=FILES-2; i<FILES; i++) {
+    if(i%3 == 0) continue;
+    for(shared=0; shared<2; shared++) {
+      file_name(fn, t, i, shared);
+      check(File_Unlink(fn) == 0, "can't unlink file", i);
+    }
+  }
+  return NULL;
+}
+
+// check that the files kept are there, with their content, and that
+// the directories hold nothing else (nor the names raced for but
+// those created once more than unlinked)
+static void check_files(char* when)
+{
+  char fn[32], buf[400], want[400];
+  int t, i, shared, bad = 0, kept = 0, left = 0;
+  for(t=0; t<THREADS; t++)
+    for(i=0; i<FILES; i++)
+      for(shared=0; shared<2; shared++) {
+	file_name(fn, t, i, shared);
+	int fd = File_Open(fn);
+	if((fd >= 0) != (i%3 == 0)) bad++;
+	if(fd < 0) continue;
+	int size = file_data(t, i, want);
+	if(File_Read(fd, buf, sizeof(buf)) != size || memcmp(buf, want, size)) bad++;
+	File_Close(fd);
+	kept++;
+      }
+  check(bad == 0, "wrong files", bad);
+
+  for(i=0, bad=0; i<COMMON; i++) {
+    sprintf(fn, "/s/c%d", i);
+    int fd = File_Open(fn);
+    if(fd >= 0) File_Close(fd);
+    if(created[i] - unlinked[i] != (fd >= 0) || created[i] < 1) bad++;
+    left += (fd >= 0);
+  }
+  check(bad == 0, "names raced for created or unlinked more than once", bad);
+
+  int want_shared = kept/2 + left;
+  check(Dir_Size("/s") == want_shared*20, "wrong size of the shared directory", Dir_Size("/s"));
+  for(t=0; t<THREADS; t++) {
+    sprintf(fn, "/t%d", t);
+    check(Dir_Size(fn) == kept/2/THREADS*20, "wrong size of a directory", t);
+  }
+  printf("%d files kept, and %d of the names raced for, %s\n", kept, left, when);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) usage(argv[0]);
+  char* disk = argv[1];
+
+  unlink(disk);
+  FS_SetGeometry(512, 20000, 4000);
+  if(FS_Boot(disk) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", disk);
+    return -1;
+  }
+
+  char fn[32];
+  int t;
+  check(Dir_Create("/s") == 0, "can't create directory", 0);
+  for(t=0; t<THREADS; t++) {
+    sprintf(fn, "/t%d", t);
+    check(Dir_Create(fn) == 0, "can't create directory", t);
+  }
+
+  pthread_t threads[THREADS];
+  for(t=0; t<THREADS; t++)
+    if(pthread_create(&threads[t], NULL, worker, (void*)(long)t) != 0) {
+      printf("ERROR: can't create thread %d\n", t);
+      return -2;
+    }
+  for(t=0; t<THREADS; t++) pthread_join(threads[t], NULL);
+  check_files("once the threads are done");
+
+  FS_Check_t r;
+  check(FS_Check(0, &r) == 0, "problems on the disk", 0);
+  check(FS_Sync() == 0, "can't sync", 0);
+  check(FS_Boot(disk) == 0, "can't boot again", 0);
+  check_files("after booting again");
+  check(FS_Check(0, &r) == 0, "problems on the disk after booting again", 0);
+
+  if(failures > 0) {
+    printf("ERROR: %d checks failed\n", failures);
+    return -2;
+  }
+  printf("every thread's files were kept as wanted\n");
+  return 0;
+}